@@ -99,8 +99,8 @@ void aes_decrypt(aes_ctx_t *ctx, void *dst, const void *src, size_t l)
 
         dst = malloc(l);
         if (dst == NULL) {
-            fprintf(stderr, "Error: AES buffer allocation failure!\n");
-            exit(EXIT_FAILURE);
+            hp_error("Error: AES buffer allocation failure!\n");
+            hp_exit_failure();
         }
     }
 
@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+#include "batch.h"
+#include "filepath.h"
+#include "utils.h"
+#include "json.h"
+#include "report.h"
+#include "worker.h"
+
+static char *batch_strdup(const char *s)
+{
+    char *copy = strdup(s);
+    if (copy == NULL)
+    {
+        fprintf(stderr, "Failed to allocate batch job!\n");
+        exit(EXIT_FAILURE);
+    }
+    return copy;
+}
+
+/* Turns manifest members into long options, "name" labels the job and false or null values are left out. */
+static int batch_add_options(batch_job_t *job, json_value_t *options, uint32_t index)
+{
+    if (options == NULL)
+        return 0;
+    if (options->type != JSON_OBJECT)
+    {
+        fprintf(stderr, "Error: Batch job %u is not an object\n", index);
+        return -1;
+    }
+
+    char **argv = realloc(job->argv, (job->argc + options->num_items * 2 + 1) * sizeof(char *));
+    if (argv == NULL)
+    {
+        fprintf(stderr, "Failed to allocate batch job!\n");
+        exit(EXIT_FAILURE);
+    }
+    job->argv = argv;
+
+    for (uint32_t i = 0; i < options->num_items; i++)
+    {
+        json_value_t *option = &options->items[i];
+        if (strcmp(option->key, "name") == 0)
+        {
+            if (option->type == JSON_STRING || option->type == JSON_NUMBER)
+            {
+                free(job->name);
+                job->name = batch_strdup(option->string);
+            }
+            continue;
+        }
+        if (option->type == JSON_NULL || (option->type == JSON_BOOL && !option->boolean))
+            continue;
+        if (option->type == JSON_ARRAY || option->type == JSON_OBJECT)
+        {
+            fprintf(stderr, "Error: Unsupported value for option %s in batch job %u\n", option->key, index);
+            return -1;
+        }
+
+        size_t len = strlen(option->key) + 3;
+        job->argv[job->argc] = malloc(len);
+        if (job->argv[job->argc] == NULL)
+        {
+            fprintf(stderr, "Failed to allocate batch job!\n");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(job->argv[job->argc++], len, "--%s", option->key);
+        if (option->type != JSON_BOOL)
+            job->argv[job->argc++] = batch_strdup(option->string);
+    }
+    job->argv[job->argc] = NULL;
+    return 0;
+}
+
+/* Builds the argument list of a job from its manifest object, defaults come first so the job can override them. */
+int batch_job_init(batch_job_t *job, json_value_t *defaults, json_value_t *options, uint32_t index)
+{
+    memset(job, 0, sizeof(*job));
+    job->exit_code = -1;
+    job->argv = calloc(2, sizeof(char *));
+    if (job->argv == NULL)
+    {
+        fprintf(stderr, "Failed to allocate batch job!\n");
+        exit(EXIT_FAILURE);
+    }
+    job->argv[job->argc++] = batch_strdup("hacpack");
+    if (batch_add_options(job, defaults, index) != 0 || batch_add_options(job, options, index) != 0)
+        return -1;
+    return 0;
+}
+
+void batch_job_free(batch_job_t *job)
+{
+    for (int i = 0; i < job->argc; i++)
+        free(job->argv[i]);
+    free(job->argv);
+    free(job->name);
+    free(job->outputs);
+    memset(job, 0, sizeof(*job));
+}
+
+/* Manifest is either an array of jobs or an object with "jobs" and optional "defaults" applied before every job. */
+static batch_job_t *batch_load_jobs(filepath_t *manifest_path, uint32_t *out_num_jobs)
+{
+    FILE *manifest_file = os_fopen(manifest_path->os_path, OS_MODE_READ);
+    if (manifest_file == NULL)
+    {
+        fprintf(stderr, "Error: Failed to open %s\n", manifest_path->char_path);
+        exit(EXIT_FAILURE);
+    }
+    char error[0x100];
+    json_value_t *manifest = json_parse_file(manifest_file, error, sizeof(error));
+    fclose(manifest_file);
+    if (manifest == NULL)
+    {
+        fprintf(stderr, "Error: Failed to parse %s: %s\n", manifest_path->char_path, error);
+        exit(EXIT_FAILURE);
+    }
+
+    json_value_t *defaults = json_get(manifest, "defaults");
+    json_value_t *jobs_value = manifest->type == JSON_ARRAY ? manifest : json_get(manifest, "jobs");
+    if (jobs_value == NULL || jobs_value->type != JSON_ARRAY || jobs_value->num_items == 0)
+    {
+        fprintf(stderr, "Error: %s doesn't contain any jobs\n", manifest_path->char_path);
+        exit(EXIT_FAILURE);
+    }
+
+    batch_job_t *jobs = calloc(jobs_value->num_items, sizeof(batch_job_t));
+    if (jobs == NULL)
+    {
+        fprintf(stderr, "Failed to allocate batch jobs!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < jobs_value->num_items; i++)
+    {
+        if (batch_job_init(&jobs[i], defaults, &jobs_value->items[i], i) != 0)
+            exit(EXIT_FAILURE);
+    }
+    *out_num_jobs = jobs_value->num_items;
+    json_free(manifest);
+    return jobs;
+}
+
+char *batch_read_file(FILE *f)
+{
+    long size;
+    if (fflush(f) != 0 || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0)
+        size = 0;
+    char *text = malloc((size_t)size + 1);
+    if (text == NULL)
+    {
+        fprintf(stderr, "Failed to allocate batch result!\n");
+        exit(EXIT_FAILURE);
+    }
+    text[fread(text, 1, (size_t)size, f)] = '\0';
+    return text;
+}
+
+/* Runs one job on a copy of the batch settings, every job gets its own temp directory and a share of the worker threads. */
+int batch_build_job(hp_settings_t *settings, batch_parse_func_t parse_func, batch_build_func_t build_func, batch_job_t *job, uint32_t index, uint32_t num_threads)
+{
+    hp_settings_t job_settings = *settings;
+    filepath_init(&job_settings.batch_manifest);
+    job_settings.num_threads = num_threads;
+    job_settings.keyareakey = malloc(0x10);
+    if (job_settings.keyareakey == NULL)
+    {
+        fprintf(stderr, "Failed to allocate key area key!\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(job_settings.keyareakey, settings->keyareakey, 0x10);
+
+    int ret = parse_func(&job_settings, job->argc, job->argv);
+    if (ret == 0)
+    {
+        // Temp directories are wiped when a build starts, jobs running side by side can't share one
+        char temp_dir[MAX_PATH + 12];
+        snprintf(temp_dir, sizeof(temp_dir), "%s_%u", job_settings.temp_dir.char_path, index);
+        filepath_set(&job_settings.temp_dir, temp_dir);
+        report_clear();
+        ret = build_func(&job_settings);
+        if (ret == 0)
+            report_write_json(job->result_file);
+    }
+    free(job_settings.keyareakey);
+    return ret;
+}
+
+static void batch_finish_job(batch_job_t *job, uint32_t index)
+{
+    job->seconds = hp_get_time() - job->start_time;
+    job->outputs = batch_read_file(job->result_file);
+    if (job->outputs[0] == '\0')
+    {
+        // Job exited before reporting, it failed
+        free(job->outputs);
+        job->outputs = batch_strdup("[]");
+    }
+    fclose(job->result_file);
+    job->result_file = NULL;
+
+    if (job->log_file != NULL)
+    {
+        char *log = batch_read_file(job->log_file);
+        fprintf(stderr, "\n===> Job %u (%s) log:\n%s", index, job->name != NULL ? job->name : "unnamed", log);
+        free(log);
+        fclose(job->log_file);
+        job->log_file = NULL;
+    }
+    fprintf(stderr, "\n----> Job %u %s in %.3f seconds\n", index, job->exit_code == 0 ? "finished" : "failed", job->seconds);
+}
+
+#ifndef _WIN32
+/* Jobs run in forked workers, a failing job can exit without taking the batch down and its output is kept apart. */
+static void batch_start_job(hp_settings_t *settings, batch_parse_func_t parse_func, batch_build_func_t build_func, batch_job_t *job, uint32_t index, uint32_t num_threads)
+{
+    job->log_file = tmpfile();
+    job->result_file = tmpfile();
+    if (job->log_file == NULL || job->result_file == NULL)
+    {
+        fprintf(stderr, "Error: Failed to create batch job files\n");
+        exit(EXIT_FAILURE);
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    job->start_time = hp_get_time();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        fprintf(stderr, "Error: Failed to start batch job %u\n", index);
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        dup2(fileno(job->log_file), STDOUT_FILENO);
+        dup2(fileno(job->log_file), STDERR_FILENO);
+        int ret = batch_build_job(settings, parse_func, build_func, job, index, num_threads);
+        fflush(NULL);
+        _exit(ret);
+    }
+    job->pid = (long)pid;
+}
+#endif
+
+int batch_run(hp_settings_t *settings, batch_parse_func_t parse_func, batch_build_func_t build_func, FILE *results_file)
+{
+    uint32_t num_jobs;
+    batch_job_t *jobs = batch_load_jobs(&settings->batch_manifest, &num_jobs);
+
+    // Jobs share the CPU budget and are capped by the memory budget
+    uint32_t num_cpus = settings->num_threads ? settings->num_threads : worker_get_cpu_count();
+    uint32_t max_jobs = num_cpus;
+    if (settings->batch_memory != 0 && settings->batch_memory / BATCH_JOB_MEMORY < max_jobs)
+        max_jobs = settings->batch_memory / BATCH_JOB_MEMORY;
+    if (max_jobs > num_jobs)
+        max_jobs = num_jobs;
+    if (max_jobs == 0)
+        max_jobs = 1;
+    uint32_t num_threads = num_cpus / max_jobs ? num_cpus / max_jobs : 1;
+    printf("Running %u batch jobs, %u at a time\n", num_jobs, max_jobs);
+
+#ifdef _WIN32
+    // No fork on Windows, jobs run one after another in this process
+    for (uint32_t i = 0; i < num_jobs; i++)
+    {
+        jobs[i].result_file = tmpfile();
+        if (jobs[i].result_file == NULL)
+        {
+            fprintf(stderr, "Error: Failed to create batch job files\n");
+            exit(EXIT_FAILURE);
+        }
+        printf("\n===> Job %u (%s):\n", i, jobs[i].name != NULL ? jobs[i].name : "unnamed");
+        jobs[i].start_time = hp_get_time();
+        jobs[i].exit_code = batch_build_job(settings, parse_func, build_func, &jobs[i], i, num_cpus);
+        batch_finish_job(&jobs[i], i);
+    }
+#else
+    uint32_t next_job = 0;
+    uint32_t running = 0;
+    while (next_job < num_jobs || running > 0)
+    {
+        while (running < max_jobs && next_job < num_jobs)
+        {
+            batch_start_job(settings, parse_func, build_func, &jobs[next_job], next_job, num_threads);
+            next_job++;
+            running++;
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error: Failed to wait for batch jobs\n");
+            exit(EXIT_FAILURE);
+        }
+        for (uint32_t i = 0; i < next_job; i++)
+        {
+            if (jobs[i].pid != (long)pid || jobs[i].result_file == NULL)
+                continue;
+            jobs[i].exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            batch_finish_job(&jobs[i], i);
+            running--;
+            break;
+        }
+    }
+#endif
+
+    // Results go to their own stream so they can be parsed while logs are read separately
+    uint32_t failed = 0;
+    fprintf(results_file, "{\"jobs\": [\n");
+    for (uint32_t i = 0; i < num_jobs; i++)
+    {
+        fprintf(results_file, "  {\"index\": %u, \"name\": ", i);
+        if (jobs[i].name != NULL)
+            json_write_string(results_file, jobs[i].name);
+        else
+            fprintf(results_file, "null");
+        fprintf(results_file, ", \"status\": \"%s\", \"exit_code\": %d, \"seconds\": %.3f, \"outputs\": %s}%s\n",
+                jobs[i].exit_code == 0 ? "ok" : "failed", jobs[i].exit_code, jobs[i].seconds, jobs[i].outputs, i + 1 < num_jobs ? "," : "");
+        if (jobs[i].exit_code != 0)
+            failed++;
+
+        batch_job_free(&jobs[i]);
+    }
+    fprintf(results_file, "], \"failed\": %u}\n", failed);
+    fflush(results_file);
+    free(jobs);
+
+    printf("\n----> Batch done: %u of %u jobs failed\n", failed, num_jobs);
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,34 @@
+#ifndef HACPACK_BATCH_H
+#define HACPACK_BATCH_H
+
+#include <stdio.h>
+#include "settings.h"
+#include "json.h"
+
+#define BATCH_JOB_MEMORY 0x100 /* Estimated peak memory of a job in MB, hashing and copy buffers. */
+
+/* Applies a job's own options to settings, a private copy of the batch settings. */
+typedef int (*batch_parse_func_t)(hp_settings_t *settings, int argc, char **argv);
+typedef int (*batch_build_func_t)(hp_settings_t *settings);
+
+typedef struct
+{
+    char *name;
+    int argc;
+    char **argv;
+    int exit_code;
+    double seconds;
+    char *outputs; /* JSON array of created files. */
+    double start_time;
+    FILE *log_file;
+    FILE *result_file;
+    long pid;
+} batch_job_t;
+
+char *batch_read_file(FILE *f);
+int batch_job_init(batch_job_t *job, json_value_t *defaults, json_value_t *options, uint32_t index);
+void batch_job_free(batch_job_t *job);
+int batch_build_job(hp_settings_t *settings, batch_parse_func_t parse_func, batch_build_func_t build_func, batch_job_t *job, uint32_t index, uint32_t num_threads);
+int batch_run(hp_settings_t *settings, batch_parse_func_t parse_func, batch_build_func_t build_func, FILE *results_file);
+
+#endif
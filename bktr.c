@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "bktr.h"
+#include "ncareader.h"
+#include "fio.h"
+#include "worker.h"
+#include "utils.h"
+
+/* A file of the patched RomFS that's also in the base, compared block by block. */
+typedef struct
+{
+    uint64_t virtual_offset; /* In the patched RomFS section */
+    uint64_t base_offset;    /* In the base RomFS section */
+    uint64_t size;
+    uint8_t known_equal; /* Body came from the base unchanged, nothing to compare */
+    uint8_t *equal_blocks; /* One flag per BKTR_BLOCK_SIZE block */
+} bktr_candidate_t;
+
+typedef struct
+{
+    bktr_candidate_t *candidate;
+    uint64_t offset; /* In the candidate, a multiple of BKTR_BLOCK_SIZE */
+    uint64_t size;
+    int failed;
+} bktr_compare_job_t;
+
+typedef struct
+{
+    int virtual_fd;
+    ncareader_t *base_reader;
+    uint8_t base_section;
+    bktr_compare_job_t *jobs;
+} bktr_compare_ctx_t;
+
+typedef struct
+{
+    bktr_relocation_entry_t *entries;
+    uint32_t num_entries;
+    uint32_t capacity;
+    uint64_t patch_size; /* Bytes of this section the entries point to */
+} bktr_relocation_table_t;
+
+static void bktr_compare_job(void *ctx, uint32_t index)
+{
+    bktr_compare_ctx_t *compare_ctx = (bktr_compare_ctx_t *)ctx;
+    bktr_compare_job_t *job = &compare_ctx->jobs[index];
+    bktr_candidate_t *candidate = job->candidate;
+
+    unsigned char *buf = hp_track_buffer(malloc(job->size * 2));
+    if (buf == NULL || fio_pread(compare_ctx->virtual_fd, buf, job->size, candidate->virtual_offset + job->offset) != 0 ||
+        ncareader_read_section(compare_ctx->base_reader, compare_ctx->base_section, buf + job->size, job->size, candidate->base_offset + job->offset) != 0)
+    {
+        hp_free(buf);
+        job->failed = 1;
+        return;
+    }
+
+    for (uint64_t ofs = 0; ofs < job->size; ofs += BKTR_BLOCK_SIZE)
+    {
+        uint64_t block_size = job->size - ofs < BKTR_BLOCK_SIZE ? job->size - ofs : BKTR_BLOCK_SIZE;
+        candidate->equal_blocks[(job->offset + ofs) / BKTR_BLOCK_SIZE] = memcmp(buf + ofs, buf + job->size + ofs, block_size) == 0;
+    }
+    hp_free(buf);
+}
+
+/* Adds a run of the patched RomFS, runs that continue the last entry extend it. */
+static void bktr_add_run(bktr_relocation_table_t *table, uint64_t virtual_offset, uint64_t size, uint64_t base_offset, uint32_t is_patch)
+{
+    if (size == 0)
+        return;
+
+    if (table->num_entries > 0)
+    {
+        bktr_relocation_entry_t *last = &table->entries[table->num_entries - 1];
+        uint64_t physical_offset = last->physical_offset + (virtual_offset - last->virtual_offset);
+        if (last->is_patch == is_patch && (is_patch == 1 || physical_offset == base_offset))
+        {
+            if (is_patch == 1)
+                table->patch_size += size;
+            return;
+        }
+    }
+
+    if (table->num_entries == table->capacity)
+    {
+        table->capacity = table->capacity ? table->capacity * 2 : 0x400;
+        bktr_relocation_entry_t *entries = realloc(table->entries, table->capacity * sizeof(bktr_relocation_entry_t));
+        if (entries == NULL)
+        {
+            hp_error("Failed to allocate BKTR relocation entries!\n");
+            hp_exit_failure();
+        }
+        table->entries = entries;
+    }
+
+    bktr_relocation_entry_t *entry = &table->entries[table->num_entries++];
+    entry->virtual_offset = virtual_offset;
+    entry->physical_offset = is_patch == 1 ? table->patch_size : base_offset;
+    entry->is_patch = is_patch;
+    if (is_patch == 1)
+        table->patch_size += size;
+}
+
+/* Lays out entries as a bucket tree, a node with the start of every bucket followed by the buckets.
+   Entries must start with their offset, the tree is used for every BKTR table. */
+unsigned char *bktr_build_bucket_tree(const void *entries, uint32_t num_entries, size_t entry_size, uint64_t end_offset, uint64_t *out_size)
+{
+    uint32_t entries_per_bucket = (BKTR_BUCKET_SIZE - sizeof(bktr_bucket_header_t)) / entry_size;
+    uint32_t num_buckets = (num_entries + entries_per_bucket - 1) / entries_per_bucket;
+    if (num_buckets > BKTR_MAX_BUCKETS)
+    {
+        hp_error("Error: BKTR table needs %u buckets, at most %u are supported\n", num_buckets, (uint32_t)BKTR_MAX_BUCKETS);
+        hp_exit_failure();
+    }
+
+    *out_size = (uint64_t)BKTR_BUCKET_SIZE * (num_buckets + 1);
+    unsigned char *tree = calloc(1, *out_size);
+    if (tree == NULL)
+    {
+        hp_error("Failed to allocate BKTR table!\n");
+        hp_exit_failure();
+    }
+
+    bktr_bucket_header_t *node_header = (bktr_bucket_header_t *)tree;
+    uint64_t *bucket_offsets = (uint64_t *)(tree + sizeof(bktr_bucket_header_t));
+    node_header->index = 0;
+    node_header->num_entries = num_buckets;
+    node_header->end_offset = end_offset;
+    for (uint32_t i = 0; i < num_buckets; i++)
+    {
+        uint32_t first = i * entries_per_bucket;
+        uint32_t count = num_entries - first < entries_per_bucket ? num_entries - first : entries_per_bucket;
+        unsigned char *bucket = tree + (uint64_t)BKTR_BUCKET_SIZE * (i + 1);
+        const unsigned char *first_entry = (const unsigned char *)entries + (uint64_t)first * entry_size;
+
+        // Every entry starts with its offset, so the start of a bucket is that of its first entry
+        memcpy(&bucket_offsets[i], first_entry, sizeof(uint64_t));
+        bktr_bucket_header_t *bucket_header = (bktr_bucket_header_t *)bucket;
+        bucket_header->index = i;
+        bucket_header->num_entries = count;
+        if (i + 1 < num_buckets)
+            memcpy(&bucket_header->end_offset, first_entry + (uint64_t)count * entry_size, sizeof(uint64_t));
+        else
+            bucket_header->end_offset = end_offset;
+        memcpy(bucket + sizeof(bktr_bucket_header_t), first_entry, (uint64_t)count * entry_size);
+    }
+    return tree;
+}
+
+/* Writes a prepared RomFS as a BKTR patch section at the end of nca_file and frees romfs_ctx.
+   The patched RomFS is built in the temp directory and matched with the base RomFS file by file in blocks of BKTR_BLOCK_SIZE,
+   only blocks that differ, hash levels and tables are stored, everything else is relocated to the base. */
+void bktr_write_romfs_section(hp_settings_t *settings, FILE *nca_file, romfs_ctx_t *romfs_ctx, nca_fs_header_t *fs_header)
+{
+    ivfc_hdr_t *ivfc_header = &fs_header->bktr_superblock.ivfc_header;
+    uint64_t data_offset = ivfc_header->level_headers[IVFC_MAX_LEVEL - 1].logical_offset;
+
+    hp_log("Opening base NCA\n");
+    ncareader_t base_reader;
+    ncareader_open(settings, &settings->romfs_base, settings->has_base_title_key ? settings->base_title_key : NULL, &base_reader);
+    int base_section = ncareader_find_section(&base_reader, FS_TYPE_ROMFS, HASH_TYPE_ROMFS);
+    if (base_section < 0 || base_reader.header.fs_headers[base_section].crypt_type == CRYPT_BKTR)
+    {
+        hp_error("Error: %s doesn't have a RomFS section a patch can be made against\n", settings->romfs_base.char_path);
+        hp_exit_failure();
+    }
+    uint64_t base_data_offset = base_reader.header.fs_headers[base_section].romfs_superblock.ivfc_header.level_headers[IVFC_MAX_LEVEL - 1].logical_offset;
+
+    // Files at the same path in the base are the only places data is looked for, the tree is freed once the RomFS is written
+    uint32_t num_candidates = 0;
+    for (romfs_fent_ctx_t *cur_file = romfs_ctx->files; cur_file != NULL; cur_file = cur_file->next)
+    {
+        if (cur_file->in_base == 1 && cur_file->size > 0 && cur_file->base_size > 0)
+            num_candidates++;
+    }
+    bktr_candidate_t *candidates = calloc(num_candidates ? num_candidates : 1, sizeof(bktr_candidate_t));
+    if (candidates == NULL)
+    {
+        hp_error("Failed to allocate BKTR candidates!\n");
+        hp_exit_failure();
+    }
+    uint32_t num_jobs = 0;
+    uint32_t num_compared = 0;
+    uint32_t candidate_index = 0;
+    for (romfs_fent_ctx_t *cur_file = romfs_ctx->files; cur_file != NULL; cur_file = cur_file->next)
+    {
+        if (cur_file->in_base == 0 || cur_file->size == 0 || cur_file->base_size == 0)
+            continue;
+        bktr_candidate_t *candidate = &candidates[candidate_index++];
+        candidate->virtual_offset = data_offset + ROMFS_FILEPARTITION_OFS + cur_file->offset;
+        candidate->base_offset = base_data_offset + cur_file->base_offset;
+        candidate->size = cur_file->size < cur_file->base_size ? cur_file->size : cur_file->base_size;
+        candidate->known_equal = cur_file->from_base;
+        candidate->equal_blocks = calloc((candidate->size + BKTR_BLOCK_SIZE - 1) / BKTR_BLOCK_SIZE, 1);
+        if (candidate->equal_blocks == NULL)
+        {
+            hp_error("Failed to allocate BKTR candidates!\n");
+            hp_exit_failure();
+        }
+        if (candidate->known_equal == 1)
+            memset(candidate->equal_blocks, 1, (candidate->size + BKTR_BLOCK_SIZE - 1) / BKTR_BLOCK_SIZE);
+        else
+        {
+            num_compared++;
+            num_jobs += (candidate->size + BKTR_COMPARE_SIZE - 1) / BKTR_COMPARE_SIZE;
+        }
+    }
+
+    // Hash levels are over the patched RomFS, so it's written in full before it's split
+    filepath_t virtual_path;
+    filepath_init(&virtual_path);
+    filepath_copy(&virtual_path, &settings->temp_dir);
+    filepath_append(&virtual_path, "program_sec1_romfs");
+    FILE *virtual_file = os_fopen(virtual_path.os_path, OS_MODE_WRITE_EDIT);
+    if (virtual_file == NULL)
+    {
+        hp_error("Failed to create %s!\n", virtual_path.char_path);
+        hp_exit_failure();
+    }
+    nca_write_prepared_romfs_section(virtual_file, romfs_ctx, ivfc_header);
+    fflush(virtual_file);
+    fseeko64(virtual_file, 0, SEEK_END);
+    uint64_t virtual_size = (uint64_t)ftello64(virtual_file);
+    int virtual_fd = fileno(virtual_file);
+
+    hp_log("\n===> Matching RomFS with base\n");
+    bktr_compare_ctx_t compare_ctx;
+    compare_ctx.virtual_fd = virtual_fd;
+    compare_ctx.base_reader = &base_reader;
+    compare_ctx.base_section = (uint8_t)base_section;
+    compare_ctx.jobs = calloc(num_jobs ? num_jobs : 1, sizeof(bktr_compare_job_t));
+    if (compare_ctx.jobs == NULL)
+    {
+        hp_error("Failed to allocate BKTR compare jobs!\n");
+        hp_exit_failure();
+    }
+    uint32_t job_index = 0;
+    for (uint32_t i = 0; i < num_candidates; i++)
+    {
+        if (candidates[i].known_equal == 1)
+            continue;
+        for (uint64_t ofs = 0; ofs < candidates[i].size; ofs += BKTR_COMPARE_SIZE)
+        {
+            bktr_compare_job_t *job = &compare_ctx.jobs[job_index++];
+            job->candidate = &candidates[i];
+            job->offset = ofs;
+            job->size = candidates[i].size - ofs < BKTR_COMPARE_SIZE ? candidates[i].size - ofs : BKTR_COMPARE_SIZE;
+        }
+    }
+    hp_log("Comparing %u overlay files with the base, %u files are unchanged\n", num_compared, num_candidates - num_compared);
+    worker_run(bktr_compare_job, &compare_ctx, num_jobs, settings->num_threads ? settings->num_threads : worker_get_cpu_count());
+    for (uint32_t i = 0; i < num_jobs; i++)
+    {
+        if (compare_ctx.jobs[i].failed)
+        {
+            hp_error("Failed to compare RomFS with %s!\n", settings->romfs_base.char_path);
+            hp_exit_failure();
+        }
+    }
+    free(compare_ctx.jobs);
+
+    // Runs taken from the base stay on 0x10 byte boundaries, so every entry can be decrypted on its own
+    bktr_relocation_table_t table;
+    memset(&table, 0, sizeof(table));
+    uint64_t cursor = 0;
+    for (uint32_t i = 0; i < num_candidates; i++)
+    {
+        bktr_candidate_t *candidate = &candidates[i];
+        bktr_add_run(&table, cursor, candidate->virtual_offset - cursor, 0, 1);
+        cursor = candidate->virtual_offset;
+        for (uint64_t ofs = 0; ofs < candidate->size; ofs += BKTR_BLOCK_SIZE)
+        {
+            uint64_t block_size = candidate->size - ofs < BKTR_BLOCK_SIZE ? candidate->size - ofs : BKTR_BLOCK_SIZE;
+            uint64_t base_size = candidate->equal_blocks[ofs / BKTR_BLOCK_SIZE] ? block_size & ~0xFULL : 0;
+            bktr_add_run(&table, cursor, base_size, candidate->base_offset + ofs, 0);
+            bktr_add_run(&table, cursor + base_size, block_size - base_size, 0, 1);
+            cursor += block_size;
+        }
+        free(candidate->equal_blocks);
+    }
+    bktr_add_run(&table, cursor, virtual_size - cursor, 0, 1);
+    free(candidates);
+
+    hp_log("Writing patch data\n");
+    fflush(nca_file);
+    fseeko64(nca_file, 0, SEEK_END);
+    uint64_t section_offset = (uint64_t)ftello64(nca_file);
+    int nca_fd = fileno(nca_file);
+    fio_copy_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    for (uint32_t i = 0; i < table.num_entries; i++)
+    {
+        bktr_relocation_entry_t *entry = &table.entries[i];
+        if (entry->is_patch == 0)
+            continue;
+        uint64_t end = i + 1 < table.num_entries ? table.entries[i + 1].virtual_offset : virtual_size;
+        if (fio_copy_range(virtual_fd, entry->virtual_offset, nca_fd, section_offset + entry->physical_offset, end - entry->virtual_offset, &stats) != 0)
+        {
+            hp_error("Failed to write patch data!\n");
+            hp_exit_failure();
+        }
+    }
+    fio_print_copy_stats(&stats);
+    os_fclose(virtual_file);
+    os_deletefile(virtual_path.char_path);
+    ncareader_close(&base_reader);
+
+    // The counter value is the same everywhere, one subsection covers all patch data
+    uint32_t generation = settings->title_version;
+    bktr_subsection_entry_t subsection_entry;
+    memset(&subsection_entry, 0, sizeof(subsection_entry));
+    subsection_entry.ctr_val = generation;
+    memset(fs_header->section_ctr, 0, sizeof(fs_header->section_ctr));
+    memcpy(fs_header->section_ctr, &generation, sizeof(generation));
+
+    hp_log("Writing BKTR tables\n");
+    uint64_t relocation_offset = (table.patch_size + 0xF) & ~0xFULL;
+    uint64_t relocation_size, subsection_size;
+    unsigned char *relocation_tree = bktr_build_bucket_tree(table.entries, table.num_entries, sizeof(bktr_relocation_entry_t), virtual_size, &relocation_size);
+    unsigned char *subsection_tree = bktr_build_bucket_tree(&subsection_entry, 1, sizeof(bktr_subsection_entry_t), relocation_offset, &subsection_size);
+    if (fio_pwrite(nca_fd, relocation_tree, relocation_size, section_offset + relocation_offset) != 0 ||
+        fio_pwrite(nca_fd, subsection_tree, subsection_size, section_offset + relocation_offset + relocation_size) != 0)
+    {
+        hp_error("Failed to write BKTR tables!\n");
+        hp_exit_failure();
+    }
+    free(relocation_tree);
+    free(subsection_tree);
+    fseeko64(nca_file, 0, SEEK_END);
+
+    bktr_superblock_t *superblock = &fs_header->bktr_superblock;
+    superblock->relocation_header.offset = relocation_offset;
+    superblock->relocation_header.size = relocation_size;
+    superblock->relocation_header.magic = MAGIC_BKTR;
+    superblock->relocation_header.version = 1;
+    superblock->relocation_header.num_entries = table.num_entries;
+    superblock->subsection_header.offset = relocation_offset + relocation_size;
+    superblock->subsection_header.size = subsection_size;
+    superblock->subsection_header.magic = MAGIC_BKTR;
+    superblock->subsection_header.version = 1;
+    superblock->subsection_header.num_entries = 1;
+
+    hp_log("Stored 0x%" PRIx64 " of 0x%" PRIx64 " bytes, %u relocation entries\n", table.patch_size, virtual_size, table.num_entries);
+    free(table.entries);
+}
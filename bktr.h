@@ -0,0 +1,47 @@
+#ifndef HACPACK_BKTR_H
+#define HACPACK_BKTR_H
+
+#include <stdio.h>
+#include "settings.h"
+#include "nca.h"
+#include "romfs.h"
+
+#define BKTR_BUCKET_SIZE 0x4000
+#define BKTR_BLOCK_SIZE 0x4000 /* Granularity data is matched with the base at */
+#define BKTR_COMPARE_SIZE 0x800000 // 8 MB
+#define BKTR_MAX_BUCKETS ((BKTR_BUCKET_SIZE - 0x10) / sizeof(uint64_t))
+
+/* Maps a range of the patched RomFS to the base RomFS section or to this section. */
+#pragma pack(push, 1)
+typedef struct
+{
+    uint64_t virtual_offset;
+    uint64_t physical_offset;
+    uint32_t is_patch;
+} bktr_relocation_entry_t;
+#pragma pack(pop)
+
+/* Sets the AES-CTR-EX counter value from a physical offset of this section on. */
+#pragma pack(push, 1)
+typedef struct
+{
+    uint64_t offset;
+    uint32_t _0x8;
+    uint32_t ctr_val;
+} bktr_subsection_entry_t;
+#pragma pack(pop)
+
+/* Header of a bucket, and of the first node that lists where every bucket starts. */
+#pragma pack(push, 1)
+typedef struct
+{
+    uint32_t index;
+    uint32_t num_entries;
+    uint64_t end_offset;
+} bktr_bucket_header_t;
+#pragma pack(pop)
+
+unsigned char *bktr_build_bucket_tree(const void *entries, uint32_t num_entries, size_t entry_size, uint64_t end_offset, uint64_t *out_size);
+void bktr_write_romfs_section(hp_settings_t *settings, FILE *nca_file, romfs_ctx_t *romfs_ctx, nca_fs_header_t *fs_header);
+
+#endif
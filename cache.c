@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <utime.h>
+#include <unistd.h>
+#include "cache.h"
+#include "nca.h"
+#include "sha.h"
+#include "fio.h"
+#include "report.h"
+#include "utils.h"
+#include "version.h"
+
+/* A cache entry on disk, <key>.nca and its sidecar. */
+typedef struct
+{
+    char *name;
+    uint64_t size;
+    time_t last_used;
+} cache_file_t;
+
+static int cache_compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int cache_compare_last_used(const void *a, const void *b)
+{
+    const cache_file_t *file_a = (const cache_file_t *)a;
+    const cache_file_t *file_b = (const cache_file_t *)b;
+    if (file_a->last_used != file_b->last_used)
+        return file_a->last_used < file_b->last_used ? -1 : 1;
+    return strcmp(file_a->name, file_b->name);
+}
+
+static void cache_hash_file(sha_ctx_t *sha_ctx, const char *path, unsigned char *buf)
+{
+    FILE *file = hp_track_file(fopen(path, "rb"));
+    if (file == NULL)
+    {
+        hp_error("Failed to open %s!\n", path);
+        hp_exit_failure();
+    }
+
+    size_t read_size;
+    while ((read_size = fread(buf, 1, CACHE_TREE_BUFFER_SIZE, file)) > 0)
+        sha_update(sha_ctx, buf, read_size);
+    os_fclose(file);
+}
+
+/* Hashes names, sizes and contents under dir_path, entries are visited in name order so the key doesn't depend on readdir order. */
+static void cache_hash_tree(sha_ctx_t *sha_ctx, const char *dir_path, const char *rel_path, unsigned char *buf)
+{
+#if __MINGW32__
+    struct __stat64 objstats;
+#else
+    struct stat objstats;
+#endif
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL)
+    {
+        hp_error("Failed to open %s!\n", dir_path);
+        hp_exit_failure();
+    }
+
+    char **names = NULL;
+    uint32_t num_names = 0;
+    uint32_t names_capacity = 0;
+    struct dirent *cur_dirent = NULL;
+    while ((cur_dirent = readdir(dir)))
+    {
+        if (strcmp(cur_dirent->d_name, ".") == 0 || strcmp(cur_dirent->d_name, "..") == 0)
+            continue;
+
+        if (num_names == names_capacity)
+        {
+            names_capacity = names_capacity ? names_capacity * 2 : 0x20;
+            char **new_names = realloc(names, names_capacity * sizeof(char *));
+            if (new_names == NULL)
+            {
+                hp_error("Failed to allocate cache tree entries!\n");
+                hp_exit_failure();
+            }
+            names = new_names;
+        }
+        if ((names[num_names++] = strdup(cur_dirent->d_name)) == NULL)
+        {
+            hp_error("Failed to allocate cache tree entries!\n");
+            hp_exit_failure();
+        }
+    }
+    closedir(dir);
+    if (num_names > 1)
+        qsort(names, num_names, sizeof(char *), cache_compare_names);
+
+    char objpath[4351];
+    char objrel[4351];
+    for (uint32_t i = 0; i < num_names; i++)
+    {
+        snprintf(objpath, sizeof(objpath), "%s%s%s", dir_path, OS_PATH_SEPARATOR, names[i]);
+        snprintf(objrel, sizeof(objrel), "%s/%s", rel_path, names[i]);
+        if (os_char_stat(objpath, &objstats) == -1)
+        {
+            hp_error("Failed to stat: %s\n", objpath);
+            hp_exit_failure();
+        }
+
+        if ((objstats.st_mode & S_IFMT) == S_IFDIR)
+        {
+            sha_update(sha_ctx, "D", 1);
+            sha_update(sha_ctx, objrel, strlen(objrel) + 1);
+            cache_hash_tree(sha_ctx, objpath, objrel, buf);
+        }
+        else if ((objstats.st_mode & S_IFMT) == S_IFREG)
+        {
+            uint64_t size = (uint64_t)objstats.st_size;
+            sha_update(sha_ctx, "F", 1);
+            sha_update(sha_ctx, objrel, strlen(objrel) + 1);
+            sha_update(sha_ctx, &size, sizeof(size));
+            cache_hash_file(sha_ctx, objpath, buf);
+        }
+        free(names[i]);
+    }
+    free(names);
+}
+
+static void cache_hash_input(sha_ctx_t *sha_ctx, const char *name, filepath_t *dir_path, unsigned char *buf)
+{
+    sha_update(sha_ctx, name, strlen(name) + 1);
+    if (dir_path->valid == VALIDITY_VALID)
+    {
+        sha_update(sha_ctx, "+", 1);
+        cache_hash_tree(sha_ctx, dir_path->char_path, "", buf);
+    }
+    else
+        sha_update(sha_ctx, "-", 1);
+    sha_update(sha_ctx, "E", 1);
+}
+
+static void cache_hash_settings(sha_ctx_t *sha_ctx, hp_settings_t *settings)
+{
+    uint32_t nca_type = (uint32_t)settings->nca_type;
+    uint64_t title_id = settings->title_id;
+    uint32_t sdk_version = settings->sdk_version;
+    int32_t keygeneration = settings->keygeneration;
+    uint32_t nca_sig = (uint32_t)settings->nca_sig;
+    uint32_t nca_disttype = (uint32_t)settings->nca_disttype;
+
+    sha_update(sha_ctx, CACHE_KEY_TAG " " HACPACK_VERSION, sizeof(CACHE_KEY_TAG " " HACPACK_VERSION));
+    sha_update(sha_ctx, &nca_type, sizeof(nca_type));
+    sha_update(sha_ctx, &title_id, sizeof(title_id));
+    sha_update(sha_ctx, &sdk_version, sizeof(sdk_version));
+    sha_update(sha_ctx, &keygeneration, sizeof(keygeneration));
+    sha_update(sha_ctx, settings->keyareakey, 0x10);
+    sha_update(sha_ctx, &settings->has_title_key, 1);
+    if (settings->has_title_key == 1)
+        sha_update(sha_ctx, settings->title_key, 0x10);
+    sha_update(sha_ctx, &settings->plaintext, 1);
+    sha_update(sha_ctx, &settings->compress_romfs, 1);
+    sha_update(sha_ctx, &settings->noselfsignncasig2, 1);
+    sha_update(sha_ctx, &nca_sig, sizeof(nca_sig));
+    sha_update(sha_ctx, &nca_disttype, sizeof(nca_disttype));
+    sha_update(sha_ctx, settings->keyset.header_key, 0x20);
+    sha_update(sha_ctx, settings->keyset.key_area_keys[settings->keygeneration - 1][0], 0x10);
+}
+
+/* Sets up the cache slot of the NCA settings describes, the cache is skipped if the NCA would carry a random signature. */
+void cache_init(hp_settings_t *settings, cache_entry_t *entry)
+{
+    memset(entry, 0, sizeof(*entry));
+    filepath_init(&entry->path);
+    if (settings->cache_dir.valid != VALIDITY_VALID)
+        return;
+
+    const char *reason = NULL;
+    if (settings->nca_sig == NCA_SIG_TYPE_RANDOM)
+        reason = "random nca signature";
+    else if (settings->nca_sig1_private_key.valid == VALIDITY_VALID)
+        reason = "nca signature 1 is signed";
+    else if (settings->nca_type == NCA_TYPE_PROGRAM && (settings->noselfsignncasig2 == 0 || settings->nca_sig2_private_key.valid == VALIDITY_VALID))
+        reason = "nca signature 2 is signed";
+    else if (settings->romfs_base.valid == VALIDITY_VALID)
+        reason = "RomFS has a base, which isn't hashed into cache keys";
+    if (reason != NULL)
+    {
+        hp_log("Skipping NCA cache, %s\n", reason);
+        return;
+    }
+
+    hp_log("Calculating NCA cache key\n");
+    unsigned char *buf = hp_track_buffer(malloc(CACHE_TREE_BUFFER_SIZE));
+    if (buf == NULL)
+    {
+        hp_error("Failed to allocate cache hash buffer!\n");
+        hp_exit_failure();
+    }
+    sha_ctx_t *sha_ctx = new_sha_ctx(HASH_TYPE_SHA256, 0);
+    cache_hash_settings(sha_ctx, settings);
+    if (settings->nca_type == NCA_TYPE_PROGRAM)
+    {
+        cache_hash_input(sha_ctx, "exefs", &settings->exefs_dir, buf);
+        cache_hash_input(sha_ctx, "romfs", &settings->romfs_dir, buf);
+        cache_hash_input(sha_ctx, "logo", &settings->logo_dir, buf);
+    }
+    else
+        cache_hash_input(sha_ctx, "romfs", &settings->romfs_dir, buf);
+    sha_get_hash(sha_ctx, entry->key);
+    free_sha_ctx(sha_ctx);
+    hp_free(buf);
+
+    char key_hex[0x41];
+    hexBinaryString(entry->key, 0x20, key_hex, sizeof(key_hex));
+    filepath_copy(&entry->path, &settings->cache_dir);
+    filepath_append(&entry->path, "%s.nca", key_hex);
+    entry->enabled = 1;
+}
+
+/* Counts a hit in CACHE_HITS_FILE and returns 1 if it is sampled for --cacheverify.
+ * Every 100 / cache_verify-th hit is sampled, so runs on the same cache directory sample the same hits. */
+static int cache_sample_hit(hp_settings_t *settings)
+{
+    filepath_t hits_path;
+    filepath_init(&hits_path);
+    filepath_copy(&hits_path, &settings->cache_dir);
+    filepath_append(&hits_path, "%s", CACHE_HITS_FILE);
+
+    uint64_t hits = 0;
+    FILE *hits_file = os_fopen(hits_path.os_path, OS_MODE_READ);
+    if (hits_file != NULL)
+    {
+        if (fscanf(hits_file, "%" SCNu64, &hits) != 1)
+            hits = 0;
+        os_fclose(hits_file);
+    }
+    hits++;
+    hits_file = os_fopen(hits_path.os_path, OS_MODE_WRITE);
+    if (hits_file != NULL)
+    {
+        fprintf(hits_file, "%" PRIu64 "\n", hits);
+        os_fclose(hits_file);
+    }
+    return hits * settings->cache_verify % 100 < settings->cache_verify;
+}
+
+static int cache_copy_file(filepath_t *src_path, filepath_t *dst_path)
+{
+    int src_fd = fio_open(src_path, FIO_MODE_READ);
+    if (src_fd < 0)
+        return -1;
+    uint64_t size;
+    int dst_fd = -1;
+    int ret = fio_get_size(src_fd, &size);
+    if (ret == 0)
+    {
+        dst_fd = fio_open(dst_path, FIO_MODE_WRITE);
+        ret = dst_fd < 0 ? -1 : fio_copy_range(src_fd, 0, dst_fd, 0, size, NULL);
+    }
+    fio_close(src_fd);
+    if (dst_fd >= 0 && fio_close(dst_fd) != 0)
+        ret = -1;
+    return ret;
+}
+
+static void cache_get_sidecar_path(filepath_t *nca_path, filepath_t *out_path)
+{
+    char path[MAX_PATH + sizeof(NCA_SIDECAR_EXTENSION)];
+    snprintf(path, sizeof(path), "%s" NCA_SIDECAR_EXTENSION, nca_path->char_path);
+    filepath_init(out_path);
+    filepath_set(out_path, path);
+}
+
+/* Copies a cached NCA to out_dir as ncaid.nca, returns 1 on a hit and 0 if the NCA has to be built. */
+int cache_lookup(hp_settings_t *settings, cache_entry_t *entry, filepath_t *out_nca_path, hp_nca_digest_t *out_digest)
+{
+    if (entry->enabled == 0)
+        return 0;
+
+    if (nca_read_sidecar(&entry->path, &entry->cached_digest) != 0)
+    {
+        hp_log("NCA cache miss: %s\n", entry->path.char_path);
+        return 0;
+    }
+    if (settings->cache_verify > 0)
+        entry->verify = (uint8_t)cache_sample_hit(settings);
+    if (entry->verify == 1)
+    {
+        hp_log("NCA cache hit sampled for verification, rebuilding: %s\n", entry->path.char_path);
+        return 0;
+    }
+
+    char nca_name[42];
+    nca_get_filename(&entry->cached_digest, 0, nca_name);
+    filepath_init(out_nca_path);
+    filepath_copy(out_nca_path, &settings->out_dir);
+    filepath_append(out_nca_path, "%s", nca_name);
+    hp_log("NCA cache hit, copying %s to %s\n", entry->path.char_path, out_nca_path->char_path);
+    if (cache_copy_file(&entry->path, out_nca_path) != 0)
+    {
+        hp_error("Failed to copy %s to %s!\n", entry->path.char_path, out_nca_path->char_path);
+        hp_exit_failure();
+    }
+
+    // Entries are evicted by last use, which is kept as the sidecar's mtime
+    filepath_t sidecar_path;
+    cache_get_sidecar_path(&entry->path, &sidecar_path);
+    utime(sidecar_path.char_path, NULL);
+
+    report_add_output(nca_get_content_type_name(settings->nca_type), out_nca_path->char_path, entry->cached_digest.hash, entry->cached_digest.size);
+    *out_digest = entry->cached_digest;
+    return 1;
+}
+
+/* Removes the least recently used entries until the cache fits in settings->cache_size, the entry just stored is kept. */
+static void cache_evict(hp_settings_t *settings, cache_entry_t *entry)
+{
+#if __MINGW32__
+    struct __stat64 objstats;
+#else
+    struct stat objstats;
+#endif
+    if (settings->cache_size == 0)
+        return;
+
+    char entry_name[0x45];
+    hexBinaryString(entry->key, 0x20, entry_name, sizeof(entry_name));
+    strcat(entry_name, ".nca");
+
+    DIR *dir = opendir(settings->cache_dir.char_path);
+    if (dir == NULL)
+        return;
+
+    cache_file_t *files = NULL;
+    uint32_t num_files = 0;
+    uint32_t files_capacity = 0;
+    uint64_t total_size = 0;
+    char objpath[4351];
+    struct dirent *cur_dirent = NULL;
+    while ((cur_dirent = readdir(dir)))
+    {
+        // Only <64 hex digits>.nca, temp files of builds in flight are left alone
+        size_t name_len = strlen(cur_dirent->d_name);
+        if (name_len != 0x40 + 4 || strcmp(cur_dirent->d_name + 0x40, ".nca") != 0)
+            continue;
+        if (strcmp(cur_dirent->d_name, entry_name) == 0)
+            continue;
+
+        snprintf(objpath, sizeof(objpath), "%s%s%s", settings->cache_dir.char_path, OS_PATH_SEPARATOR, cur_dirent->d_name);
+        if (os_char_stat(objpath, &objstats) == -1)
+            continue;
+
+        if (num_files == files_capacity)
+        {
+            files_capacity = files_capacity ? files_capacity * 2 : 0x20;
+            cache_file_t *new_files = realloc(files, files_capacity * sizeof(cache_file_t));
+            if (new_files == NULL)
+            {
+                hp_error("Failed to allocate cache entries!\n");
+                hp_exit_failure();
+            }
+            files = new_files;
+        }
+        cache_file_t *cur_file = &files[num_files];
+        cur_file->size = (uint64_t)objstats.st_size;
+        cur_file->last_used = objstats.st_mtime;
+        snprintf(objpath, sizeof(objpath), "%s%s%s" NCA_SIDECAR_EXTENSION, settings->cache_dir.char_path, OS_PATH_SEPARATOR, cur_dirent->d_name);
+        if (os_char_stat(objpath, &objstats) == 0)
+            cur_file->last_used = objstats.st_mtime;
+        if ((cur_file->name = strdup(cur_dirent->d_name)) == NULL)
+        {
+            hp_error("Failed to allocate cache entries!\n");
+            hp_exit_failure();
+        }
+        total_size += cur_file->size;
+        num_files++;
+    }
+    closedir(dir);
+
+    // The kept entry doesn't count against the limit, a single NCA larger than the cache still gets reused
+    uint64_t max_size = settings->cache_size * 0x100000;
+    if (total_size > max_size)
+    {
+        hp_log("NCA cache is %" PRIu64 " MB, evicting down to %" PRIu64 " MB\n", total_size / 0x100000, settings->cache_size);
+        qsort(files, num_files, sizeof(cache_file_t), cache_compare_last_used);
+        for (uint32_t i = 0; i < num_files && total_size > max_size; i++)
+        {
+            snprintf(objpath, sizeof(objpath), "%s%s%s", settings->cache_dir.char_path, OS_PATH_SEPARATOR, files[i].name);
+            hp_log("Evicting %s\n", objpath);
+            os_deletefile(objpath);
+            snprintf(objpath, sizeof(objpath), "%s%s%s" NCA_SIDECAR_EXTENSION, settings->cache_dir.char_path, OS_PATH_SEPARATOR, files[i].name);
+            os_deletefile(objpath);
+            total_size -= files[i].size;
+        }
+    }
+
+    for (uint32_t i = 0; i < num_files; i++)
+        free(files[i].name);
+    free(files);
+}
+
+/* Stores a freshly built NCA under its cache key, failing to store only costs the next build a miss. */
+void cache_store(hp_settings_t *settings, cache_entry_t *entry, filepath_t *nca_path, hp_nca_digest_t *digest)
+{
+    if (entry->enabled == 0)
+        return;
+
+    if (entry->verify == 1 && entry->cached_digest.valid == 1)
+    {
+        if (memcmp(entry->cached_digest.hash, digest->hash, 0x20) == 0 && entry->cached_digest.size == digest->size)
+        {
+            hp_log("NCA cache entry verified: %s\n", entry->path.char_path);
+            return;
+        }
+        hp_error("NCA cache entry %s doesn't match the rebuilt NCA, replacing it!\n", entry->path.char_path);
+    }
+
+    // Copy under a temp name first, a concurrent lookup never sees a partial entry
+    char path[MAX_PATH + 0x10];
+    snprintf(path, sizeof(path), "%s.%d.tmp", entry->path.char_path, (int)getpid());
+    filepath_t temp_path;
+    filepath_init(&temp_path);
+    filepath_set(&temp_path, path);
+
+    hp_log("Storing NCA in cache: %s\n", entry->path.char_path);
+    if (cache_copy_file(nca_path, &temp_path) != 0 || os_rename(temp_path.os_path, entry->path.os_path) != 0)
+    {
+        hp_error("Failed to store %s in NCA cache!\n", nca_path->char_path);
+        os_deletefile(temp_path.char_path);
+        return;
+    }
+    nca_write_sidecar(settings, &entry->path, digest);
+
+    cache_evict(settings, entry);
+}
@@ -0,0 +1,25 @@
+#ifndef HACPACK_CACHE_H
+#define HACPACK_CACHE_H
+
+#include "settings.h"
+#include "filepath.h"
+
+#define CACHE_KEY_TAG "hacPack NCA cache"
+#define CACHE_TREE_BUFFER_SIZE 0x400000 // 4 MB
+#define CACHE_HITS_FILE "hits.txt" // Hit counter of --cacheverify sampling
+
+/* Cache slot of one NCA build, keyed by the input trees and every setting that ends up in the NCA. */
+typedef struct
+{
+    uint8_t enabled;
+    uint8_t verify; /* Sampled for --cacheverify, the NCA is rebuilt and compared with cached_digest */
+    unsigned char key[0x20];
+    filepath_t path; /* <cachedir>/<key>.nca */
+    hp_nca_digest_t cached_digest;
+} cache_entry_t;
+
+void cache_init(hp_settings_t *settings, cache_entry_t *entry);
+int cache_lookup(hp_settings_t *settings, cache_entry_t *entry, filepath_t *out_nca_path, hp_nca_digest_t *out_digest);
+void cache_store(hp_settings_t *settings, cache_entry_t *entry, filepath_t *nca_path, hp_nca_digest_t *digest);
+
+#endif
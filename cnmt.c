@@ -14,34 +14,34 @@ void cnmt_create_application(filepath_t *cnmt_filepath, hp_settings_t *settings)
     memset(&cnmt_ctx, 0, sizeof(cnmt_ctx));
     memset(&cnmt_ext_header, 0, sizeof(cnmt_ext_header));
 
-    printf("Setting content records\n");
-    if (settings->programnca.valid == VALIDITY_VALID)
+    hp_log("Setting content records\n");
+    if (settings->programnca.valid == VALIDITY_VALID || settings->programnca_digest.valid)
     {
-        cnmt_set_content_record(&settings->programnca, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
+        cnmt_set_content_record(&settings->programnca, &settings->programnca_digest, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
         cnmt_ctx.content_records[cnmt_ctx.content_records_count].type = 0x1; // Program
         cnmt_ctx.content_records_count += 1;
     }
     if (settings->datanca.valid == VALIDITY_VALID)
     {
-        cnmt_set_content_record(&settings->datanca, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
+        cnmt_set_content_record(&settings->datanca, &settings->datanca_digest, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
         cnmt_ctx.content_records[cnmt_ctx.content_records_count].type = 0x2; // Data
         cnmt_ctx.content_records_count += 1;
     }
-    if (settings->controlnca.valid == VALIDITY_VALID)
+    if (settings->controlnca.valid == VALIDITY_VALID || settings->controlnca_digest.valid)
     {
-        cnmt_set_content_record(&settings->controlnca, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
+        cnmt_set_content_record(&settings->controlnca, &settings->controlnca_digest, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
         cnmt_ctx.content_records[cnmt_ctx.content_records_count].type = 0x3; // Control
         cnmt_ctx.content_records_count += 1;
     }
-    if (settings->htmldocnca.valid == VALIDITY_VALID)
+    if (settings->htmldocnca.valid == VALIDITY_VALID || settings->htmldocnca_digest.valid)
     {
-        cnmt_set_content_record(&settings->htmldocnca, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
+        cnmt_set_content_record(&settings->htmldocnca, &settings->htmldocnca_digest, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
         cnmt_ctx.content_records[cnmt_ctx.content_records_count].type = 0x4; // HtmlDocument
         cnmt_ctx.content_records_count += 1;
     }
-    if (settings->legalnca.valid == VALIDITY_VALID)
+    if (settings->legalnca.valid == VALIDITY_VALID || settings->legalnca_digest.valid)
     {
-        cnmt_set_content_record(&settings->legalnca, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
+        cnmt_set_content_record(&settings->legalnca, &settings->legalnca_digest, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
         cnmt_ctx.content_records[cnmt_ctx.content_records_count].type = 0x5; // LegalInformation
         cnmt_ctx.content_records_count += 1;
     }
@@ -54,7 +54,7 @@ void cnmt_create_application(filepath_t *cnmt_filepath, hp_settings_t *settings)
     cnmt_ctx.header.content_entry_count = cnmt_ctx.content_records_count;
     cnmt_ext_header.patch_title_id = cnmt_ctx.header.title_id + 0x800;
 
-    printf("Writing metadata header\n");
+    hp_log("Writing metadata header\n");
     FILE *cnmt_file;
     cnmt_file = os_fopen(cnmt_filepath->os_path, OS_MODE_WRITE);
 
@@ -65,17 +65,17 @@ void cnmt_create_application(filepath_t *cnmt_filepath, hp_settings_t *settings)
     }
     else
     {
-        fprintf(stderr, "Failed to create %s!\n", cnmt_filepath->char_path);
-        exit(EXIT_FAILURE);
+        hp_error("Failed to create %s!\n", cnmt_filepath->char_path);
+        hp_exit_failure();
     }
 
     // Write content records
-    printf("Writing content records\n");
+    hp_log("Writing content records\n");
     for (int i=0; i < cnmt_ctx.content_records_count; i++)
         fwrite(&cnmt_ctx.content_records[i], sizeof(cnmt_content_record_t), 1, cnmt_file);
     fwrite(settings->digest, 1, 0x20, cnmt_file);
 
-    fclose(cnmt_file);
+    os_fclose(cnmt_file);
 }
 
 void cnmt_create_addon(filepath_t *cnmt_filepath, hp_settings_t *settings)
@@ -85,10 +85,10 @@ void cnmt_create_addon(filepath_t *cnmt_filepath, hp_settings_t *settings)
     memset(&cnmt_ctx, 0, sizeof(cnmt_ctx));
     memset(&cnmt_ext_header, 0, sizeof(cnmt_ext_header));
 
-    printf("Setting content records\n");
+    hp_log("Setting content records\n");
     if (settings->publicdatanca.valid == VALIDITY_VALID)
     {
-        cnmt_set_content_record(&settings->publicdatanca, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
+        cnmt_set_content_record(&settings->publicdatanca, &settings->publicdatanca_digest, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
         cnmt_ctx.content_records[cnmt_ctx.content_records_count].type = 0x2; // Data
         cnmt_ctx.content_records_count += 1;
     }
@@ -101,7 +101,7 @@ void cnmt_create_addon(filepath_t *cnmt_filepath, hp_settings_t *settings)
     cnmt_ctx.header.content_entry_count = cnmt_ctx.content_records_count;
     cnmt_ext_header.application_title_id = (cnmt_ctx.header.title_id - 0x1000) & 0xFFFFFFFFFFFFF000;
 
-    printf("Writing metadata header\n");
+    hp_log("Writing metadata header\n");
     FILE *cnmt_file;
     cnmt_file = os_fopen(cnmt_filepath->os_path, OS_MODE_WRITE);
 
@@ -112,17 +112,17 @@ void cnmt_create_addon(filepath_t *cnmt_filepath, hp_settings_t *settings)
     }
     else
     {
-        fprintf(stderr, "Failed to create %s!\n", cnmt_filepath->char_path);
-        exit(EXIT_FAILURE);
+        hp_error("Failed to create %s!\n", cnmt_filepath->char_path);
+        hp_exit_failure();
     }
 
     // Write content records
-    printf("Writing content records\n");
+    hp_log("Writing content records\n");
     for (int i=0; i < cnmt_ctx.content_records_count; i++)
         fwrite(&cnmt_ctx.content_records[i], sizeof(cnmt_content_record_t), 1, cnmt_file);
     fwrite(settings->digest, 1, 0x20, cnmt_file);
 
-    fclose(cnmt_file);
+    os_fclose(cnmt_file);
 }
 
 void cnmt_create_systemprogram(filepath_t *cnmt_filepath, hp_settings_t *settings)
@@ -130,10 +130,10 @@ void cnmt_create_systemprogram(filepath_t *cnmt_filepath, hp_settings_t *setting
     cnmt_ctx_t cnmt_ctx;
     memset(&cnmt_ctx, 0, sizeof(cnmt_ctx));
 
-    printf("Setting content records\n");
-    if (settings->programnca.valid == VALIDITY_VALID)
+    hp_log("Setting content records\n");
+    if (settings->programnca.valid == VALIDITY_VALID || settings->programnca_digest.valid)
     {
-        cnmt_set_content_record(&settings->programnca, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
+        cnmt_set_content_record(&settings->programnca, &settings->programnca_digest, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
         cnmt_ctx.content_records[cnmt_ctx.content_records_count].type = 0x1; // Program
         cnmt_ctx.content_records_count += 1;
     }
@@ -144,7 +144,7 @@ void cnmt_create_systemprogram(filepath_t *cnmt_filepath, hp_settings_t *setting
     cnmt_ctx.header.title_version = settings->title_version;
     cnmt_ctx.header.content_entry_count = cnmt_ctx.content_records_count;
 
-    printf("Writing metadata header\n");
+    hp_log("Writing metadata header\n");
     FILE *cnmt_file;
     cnmt_file = os_fopen(cnmt_filepath->os_path, OS_MODE_WRITE);
 
@@ -154,17 +154,17 @@ void cnmt_create_systemprogram(filepath_t *cnmt_filepath, hp_settings_t *setting
     }
     else
     {
-        fprintf(stderr, "Failed to create %s!\n", cnmt_filepath->char_path);
-        exit(EXIT_FAILURE);
+        hp_error("Failed to create %s!\n", cnmt_filepath->char_path);
+        hp_exit_failure();
     }
 
     // Write content records
-    printf("Writing content records\n");
+    hp_log("Writing content records\n");
     for (int i=0; i < cnmt_ctx.content_records_count; i++)
         fwrite(&cnmt_ctx.content_records[i], sizeof(cnmt_content_record_t), 1, cnmt_file);
     fwrite(settings->digest, 1, 0x20, cnmt_file);
 
-    fclose(cnmt_file);
+    os_fclose(cnmt_file);
 }
 
 void cnmt_create_systemdata(filepath_t *cnmt_filepath, hp_settings_t *settings)
@@ -172,10 +172,10 @@ void cnmt_create_systemdata(filepath_t *cnmt_filepath, hp_settings_t *settings)
     cnmt_ctx_t cnmt_ctx;
     memset(&cnmt_ctx, 0, sizeof(cnmt_ctx));
 
-    printf("Setting content records\n");
+    hp_log("Setting content records\n");
     if (settings->datanca.valid == VALIDITY_VALID)
     {
-        cnmt_set_content_record(&settings->datanca, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
+        cnmt_set_content_record(&settings->datanca, &settings->datanca_digest, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
         cnmt_ctx.content_records[cnmt_ctx.content_records_count].type = 0x2; // Data
         cnmt_ctx.content_records_count += 1;
     }
@@ -186,7 +186,7 @@ void cnmt_create_systemdata(filepath_t *cnmt_filepath, hp_settings_t *settings)
     cnmt_ctx.header.title_version = settings->title_version;
     cnmt_ctx.header.content_entry_count = cnmt_ctx.content_records_count;
 
-    printf("Writing metadata header\n");
+    hp_log("Writing metadata header\n");
     FILE *cnmt_file;
     cnmt_file = os_fopen(cnmt_filepath->os_path, OS_MODE_WRITE);
 
@@ -196,27 +196,108 @@ void cnmt_create_systemdata(filepath_t *cnmt_filepath, hp_settings_t *settings)
     }
     else
     {
-        fprintf(stderr, "Failed to create %s!\n", cnmt_filepath->char_path);
-        exit(EXIT_FAILURE);
+        hp_error("Failed to create %s!\n", cnmt_filepath->char_path);
+        hp_exit_failure();
     }
 
     // Write content records
-    printf("Writing content records\n");
+    hp_log("Writing content records\n");
     for (int i=0; i < cnmt_ctx.content_records_count; i++)
         fwrite(&cnmt_ctx.content_records[i], sizeof(cnmt_content_record_t), 1, cnmt_file);
     fwrite(settings->digest, 1, 0x20, cnmt_file);
 
-    fclose(cnmt_file);
+    os_fclose(cnmt_file);
 }
 
-void cnmt_set_content_record(filepath_t *nca_path, cnmt_content_record_t *content_record)
+/* Patch metadata without patch history or delta extended data, the content records are those of an application. */
+void cnmt_create_patch(filepath_t *cnmt_filepath, hp_settings_t *settings)
 {
+    cnmt_ctx_t cnmt_ctx;
+    cnmt_extended_patch_header_t cnmt_ext_header;
+    memset(&cnmt_ctx, 0, sizeof(cnmt_ctx));
+    memset(&cnmt_ext_header, 0, sizeof(cnmt_ext_header));
+
+    hp_log("Setting content records\n");
+    if (settings->programnca.valid == VALIDITY_VALID || settings->programnca_digest.valid)
+    {
+        cnmt_set_content_record(&settings->programnca, &settings->programnca_digest, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
+        cnmt_ctx.content_records[cnmt_ctx.content_records_count].type = 0x1; // Program
+        cnmt_ctx.content_records_count += 1;
+    }
+    if (settings->datanca.valid == VALIDITY_VALID)
+    {
+        cnmt_set_content_record(&settings->datanca, &settings->datanca_digest, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
+        cnmt_ctx.content_records[cnmt_ctx.content_records_count].type = 0x2; // Data
+        cnmt_ctx.content_records_count += 1;
+    }
+    if (settings->controlnca.valid == VALIDITY_VALID || settings->controlnca_digest.valid)
+    {
+        cnmt_set_content_record(&settings->controlnca, &settings->controlnca_digest, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
+        cnmt_ctx.content_records[cnmt_ctx.content_records_count].type = 0x3; // Control
+        cnmt_ctx.content_records_count += 1;
+    }
+    if (settings->htmldocnca.valid == VALIDITY_VALID || settings->htmldocnca_digest.valid)
+    {
+        cnmt_set_content_record(&settings->htmldocnca, &settings->htmldocnca_digest, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
+        cnmt_ctx.content_records[cnmt_ctx.content_records_count].type = 0x4; // HtmlDocument
+        cnmt_ctx.content_records_count += 1;
+    }
+    if (settings->legalnca.valid == VALIDITY_VALID || settings->legalnca_digest.valid)
+    {
+        cnmt_set_content_record(&settings->legalnca, &settings->legalnca_digest, &cnmt_ctx.content_records[cnmt_ctx.content_records_count]);
+        cnmt_ctx.content_records[cnmt_ctx.content_records_count].type = 0x5; // LegalInformation
+        cnmt_ctx.content_records_count += 1;
+    }
+
+    // Common values
+    cnmt_ctx.header.type = 0x81;
+    cnmt_ctx.header.title_id = settings->title_id;
+    cnmt_ctx.header.title_version = settings->title_version;
+    cnmt_ctx.header.extended_header_size = sizeof(cnmt_extended_patch_header_t);
+    cnmt_ctx.header.content_entry_count = cnmt_ctx.content_records_count;
+    cnmt_ext_header.application_title_id = cnmt_ctx.header.title_id & ~0x800ULL;
+
+    hp_log("Writing metadata header\n");
+    FILE *cnmt_file;
+    cnmt_file = os_fopen(cnmt_filepath->os_path, OS_MODE_WRITE);
+
+    if (cnmt_file != NULL)
+    {
+        fwrite(&cnmt_ctx.header, 1, sizeof(cnmt_header_t), cnmt_file);
+        fwrite(&cnmt_ext_header, 1, sizeof(cnmt_extended_patch_header_t), cnmt_file);
+    }
+    else
+    {
+        hp_error("Failed to create %s!\n", cnmt_filepath->char_path);
+        hp_exit_failure();
+    }
+
+    // Write content records
+    hp_log("Writing content records\n");
+    for (int i=0; i < cnmt_ctx.content_records_count; i++)
+        fwrite(&cnmt_ctx.content_records[i], sizeof(cnmt_content_record_t), 1, cnmt_file);
+    fwrite(settings->digest, 1, 0x20, cnmt_file);
+
+    os_fclose(cnmt_file);
+}
+
+void cnmt_set_content_record(filepath_t *nca_path, hp_nca_digest_t *digest, cnmt_content_record_t *content_record)
+{
+    // Reuse the digest captured while building the nca
+    if (digest != NULL && digest->valid)
+    {
+        memcpy(content_record->hash, digest->hash, 0x20);
+        memcpy(content_record->ncaid, digest->hash, 0x10);
+        memcpy(content_record->size, &digest->size, 0x6);
+        return;
+    }
+
     FILE *nca_file;
     nca_file = os_fopen(nca_path->os_path, OS_MODE_READ);
     if (nca_file == NULL)
     {
-        fprintf(stderr, "Unable to open: %s", nca_path->char_path);
-        exit(EXIT_FAILURE);
+        hp_error("Unable to open: %s", nca_path->char_path);
+        hp_exit_failure();
     }
 
     // Calculate nca size
@@ -228,7 +309,7 @@ void cnmt_set_content_record(filepath_t *nca_path, cnmt_content_record_t *conten
     // Calculate hash
     sha_ctx_t *sha_ctx = new_sha_ctx(HASH_TYPE_SHA256, 0);
     uint64_t read_size = 0x61A8000; // 100 MB buffer.
-    unsigned char *buf = (unsigned char *)malloc(read_size);
+    unsigned char *buf = hp_track_buffer(malloc(read_size));
     uint64_t ofs = 0;
     while (ofs < ncasize)
     {
@@ -236,8 +317,8 @@ void cnmt_set_content_record(filepath_t *nca_path, cnmt_content_record_t *conten
             read_size = ncasize - ofs;
         if (fread(buf, 1, read_size, nca_file) != read_size)
         {
-            fprintf(stderr, "Failed to read file: %s!\n", nca_path->char_path);
-            exit(EXIT_FAILURE);
+            hp_error("Failed to read file: %s!\n", nca_path->char_path);
+            hp_exit_failure();
         }
         sha_update(sha_ctx, buf, read_size);
         ofs += read_size;
@@ -249,6 +330,25 @@ void cnmt_set_content_record(filepath_t *nca_path, cnmt_content_record_t *conten
     memcpy(content_record->size, &ncasize, 0x6);
 
     free_sha_ctx(sha_ctx);
-    free(buf);
-    fclose(nca_file);
+    hp_free(buf);
+    os_fclose(nca_file);
+}
+
+/* Content records of a cnmt read from a meta nca, NULL if they don't fit in cnmt_size. */
+const cnmt_content_record_t *cnmt_get_content_records(const unsigned char *cnmt, uint64_t cnmt_size)
+{
+    const cnmt_header_t *header = (const cnmt_header_t *)cnmt;
+    if (cnmt_size < sizeof(cnmt_header_t))
+        return NULL;
+    uint64_t records_offset = sizeof(cnmt_header_t) + header->extended_header_size;
+    if (records_offset + (uint64_t)header->content_entry_count * sizeof(cnmt_content_record_t) > cnmt_size)
+        return NULL;
+    return (const cnmt_content_record_t *)(cnmt + records_offset);
+}
+
+uint64_t cnmt_get_content_size(const cnmt_content_record_t *content_record)
+{
+    uint64_t size = 0;
+    memcpy(&size, content_record->size, 0x6);
+    return size;
 }
\ No newline at end of file
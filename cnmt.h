@@ -33,6 +33,15 @@ typedef struct {
 } cnmt_extended_addon_header_t;
 #pragma pack(pop)
 
+#pragma pack(push, 1)
+typedef struct {
+    uint64_t application_title_id;
+    uint32_t required_system_version;
+    uint32_t extended_data_size;
+    uint8_t _0x10[0x8];
+} cnmt_extended_patch_header_t;
+#pragma pack(pop)
+
 #pragma pack(push, 1)
 typedef struct {
     unsigned char hash[0x20];
@@ -53,6 +62,9 @@ void cnmt_create_application(filepath_t *cnmt_filepath, hp_settings_t *settings)
 void cnmt_create_addon(filepath_t *cnmt_filepath, hp_settings_t *settings);
 void cnmt_create_systemprogram(filepath_t *cnmt_filepath, hp_settings_t *settings);
 void cnmt_create_systemdata(filepath_t *cnmt_filepath, hp_settings_t *settings);
-void cnmt_set_content_record(filepath_t *nca_path, cnmt_content_record_t *content_record);
+void cnmt_create_patch(filepath_t *cnmt_filepath, hp_settings_t *settings);
+void cnmt_set_content_record(filepath_t *nca_path, hp_nca_digest_t *digest, cnmt_content_record_t *content_record);
+const cnmt_content_record_t *cnmt_get_content_records(const unsigned char *cnmt, uint64_t cnmt_size);
+uint64_t cnmt_get_content_size(const cnmt_content_record_t *content_record);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "compress.h"
+#include "bktr.h"
+#include "lz4.h"
+#include "ivfc.h"
+#include "fio.h"
+#include "worker.h"
+#include "utils.h"
+
+typedef struct
+{
+    uint64_t offset; /* In the RomFS image */
+    uint64_t size;
+    unsigned char *out; /* Blocks as they are stored, back to back */
+    uint32_t *block_sizes;
+    uint8_t *block_types;
+    int failed;
+} compress_job_t;
+
+typedef struct
+{
+    int image_fd;
+    compress_job_t *jobs;
+} compress_ctx_t;
+
+static int compress_is_zero(const unsigned char *buf, uint64_t size)
+{
+    for (uint64_t i = 0; i < size; i++)
+    {
+        if (buf[i] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+static void compress_free_job(compress_job_t *job)
+{
+    hp_free(job->out);
+    hp_free(job->block_sizes);
+    hp_free(job->block_types);
+    job->out = NULL;
+    job->block_sizes = NULL;
+    job->block_types = NULL;
+}
+
+static void compress_job(void *ctx, uint32_t index)
+{
+    compress_ctx_t *compress_ctx = (compress_ctx_t *)ctx;
+    compress_job_t *job = &compress_ctx->jobs[index];
+    uint32_t num_blocks = (uint32_t)((job->size + COMPRESS_BLOCK_SIZE - 1) / COMPRESS_BLOCK_SIZE);
+
+    unsigned char *in = hp_track_buffer(malloc(job->size));
+    lz4_ctx_t *lz4_ctx = malloc(sizeof(lz4_ctx_t));
+    job->out = hp_track_buffer(malloc(job->size));
+    job->block_sizes = hp_track_buffer(malloc(num_blocks * sizeof(uint32_t)));
+    job->block_types = hp_track_buffer(malloc(num_blocks));
+    if (in == NULL || lz4_ctx == NULL || job->out == NULL || job->block_sizes == NULL || job->block_types == NULL ||
+        fio_pread(compress_ctx->image_fd, in, job->size, job->offset) != 0)
+    {
+        hp_free(in);
+        free(lz4_ctx);
+        compress_free_job(job);
+        job->failed = 1;
+        return;
+    }
+
+    // Blocks that don't get smaller are stored as they are
+    uint64_t out_offset = 0;
+    for (uint32_t i = 0; i < num_blocks; i++)
+    {
+        uint64_t offset = (uint64_t)i * COMPRESS_BLOCK_SIZE;
+        uint32_t block_size = (uint32_t)(job->size - offset < COMPRESS_BLOCK_SIZE ? job->size - offset : COMPRESS_BLOCK_SIZE);
+        uint32_t stored_size = 0;
+        if (compress_is_zero(in + offset, block_size))
+            job->block_types[i] = COMPRESS_TYPE_ZEROS;
+        else if ((stored_size = lz4_compress_block(lz4_ctx, in + offset, block_size, job->out + out_offset, block_size - 1)) != 0)
+            job->block_types[i] = COMPRESS_TYPE_LZ4;
+        else
+        {
+            stored_size = block_size;
+            memcpy(job->out + out_offset, in + offset, block_size);
+            job->block_types[i] = COMPRESS_TYPE_NONE;
+        }
+        job->block_sizes[i] = stored_size;
+        out_offset += stored_size;
+    }
+    hp_free(in);
+    free(lz4_ctx);
+}
+
+/* Writes a prepared RomFS at the end of nca_file as a compressed section and frees romfs_ctx.
+   The RomFS image is built in the temp directory and compressed in blocks of COMPRESS_BLOCK_SIZE over the worker threads.
+   Stored blocks and the table of compress_entry_t after them are the data level of the IVFC hash tree. */
+void compress_write_romfs_section(hp_settings_t *settings, FILE *nca_file, romfs_ctx_t *romfs_ctx, nca_fs_header_t *fs_header)
+{
+    ivfc_hdr_t *ivfc_header = &fs_header->romfs_superblock.ivfc_header;
+    const char *name = nca_get_content_type_name(settings->nca_type);
+
+    filepath_t image_path;
+    filepath_init(&image_path);
+    filepath_copy(&image_path, &settings->temp_dir);
+    filepath_append(&image_path, "%s_romfs_image", name);
+    FILE *image_file = os_fopen(image_path.os_path, OS_MODE_WRITE_EDIT);
+    if (image_file == NULL)
+    {
+        hp_error("Failed to create %s!\n", image_path.char_path);
+        hp_exit_failure();
+    }
+    hp_log("Writing RomFS\n");
+    romfs_write(romfs_ctx, image_file, 0);
+    fflush(image_file);
+    fseeko64(image_file, 0, SEEK_END);
+    uint64_t image_size = (uint64_t)ftello64(image_file);
+
+    filepath_t data_path;
+    filepath_init(&data_path);
+    filepath_copy(&data_path, &settings->temp_dir);
+    filepath_append(&data_path, "%s_romfs_compressed", name);
+    int data_fd = fio_open(&data_path, FIO_MODE_WRITE);
+    if (data_fd < 0)
+    {
+        hp_error("Failed to create %s!\n", data_path.char_path);
+        hp_exit_failure();
+    }
+
+    hp_log("\n===> Compressing RomFS\n");
+    uint32_t num_blocks = (uint32_t)((image_size + COMPRESS_BLOCK_SIZE - 1) / COMPRESS_BLOCK_SIZE);
+    uint32_t num_jobs = (uint32_t)((image_size + COMPRESS_JOB_SIZE - 1) / COMPRESS_JOB_SIZE);
+    uint32_t num_threads = settings->num_threads ? settings->num_threads : worker_get_cpu_count();
+    uint32_t window = num_threads * COMPRESS_JOBS_PER_THREAD;
+    compress_entry_t *entries = hp_track_buffer(calloc(num_blocks, sizeof(compress_entry_t)));
+    compress_ctx_t compress_ctx;
+    compress_ctx.image_fd = fileno(image_file);
+    compress_ctx.jobs = hp_track_buffer(calloc(window, sizeof(compress_job_t)));
+    if (entries == NULL || compress_ctx.jobs == NULL)
+    {
+        hp_error("Failed to allocate RomFS compression jobs!\n");
+        hp_exit_failure();
+    }
+
+    // Jobs run a window at a time so only that many compressed jobs wait to be written in order
+    uint32_t num_lz4_blocks = 0;
+    uint32_t num_zero_blocks = 0;
+    uint32_t num_plain_blocks = 0;
+    uint32_t block_index = 0;
+    uint64_t physical_offset = 0;
+    for (uint32_t first_job = 0; first_job < num_jobs; first_job += window)
+    {
+        uint32_t count = num_jobs - first_job < window ? num_jobs - first_job : window;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            compress_job_t *job = &compress_ctx.jobs[i];
+            memset(job, 0, sizeof(*job));
+            job->offset = (uint64_t)(first_job + i) * COMPRESS_JOB_SIZE;
+            job->size = image_size - job->offset < COMPRESS_JOB_SIZE ? image_size - job->offset : COMPRESS_JOB_SIZE;
+        }
+        worker_run(compress_job, &compress_ctx, count, num_threads);
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            compress_job_t *job = &compress_ctx.jobs[i];
+            if (job->failed)
+            {
+                for (uint32_t j = i; j < count; j++)
+                    compress_free_job(&compress_ctx.jobs[j]);
+                hp_error("Failed to compress %s!\n", image_path.char_path);
+                hp_exit_failure();
+            }
+            uint64_t out_offset = 0;
+            for (uint64_t offset = 0; offset < job->size; offset += COMPRESS_BLOCK_SIZE)
+            {
+                uint32_t job_block = (uint32_t)(offset / COMPRESS_BLOCK_SIZE);
+                compress_entry_t *entry = &entries[block_index++];
+                entry->virtual_offset = job->offset + offset;
+                entry->physical_offset = physical_offset;
+                entry->compression_type = job->block_types[job_block];
+                entry->physical_size = job->block_sizes[job_block];
+                if (entry->compression_type == COMPRESS_TYPE_LZ4)
+                    num_lz4_blocks++;
+                else if (entry->compression_type == COMPRESS_TYPE_ZEROS)
+                    num_zero_blocks++;
+                else
+                    num_plain_blocks++;
+                if (entry->physical_size == 0)
+                    continue;
+
+                if (fio_pwrite(data_fd, job->out + out_offset, entry->physical_size, physical_offset) != 0)
+                {
+                    hp_error("Failed to write %s!\n", data_path.char_path);
+                    hp_exit_failure();
+                }
+                out_offset += entry->physical_size;
+                physical_offset = (physical_offset + entry->physical_size + 0xF) & ~0xFULL;
+            }
+            compress_free_job(job);
+        }
+    }
+    hp_free(compress_ctx.jobs);
+    os_fclose(image_file);
+    os_deletefile(image_path.char_path);
+
+    hp_log("Writing compression table\n");
+    uint64_t table_offset = physical_offset;
+    uint64_t table_size;
+    unsigned char *table = bktr_build_bucket_tree(entries, num_blocks, sizeof(compress_entry_t), image_size, &table_size);
+    if (fio_pwrite(data_fd, table, table_size, table_offset) != 0)
+    {
+        hp_error("Failed to write %s!\n", data_path.char_path);
+        hp_exit_failure();
+    }
+    free(table);
+    hp_free(entries);
+    uint64_t data_size = table_offset + table_size;
+
+    hp_log("Writing compressed RomFS\n");
+    ivfc_calculate_layout(ivfc_header, data_size);
+    fflush(nca_file);
+    fseeko64(nca_file, 0, SEEK_END);
+    uint64_t section_offset = (uint64_t)ftello64(nca_file);
+    if (fio_copy_range(data_fd, 0, fileno(nca_file), section_offset + ivfc_header->level_headers[IVFC_MAX_LEVEL - 1].logical_offset, data_size, NULL) != 0)
+    {
+        hp_error("Failed to read %s!\n", data_path.char_path);
+        hp_exit_failure();
+    }
+    fio_close(data_fd);
+    os_deletefile(data_path.char_path);
+
+    hp_log("\n===> Creating IVFC levels\n");
+    ivfc_create_levels(nca_file, section_offset, ivfc_header);
+
+    bktr_header_t *compression_header = &fs_header->compression_header;
+    compression_header->offset = table_offset;
+    compression_header->size = table_size;
+    compression_header->magic = MAGIC_BKTR;
+    compression_header->version = 1;
+    compression_header->num_entries = num_blocks;
+
+    hp_log("RomFS of 0x%" PRIx64 " bytes stored in 0x%" PRIx64 " (%.1f%%), %u LZ4, %u zero and %u uncompressed blocks\n", image_size, data_size,
+           image_size ? (double)data_size * 100.0 / (double)image_size : 0.0, num_lz4_blocks, num_zero_blocks, num_plain_blocks);
+}
+
+/* Buffers reused across the blocks of a decompressed section, grown for blocks larger than COMPRESS_BLOCK_SIZE. */
+typedef struct
+{
+    unsigned char *stored;
+    unsigned char *block;
+    uint64_t stored_capacity;
+    uint64_t block_capacity;
+} compress_read_ctx_t;
+
+static int compress_reserve(unsigned char **buf, uint64_t *capacity, uint64_t size)
+{
+    if (size <= *capacity)
+        return 0;
+    unsigned char *larger = realloc(*buf, size);
+    if (larger == NULL)
+        return 1;
+    *buf = larger;
+    *capacity = size;
+    return 0;
+}
+
+/* Writes size bytes of the RomFS at the virtual offset of entry to fd. Returns 0 on success. */
+static int compress_read_block(ncareader_t *reader, uint8_t section_index, uint64_t data_offset, compress_entry_t *entry, uint64_t size, int fd, compress_read_ctx_t *ctx)
+{
+    if (entry->compression_type == COMPRESS_TYPE_LZ4)
+    {
+        if (size > COMPRESS_JOB_SIZE || entry->physical_size > COMPRESS_JOB_SIZE ||
+            compress_reserve(&ctx->block, &ctx->block_capacity, size) != 0 || compress_reserve(&ctx->stored, &ctx->stored_capacity, entry->physical_size) != 0)
+        {
+            hp_error("Error: LZ4 block at 0x%" PRIx64 " of section %u is too large\n", entry->virtual_offset, section_index);
+            return 1;
+        }
+        if (ncareader_read_section(reader, section_index, ctx->stored, entry->physical_size, data_offset + entry->physical_offset) != 0)
+        {
+            hp_error("Error: Failed to read block at 0x%" PRIx64 " of section %u\n", entry->virtual_offset, section_index);
+            return 1;
+        }
+        if (lz4_decompress_block(ctx->stored, entry->physical_size, ctx->block, (uint32_t)size) != size)
+        {
+            hp_error("Error: LZ4 block at 0x%" PRIx64 " of section %u is corrupt\n", entry->virtual_offset, section_index);
+            return 1;
+        }
+        return fio_pwrite(fd, ctx->block, size, entry->virtual_offset);
+    }
+    if (entry->compression_type != COMPRESS_TYPE_NONE && entry->compression_type != COMPRESS_TYPE_ZEROS)
+    {
+        hp_error("Error: Unsupported compression type %u at 0x%" PRIx64 " of section %u\n", entry->compression_type, entry->virtual_offset, section_index);
+        return 1;
+    }
+
+    // Uncompressed and zero blocks may span more than the buffer, they are written in parts
+    if (entry->compression_type == COMPRESS_TYPE_ZEROS)
+        memset(ctx->block, 0, ctx->block_capacity);
+    for (uint64_t offset = 0; offset < size; offset += ctx->block_capacity)
+    {
+        uint64_t part_size = size - offset < ctx->block_capacity ? size - offset : ctx->block_capacity;
+        if (entry->compression_type == COMPRESS_TYPE_NONE &&
+            ncareader_read_section(reader, section_index, ctx->block, part_size, data_offset + entry->physical_offset + offset) != 0)
+        {
+            hp_error("Error: Failed to read block at 0x%" PRIx64 " of section %u\n", entry->virtual_offset, section_index);
+            return 1;
+        }
+        if (fio_pwrite(fd, ctx->block, part_size, entry->virtual_offset + offset) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Writes every block of a compression table to fd in order, checking they cover the RomFS back to back. Returns 0 on success. */
+static int compress_read_blocks(ncareader_t *reader, uint8_t section_index, uint64_t data_offset, unsigned char *table, uint64_t table_size, int fd, compress_read_ctx_t *ctx)
+{
+    bktr_bucket_header_t *node_header = (bktr_bucket_header_t *)table;
+    uint32_t entries_per_bucket = (BKTR_BUCKET_SIZE - sizeof(bktr_bucket_header_t)) / sizeof(compress_entry_t);
+    if (node_header->num_entries == 0 || node_header->num_entries > BKTR_MAX_BUCKETS || (uint64_t)BKTR_BUCKET_SIZE * (node_header->num_entries + 1) > table_size)
+        return 1;
+
+    hp_log("Decompressing RomFS of 0x%" PRIx64 " bytes\n", node_header->end_offset);
+    uint64_t virtual_offset = 0;
+    for (uint32_t i = 0; i < node_header->num_entries; i++)
+    {
+        unsigned char *bucket = table + (uint64_t)BKTR_BUCKET_SIZE * (i + 1);
+        bktr_bucket_header_t *bucket_header = (bktr_bucket_header_t *)bucket;
+        compress_entry_t *entries = (compress_entry_t *)(bucket + sizeof(bktr_bucket_header_t));
+        if (bucket_header->num_entries == 0 || bucket_header->num_entries > entries_per_bucket || bucket_header->end_offset > node_header->end_offset)
+            return 1;
+        for (uint32_t j = 0; j < bucket_header->num_entries; j++)
+        {
+            // Each block ends where the next one starts, the last one of a bucket at the end of the bucket
+            uint64_t end_offset = j + 1 < bucket_header->num_entries ? entries[j + 1].virtual_offset : bucket_header->end_offset;
+            if (entries[j].virtual_offset != virtual_offset || end_offset <= virtual_offset)
+                return 1;
+            if (compress_read_block(reader, section_index, data_offset, &entries[j], end_offset - virtual_offset, fd, ctx) != 0)
+                return 1;
+            virtual_offset = end_offset;
+        }
+    }
+    return virtual_offset != node_header->end_offset;
+}
+
+/* Decompresses the RomFS of a compressed section to a RomFS image at image_path through its compression table.
+   Returns 0 on success, the image may be left partially written on failure. */
+int compress_read_romfs_section(ncareader_t *reader, uint8_t section_index, filepath_t *image_path)
+{
+    nca_fs_header_t *fs_header = &reader->header.fs_headers[section_index];
+    bktr_header_t *compression_header = &fs_header->compression_header;
+    uint64_t data_offset = fs_header->romfs_superblock.ivfc_header.level_headers[IVFC_MAX_LEVEL - 1].logical_offset;
+    if (compression_header->size < BKTR_BUCKET_SIZE || compression_header->size > (uint64_t)BKTR_BUCKET_SIZE * (BKTR_MAX_BUCKETS + 1))
+    {
+        hp_error("Error: Invalid compression table of section %u\n", section_index);
+        return 1;
+    }
+
+    compress_read_ctx_t ctx;
+    ctx.stored_capacity = COMPRESS_BLOCK_SIZE;
+    ctx.block_capacity = COMPRESS_BLOCK_SIZE;
+    ctx.stored = malloc(ctx.stored_capacity);
+    ctx.block = malloc(ctx.block_capacity);
+    unsigned char *table = malloc(compression_header->size);
+    int ret = 1;
+    if (ctx.stored == NULL || ctx.block == NULL || table == NULL)
+        hp_error("Failed to allocate decompression buffers!\n");
+    else if (ncareader_read_section(reader, section_index, table, compression_header->size, data_offset + compression_header->offset) != 0)
+        hp_error("Error: Failed to read compression table of section %u\n", section_index);
+    else
+    {
+        int fd = fio_open(image_path, FIO_MODE_WRITE);
+        if (fd < 0)
+            hp_error("Failed to create %s!\n", image_path->char_path);
+        else
+        {
+            ret = compress_read_blocks(reader, section_index, data_offset, table, compression_header->size, fd, &ctx);
+            fio_close(fd);
+            if (ret != 0)
+                hp_error("Error: Failed to decompress RomFS of section %u to %s\n", section_index, image_path->char_path);
+        }
+    }
+    free(table);
+    free(ctx.stored);
+    free(ctx.block);
+    return ret;
+}
@@ -0,0 +1,37 @@
+#ifndef HACPACK_COMPRESS_H
+#define HACPACK_COMPRESS_H
+
+#include <stdio.h>
+#include "settings.h"
+#include "nca.h"
+#include "romfs.h"
+#include "ncareader.h"
+
+#define COMPRESS_BLOCK_SIZE 0x10000 // 64 KB
+#define COMPRESS_JOB_SIZE 0x800000  // 8 MB
+#define COMPRESS_JOBS_PER_THREAD 2   /* Jobs held in memory at once, per worker thread */
+
+typedef enum
+{
+    COMPRESS_TYPE_NONE = 0,
+    COMPRESS_TYPE_ZEROS = 1,
+    COMPRESS_TYPE_LZ4 = 3
+} compress_type_t;
+
+/* Maps a block of the RomFS to where it's stored in the hashed data of the section. */
+#pragma pack(push, 1)
+typedef struct
+{
+    uint64_t virtual_offset;
+    uint64_t physical_offset;
+    uint8_t compression_type;
+    int8_t compression_level;
+    uint8_t _0x12[0x2];
+    uint32_t physical_size;
+} compress_entry_t;
+#pragma pack(pop)
+
+void compress_write_romfs_section(hp_settings_t *settings, FILE *nca_file, romfs_ctx_t *romfs_ctx, nca_fs_header_t *fs_header);
+int compress_read_romfs_section(ncareader_t *reader, uint8_t section_index, filepath_t *image_path);
+
+#endif
@@ -38,12 +38,13 @@
  * @param f the file to read
  * @param key pointer to change to point to the key
  * @param value pointer to change to point to the value
+ * @param line buffer the key and value point into, owned by the caller
  * @return 0 on success,
  *         1 on end of file,
  *         -1 on parse error (line too long, line malformed)
  *         -2 on I/O error
  */
-static int get_kv(FILE *f, char **key, char **value)
+static int get_kv(FILE *f, char **key, char **value, char (*line)[1024])
 {
 #define SKIP_SPACE(p)                        \
     do                                       \
@@ -51,13 +52,12 @@ static int get_kv(FILE *f, char **key, char **value)
         for (; *p == ' ' || *p == '\t'; ++p) \
             ;                                \
     } while (0);
-    static char line[1024];
     char *k, *v, *p, *end;
 
     *key = *value = NULL;
 
     errno = 0;
-    if (fgets(line, (int)sizeof(line), f) == NULL)
+    if (fgets(*line, (int)sizeof(*line), f) == NULL)
     {
         if (feof(f))
             return 1;
@@ -67,7 +67,7 @@ static int get_kv(FILE *f, char **key, char **value)
     if (errno != 0)
         return -2;
 
-    if (*line == '\n' || *line == '\r' || *line == '\0')
+    if (**line == '\n' || **line == '\r' || **line == '\0')
         return 0;
 
     /* Not finding \r or \n is not a problem.
@@ -76,17 +76,17 @@ static int get_kv(FILE *f, char **key, char **value)
      * Additionally, it's possible that the last line of a file is not actually
      * a line (i.e., does not end in '\n'); we do want to handle those.
      */
-    if ((p = strchr(line, '\r')) != NULL || (p = strchr(line, '\n')) != NULL)
+    if ((p = strchr(*line, '\r')) != NULL || (p = strchr(*line, '\n')) != NULL)
     {
         end = p;
         *p = '\0';
     }
     else
     {
-        end = line + strlen(line) + 1;
+        end = *line + strlen(*line) + 1;
     }
 
-    p = line;
+    p = *line;
     SKIP_SPACE(p);
     k = p;
 
@@ -176,16 +176,16 @@ void parse_hex_key(unsigned char *key, const char *hex, unsigned int len)
 {
     if (strlen(hex) != 2 * len)
     {
-        fprintf(stderr, "Key (%s) must be %" PRIu32 " hex digits!\n", hex, 2 * len);
-        exit(EXIT_FAILURE);
+        hp_error("Key (%s) must be %" PRIu32 " hex digits!\n", hex, 2 * len);
+        hp_exit_failure();
     }
 
     for (unsigned int i = 0; i < 2 * len; i++)
     {
         if (!ishex(hex[i]))
         {
-            fprintf(stderr, "Key (%s) must be %" PRIu32 " hex digits!\n", hex, 2 * len);
-            exit(EXIT_FAILURE);
+            hp_error("Key (%s) must be %" PRIu32 " hex digits!\n", hex, 2 * len);
+            hp_exit_failure();
         }
     }
 
@@ -204,10 +204,11 @@ void parse_hex_key(unsigned char *key, const char *hex, unsigned int len)
 
 void extkeys_initialize_keyset(hp_keyset_t *keyset, FILE *f)
 {
+    char line[1024];
     char *key, *value;
     int ret;
 
-    while ((ret = get_kv(f, &key, &value)) != 1 && ret != -2)
+    while ((ret = get_kv(f, &key, &value, &line)) != 1 && ret != -2)
     {
         if (ret == 0)
         {
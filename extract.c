@@ -0,0 +1,535 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "extract.h"
+#include "ncareader.h"
+#include "romfs.h"
+#include "pfs0.h"
+#include "compress.h"
+#include "types.h"
+#include "fio.h"
+#include "worker.h"
+#include "utils.h"
+
+/* A file to write, decrypted from a section of the NCA or copied from the source file. */
+typedef struct
+{
+    char *path;
+    uint64_t size;
+    int section_index; /* -1 to copy from the source file */
+    uint64_t offset;   /* In the section or the source file */
+} extract_entry_t;
+
+/* A range of an entry written by one worker job, entries larger than EXTRACT_JOB_SIZE are split. */
+typedef struct
+{
+    uint32_t entry_index;
+    uint64_t offset; /* In the entry */
+    uint64_t size;
+    uint8_t creates_file; /* The only job of its entry creates the file, split entries are created before the jobs run */
+    int failed;
+} extract_job_t;
+
+typedef struct
+{
+    int src_fd;
+    ncareader_t *reader;
+    extract_entry_t *entries;
+    uint32_t num_entries;
+    uint32_t max_entries;
+    uint32_t num_dirs;
+    uint64_t total_size;
+    extract_job_t *jobs;
+} extract_ctx_t;
+
+/* Entry tables of a RomFS in an NCA section or a RomFS image. */
+typedef struct
+{
+    romfs_header_t *header; /* In host order */
+    unsigned char *dir_table;
+    unsigned char *file_table;
+    uint64_t size;
+    uint64_t data_offset; /* Of the RomFS in the section or the source file */
+    int section_index;    /* -1 for a RomFS image */
+} extract_romfs_t;
+
+static void extract_add_entry(extract_ctx_t *ctx, filepath_t *path, uint64_t size, int section_index, uint64_t offset)
+{
+    if (ctx->num_entries == ctx->max_entries)
+    {
+        ctx->max_entries = ctx->max_entries ? ctx->max_entries * 2 : 256;
+        ctx->entries = realloc(ctx->entries, ctx->max_entries * sizeof(extract_entry_t));
+        if (ctx->entries == NULL)
+        {
+            hp_error("Failed to allocate extraction entries!\n");
+            hp_exit_failure();
+        }
+    }
+    extract_entry_t *entry = &ctx->entries[ctx->num_entries++];
+    entry->path = strdup(path->char_path);
+    if (entry->path == NULL)
+    {
+        hp_error("Failed to allocate extraction entries!\n");
+        hp_exit_failure();
+    }
+    entry->size = size;
+    entry->section_index = section_index;
+    entry->offset = offset;
+    ctx->total_size += size;
+}
+
+static void extract_free_ctx(extract_ctx_t *ctx)
+{
+    for (uint32_t i = 0; i < ctx->num_entries; i++)
+        free(ctx->entries[i].path);
+    free(ctx->entries);
+    free(ctx->jobs);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+/* Appends the name of a PFS0 or RomFS entry to path, names that would leave the output directory are refused. */
+static int extract_append_name(filepath_t *path, const char *name, size_t name_len)
+{
+    if (name_len == 0 || (name_len == 1 && name[0] == '.') || (name_len == 2 && name[0] == '.' && name[1] == '.') ||
+        memchr(name, '/', name_len) != NULL || memchr(name, '\\', name_len) != NULL || memchr(name, '\0', name_len) != NULL ||
+        strlen(path->char_path) + 1 + name_len >= MAX_PATH)
+        return -1;
+    filepath_append(path, "%.*s", (int)name_len, name);
+    return path->valid == VALIDITY_VALID ? 0 : -1;
+}
+
+static void extract_job(void *ctx, uint32_t index)
+{
+    extract_ctx_t *extract_ctx = (extract_ctx_t *)ctx;
+    extract_job_t *job = &extract_ctx->jobs[index];
+    extract_entry_t *entry = &extract_ctx->entries[job->entry_index];
+
+    filepath_t path;
+    filepath_init(&path);
+    filepath_set(&path, entry->path);
+    int fd = fio_open(&path, job->creates_file ? FIO_MODE_WRITE : FIO_MODE_EDIT);
+    if (fd < 0)
+    {
+        job->failed = 1;
+        return;
+    }
+
+    // Decrypted ranges go straight from memory to the file, copied ones can be reflinked
+    if (job->size > 0 && entry->section_index < 0)
+        job->failed = fio_copy_range(extract_ctx->src_fd, entry->offset + job->offset, fd, job->offset, job->size, NULL) != 0;
+    else if (job->size > 0)
+    {
+        unsigned char *buf = hp_track_buffer(malloc(job->size));
+        job->failed = buf == NULL || ncareader_read_section(extract_ctx->reader, (uint8_t)entry->section_index, buf, job->size, entry->offset + job->offset) != 0 ||
+                      fio_pwrite(fd, buf, job->size, job->offset) != 0;
+        hp_free(buf);
+    }
+    if (fio_close(fd) != 0)
+        job->failed = 1;
+}
+
+/* Writes every entry over the worker threads in ranges of up to EXTRACT_JOB_SIZE, returns the number of entries that failed. */
+static int extract_run(hp_settings_t *settings, extract_ctx_t *ctx)
+{
+    uint32_t num_jobs = 0;
+    for (uint32_t i = 0; i < ctx->num_entries; i++)
+        num_jobs += ctx->entries[i].size > EXTRACT_JOB_SIZE ? (uint32_t)((ctx->entries[i].size + EXTRACT_JOB_SIZE - 1) / EXTRACT_JOB_SIZE) : 1;
+    ctx->jobs = calloc(num_jobs ? num_jobs : 1, sizeof(extract_job_t));
+    if (ctx->jobs == NULL)
+    {
+        hp_error("Failed to allocate extraction jobs!\n");
+        hp_exit_failure();
+    }
+
+    // Split entries are created at their full size first so their jobs can write in place in any order
+    uint32_t job_index = 0;
+    for (uint32_t i = 0; i < ctx->num_entries; i++)
+    {
+        extract_entry_t *entry = &ctx->entries[i];
+        if (entry->size > EXTRACT_JOB_SIZE)
+        {
+            filepath_t path;
+            filepath_init(&path);
+            filepath_set(&path, entry->path);
+            int fd = fio_open(&path, FIO_MODE_WRITE);
+            if (fd >= 0)
+            {
+                fio_set_size(fd, entry->size);
+                fio_close(fd);
+            }
+        }
+        uint64_t offset = 0;
+        do
+        {
+            extract_job_t *job = &ctx->jobs[job_index++];
+            job->entry_index = i;
+            job->offset = offset;
+            job->size = entry->size - offset < EXTRACT_JOB_SIZE ? entry->size - offset : EXTRACT_JOB_SIZE;
+            job->creates_file = entry->size <= EXTRACT_JOB_SIZE;
+            offset += job->size;
+        } while (offset < entry->size);
+    }
+
+    uint32_t num_threads = settings->num_threads ? settings->num_threads : worker_get_cpu_count();
+    hp_log("\n===> Writing %" PRIu32 " files, 0x%" PRIx64 " bytes on %" PRIu32 " threads\n", ctx->num_entries, ctx->total_size, num_threads);
+    double start_time = hp_get_time();
+    worker_run(extract_job, ctx, num_jobs, num_threads);
+    double seconds = hp_get_time() - start_time;
+
+    int num_failed = 0;
+    uint32_t last_failed = UINT32_MAX;
+    for (uint32_t i = 0; i < num_jobs; i++)
+    {
+        extract_job_t *job = &ctx->jobs[i];
+        if (!job->failed || job->entry_index == last_failed)
+            continue;
+        hp_error("Error: Failed to write %s\n", ctx->entries[job->entry_index].path);
+        last_failed = job->entry_index;
+        num_failed++;
+    }
+    hp_log("Wrote 0x%" PRIx64 " bytes in %.2f s, %.1f MB/s\n", ctx->total_size, seconds, seconds > 0 ? (double)ctx->total_size / seconds / 1048576.0 : 0.0);
+    return num_failed;
+}
+
+/* Creates the directory at dir_offset and adds its files, then does the same for its subdirectories. */
+static int extract_visit_romfs_dir(extract_ctx_t *ctx, extract_romfs_t *romfs, uint32_t dir_offset, filepath_t *dir_path, uint32_t depth)
+{
+    romfs_header_t *header = romfs->header;
+    uint64_t partition_size = romfs->size - header->file_partition_ofs;
+    if (depth > 0x100)
+    {
+        hp_error("Error: RomFS directory table has a loop\n");
+        return -1;
+    }
+    os_makedir(dir_path->os_path);
+    ctx->num_dirs++;
+
+    // Sibling chains can't be longer than their table has entries
+    romfs_direntry_t *dir_entry = (romfs_direntry_t *)(romfs->dir_table + dir_offset);
+    uint32_t file_offset = le_word(dir_entry->file);
+    for (uint64_t i = 0; file_offset != ROMFS_ENTRY_EMPTY; i++)
+    {
+        romfs_fentry_t *file_entry = (romfs_fentry_t *)(romfs->file_table + file_offset);
+        filepath_t path;
+        filepath_copy(&path, dir_path);
+        if (i > header->file_table_size / sizeof(romfs_fentry_t) || (uint64_t)file_offset + sizeof(romfs_fentry_t) > header->file_table_size ||
+            le_word(file_entry->name_size) > header->file_table_size - file_offset - sizeof(romfs_fentry_t) ||
+            le_dword(file_entry->offset) > partition_size || le_dword(file_entry->size) > partition_size - le_dword(file_entry->offset) ||
+            extract_append_name(&path, file_entry->name, le_word(file_entry->name_size)) != 0)
+        {
+            hp_error("Error: Invalid RomFS file entry in %s\n", dir_path->char_path);
+            return -1;
+        }
+        extract_add_entry(ctx, &path, le_dword(file_entry->size), romfs->section_index, romfs->data_offset + header->file_partition_ofs + le_dword(file_entry->offset));
+        file_offset = le_word(file_entry->sibling);
+    }
+
+    uint32_t child_offset = le_word(dir_entry->child);
+    for (uint64_t i = 0; child_offset != ROMFS_ENTRY_EMPTY; i++)
+    {
+        romfs_direntry_t *child_entry = (romfs_direntry_t *)(romfs->dir_table + child_offset);
+        filepath_t path;
+        filepath_copy(&path, dir_path);
+        if (i > header->dir_table_size / sizeof(romfs_direntry_t) || (uint64_t)child_offset + sizeof(romfs_direntry_t) > header->dir_table_size ||
+            le_word(child_entry->name_size) > header->dir_table_size - child_offset - sizeof(romfs_direntry_t) ||
+            extract_append_name(&path, child_entry->name, le_word(child_entry->name_size)) != 0)
+        {
+            hp_error("Error: Invalid RomFS directory entry in %s\n", dir_path->char_path);
+            return -1;
+        }
+        if (extract_visit_romfs_dir(ctx, romfs, child_offset, &path, depth + 1) != 0)
+            return -1;
+        child_offset = le_word(child_entry->sibling);
+    }
+    return 0;
+}
+
+/* Adds the files of the PFS0 in an NCA section. */
+static int extract_add_pfs0(extract_ctx_t *ctx, uint8_t section_index, filepath_t *dir_path)
+{
+    pfs0_ctx_t pfs0_ctx;
+    if (ncareader_read_pfs0_header(ctx->reader, section_index, &pfs0_ctx) != 0)
+    {
+        hp_error("Error: Failed to read PFS0 header of section %u\n", section_index);
+        return -1;
+    }
+    os_makedir(dir_path->os_path);
+    ctx->num_dirs++;
+
+    uint64_t data_offset = ctx->reader->header.fs_headers[section_index].pfs0_superblock.pfs0_offset + pfs0_ctx.header_size;
+    int ret = 0;
+    for (uint32_t i = 0; i < pfs0_ctx.num_files; i++)
+    {
+        pfs0_file_ctx_t *file = &pfs0_ctx.files[i];
+        filepath_t path;
+        filepath_copy(&path, dir_path);
+        if (extract_append_name(&path, file->name, strlen(file->name)) != 0)
+        {
+            hp_error("Error: Invalid PFS0 file name %s in section %u\n", file->name, section_index);
+            ret = -1;
+            break;
+        }
+        extract_add_entry(ctx, &path, file->size, section_index, data_offset + file->offset);
+    }
+    pfs0_free_ctx(&pfs0_ctx);
+    return ret;
+}
+
+static int extract_romfs_read(void *read_ctx, void *buf, uint64_t size, uint64_t offset)
+{
+    return fio_pread(*(int *)read_ctx, buf, size, offset);
+}
+
+/* Opens a decrypted RomFS image and loads its tables into base, which reads through *fd. Returns 0 on success. */
+static int extract_open_romfs_image(filepath_t *romfs_path, int *fd, romfs_base_t *base, extract_romfs_t *romfs)
+{
+    memset(base, 0, sizeof(*base));
+    *fd = fio_open(romfs_path, FIO_MODE_READ);
+    if (*fd < 0 || fio_get_size(*fd, &base->size) != 0)
+    {
+        hp_error("Failed to open %s!\n", romfs_path->char_path);
+        if (*fd >= 0)
+            fio_close(*fd);
+        *fd = -1;
+        return 1;
+    }
+    filepath_copy(&base->path, romfs_path);
+    base->read_func = extract_romfs_read;
+    base->read_ctx = fd;
+    romfs_base_load(base);
+
+    romfs->header = &base->header;
+    romfs->dir_table = (unsigned char *)base->dir_table;
+    romfs->file_table = (unsigned char *)base->file_table;
+    romfs->size = base->size;
+    romfs->data_offset = 0;
+    romfs->section_index = -1;
+    return 0;
+}
+
+/* Writes the files of every PFS0 section and the tree of the RomFS section to out_dirpath, each in a directory named after the section.
+   Titlekey crypto NCAs are decrypted with --titlekey or the ticket of their rights ID next to the NCA. Returns the number of failures. */
+int extract_nca(hp_settings_t *settings, filepath_t *nca_path, filepath_t *out_dirpath)
+{
+    hp_log("----> Extracting NCA: %s\n", nca_path->char_path);
+    ncareader_t reader;
+    ncareader_open(settings, nca_path, settings->has_title_key ? settings->title_key : NULL, &reader);
+    if (reader.has_key == 0 && ncareader_load_sibling_ticket(settings, &reader) == 0)
+        hp_log("Using titlekey of ticket next to NCA\n");
+    hp_log("%s NCA of title %016" PRIx64 ", keygeneration %i, %s crypto\n", nca_get_content_type_name((enum hp_nca_type)reader.header.content_type), reader.header.title_id,
+           ncareader_get_keygeneration(&reader.header), ncareader_has_rights_id(&reader.header) ? "titlekey" : "key area");
+
+    extract_ctx_t extract_ctx;
+    memset(&extract_ctx, 0, sizeof(extract_ctx));
+    extract_ctx.src_fd = -1;
+    extract_ctx.reader = &reader;
+    ncareader_romfs_t romfs_tables;
+    memset(&romfs_tables, 0, sizeof(romfs_tables));
+    romfs_base_t image_base;
+    memset(&image_base, 0, sizeof(image_base));
+    int image_fd = -1;
+    filepath_t image_path;
+    filepath_init(&image_path);
+
+    hp_log("\n===> Creating directories\n");
+    os_makedir(out_dirpath->os_path);
+    int num_failed = 0;
+    int romfs_index = ncareader_find_section(&reader, FS_TYPE_ROMFS, HASH_TYPE_ROMFS);
+    for (int i = 0; i < 4; i++)
+    {
+        nca_section_entry_t *entry = &reader.header.section_entries[i];
+        nca_fs_header_t *fs_header = &reader.header.fs_headers[i];
+        if (entry->media_end_offset <= entry->media_start_offset)
+            continue;
+
+        // Sections are named like the directories a program NCA is built from
+        char name[0x10];
+        if (reader.header.content_type == NCA_TYPE_PROGRAM && i == 0 && fs_header->hash_type == HASH_TYPE_PFS0)
+            strcpy(name, "exefs");
+        else if (reader.header.content_type == NCA_TYPE_PROGRAM && i == 2 && fs_header->hash_type == HASH_TYPE_PFS0)
+            strcpy(name, "logo");
+        else if (i == romfs_index)
+            strcpy(name, "romfs");
+        else
+            snprintf(name, sizeof(name), "section%i", i);
+        filepath_t section_path;
+        filepath_copy(&section_path, out_dirpath);
+        filepath_append(&section_path, "%s", name);
+
+        const char *skipped = NULL;
+        uint32_t first_entry = extract_ctx.num_entries;
+        if (fs_header->crypt_type == CRYPT_BKTR)
+            skipped = "BKTR patch, it only reads with its base NCA";
+        else if (fs_header->crypt_type != CRYPT_NONE && fs_header->crypt_type != CRYPT_CTR)
+            skipped = "unsupported encryption";
+        else if (fs_header->crypt_type == CRYPT_CTR && reader.has_key == 0)
+            skipped = "no titlekey, set --titlekey or put the ticket next to the NCA";
+        else if (fs_header->hash_type == HASH_TYPE_PFS0)
+        {
+            if (extract_add_pfs0(&extract_ctx, (uint8_t)i, &section_path) != 0)
+                num_failed++;
+        }
+        else if (fs_header->hash_type == HASH_TYPE_ROMFS && fs_header->compression_header.magic == MAGIC_BKTR && i == romfs_index)
+        {
+            // Decompressed to an image in the output directory, its files are copied from there like from a RomFS image
+            filepath_copy(&image_path, out_dirpath);
+            filepath_append(&image_path, "%s_image", name);
+            extract_romfs_t romfs;
+            if (compress_read_romfs_section(&reader, (uint8_t)i, &image_path) != 0 || extract_open_romfs_image(&image_path, &image_fd, &image_base, &romfs) != 0)
+                num_failed++;
+            else
+            {
+                extract_ctx.src_fd = image_fd;
+                if (extract_visit_romfs_dir(&extract_ctx, &romfs, 0, &section_path, 0) != 0)
+                    num_failed++;
+            }
+        }
+        else if (fs_header->hash_type == HASH_TYPE_ROMFS && i == romfs_index)
+        {
+            if (ncareader_open_romfs(&reader, (uint8_t)i, &romfs_tables) != 0)
+            {
+                hp_error("Error: Failed to read RomFS of section %i\n", i);
+                num_failed++;
+            }
+            else
+            {
+                extract_romfs_t romfs;
+                romfs.header = &romfs_tables.header;
+                romfs.dir_table = (unsigned char *)romfs_tables.dir_table;
+                romfs.file_table = (unsigned char *)romfs_tables.file_table;
+                romfs.size = romfs_tables.size;
+                romfs.data_offset = romfs_tables.data_offset;
+                romfs.section_index = i;
+                if (extract_visit_romfs_dir(&extract_ctx, &romfs, 0, &section_path, 0) != 0)
+                    num_failed++;
+            }
+        }
+        else
+            skipped = "unknown section type";
+
+        if (skipped != NULL)
+            hp_log("Section %i: skipped, %s\n", i, skipped);
+        else
+            hp_log("Section %i: %" PRIu32 " files in %s\n", i, extract_ctx.num_entries - first_entry, section_path.char_path);
+    }
+
+    // Nothing is written if the tables are broken, a partial tree would look complete
+    if (num_failed == 0)
+        num_failed += extract_run(settings, &extract_ctx);
+    extract_free_ctx(&extract_ctx);
+    ncareader_close_romfs(&romfs_tables);
+    ncareader_close(&reader);
+    if (image_fd >= 0)
+    {
+        romfs_base_free(&image_base);
+        fio_close(image_fd);
+    }
+    if (image_path.valid == VALIDITY_VALID)
+        os_deletefile(image_path.char_path);
+
+    if (num_failed > 0)
+        hp_error("Error: %i failures extracting %s\n", num_failed, nca_path->char_path);
+    else
+        hp_log("\n----> Extracted NCA: %s\n", nca_path->char_path);
+    return num_failed;
+}
+
+/* Copies every file of an NSP to out_dirpath as it is, NCAs stay encrypted. */
+int extract_nsp(hp_settings_t *settings, filepath_t *nsp_path, filepath_t *out_dirpath)
+{
+    hp_log("----> Extracting NSP: %s\n", nsp_path->char_path);
+    uint64_t nsp_size;
+    pfs0_ctx_t pfs0_ctx;
+    int fd = fio_open(nsp_path, FIO_MODE_READ);
+    if (fd < 0 || fio_get_size(fd, &nsp_size) != 0 || pfs0_read_header(&pfs0_ctx, fd, 0, nsp_size) != 0)
+    {
+        hp_error("Error: Failed to read NSP header of %s\n", nsp_path->char_path);
+        if (fd >= 0)
+            fio_close(fd);
+        return 1;
+    }
+
+    extract_ctx_t extract_ctx;
+    memset(&extract_ctx, 0, sizeof(extract_ctx));
+    extract_ctx.src_fd = fd;
+    hp_log("\n===> Creating directories\n");
+    os_makedir(out_dirpath->os_path);
+    int num_failed = 0;
+    for (uint32_t i = 0; i < pfs0_ctx.num_files; i++)
+    {
+        pfs0_file_ctx_t *file = &pfs0_ctx.files[i];
+        filepath_t path;
+        filepath_copy(&path, out_dirpath);
+        if (extract_append_name(&path, file->name, strlen(file->name)) != 0)
+        {
+            hp_error("Error: Invalid NSP file name %s\n", file->name);
+            num_failed++;
+            break;
+        }
+        extract_add_entry(&extract_ctx, &path, file->size, -1, pfs0_ctx.header_size + file->offset);
+    }
+    hp_log("%" PRIu32 " files\n", pfs0_ctx.num_files);
+
+    if (num_failed == 0)
+        num_failed += extract_run(settings, &extract_ctx);
+    extract_free_ctx(&extract_ctx);
+    pfs0_free_ctx(&pfs0_ctx);
+    fio_close(fd);
+
+    if (num_failed > 0)
+        hp_error("Error: %i failures extracting %s\n", num_failed, nsp_path->char_path);
+    else
+        hp_log("\n----> Extracted NSP: %s\n", nsp_path->char_path);
+    return num_failed;
+}
+
+/* Writes the tree of a decrypted RomFS image to out_dirpath. */
+int extract_romfs(hp_settings_t *settings, filepath_t *romfs_path, filepath_t *out_dirpath)
+{
+    hp_log("----> Extracting RomFS: %s\n", romfs_path->char_path);
+    romfs_base_t base;
+    extract_romfs_t romfs;
+    int fd;
+    if (extract_open_romfs_image(romfs_path, &fd, &base, &romfs) != 0)
+        return 1;
+
+    extract_ctx_t extract_ctx;
+    memset(&extract_ctx, 0, sizeof(extract_ctx));
+    extract_ctx.src_fd = fd;
+    hp_log("\n===> Creating directories\n");
+    int num_failed = extract_visit_romfs_dir(&extract_ctx, &romfs, 0, out_dirpath, 0) != 0;
+    hp_log("%" PRIu32 " directories\n", extract_ctx.num_dirs);
+
+    if (num_failed == 0)
+        num_failed += extract_run(settings, &extract_ctx);
+    extract_free_ctx(&extract_ctx);
+    romfs_base_free(&base);
+    fio_close(fd);
+
+    if (num_failed > 0)
+        hp_error("Error: %i failures extracting %s\n", num_failed, romfs_path->char_path);
+    else
+        hp_log("\n----> Extracted RomFS: %s\n", romfs_path->char_path);
+    return num_failed;
+}
+
+/* Extracts an NSP, told apart by its PFS0 header, a RomFS image, which starts with its header size, or an NCA. */
+int extract_file(hp_settings_t *settings, filepath_t *path, filepath_t *out_dirpath)
+{
+    uint64_t magic = 0;
+    int fd = fio_open(path, FIO_MODE_READ);
+    if (fd < 0)
+    {
+        hp_error("Failed to open %s!\n", path->char_path);
+        return 1;
+    }
+    int ret = fio_pread(fd, &magic, sizeof(magic), 0);
+    fio_close(fd);
+    if (ret == 0 && (uint32_t)magic == MAGIC_PFS0)
+        return extract_nsp(settings, path, out_dirpath);
+    if (ret == 0 && le_dword(magic) == sizeof(romfs_header_t))
+        return extract_romfs(settings, path, out_dirpath);
+    return extract_nca(settings, path, out_dirpath);
+}
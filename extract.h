@@ -0,0 +1,14 @@
+#ifndef HACPACK_EXTRACT_H
+#define HACPACK_EXTRACT_H
+
+#include "settings.h"
+#include "filepath.h"
+
+#define EXTRACT_JOB_SIZE 0x800000 // 8 MB
+
+int extract_nca(hp_settings_t *settings, filepath_t *nca_path, filepath_t *out_dirpath);
+int extract_nsp(hp_settings_t *settings, filepath_t *nsp_path, filepath_t *out_dirpath);
+int extract_romfs(hp_settings_t *settings, filepath_t *romfs_path, filepath_t *out_dirpath);
+int extract_file(hp_settings_t *settings, filepath_t *path, filepath_t *out_dirpath);
+
+#endif
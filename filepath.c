@@ -23,8 +23,8 @@ void os_strcpy(oschar_t *dst, const char *src)
 
     if (ConvertUTF8toUTF16(&sourceStart, sourceEnd, &targetStart, targetEnd, 0) != conversionOK)
     {
-        fprintf(stderr, "Failed to convert %s to UTF-16!\n", src);
-        exit(EXIT_FAILURE);
+        hp_error("Failed to convert %s to UTF-16!\n", src);
+        hp_exit_failure();
     }
 #else
     strcpy(dst, src);
@@ -233,13 +233,13 @@ void filepath_copy_file(filepath_t *source_file, filepath_t *destination_path)
 
     if (source == NULL)
     {
-        fprintf(stderr, "Failed to open %s!\n", source_file->char_path);
-        exit(EXIT_FAILURE);
+        hp_error("Failed to open %s!\n", source_file->char_path);
+        hp_exit_failure();
     }
     if (dst == NULL)
     {
-        fprintf(stderr, "Failed to open %s!\n", destination_path->char_path);
-        exit(EXIT_FAILURE);
+        hp_error("Failed to open %s!\n", destination_path->char_path);
+        hp_exit_failure();
     }
 
     fseeko64(source, 0, SEEK_END);
@@ -247,11 +247,11 @@ void filepath_copy_file(filepath_t *source_file, filepath_t *destination_path)
     fseeko64(source, 0, SEEK_SET);
 
     uint64_t read_size = 0x61A8000; // 100 MB buffer.
-    unsigned char *buf = malloc(read_size);
+    unsigned char *buf = hp_track_buffer(malloc(read_size));
     if (buf == NULL)
     {
-        fprintf(stderr, "Failed to allocate file-read buffer!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Failed to allocate file-read buffer!\n");
+        hp_exit_failure();
     }
 
     uint64_t ofs = 0;
@@ -261,14 +261,14 @@ void filepath_copy_file(filepath_t *source_file, filepath_t *destination_path)
             read_size = file_size - ofs;
         if (fread(buf, 1, read_size, source) != read_size)
         {
-            fprintf(stderr, "Failed to read file %s\n", source_file->char_path);
-            exit(EXIT_FAILURE);
+            hp_error("Failed to read file %s\n", source_file->char_path);
+            hp_exit_failure();
         }
         fwrite(buf, read_size, 1, dst);
         ofs += read_size;
     }
 
-    free(buf);
-    fclose(source);
-    fclose(dst);
+    hp_free(buf);
+    os_fclose(source);
+    os_fclose(dst);
 }
@@ -20,13 +20,13 @@ typedef _WDIR osdir_t;
 typedef struct _wdirent osdirent_t;
 typedef struct _stati64 os_stat64_t;
 
-#define os_fopen _wfopen
+#define os_fopen(path, mode) hp_track_file(_wfopen(path, mode))
 #define os_opendir _wopendir
 #define os_closedir _wclosedir
 #define os_readdir _wreaddir
 #define os_stat _wstati64
 #define os_char_stat _stat64
-#define os_fclose fclose
+#define os_fclose hp_fclose
 #define os_rename _wrename
 #define os_deletefile remove
 #define OS_MODE_READ L"rb"
@@ -40,13 +40,13 @@ typedef DIR osdir_t;
 typedef struct dirent osdirent_t;
 typedef struct stat os_stat64_t;
 
-#define os_fopen fopen
+#define os_fopen(path, mode) hp_track_file(fopen(path, mode))
 #define os_opendir opendir
 #define os_closedir closedir
 #define os_readdir readdir
 #define os_stat stat
 #define os_char_stat stat
-#define os_fclose fclose
+#define os_fclose hp_fclose
 #define os_rename rename
 #define os_deletefile unlink
 #define OS_MODE_READ "rb"
@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
+#include "fio.h"
+
+#define FIO_IO_CHUNK_SIZE 0x40000000 // Max bytes per syscall, 1 GB
+
+/* fds are registered with the trap as fd + 1, so fd 0 isn't a NULL resource. */
+static void fio_release(void *resource)
+{
+#ifdef _WIN32
+    _close((int)(intptr_t)resource - 1);
+#else
+    close((int)(intptr_t)resource - 1);
+#endif
+}
+
+int fio_open(filepath_t *fpath, fio_mode_t mode)
+{
+    int flags;
+    switch (mode)
+    {
+    case FIO_MODE_WRITE:
+        flags = O_RDWR | O_CREAT | O_TRUNC;
+        break;
+    case FIO_MODE_EDIT:
+        flags = O_RDWR;
+        break;
+    default:
+        flags = O_RDONLY;
+        break;
+    }
+#ifdef _WIN32
+    int fd = _wopen(fpath->os_path, flags | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    int fd = open(fpath->os_path, flags, 0666);
+#endif
+    if (fd >= 0)
+        hp_trap_add(fio_release, (void *)(intptr_t)(fd + 1));
+    return fd;
+}
+
+int fio_close(int fd)
+{
+    hp_trap_remove((void *)(intptr_t)(fd + 1));
+#ifdef _WIN32
+    return _close(fd);
+#else
+    return close(fd);
+#endif
+}
+
+int fio_get_size(int fd, uint64_t *out_size)
+{
+#ifdef _WIN32
+    __int64 size = _filelengthi64(fd);
+    if (size < 0)
+        return -1;
+    *out_size = (uint64_t)size;
+#else
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return -1;
+    *out_size = (uint64_t)st.st_size;
+#endif
+    return 0;
+}
+
+int fio_set_size(int fd, uint64_t size)
+{
+#ifdef _WIN32
+    return _chsize_s(fd, (__int64)size) == 0 ? 0 : -1;
+#else
+    return ftruncate(fd, (off_t)size);
+#endif
+}
+
+#ifdef _WIN32
+static int fio_win32_io(int fd, void *buf, DWORD size, uint64_t offset, DWORD *out_done, int write)
+{
+    HANDLE handle = (HANDLE)_get_osfhandle(fd);
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)(offset & 0xFFFFFFFF);
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    if (handle == INVALID_HANDLE_VALUE)
+        return -1;
+    if (write)
+        return WriteFile(handle, buf, size, out_done, &ov) ? 0 : -1;
+    return ReadFile(handle, buf, size, out_done, &ov) ? 0 : -1;
+}
+#endif
+
+/* Reads exactly size bytes at offset. Returns 0 on success. */
+int fio_pread(int fd, void *buf, uint64_t size, uint64_t offset)
+{
+    unsigned char *p = (unsigned char *)buf;
+    while (size > 0)
+    {
+        uint64_t chunk = size < FIO_IO_CHUNK_SIZE ? size : FIO_IO_CHUNK_SIZE;
+#ifdef _WIN32
+        DWORD done = 0;
+        if (fio_win32_io(fd, p, (DWORD)chunk, offset, &done, 0) != 0 || done == 0)
+            return -1;
+#else
+        ssize_t done = pread(fd, p, (size_t)chunk, (off_t)offset);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return -1;
+#endif
+        p += done;
+        offset += done;
+        size -= done;
+    }
+    return 0;
+}
+
+/* Writes exactly size bytes at offset. Returns 0 on success. */
+int fio_pwrite(int fd, const void *buf, uint64_t size, uint64_t offset)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    while (size > 0)
+    {
+        uint64_t chunk = size < FIO_IO_CHUNK_SIZE ? size : FIO_IO_CHUNK_SIZE;
+#ifdef _WIN32
+        DWORD done = 0;
+        if (fio_win32_io(fd, (void *)p, (DWORD)chunk, offset, &done, 1) != 0 || done == 0)
+            return -1;
+#else
+        ssize_t done = pwrite(fd, p, (size_t)chunk, (off_t)offset);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return -1;
+#endif
+        p += done;
+        offset += done;
+        size -= done;
+    }
+    return 0;
+}
+
+/* Writes exactly size bytes at the current position, works on pipes and other non-seekable outputs. */
+int fio_write(int fd, const void *buf, uint64_t size)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    while (size > 0)
+    {
+        uint64_t chunk = size < FIO_IO_CHUNK_SIZE ? size : FIO_IO_CHUNK_SIZE;
+#ifdef _WIN32
+        int done = _write(fd, p, (unsigned int)chunk);
+#else
+        ssize_t done = write(fd, p, (size_t)chunk);
+        if (done < 0 && errno == EINTR)
+            continue;
+#endif
+        if (done <= 0)
+            return -1;
+        p += done;
+        size -= done;
+    }
+    return 0;
+}
+
+/* Points stdout at stderr so progress messages stay out of a streamed output, returns a descriptor for the original stdout. */
+int fio_redirect_stdout(void)
+{
+#ifdef _WIN32
+    int fd = _dup(_fileno(stdout));
+    if (fd < 0 || _dup2(_fileno(stderr), _fileno(stdout)) != 0)
+        return -1;
+    _setmode(fd, _O_BINARY);
+#else
+    int fd = dup(STDOUT_FILENO);
+    if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+        return -1;
+#endif
+    return fd;
+}
+
+#ifdef __linux__
+#ifdef FICLONERANGE
+static int fio_clone_range(int src_fd, uint64_t src_offset, int dst_fd, uint64_t dst_offset, uint64_t size)
+{
+    struct file_clone_range range;
+    range.src_fd = src_fd;
+    range.src_offset = src_offset;
+    range.src_length = size;
+    range.dest_offset = dst_offset;
+    return ioctl(dst_fd, FICLONERANGE, &range) == 0 ? 0 : -1;
+}
+#endif
+
+/* Shares the extents of the source range on CoW filesystems (btrfs, XFS), returns the number of bytes reflinked from the start of the range. */
+static uint64_t fio_reflink_range(int src_fd, uint64_t src_offset, int dst_fd, uint64_t dst_offset, uint64_t size)
+{
+#ifdef FICLONERANGE
+    struct stat st;
+    uint64_t src_size;
+    if (fstat(dst_fd, &st) != 0 || st.st_blksize <= 0 || fio_get_size(src_fd, &src_size) != 0)
+        return 0;
+
+    // Offsets must be block aligned, the length too unless the range ends at source EOF
+    uint64_t block_size = (uint64_t)st.st_blksize;
+    if (src_offset % block_size != 0 || dst_offset % block_size != 0)
+        return 0;
+    uint64_t tail_size = size % block_size;
+    if ((tail_size == 0 || src_offset + size == src_size) && fio_clone_range(src_fd, src_offset, dst_fd, dst_offset, size) == 0)
+        return size;
+
+    // An unaligned tail that ends inside the destination is refused, the caller copies it
+    if (tail_size == 0 || size - tail_size == 0 || fio_clone_range(src_fd, src_offset, dst_fd, dst_offset, size - tail_size) != 0)
+        return 0;
+    return size - tail_size;
+#else
+    (void)src_fd;
+    (void)src_offset;
+    (void)dst_fd;
+    (void)dst_offset;
+    (void)size;
+    return 0;
+#endif
+}
+
+/* In-kernel copy, returns the number of bytes copied before the first failure. */
+static uint64_t fio_kernel_copy_range(int src_fd, uint64_t src_offset, int dst_fd, uint64_t dst_offset, uint64_t size)
+{
+    uint64_t copied = 0;
+#ifdef __NR_copy_file_range
+    while (copied < size)
+    {
+        loff_t in_off = (loff_t)(src_offset + copied);
+        loff_t out_off = (loff_t)(dst_offset + copied);
+        uint64_t chunk = size - copied < FIO_IO_CHUNK_SIZE ? size - copied : FIO_IO_CHUNK_SIZE;
+        long done = syscall(__NR_copy_file_range, src_fd, &in_off, dst_fd, &out_off, (size_t)chunk, 0);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            break;
+        copied += (uint64_t)done;
+    }
+#else
+    (void)src_fd;
+    (void)src_offset;
+    (void)dst_fd;
+    (void)dst_offset;
+    (void)size;
+#endif
+    return copied;
+}
+#endif
+
+/* Copies a range between files, preferring reflinks, then in-kernel copies, then a userspace buffer. */
+int fio_copy_range(int src_fd, uint64_t src_offset, int dst_fd, uint64_t dst_offset, uint64_t size, fio_copy_stats_t *stats)
+{
+    uint64_t ofs = 0;
+
+#ifdef __linux__
+    if (size > 0)
+        ofs = fio_reflink_range(src_fd, src_offset, dst_fd, dst_offset, size);
+    if (stats != NULL)
+        stats->reflinked += ofs;
+    if (ofs == size)
+        return 0;
+
+    uint64_t copied = fio_kernel_copy_range(src_fd, src_offset + ofs, dst_fd, dst_offset + ofs, size - ofs);
+    if (stats != NULL)
+        stats->kernel_copied += copied;
+    ofs += copied;
+    if (ofs == size)
+        return 0;
+#endif
+
+    uint64_t buf_size = size - ofs < FIO_COPY_BUFFER_SIZE ? size - ofs : FIO_COPY_BUFFER_SIZE;
+    unsigned char *buf = hp_track_buffer(malloc(buf_size));
+    if (buf == NULL)
+    {
+        hp_error("Failed to allocate file-copy buffer!\n");
+        hp_exit_failure();
+    }
+
+    int ret = 0;
+    while (ofs < size)
+    {
+        uint64_t read_size = size - ofs < buf_size ? size - ofs : buf_size;
+        if (fio_pread(src_fd, buf, read_size, src_offset + ofs) != 0 || fio_pwrite(dst_fd, buf, read_size, dst_offset + ofs) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        ofs += read_size;
+        if (stats != NULL)
+            stats->buffered += read_size;
+    }
+
+    hp_free(buf);
+    return ret;
+}
+
+/* Appends a source range to the current position of dst_fd, in-kernel where possible. */
+int fio_stream_copy(int src_fd, uint64_t src_offset, int dst_fd, uint64_t size, fio_copy_stats_t *stats)
+{
+    uint64_t ofs = 0;
+
+#ifdef __linux__
+    while (ofs < size)
+    {
+        off_t in_off = (off_t)(src_offset + ofs);
+        uint64_t chunk = size - ofs < FIO_IO_CHUNK_SIZE ? size - ofs : FIO_IO_CHUNK_SIZE;
+        ssize_t done = sendfile(dst_fd, src_fd, &in_off, (size_t)chunk);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            break;
+        ofs += (uint64_t)done;
+        if (stats != NULL)
+            stats->kernel_copied += (uint64_t)done;
+    }
+    if (ofs == size)
+        return 0;
+#endif
+
+    uint64_t buf_size = size - ofs < FIO_COPY_BUFFER_SIZE ? size - ofs : FIO_COPY_BUFFER_SIZE;
+    unsigned char *buf = hp_track_buffer(malloc(buf_size));
+    if (buf == NULL)
+    {
+        hp_error("Failed to allocate file-copy buffer!\n");
+        hp_exit_failure();
+    }
+
+    int ret = 0;
+    while (ofs < size)
+    {
+        uint64_t read_size = size - ofs < buf_size ? size - ofs : buf_size;
+        if (fio_pread(src_fd, buf, read_size, src_offset + ofs) != 0 || fio_write(dst_fd, buf, read_size) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        ofs += read_size;
+        if (stats != NULL)
+            stats->buffered += read_size;
+    }
+
+    hp_free(buf);
+    return ret;
+}
+
+void fio_print_copy_stats(fio_copy_stats_t *stats)
+{
+    hp_log("Copied %" PRIu64 " bytes (reflinked: %" PRIu64 ", in-kernel: %" PRIu64 ", buffered: %" PRIu64 ")\n",
+           stats->reflinked + stats->kernel_copied + stats->buffered, stats->reflinked, stats->kernel_copied, stats->buffered);
+}
@@ -0,0 +1,37 @@
+#ifndef HACPACK_FIO_H
+#define HACPACK_FIO_H
+
+#include <stdint.h>
+#include "types.h"
+#include "filepath.h"
+
+#define FIO_COPY_BUFFER_SIZE 0x400000 // 4 MB
+
+typedef enum
+{
+    FIO_MODE_READ = 0,
+    FIO_MODE_WRITE = 1, /* Create or truncate, read/write. */
+    FIO_MODE_EDIT = 2   /* Existing file, read/write. */
+} fio_mode_t;
+
+/* Bytes moved by each copy method, for reporting. */
+typedef struct
+{
+    uint64_t reflinked;
+    uint64_t kernel_copied;
+    uint64_t buffered;
+} fio_copy_stats_t;
+
+int fio_open(filepath_t *fpath, fio_mode_t mode);
+int fio_close(int fd);
+int fio_get_size(int fd, uint64_t *out_size);
+int fio_set_size(int fd, uint64_t size);
+int fio_pread(int fd, void *buf, uint64_t size, uint64_t offset);
+int fio_pwrite(int fd, const void *buf, uint64_t size, uint64_t offset);
+int fio_write(int fd, const void *buf, uint64_t size);
+int fio_redirect_stdout(void);
+int fio_copy_range(int src_fd, uint64_t src_offset, int dst_fd, uint64_t dst_offset, uint64_t size, fio_copy_stats_t *stats);
+int fio_stream_copy(int src_fd, uint64_t src_offset, int dst_fd, uint64_t size, fio_copy_stats_t *stats);
+void fio_print_copy_stats(fio_copy_stats_t *stats);
+
+#endif
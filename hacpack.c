@@ -0,0 +1,638 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hacpack.h"
+#include "nca.h"
+#include "pki.h"
+#include "extkeys.h"
+#include "nacp.h"
+#include "npdm.h"
+#include "nsp.h"
+#include "rekey.h"
+#include "ncz.h"
+#include "verify.h"
+#include "extract.h"
+
+/* Fills settings with the defaults of the CLI. */
+void hacpack_settings_init(hp_settings_t *settings)
+{
+    memset(settings, 0, sizeof(*settings));
+    settings->nsp_out_fd = -1;
+
+    filepath_init(&settings->out_dir);
+    filepath_init(&settings->exefs_dir);
+    filepath_init(&settings->romfs_dir);
+    filepath_init(&settings->logo_dir);
+    filepath_init(&settings->programnca);
+    filepath_init(&settings->controlnca);
+    filepath_init(&settings->legalnca);
+    filepath_init(&settings->htmldocnca);
+    filepath_init(&settings->datanca);
+    filepath_init(&settings->publicdatanca);
+    filepath_init(&settings->metanca);
+    filepath_init(&settings->ncadir);
+    filepath_init(&settings->control_dir);
+    filepath_init(&settings->legal_dir);
+    filepath_init(&settings->htmldoc_dir);
+    filepath_init(&settings->cnmt);
+    filepath_init(&settings->acid_sig_private_key);
+    filepath_init(&settings->nca_sig1_private_key);
+    filepath_init(&settings->nca_sig2_private_key);
+    filepath_init(&settings->nca_sig2_modulus);
+    filepath_init(&settings->batch_manifest);
+    filepath_init(&settings->serve_socket);
+    filepath_init(&settings->connect_socket);
+    filepath_init(&settings->cache_dir);
+    filepath_init(&settings->rekey_nca);
+    filepath_init(&settings->patch_nca);
+    filepath_init(&settings->verify_path);
+    filepath_init(&settings->extract_path);
+    filepath_init(&settings->info_path);
+    filepath_init(&settings->variants);
+    settings->variant_writer = NULL;
+    filepath_init(&settings->romfs_base);
+    filepath_init(&settings->request);
+
+    // Hardcode default temp directory
+    filepath_init(&settings->temp_dir);
+    filepath_set(&settings->temp_dir, "hacpack_temp");
+
+    // Hardcode default backup directory
+    filepath_init(&settings->backup_dir);
+    filepath_set(&settings->backup_dir, "hacpack_backup");
+
+    pki_initialize_keyset(&settings->keyset);
+
+    // Default Settings
+    settings->keygeneration = 1;
+    settings->sdk_version = 0x000C1100;
+    settings->keyareakey = (unsigned char *)calloc(1, 0x10);
+    memset(settings->keyareakey, 4, 0x10);
+}
+
+/* Loads keypath, or the first default keyset found if it isn't set. */
+int hacpack_settings_load_keyset(hp_settings_t *settings, filepath_t *keypath)
+{
+    // Try to populate default keyfile.
+    FILE *keyfile = NULL;
+    if (keypath->valid == VALIDITY_INVALID)
+    {
+        // Locating default key file
+        filepath_set(keypath, "keys.dat");
+        keyfile = os_fopen(keypath->os_path, OS_MODE_READ);
+        if (keyfile == NULL)
+        {
+            filepath_set(keypath, "keys.txt");
+            keyfile = os_fopen(keypath->os_path, OS_MODE_READ);
+        }
+        if (keyfile == NULL)
+        {
+            filepath_set(keypath, "keys.ini");
+            keyfile = os_fopen(keypath->os_path, OS_MODE_READ);
+        }
+        if (keyfile == NULL)
+        {
+            filepath_set(keypath, "prod.keys");
+            keyfile = os_fopen(keypath->os_path, OS_MODE_READ);
+        }
+        if (keyfile == NULL)
+        {
+            /* Use $HOME/.switch/prod.keys if it exists */
+            char *home = getenv("HOME");
+            if (home == NULL)
+                home = getenv("USERPROFILE");
+            if (home != NULL)
+            {
+                filepath_set(keypath, home);
+                filepath_append(keypath, ".switch");
+                filepath_append(keypath, "prod.keys");
+                keyfile = os_fopen(keypath->os_path, OS_MODE_READ);
+            }
+        }
+    }
+    else if (keypath->valid == VALIDITY_VALID)
+        keyfile = os_fopen(keypath->os_path, OS_MODE_READ);
+
+    // Try to populate keyfile.
+    if (keyfile != NULL)
+    {
+        hp_log("Loading '%s' keyset file\n", keypath->char_path);
+        extkeys_initialize_keyset(&settings->keyset, keyfile);
+        pki_derive_keys(&settings->keyset);
+        os_fclose(keyfile);
+    }
+    else
+    {
+        hp_log("\n");
+        hp_error("Error: Unable to open keyset file\n"
+                        "Use -k or --keyset to specify your keyset file path or place your keyset in ." OS_PATH_SEPARATOR "keys.dat\n");
+        return HACPACK_ERROR_KEYSET;
+    }
+
+    // Make sure that header_key exists
+    uint8_t has_header_Key = 0;
+    for (unsigned int i = 0; i < 0x10; i++)
+    {
+        if (settings->keyset.header_key[i] != 0)
+        {
+            has_header_Key = 1;
+            break;
+        }
+    }
+    if (has_header_Key == 0)
+    {
+        hp_error("Error: header_key is not present in keyset file\n");
+        return HACPACK_ERROR_KEYSET;
+    }
+
+    return HACPACK_OK;
+}
+
+/* Validates settings and builds the requested nca or nsp, failures of the build itself exit unless a trap is set. */
+int hacpack_settings_build(hp_settings_t *settings)
+{
+    // Re-keying takes title, content type and hashes from the input nca
+    if (settings->rekey_nca.valid == VALIDITY_VALID)
+    {
+        if (settings->out_dir.valid == VALIDITY_INVALID)
+        {
+            hp_error("Error: Output directory is not specified\n");
+            return HACPACK_ERROR_INVALID;
+        }
+        hp_log("Creating output directory\n");
+        os_makedir(settings->out_dir.os_path);
+        hp_log("\n");
+        rekey_nca(settings);
+        return HACPACK_OK;
+    }
+
+    // Patched ncas stay where they are
+    if (settings->patch_nca.valid == VALIDITY_VALID)
+    {
+        hp_log("\n");
+        rekey_patch_header(settings);
+        return HACPACK_OK;
+    }
+
+    // Verifying only reads the nca or nsp
+    if (settings->verify_path.valid == VALIDITY_VALID)
+    {
+        hp_log("\n");
+        return verify_file(settings, &settings->verify_path) == 0 ? HACPACK_OK : HACPACK_ERROR_FAILED;
+    }
+
+    // Extracting writes what's in the nca, nsp or romfs image to the output directory
+    if (settings->extract_path.valid == VALIDITY_VALID)
+    {
+        if (settings->out_dir.valid == VALIDITY_INVALID)
+        {
+            hp_error("Error: Output directory is not specified\n");
+            return HACPACK_ERROR_INVALID;
+        }
+        hp_log("\n");
+        return extract_file(settings, &settings->extract_path, &settings->out_dir) == 0 ? HACPACK_OK : HACPACK_ERROR_FAILED;
+    }
+
+    // Make sure that key_area_key_application_keygen exists, rekeying and patching check the keys they use themselves
+    uint8_t has_kek = 0;
+    for (unsigned int kekc = 0; kekc < 0x10; kekc++)
+    {
+        if (settings->keyset.key_area_keys[settings->keygeneration - 1][0][kekc] != 0)
+        {
+            has_kek = 1;
+            break;
+        }
+    }
+    if (has_kek == 0)
+    {
+        hp_error("Error: key_area_key_application for keygeneration %i is not present in keyset file\n", settings->keygeneration);
+        return HACPACK_ERROR_KEYSET;
+    }
+
+    // Make sure that titlekek_keygen exists if titlekey is specified
+    if (settings->has_title_key == 1)
+    {
+        uint8_t has_titlekek = 0;
+        for (unsigned int tkekc = 0; tkekc < 0x10; tkekc++)
+        {
+            if (settings->keyset.titlekeks[settings->keygeneration - 1][tkekc] != 0)
+            {
+                has_titlekek = 1;
+                break;
+            }
+        }
+        if (has_titlekek == 0)
+        {
+            hp_error("Error: titlekek for keygeneration %i is not present in keyset file\n", settings->keygeneration);
+            return HACPACK_ERROR_KEYSET;
+        }
+    }
+
+    // Make sure that titleid is within valid range
+    if (settings->title_id < 0x0100000000000000)
+    {
+        hp_error("Error: Bad TitleID: %016" PRIx64 "\n"
+                        "Valid TitleID range: 0100000000000000 - ffffffffffffffff\n",
+                settings->title_id);
+        return HACPACK_ERROR_INVALID;
+    }
+    if (settings->title_id > 0x01ffffffffffffff)
+        hp_log("Warning: TitleID %" PRIx64 " is greater than 01ffffffffffffff and it's not suggested\n", settings->title_id);
+
+    // Make sure that outout directory is set
+    if (settings->out_dir.valid == VALIDITY_INVALID && settings->nsp_out_fd < 0)
+    {
+        hp_error("Error: Output directory is not specified\n");
+        return HACPACK_ERROR_INVALID;
+    }
+
+    if (settings->nsp_out_fd >= 0 && (settings->file_type != FILE_TYPE_NSP || settings->nsp_split != NSP_SPLIT_NONE))
+    {
+        hp_error("Error: Only unsplit nsp can be streamed\n");
+        return HACPACK_ERROR_INVALID;
+    }
+
+    // NSP without --ncadir builds its ncas in place
+    int nsp_build_ncas = settings->file_type == FILE_TYPE_NSP && settings->ncadir.valid == VALIDITY_INVALID && settings->exefs_dir.valid == VALIDITY_VALID;
+    if (nsp_build_ncas && (settings->nsp_out_fd >= 0 || settings->nsp_split != NSP_SPLIT_NONE))
+    {
+        hp_error("Error: Building ncas into nsp doesn't support --nspsplit or streaming\n");
+        return HACPACK_ERROR_INVALID;
+    }
+
+    if (settings->file_type == FILE_TYPE_NCA || nsp_build_ncas)
+    {
+        // Remove existing temp directory and create a new one
+        hp_log("Removing existing temp directory\n");
+        filepath_remove_directory(&settings->temp_dir);
+        hp_log("Creating temp directory\n");
+        os_makedir(settings->temp_dir.os_path);
+
+        // Create backup directory
+        hp_log("Creating backup directory\n");
+        os_makedir(settings->backup_dir.os_path);
+        // Add titleid to backup folder path
+        filepath_append(&settings->backup_dir, "%016" PRIx64, settings->title_id);
+        os_makedir(settings->backup_dir.os_path);
+    }
+
+    // Create output directory
+    if (settings->out_dir.valid == VALIDITY_VALID)
+    {
+        hp_log("Creating output directory\n");
+        os_makedir(settings->out_dir.os_path);
+    }
+
+    // Create cache directory
+    if (settings->cache_dir.valid == VALIDITY_VALID)
+    {
+        hp_log("Creating cache directory\n");
+        os_makedir(settings->cache_dir.os_path);
+    }
+
+    hp_log("\n");
+
+    if (settings->variants.valid == VALIDITY_VALID && (settings->file_type != FILE_TYPE_NCA || settings->nca_type == NCA_TYPE_META || settings->nca_type == NCA_TYPE_APPLICATION))
+    {
+        hp_error("Error: --variants needs a program, control, manual, data or publicdata nca\n");
+        return HACPACK_ERROR_INVALID;
+    }
+
+    if (settings->romfs_base.valid == VALIDITY_VALID && (settings->file_type != FILE_TYPE_NCA || settings->nca_type == NCA_TYPE_CONTROL || settings->nca_type == NCA_TYPE_META))
+    {
+        hp_error("Error: --baseromfs needs a program, application, manual, data or publicdata nca\n");
+        return HACPACK_ERROR_INVALID;
+    }
+
+    if (settings->bktr == 1 && (settings->file_type != FILE_TYPE_NCA || settings->nca_type != NCA_TYPE_PROGRAM || settings->romfs_base.valid != VALIDITY_VALID))
+    {
+        hp_error("Error: --bktr needs a program nca and --baseromfs\n");
+        return HACPACK_ERROR_INVALID;
+    }
+    else if (settings->bktr == 1 && (settings->plaintext == 1 || settings->variants.valid == VALIDITY_VALID))
+    {
+        hp_error("Error: --bktr can't be used with --plaintext or --variants\n");
+        return HACPACK_ERROR_INVALID;
+    }
+
+    if (settings->compress_romfs == 1 && (settings->file_type != FILE_TYPE_NCA || settings->nca_type == NCA_TYPE_CONTROL || settings->nca_type == NCA_TYPE_META))
+    {
+        hp_error("Error: --compressromfs needs a program, application, manual, data or publicdata nca\n");
+        return HACPACK_ERROR_INVALID;
+    }
+    else if (settings->compress_romfs == 1 && settings->bktr == 1)
+    {
+        hp_error("Error: --compressromfs can't be used with --bktr\n");
+        return HACPACK_ERROR_INVALID;
+    }
+
+    if (settings->nsz == 1 && (settings->file_type != FILE_TYPE_NSP || settings->ncadir.valid == VALIDITY_INVALID))
+    {
+        hp_error("Error: --nsz needs --type nsp and --ncadir\n");
+        return HACPACK_ERROR_INVALID;
+    }
+    else if (settings->nsz == 1 && !ncz_is_supported())
+    {
+        hp_error("Error: --nsz needs hacPack built with zstd, build with ZSTD=1\n");
+        return HACPACK_ERROR_INVALID;
+    }
+
+    if (settings->file_type == FILE_TYPE_NCA)
+    {
+        hp_nca_digest_t nca_digest;
+        memset(&nca_digest, 0, sizeof(nca_digest));
+        settings->variant_writer = NULL;
+        switch (settings->nca_type)
+        {
+        case NCA_TYPE_PROGRAM:
+            if (settings->exefs_dir.valid == VALIDITY_INVALID)
+            {
+                hp_error("Error: exefs filepath is not set\n");
+                return HACPACK_ERROR_INVALID;
+            }
+            else if (((settings->nca_sig2_private_key.valid == VALIDITY_VALID) && (settings->nca_sig2_modulus.valid == VALIDITY_INVALID)) || ((settings->nca_sig2_private_key.valid == VALIDITY_INVALID) && (settings->nca_sig2_modulus.valid == VALIDITY_VALID)))
+            {
+                hp_error("Error: Both nca signature 2 private key and public key filepaths must be valid\n");
+                return HACPACK_ERROR_INVALID;
+            }
+            hp_log("----> Processing NPDM\n");
+            npdm_process(settings);
+            hp_log("\n");
+            nca_create_program(settings, &nca_digest);
+            break;
+        case NCA_TYPE_APPLICATION:
+            if (settings->exefs_dir.valid == VALIDITY_INVALID || settings->control_dir.valid == VALIDITY_INVALID)
+            {
+                hp_error("Error: --exefsdir and/or --controldir is not set\n");
+                return HACPACK_ERROR_INVALID;
+            }
+            else if (settings->title_type != 0 && settings->title_type != TITLE_TYPE_APPLICATION)
+            {
+                hp_error("Error: Only application title type is supported for application ncas\n");
+                return HACPACK_ERROR_INVALID;
+            }
+            else if (((settings->nca_sig2_private_key.valid == VALIDITY_VALID) && (settings->nca_sig2_modulus.valid == VALIDITY_INVALID)) || ((settings->nca_sig2_private_key.valid == VALIDITY_INVALID) && (settings->nca_sig2_modulus.valid == VALIDITY_VALID)))
+            {
+                hp_error("Error: Both nca signature 2 private key and public key filepaths must be valid\n");
+                return HACPACK_ERROR_INVALID;
+            }
+            nca_create_application(settings);
+            break;
+        case NCA_TYPE_CONTROL:
+            if (settings->romfs_dir.valid == VALIDITY_INVALID)
+                return HACPACK_ERROR_INVALID;
+            else if (settings->has_title_key)
+            {
+                hp_error("Error: Titlekey is not supported for control nca\n");
+                return HACPACK_ERROR_INVALID;
+            }
+            hp_log("----> Processing NACP\n");
+            nacp_process(settings);
+            hp_log("\n");
+            nca_create_romfs_type(settings, nca_romfs_get_type(settings->nca_type), &nca_digest);
+            break;
+        case NCA_TYPE_DATA:
+            if (settings->romfs_dir.valid == VALIDITY_INVALID && settings->romfs_base.valid == VALIDITY_INVALID)
+                return HACPACK_ERROR_INVALID;
+            else if (settings->has_title_key)
+            {
+                hp_error("Error: Titlekey is not supported for data nca\n");
+                return HACPACK_ERROR_INVALID;
+            }
+            nca_create_romfs_type(settings, nca_romfs_get_type(settings->nca_type), &nca_digest);
+            break;
+        case NCA_TYPE_MANUAL:
+            if (settings->romfs_dir.valid == VALIDITY_INVALID && settings->romfs_base.valid == VALIDITY_INVALID)
+                return HACPACK_ERROR_INVALID;
+            nca_create_romfs_type(settings, nca_romfs_get_type(settings->nca_type), &nca_digest);
+            break;
+        case NCA_TYPE_PUBLICDATA:
+            if (settings->romfs_dir.valid == VALIDITY_INVALID && settings->romfs_base.valid == VALIDITY_INVALID)
+                return HACPACK_ERROR_INVALID;
+            nca_create_romfs_type(settings, nca_romfs_get_type(settings->nca_type), &nca_digest);
+            break;
+        case NCA_TYPE_META:
+            if (settings->cnmt.valid == VALIDITY_VALID)
+                nca_create_meta(settings);
+            else if (settings->title_type == 0)
+            {
+                hp_error("Error: invalid titletype\n");
+                return HACPACK_ERROR_INVALID;
+            }
+            else if (settings->has_title_key)
+            {
+                hp_error("Error: Titlekey is not supported for metadata nca\n");
+                return HACPACK_ERROR_INVALID;
+            }
+            else if ((settings->programnca.valid == VALIDITY_INVALID || settings->controlnca.valid == VALIDITY_INVALID) && settings->title_type == TITLE_TYPE_APPLICATION)
+            {
+                hp_error("Error: --programnca and/or --controlnca is not set\n");
+                return HACPACK_ERROR_INVALID;
+            }
+            else if (settings->title_type == TITLE_TYPE_ADDON && settings->publicdatanca.valid == VALIDITY_INVALID)
+            {
+                hp_error("Error: --publicdatanca is not set\n");
+                return HACPACK_ERROR_INVALID;
+            }
+            else if (settings->title_type == TITLE_TYPE_SYSTEMPROGRAM && settings->programnca.valid == VALIDITY_INVALID)
+            {
+                hp_error("Error: --programnca is not set\n");
+                return HACPACK_ERROR_INVALID;
+            }
+            else if (settings->title_type == TITLE_TYPE_SYSTEMDATA && settings->datanca.valid == VALIDITY_INVALID)
+            {
+                hp_error("Error: --datanca is not set\n");
+                return HACPACK_ERROR_INVALID;
+            }
+            else if (settings->title_type == TITLE_TYPE_PATCH && settings->programnca.valid == VALIDITY_INVALID)
+            {
+                hp_error("Error: --programnca is not set\n");
+                return HACPACK_ERROR_INVALID;
+            }
+            else
+                nca_create_meta(settings);
+            break;
+        default:
+            return HACPACK_ERROR_INVALID;
+        }
+
+        // Variants get their headers and unencrypted data from the nca just built, a cache hit hands over nothing else
+        if (settings->variants.valid == VALIDITY_VALID)
+        {
+            if (settings->variant_writer == NULL)
+                settings->variant_writer = rekey_variants_open(settings);
+            char nca_name[42];
+            nca_get_filename(&nca_digest, 0, nca_name);
+            filepath_t nca_path;
+            filepath_init(&nca_path);
+            filepath_copy(&nca_path, &settings->out_dir);
+            filepath_append(&nca_path, "%s", nca_name);
+            rekey_variants_close(settings->variant_writer, settings, &nca_path);
+            settings->variant_writer = NULL;
+        }
+    }
+    else if (settings->file_type == FILE_TYPE_NSP)
+    {
+        if (settings->ncadir.valid != VALIDITY_INVALID)
+        {
+            // Create NSP, or NSZ of the same files with NCAs stored as NCZs
+            const char *nsp_name = settings->nsz ? "NSZ" : "NSP";
+            hp_log("----> Creating %s:\n", nsp_name);
+            filepath_t nsp_file_path;
+            filepath_init(&nsp_file_path);
+            filepath_copy(&nsp_file_path, &settings->out_dir);
+            filepath_append(&nsp_file_path, "%016" PRIx64 ".%s", settings->title_id, settings->nsz ? "nsz" : "nsp");
+            uint64_t pfs0_size;
+            int ret = settings->nsz ? ncz_build_nsz(&settings->ncadir, &nsp_file_path, settings, &pfs0_size) : nsp_build(&settings->ncadir, &nsp_file_path, settings, &pfs0_size);
+            if (ret != 0)
+            {
+                hp_error("Error: Failed to create %s\n", nsp_file_path.char_path);
+                return HACPACK_ERROR_FAILED;
+            }
+            if (settings->nsp_out_fd >= 0)
+                hp_log("\n----> Streamed %s: %" PRIu64 " bytes\n", nsp_name, pfs0_size);
+            else
+            {
+                report_add_output(settings->nsz ? "nsz" : "nsp", nsp_file_path.char_path, NULL, pfs0_size);
+                hp_log("\n----> Created %s: %s\n", nsp_name, nsp_file_path.char_path);
+            }
+        }
+        else if (nsp_build_ncas)
+        {
+            if (settings->control_dir.valid == VALIDITY_INVALID)
+            {
+                hp_error("Error: --controldir is not set\n");
+                return HACPACK_ERROR_INVALID;
+            }
+            else if (settings->title_type != 0 && settings->title_type != TITLE_TYPE_APPLICATION)
+            {
+                hp_error("Error: Only application ncas can be built into nsp\n");
+                return HACPACK_ERROR_INVALID;
+            }
+            else if (((settings->nca_sig2_private_key.valid == VALIDITY_VALID) && (settings->nca_sig2_modulus.valid == VALIDITY_INVALID)) || ((settings->nca_sig2_private_key.valid == VALIDITY_INVALID) && (settings->nca_sig2_modulus.valid == VALIDITY_VALID)))
+            {
+                hp_error("Error: Both nca signature 2 private key and public key filepaths must be valid\n");
+                return HACPACK_ERROR_INVALID;
+            }
+            hp_log("----> Creating NSP:\n");
+            filepath_t nsp_file_path;
+            filepath_init(&nsp_file_path);
+            filepath_copy(&nsp_file_path, &settings->out_dir);
+            filepath_append(&nsp_file_path, "%016" PRIx64 ".nsp", settings->title_id);
+            uint64_t pfs0_size;
+            if (nsp_build_application(settings, &nsp_file_path, &pfs0_size) != 0)
+            {
+                hp_error("Error: Failed to create %s\n", nsp_file_path.char_path);
+                return HACPACK_ERROR_FAILED;
+            }
+            report_add_output("nsp", nsp_file_path.char_path, NULL, pfs0_size);
+            hp_log("\n----> Created NSP: %s\n", nsp_file_path.char_path);
+        }
+        else
+        {
+            hp_error("Error: --ncadir or --exefsdir is not set\n");
+            return HACPACK_ERROR_INVALID;
+        }
+    }
+    else
+    {
+        hp_error("Error: --type is not set\n");
+        return HACPACK_ERROR_INVALID;
+    }
+
+    // Remove temp directory
+    if (settings->file_type == FILE_TYPE_NCA || nsp_build_ncas)
+    {
+        hp_log("\n");
+        hp_log("Removing created temp directory\n");
+        filepath_remove_directory(&settings->temp_dir);
+    }
+
+    hp_log("\nDone.\n");
+    return HACPACK_OK;
+}
+
+
+/* Records the last error of a library call and passes messages on to the caller. */
+static void hacpack_log(void *user, int is_error, const char *message)
+{
+    hacpack_ctx_t *ctx = (hacpack_ctx_t *)user;
+    if (is_error)
+    {
+        strncpy(ctx->error, message, sizeof(ctx->error) - 1);
+        ctx->error[sizeof(ctx->error) - 1] = '\0';
+    }
+    if (ctx->log_func != NULL)
+        ctx->log_func(ctx->log_user, is_error, message);
+    else
+        fputs(message, is_error ? stderr : stdout);
+}
+
+static void hacpack_begin(hacpack_ctx_t *ctx, hp_trap_t *trap)
+{
+    hp_trap_init(trap, NULL, hacpack_log, ctx);
+    ctx->error[0] = '\0';
+    hp_set_trap(trap);
+}
+
+void hacpack_init(hacpack_ctx_t *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    hacpack_settings_init(&ctx->settings);
+}
+
+/* keypath can be NULL to look for the default keyset files. */
+int hacpack_load_keyset(hacpack_ctx_t *ctx, const char *keypath)
+{
+    hp_trap_t trap;
+    hp_trap_t *prev_trap = hp_get_trap();
+    filepath_t path;
+    int ret;
+
+    filepath_init(&path);
+    if (keypath != NULL)
+        filepath_set(&path, keypath);
+    hacpack_begin(ctx, &trap);
+    if (setjmp(trap.env) == 0)
+        ret = hacpack_settings_load_keyset(&ctx->settings, &path);
+    else
+        ret = HACPACK_ERROR_KEYSET;
+    hp_trap_finish(&trap, ret != HACPACK_OK);
+    hp_set_trap(prev_trap);
+    return ret;
+}
+
+/* Builds with a copy of the context settings, so a context can be built again.
+ * Failures return to here instead of exiting, files and I/O buffers of the failed build are released. */
+int hacpack_build(hacpack_ctx_t *ctx)
+{
+    hp_trap_t trap;
+    hp_trap_t *prev_trap = hp_get_trap();
+    hp_settings_t settings = ctx->settings;
+    int ret;
+
+    report_free_outputs(ctx->outputs, ctx->num_outputs);
+    ctx->outputs = NULL;
+    ctx->num_outputs = 0;
+    report_clear();
+
+    hacpack_begin(ctx, &trap);
+    if (setjmp(trap.env) == 0)
+        ret = hacpack_settings_build(&settings);
+    else
+        ret = HACPACK_ERROR_FAILED;
+    hp_trap_finish(&trap, ret != HACPACK_OK);
+    hp_set_trap(prev_trap);
+
+    if (ret == HACPACK_OK)
+        ctx->outputs = report_take_outputs(&ctx->num_outputs);
+    report_clear();
+    return ret;
+}
+
+void hacpack_free(hacpack_ctx_t *ctx)
+{
+    report_free_outputs(ctx->outputs, ctx->num_outputs);
+    free(ctx->settings.keyareakey);
+    memset(ctx, 0, sizeof(*ctx));
+}
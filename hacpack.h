@@ -0,0 +1,41 @@
+#ifndef HACPACK_HACPACK_H
+#define HACPACK_HACPACK_H
+
+#include "settings.h"
+#include "report.h"
+#include "utils.h"
+
+/* libhacpack, the CLI is a wrapper around these calls.
+ * Failures inside the library longjmp back to a trap these calls set and return as error codes,
+ * there are no I/O callbacks and resources are tracked in a process-wide registry. */
+
+typedef enum
+{
+    HACPACK_OK = 0,
+    HACPACK_ERROR_FAILED = 1,  /* Build failed, the reason is in the error message. */
+    HACPACK_ERROR_INVALID = 2, /* Settings are missing or invalid. */
+    HACPACK_ERROR_KEYSET = 3   /* Keyset can't be loaded or lacks a required key. */
+} hacpack_error_t;
+
+/* One embedded build configuration. Builds of different contexts can run on different threads
+ * as long as their temp directories differ. */
+typedef struct
+{
+    hp_settings_t settings;
+    hp_log_func_t log_func; /* Receives progress and error messages, NULL prints them to stdout and stderr. */
+    void *log_user;
+    char error[0x400]; /* Last error message. */
+    report_output_t *outputs; /* Files created by the last successful build. */
+    uint32_t num_outputs;
+} hacpack_ctx_t;
+
+void hacpack_settings_init(hp_settings_t *settings);
+int hacpack_settings_load_keyset(hp_settings_t *settings, filepath_t *keypath);
+int hacpack_settings_build(hp_settings_t *settings);
+
+void hacpack_init(hacpack_ctx_t *ctx);
+int hacpack_load_keyset(hacpack_ctx_t *ctx, const char *keypath);
+int hacpack_build(hacpack_ctx_t *ctx);
+void hacpack_free(hacpack_ctx_t *ctx);
+
+#endif
@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include "info.h"
+#include "ncareader.h"
+#include "pfs0.h"
+#include "cnmt.h"
+#include "json.h"
+#include "fio.h"
+#include "worker.h"
+#include "utils.h"
+
+/* An NCA file, or a file of an NSP. Only NCA headers and the cnmt of meta NCAs are read. */
+typedef struct
+{
+    char *name;      /* In the NSP, NULL for an NCA file */
+    uint64_t offset; /* In the NSP */
+    uint64_t size;
+    uint8_t is_nca;  /* Its header could be decrypted */
+    uint8_t has_key;
+    nca_header_t header;
+    unsigned char *cnmt; /* Of a meta NCA, NULL if it couldn't be read */
+    uint64_t cnmt_size;
+} info_entry_t;
+
+typedef struct
+{
+    char *path;
+    uint64_t size;
+    uint8_t is_nsp;
+    const char *error; /* Why the file couldn't be read, NULL if it could */
+    info_entry_t *entries;
+    uint32_t num_entries;
+} info_file_t;
+
+typedef struct
+{
+    hp_settings_t *settings;
+    info_file_t *files;
+    uint32_t num_files;
+    uint32_t max_files;
+} info_ctx_t;
+
+static const char *info_get_title_type_name(uint8_t type)
+{
+    switch (type)
+    {
+    case TITLE_TYPE_SYSTEMPROGRAM:
+        return "systemprogram";
+    case TITLE_TYPE_SYSTEMDATA:
+        return "systemdata";
+    case TITLE_TYPE_APPLICATION:
+        return "application";
+    case TITLE_TYPE_PATCH:
+        return "patch";
+    case TITLE_TYPE_ADDON:
+        return "addon";
+    default:
+        return "unknown";
+    }
+}
+
+static const char *info_get_content_record_type_name(uint8_t type)
+{
+    static const char *names[] = {"meta", "program", "data", "control", "htmldocument", "legalinformation", "deltafragment"};
+    return type < sizeof(names) / sizeof(names[0]) ? names[type] : "unknown";
+}
+
+static const char *info_get_crypt_type_name(uint8_t crypt_type)
+{
+    static const char *names[] = {"unknown", "none", "xts", "ctr", "bktr"};
+    return crypt_type < sizeof(names) / sizeof(names[0]) ? names[crypt_type] : "unknown";
+}
+
+static void info_add_file(info_ctx_t *ctx, const char *path)
+{
+    if (ctx->num_files == ctx->max_files)
+    {
+        ctx->max_files = ctx->max_files ? ctx->max_files * 2 : 64;
+        ctx->files = realloc(ctx->files, ctx->max_files * sizeof(info_file_t));
+        if (ctx->files == NULL)
+        {
+            hp_error("Failed to allocate info files!\n");
+            hp_exit_failure();
+        }
+    }
+    info_file_t *file = &ctx->files[ctx->num_files++];
+    memset(file, 0, sizeof(*file));
+    if ((file->path = strdup(path)) == NULL)
+    {
+        hp_error("Failed to allocate info files!\n");
+        hp_exit_failure();
+    }
+}
+
+/* Adds every .nca and .nsp under dir_path. */
+static void info_visit_dir(info_ctx_t *ctx, const char *dir_path, uint32_t depth)
+{
+#if __MINGW32__
+    struct __stat64 objstats;
+#else
+    struct stat objstats;
+#endif
+    char objpath[4351];
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL)
+    {
+        hp_error("Failed to open %s!\n", dir_path);
+        return;
+    }
+
+    struct dirent *cur_dirent;
+    while ((cur_dirent = readdir(dir)))
+    {
+        if (strcmp(cur_dirent->d_name, ".") == 0 || strcmp(cur_dirent->d_name, "..") == 0)
+            continue;
+        snprintf(objpath, sizeof(objpath), "%s%s%s", dir_path, OS_PATH_SEPARATOR, cur_dirent->d_name);
+        if (os_char_stat(objpath, &objstats) == -1)
+            continue;
+
+        size_t name_len = strlen(cur_dirent->d_name);
+        if ((objstats.st_mode & S_IFMT) == S_IFDIR && depth < INFO_MAX_DEPTH)
+            info_visit_dir(ctx, objpath, depth + 1);
+        else if ((objstats.st_mode & S_IFMT) == S_IFREG && name_len > 4 &&
+                 (strcmp(cur_dirent->d_name + name_len - 4, ".nca") == 0 || strcmp(cur_dirent->d_name + name_len - 4, ".nsp") == 0))
+            info_add_file(ctx, objpath);
+    }
+    closedir(dir);
+}
+
+static int info_compare_files(const void *a, const void *b)
+{
+    return strcmp(((const info_file_t *)a)->path, ((const info_file_t *)b)->path);
+}
+
+static void info_read_nca(hp_settings_t *settings, filepath_t *path, info_entry_t *entry)
+{
+    ncareader_t reader;
+    if (ncareader_try_open_at(settings, path, entry->offset, entry->size, settings->has_title_key ? settings->title_key : NULL, &reader) != 0)
+        return;
+    entry->is_nca = 1;
+    entry->has_key = reader.has_key;
+    memcpy(&entry->header, &reader.header, sizeof(entry->header));
+
+    // The PFS0 header and the cnmt are the only reads past the NCA header
+    int section_index = ncareader_find_section(&reader, FS_TYPE_PFS0, HASH_TYPE_PFS0);
+    if (reader.header.content_type == NCA_TYPE_META && reader.has_key && section_index >= 0)
+        entry->cnmt = ncareader_read_pfs0_file(&reader, (uint8_t)section_index, ".cnmt", &entry->cnmt_size);
+    ncareader_close(&reader);
+}
+
+static void info_job(void *ctx, uint32_t index)
+{
+    info_ctx_t *info_ctx = (info_ctx_t *)ctx;
+    info_file_t *file = &info_ctx->files[index];
+    filepath_t path;
+    filepath_init(&path);
+    filepath_set(&path, file->path);
+
+    uint32_t magic = 0;
+    int fd = fio_open(&path, FIO_MODE_READ);
+    if (fd < 0 || fio_get_size(fd, &file->size) != 0)
+    {
+        file->error = "can't be read";
+        if (fd >= 0)
+            fio_close(fd);
+        return;
+    }
+    if (fio_pread(fd, &magic, sizeof(magic), 0) != 0 || magic != MAGIC_PFS0)
+    {
+        fio_close(fd);
+        file->entries = calloc(1, sizeof(info_entry_t));
+        if (file->entries == NULL)
+        {
+            file->error = "out of memory";
+            return;
+        }
+        file->num_entries = 1;
+        file->entries[0].size = file->size;
+        info_read_nca(info_ctx->settings, &path, &file->entries[0]);
+        if (!file->entries[0].is_nca)
+            file->error = "not an NCA3 or NSP, or header_key is wrong";
+        return;
+    }
+
+    file->is_nsp = 1;
+    pfs0_ctx_t pfs0_ctx;
+    int ret = pfs0_read_header(&pfs0_ctx, fd, 0, file->size);
+    fio_close(fd);
+    if (ret != 0)
+    {
+        file->error = "invalid NSP header";
+        return;
+    }
+    file->entries = calloc(pfs0_ctx.num_files ? pfs0_ctx.num_files : 1, sizeof(info_entry_t));
+    if (file->entries == NULL)
+    {
+        file->error = "out of memory";
+        pfs0_free_ctx(&pfs0_ctx);
+        return;
+    }
+    for (uint32_t i = 0; i < pfs0_ctx.num_files; i++)
+    {
+        info_entry_t *entry = &file->entries[file->num_entries++];
+        entry->name = pfs0_ctx.files[i].name;
+        pfs0_ctx.files[i].name = NULL;
+        entry->offset = pfs0_ctx.header_size + pfs0_ctx.files[i].offset;
+        entry->size = pfs0_ctx.files[i].size;
+        size_t name_len = strlen(entry->name);
+        if (name_len > 4 && strcmp(entry->name + name_len - 4, ".nca") == 0)
+            info_read_nca(info_ctx->settings, &path, entry);
+    }
+    pfs0_free_ctx(&pfs0_ctx);
+}
+
+static void info_write_hex(FILE *f, const unsigned char *data, int size)
+{
+    char hex[0x41];
+    hexBinaryString((unsigned char *)data, size, hex, sizeof(hex));
+    fprintf(f, "\"%s\"", hex);
+}
+
+static void info_write_cnmt_json(FILE *f, info_entry_t *entry)
+{
+    const cnmt_header_t *cnmt_header = (const cnmt_header_t *)entry->cnmt;
+    const cnmt_content_record_t *records = cnmt_get_content_records(entry->cnmt, entry->cnmt_size);
+    if (records == NULL)
+    {
+        fprintf(f, "null");
+        return;
+    }
+    fprintf(f, "{\"title_id\": \"%016" PRIx64 "\", \"title_version\": %" PRIu32 ", \"type\": \"%s\", \"contents\": [",
+            cnmt_header->title_id, cnmt_header->title_version, info_get_title_type_name(cnmt_header->type));
+    for (uint16_t i = 0; i < cnmt_header->content_entry_count; i++)
+    {
+        fprintf(f, "%s{\"ncaid\": ", i ? ", " : "");
+        info_write_hex(f, records[i].ncaid, 0x10);
+        fprintf(f, ", \"type\": \"%s\", \"size\": %" PRIu64 ", \"hash\": ", info_get_content_record_type_name(records[i].type), cnmt_get_content_size(&records[i]));
+        info_write_hex(f, records[i].hash, 0x20);
+        fprintf(f, "}");
+    }
+    fprintf(f, "]}");
+}
+
+static void info_write_nca_json(FILE *f, info_entry_t *entry)
+{
+    nca_header_t *header = &entry->header;
+    fprintf(f, "{\"content_type\": \"%s\", \"title_id\": \"%016" PRIx64 "\", \"keygeneration\": %i, \"key_area_key_index\": %u, \"distribution\": \"%s\", \"sdk_version\": \"%08" PRIX32 "\"",
+            nca_get_content_type_name(header->content_type), header->title_id, ncareader_get_keygeneration(header), header->kaek_ind,
+            header->distribution ? "gamecard" : "download", header->sdk_version);
+    fprintf(f, ", \"rights_id\": ");
+    if (ncareader_has_rights_id(header))
+        info_write_hex(f, header->rights_id, 0x10);
+    else
+        fprintf(f, "null");
+    fprintf(f, ", \"sections\": [");
+    int num_sections = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        nca_section_entry_t *section_entry = &header->section_entries[i];
+        nca_fs_header_t *fs_header = &header->fs_headers[i];
+        if (section_entry->media_end_offset <= section_entry->media_start_offset)
+            continue;
+        fprintf(f, "%s{\"index\": %i, \"offset\": %" PRIu64 ", \"size\": %" PRIu64 ", \"fs_type\": \"%s\", \"crypt_type\": \"%s\", \"compressed\": %s}",
+                num_sections++ ? ", " : "", i, (uint64_t)section_entry->media_start_offset * 0x200,
+                (uint64_t)(section_entry->media_end_offset - section_entry->media_start_offset) * 0x200, fs_header->fs_type == FS_TYPE_PFS0 ? "pfs0" : "romfs",
+                info_get_crypt_type_name(fs_header->crypt_type), fs_header->compression_header.magic == MAGIC_BKTR ? "true" : "false");
+    }
+    fprintf(f, "]");
+    if (header->content_type == NCA_TYPE_META)
+    {
+        fprintf(f, ", \"cnmt\": ");
+        if (entry->cnmt != NULL)
+            info_write_cnmt_json(f, entry);
+        else
+            fprintf(f, "null");
+    }
+    fprintf(f, "}");
+}
+
+static void info_write_json(FILE *f, info_ctx_t *ctx, int num_failed)
+{
+    fprintf(f, "{\"files\": [\n");
+    for (uint32_t i = 0; i < ctx->num_files; i++)
+    {
+        info_file_t *file = &ctx->files[i];
+        fprintf(f, "  {\"path\": ");
+        json_write_string(f, file->path);
+        fprintf(f, ", \"type\": \"%s\", \"size\": %" PRIu64, file->is_nsp ? "nsp" : (file->error == NULL ? "nca" : "unknown"), file->size);
+        if (file->error != NULL)
+            fprintf(f, ", \"error\": \"%s\"", file->error);
+        else if (!file->is_nsp)
+        {
+            fprintf(f, ", \"nca\": ");
+            info_write_nca_json(f, &file->entries[0]);
+        }
+        else
+        {
+            fprintf(f, ", \"entries\": [");
+            for (uint32_t j = 0; j < file->num_entries; j++)
+            {
+                info_entry_t *entry = &file->entries[j];
+                fprintf(f, "%s{\"name\": ", j ? ", " : "");
+                json_write_string(f, entry->name);
+                fprintf(f, ", \"offset\": %" PRIu64 ", \"size\": %" PRIu64, entry->offset, entry->size);
+                if (entry->is_nca)
+                {
+                    fprintf(f, ", \"nca\": ");
+                    info_write_nca_json(f, entry);
+                }
+                fprintf(f, "}");
+            }
+            fprintf(f, "]");
+        }
+        fprintf(f, "}%s\n", i + 1 < ctx->num_files ? "," : "");
+    }
+    fprintf(f, "], \"failed\": %i}\n", num_failed);
+    fflush(f);
+}
+
+static void info_log_nca(const char *name, info_entry_t *entry)
+{
+    nca_header_t *header = &entry->header;
+    hp_log("%s: %s NCA of title %016" PRIx64 ", keygeneration %i, %s crypto, 0x%" PRIx64 " bytes\n", name, nca_get_content_type_name(header->content_type), header->title_id,
+           ncareader_get_keygeneration(header), ncareader_has_rights_id(header) ? "titlekey" : "key area", entry->size);
+    const cnmt_content_record_t *records = entry->cnmt != NULL ? cnmt_get_content_records(entry->cnmt, entry->cnmt_size) : NULL;
+    if (records == NULL)
+        return;
+    const cnmt_header_t *cnmt_header = (const cnmt_header_t *)entry->cnmt;
+    hp_log("  cnmt: %s %016" PRIx64 " v%" PRIu32 ", %u contents\n", info_get_title_type_name(cnmt_header->type), cnmt_header->title_id, cnmt_header->title_version,
+           cnmt_header->content_entry_count);
+    for (uint16_t i = 0; i < cnmt_header->content_entry_count; i++)
+    {
+        char ncaid[33];
+        hexBinaryString((unsigned char *)records[i].ncaid, 0x10, ncaid, sizeof(ncaid));
+        hp_log("  %s %s, 0x%" PRIx64 " bytes\n", ncaid, info_get_content_record_type_name(records[i].type), cnmt_get_content_size(&records[i]));
+    }
+}
+
+static void info_free_ctx(info_ctx_t *ctx)
+{
+    for (uint32_t i = 0; i < ctx->num_files; i++)
+    {
+        info_file_t *file = &ctx->files[i];
+        for (uint32_t j = 0; j < file->num_entries; j++)
+        {
+            free(file->entries[j].name);
+            free(file->entries[j].cnmt);
+        }
+        free(file->entries);
+        free(file->path);
+    }
+    free(ctx->files);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+/* Reads the headers of an NCA or NSP, or of every one in a directory, and the cnmt of their meta NCAs, many files at once.
+   Writes them as JSON to json_file, or logs them if it's NULL. Returns the number of files that couldn't be read. */
+int info_run(hp_settings_t *settings, filepath_t *path, FILE *json_file)
+{
+#if __MINGW32__
+    struct __stat64 objstats;
+#else
+    struct stat objstats;
+#endif
+    info_ctx_t info_ctx;
+    memset(&info_ctx, 0, sizeof(info_ctx));
+    info_ctx.settings = settings;
+    if (os_char_stat(path->char_path, &objstats) == 0 && (objstats.st_mode & S_IFMT) == S_IFDIR)
+    {
+        info_visit_dir(&info_ctx, path->char_path, 0);
+        if (info_ctx.num_files > 1)
+            qsort(info_ctx.files, info_ctx.num_files, sizeof(info_file_t), info_compare_files);
+    }
+    else
+        info_add_file(&info_ctx, path->char_path);
+
+    uint32_t num_threads = settings->num_threads ? settings->num_threads : worker_get_cpu_count() * INFO_THREADS_PER_CPU;
+    hp_log("===> Reading headers of %" PRIu32 " files on %" PRIu32 " threads\n", info_ctx.num_files, num_threads);
+    double start_time = hp_get_time();
+    worker_run(info_job, &info_ctx, info_ctx.num_files, num_threads);
+    double seconds = hp_get_time() - start_time;
+
+    int num_failed = 0;
+    for (uint32_t i = 0; i < info_ctx.num_files; i++)
+    {
+        info_file_t *file = &info_ctx.files[i];
+        if (file->error != NULL)
+        {
+            hp_error("Error: %s: %s\n", file->path, file->error);
+            num_failed++;
+        }
+        else if (json_file == NULL)
+        {
+            hp_log("\n----> %s: %s, 0x%" PRIx64 " bytes\n", file->path, file->is_nsp ? "NSP" : "NCA", file->size);
+            for (uint32_t j = 0; j < file->num_entries; j++)
+            {
+                if (file->entries[j].is_nca)
+                    info_log_nca(file->is_nsp ? file->entries[j].name : file->path, &file->entries[j]);
+                else
+                    hp_log("%s: 0x%" PRIx64 " bytes\n", file->entries[j].name, file->entries[j].size);
+            }
+        }
+    }
+    if (json_file != NULL)
+        info_write_json(json_file, &info_ctx, num_failed);
+    hp_log("\n===> Read %" PRIu32 " files in %.2f s\n", info_ctx.num_files, seconds);
+    info_free_ctx(&info_ctx);
+    return num_failed;
+}
@@ -0,0 +1,13 @@
+#ifndef HACPACK_INFO_H
+#define HACPACK_INFO_H
+
+#include <stdio.h>
+#include "settings.h"
+#include "filepath.h"
+
+#define INFO_THREADS_PER_CPU 4 /* Jobs mostly wait on small reads, so more run than there are CPUs */
+#define INFO_MAX_DEPTH 0x40
+
+int info_run(hp_settings_t *settings, filepath_t *path, FILE *json_file);
+
+#endif
@@ -1,107 +1,156 @@
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #include "ivfc.h"
 #include "sha.h"
-#include "string.h"
+#include "fio.h"
 
-void ivfc_create_level(filepath_t *dst_level_file, filepath_t *src_level_file, uint64_t *out_size)
+#define IVFC_MAP_WINDOW_SIZE 0x4000000 // Level 6 is hashed in 64 MB windows
+
+/* Levels are always followed by padding, a full block when they are already aligned. */
+static uint64_t ivfc_get_padded_size(uint64_t size)
 {
-    FILE *src_file;
-    FILE *dst_file;
     uint64_t hash_block_size = IVFC_HASH_BLOCK_SIZE;
+    return size + hash_block_size - (size % hash_block_size);
+}
 
-    // Open files
-    src_file = os_fopen(src_level_file->os_path, OS_MODE_READ);
-    if (src_file == NULL)
-    {
-        fprintf(stderr, "Unable to open: %s", src_level_file->char_path);
-        exit(EXIT_FAILURE);
-    }
-    dst_file = os_fopen(dst_level_file->os_path, OS_MODE_WRITE);
-    if (dst_file == NULL)
+static uint64_t ivfc_get_hashes_size(uint64_t size)
+{
+    uint64_t hash_block_size = IVFC_HASH_BLOCK_SIZE;
+    return ((size + hash_block_size - 1) / hash_block_size) * 0x20;
+}
+
+static void ivfc_hash_blocks(const unsigned char *data, uint64_t size, unsigned char *out_hashes)
+{
+    uint64_t hash_block_size = IVFC_HASH_BLOCK_SIZE;
+    for (uint64_t ofs = 0; ofs < size; ofs += hash_block_size)
     {
-        fprintf(stderr, "Unable to open: %s", dst_level_file->char_path);
-        exit(EXIT_FAILURE);
+        uint64_t block_size = size - ofs < hash_block_size ? size - ofs : hash_block_size;
+        sha256_hash_buffer(out_hashes, data + ofs, block_size);
+        out_hashes += 0x20;
     }
+}
 
-    uint64_t read_size = hash_block_size;
-    uint64_t src_file_size;
-    unsigned char *hash = (unsigned char *)malloc(0x20);
-
-    // Get source file size
-    fseeko64(src_file, 0, SEEK_END);
-    src_file_size = ftello64(src_file);
-
-    unsigned char *buf = calloc(1, read_size);
-    fseeko64(src_file, 0, SEEK_SET);
-    fseeko64(dst_file, 0, SEEK_SET);
+/* Hashes a file region block by block, through a shared mapping where available. */
+static void ivfc_hash_file_region(int fd, uint64_t offset, uint64_t size, unsigned char *out_hashes)
+{
+    uint64_t ofs = 0;
 
-    if (buf == NULL)
+#ifndef _WIN32
+    uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    while (ofs < size)
     {
-        fprintf(stderr, "Failed to allocate file-read buffer!\n");
-        exit(EXIT_FAILURE);
+        uint64_t window_size = size - ofs < IVFC_MAP_WINDOW_SIZE ? size - ofs : IVFC_MAP_WINDOW_SIZE;
+        uint64_t map_offset = (offset + ofs) - ((offset + ofs) % page_size);
+        uint64_t map_delta = (offset + ofs) - map_offset;
+        void *map = mmap(NULL, (size_t)(window_size + map_delta), PROT_READ, MAP_SHARED, fd, (off_t)map_offset);
+        if (map == MAP_FAILED)
+            break;
+        ivfc_hash_blocks((unsigned char *)map + map_delta, window_size, out_hashes + ivfc_get_hashes_size(ofs));
+        munmap(map, (size_t)(window_size + map_delta));
+        ofs += window_size;
     }
-    uint64_t ofs = 0;
+#endif
 
-    while (ofs < src_file_size)
+    // Fall back to reads when the region can't be mapped
+    if (ofs < size)
     {
-        sha_ctx_t *sha_ctx = new_sha_ctx(HASH_TYPE_SHA256, 0);
-        if (ofs + read_size >= src_file_size)
-            read_size = src_file_size - ofs;
-        if (fread(buf, 1, read_size, src_file) != read_size)
+        unsigned char *buf = hp_track_buffer(malloc(IVFC_MAP_WINDOW_SIZE));
+        if (buf == NULL)
         {
-            fprintf(stderr, "Failed to read file!\n");
-            exit(EXIT_FAILURE);
+            hp_error("Failed to allocate file-read buffer!\n");
+            hp_exit_failure();
         }
-        sha_update(sha_ctx, buf, read_size);
-        sha_get_hash(sha_ctx, hash);
-        fwrite(hash, 0x20, 1, dst_file);
-        free_sha_ctx(sha_ctx);
-        ofs += read_size;
+        while (ofs < size)
+        {
+            uint64_t read_size = size - ofs < IVFC_MAP_WINDOW_SIZE ? size - ofs : IVFC_MAP_WINDOW_SIZE;
+            if (fio_pread(fd, buf, read_size, offset + ofs) != 0)
+            {
+                hp_error("Failed to read file!\n");
+                hp_exit_failure();
+            }
+            ivfc_hash_blocks(buf, read_size, out_hashes + ivfc_get_hashes_size(ofs));
+            ofs += read_size;
+        }
+        hp_free(buf);
     }
+}
 
-    uint64_t curr_offset = (uint64_t)ftello64(dst_file);
-    uint64_t padding_size = hash_block_size - (curr_offset % hash_block_size);
-    if (padding_size != 0)
+/* Fills the level headers for data_size bytes of level 6 data, returns the level 6 offset within the section. */
+uint64_t ivfc_calculate_layout(ivfc_hdr_t *ivfc_header, uint64_t data_size)
+{
+    uint64_t level_sizes[IVFC_MAX_LEVEL];
+    uint64_t padded_size = ivfc_get_padded_size(data_size);
+    level_sizes[IVFC_MAX_LEVEL - 1] = data_size;
+    for (int i = IVFC_MAX_LEVEL - 2; i >= 0; i--)
     {
-        unsigned char *padding_buf = (unsigned char*)calloc(1, padding_size);
-        fwrite(padding_buf, 1, padding_size, dst_file);
-        free(padding_buf);
+        level_sizes[i] = ivfc_get_padded_size(ivfc_get_hashes_size(padded_size));
+        padded_size = level_sizes[i];
     }
 
-    *out_size = (uint64_t)ftello64(dst_file);
-
-    free(buf);
-    fclose(src_file);
-    fclose(dst_file);
+    uint64_t logical_offset = 0;
+    for (int i = 0; i < IVFC_MAX_LEVEL; i++)
+    {
+        ivfc_header->level_headers[i].logical_offset = logical_offset;
+        ivfc_header->level_headers[i].hash_data_size = level_sizes[i];
+        ivfc_header->level_headers[i].block_size = 0x0E; // 0x4000
+        logical_offset += level_sizes[i];
+    }
+    return ivfc_header->level_headers[IVFC_MAX_LEVEL - 1].logical_offset;
 }
 
-void ivfc_calculate_master_hash(filepath_t *ivfc_level1_filepath, uint8_t *out_master_hash)
+/* Pads level 6, already written at its offset in the section, then writes levels 1-5 in front of it and sets the master hash. */
+void ivfc_create_levels(FILE *file, uint64_t section_offset, ivfc_hdr_t *ivfc_header)
 {
-    uint64_t size;
-    FILE *ivfc_level1_file;
-    ivfc_level1_file = os_fopen(ivfc_level1_filepath->os_path, OS_MODE_READ);
-    if (ivfc_level1_file == NULL)
+    ivfc_level_hdr_t *data_level = &ivfc_header->level_headers[IVFC_MAX_LEVEL - 1];
+    uint64_t data_offset = section_offset + data_level->logical_offset;
+    uint64_t padded_size = ivfc_get_padded_size(data_level->hash_data_size);
+
+    // Write level 6 padding
+    uint64_t padding_size = padded_size - data_level->hash_data_size;
+    unsigned char *padding_buf = (unsigned char *)calloc(1, padding_size);
+    fseeko64(file, data_offset + data_level->hash_data_size, SEEK_SET);
+    if (padding_buf == NULL || fwrite(padding_buf, 1, padding_size, file) != padding_size)
+    {
+        hp_error("Failed to write IVFC padding!\n");
+        hp_exit_failure();
+    }
+    free(padding_buf);
+    fflush(file);
+
+    unsigned char *levels[IVFC_MAX_LEVEL - 1];
+    for (int i = 0; i < IVFC_MAX_LEVEL - 1; i++)
     {
-        fprintf(stderr, "Unable to open: %s", ivfc_level1_filepath->char_path);
-        exit(EXIT_FAILURE);
+        levels[i] = calloc(1, ivfc_header->level_headers[i].hash_data_size);
+        if (levels[i] == NULL)
+        {
+            hp_error("Failed to allocate IVFC level buffer!\n");
+            hp_exit_failure();
+        }
     }
 
-    // Get file size
-    fseeko64(ivfc_level1_file, 0, SEEK_END);
-    size = (uint64_t)ftello64(ivfc_level1_file);
-    fseeko64(ivfc_level1_file, 0, SEEK_SET);
-    
-    // Calculate hash
-    unsigned char *buf = (unsigned char*)malloc(size);
-    sha_ctx_t *sha_ctx = new_sha_ctx(HASH_TYPE_SHA256, 0);
-    if (fread(buf, 1, size, ivfc_level1_file) != size)
+    // Level 5 is the only one hashed from the file, the smaller levels are hashed in memory
+    hp_log("Hashing level 6\n");
+    ivfc_hash_file_region(fileno(file), data_offset, padded_size, levels[IVFC_MAX_LEVEL - 2]);
+    for (int i = IVFC_MAX_LEVEL - 3; i >= 0; i--)
+        ivfc_hash_blocks(levels[i + 1], ivfc_header->level_headers[i + 1].hash_data_size, levels[i]);
+
+    for (int i = 0; i < IVFC_MAX_LEVEL - 1; i++)
     {
-        fprintf(stderr, "Failed to read file: %s!\n", ivfc_level1_filepath->char_path);
-        exit(EXIT_FAILURE);
+        hp_log("Writing level %i\n", i + 1);
+        fseeko64(file, section_offset + ivfc_header->level_headers[i].logical_offset, SEEK_SET);
+        if (fwrite(levels[i], 1, ivfc_header->level_headers[i].hash_data_size, file) != ivfc_header->level_headers[i].hash_data_size)
+        {
+            hp_error("Failed to write IVFC level %i!\n", i + 1);
+            hp_exit_failure();
+        }
     }
-    sha_update(sha_ctx, buf, size);
-    sha_get_hash(sha_ctx, (unsigned char*)out_master_hash);
 
-    free_sha_ctx(sha_ctx);
-    free(buf);
-    fclose(ivfc_level1_file);
-}
\ No newline at end of file
+    sha256_hash_buffer(ivfc_header->master_hash, levels[0], ivfc_header->level_headers[0].hash_data_size);
+    for (int i = 0; i < IVFC_MAX_LEVEL - 1; i++)
+        free(levels[i]);
+    fseeko64(file, 0, SEEK_END);
+}
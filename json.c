@@ -0,0 +1,377 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json.h"
+#include "utils.h"
+
+#define JSON_MAX_DEPTH 64
+
+typedef struct
+{
+    const char *text;
+    size_t pos;
+    char *error;
+    size_t error_size;
+} json_parser_t;
+
+static int json_parse_value(json_parser_t *parser, json_value_t *value, uint32_t depth);
+
+static int json_fail(json_parser_t *parser, const char *message)
+{
+    if (parser->error != NULL && parser->error_size > 0)
+        snprintf(parser->error, parser->error_size, "%s at offset %zu", message, parser->pos);
+    return -1;
+}
+
+static void json_skip_whitespace(json_parser_t *parser)
+{
+    while (parser->text[parser->pos] == ' ' || parser->text[parser->pos] == '\t' || parser->text[parser->pos] == '\r' || parser->text[parser->pos] == '\n')
+        parser->pos++;
+}
+
+static int json_parse_hex4(json_parser_t *parser, uint32_t *out)
+{
+    *out = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        char c = parser->text[parser->pos++];
+        *out <<= 4;
+        if (c >= '0' && c <= '9')
+            *out |= (uint32_t)(c - '0');
+        else if (c >= 'a' && c <= 'f')
+            *out |= (uint32_t)(c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F')
+            *out |= (uint32_t)(c - 'A' + 10);
+        else
+            return json_fail(parser, "Bad unicode escape");
+    }
+    return 0;
+}
+
+/* Parses a string literal, escapes are decoded and \u sequences are stored as UTF-8. */
+static int json_parse_string(json_parser_t *parser, char **out)
+{
+    parser->pos++; // Opening quote
+    size_t start = parser->pos;
+    size_t len = 0;
+    while (parser->text[start + len] != '"')
+    {
+        if (parser->text[start + len] == '\0')
+            return json_fail(parser, "Unterminated string");
+        if (parser->text[start + len] == '\\' && parser->text[start + len + 1] != '\0')
+            len++;
+        len++;
+    }
+
+    // Decoded text never grows beyond the escaped one
+    char *s = malloc(len + 1);
+    if (s == NULL)
+    {
+        hp_error("Failed to allocate JSON string!\n");
+        hp_exit_failure();
+    }
+    size_t n = 0;
+    while (parser->text[parser->pos] != '"')
+    {
+        char c = parser->text[parser->pos++];
+        if ((unsigned char)c < 0x20)
+        {
+            free(s);
+            return json_fail(parser, "Control character in string");
+        }
+        if (c != '\\')
+        {
+            s[n++] = c;
+            continue;
+        }
+        c = parser->text[parser->pos++];
+        switch (c)
+        {
+        case '"':
+        case '\\':
+        case '/':
+            s[n++] = c;
+            break;
+        case 'b':
+            s[n++] = '\b';
+            break;
+        case 'f':
+            s[n++] = '\f';
+            break;
+        case 'n':
+            s[n++] = '\n';
+            break;
+        case 'r':
+            s[n++] = '\r';
+            break;
+        case 't':
+            s[n++] = '\t';
+            break;
+        case 'u':
+        {
+            uint32_t cp;
+            if (json_parse_hex4(parser, &cp) != 0)
+            {
+                free(s);
+                return -1;
+            }
+            if (cp >= 0xD800 && cp <= 0xDBFF && parser->text[parser->pos] == '\\' && parser->text[parser->pos + 1] == 'u')
+            {
+                uint32_t low;
+                parser->pos += 2;
+                if (json_parse_hex4(parser, &low) != 0 || low < 0xDC00 || low > 0xDFFF)
+                {
+                    free(s);
+                    return json_fail(parser, "Bad surrogate pair");
+                }
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+            }
+            if (cp < 0x80)
+                s[n++] = (char)cp;
+            else if (cp < 0x800)
+            {
+                s[n++] = (char)(0xC0 | (cp >> 6));
+                s[n++] = (char)(0x80 | (cp & 0x3F));
+            }
+            else if (cp < 0x10000)
+            {
+                s[n++] = (char)(0xE0 | (cp >> 12));
+                s[n++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+                s[n++] = (char)(0x80 | (cp & 0x3F));
+            }
+            else
+            {
+                s[n++] = (char)(0xF0 | (cp >> 18));
+                s[n++] = (char)(0x80 | ((cp >> 12) & 0x3F));
+                s[n++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+                s[n++] = (char)(0x80 | (cp & 0x3F));
+            }
+            break;
+        }
+        default:
+            free(s);
+            return json_fail(parser, "Bad escape");
+        }
+    }
+    parser->pos++; // Closing quote
+    s[n] = '\0';
+    *out = s;
+    return 0;
+}
+
+static void json_add_item(json_value_t *container, uint32_t *capacity)
+{
+    if (container->num_items == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 8;
+        json_value_t *items = realloc(container->items, *capacity * sizeof(json_value_t));
+        if (items == NULL)
+        {
+            hp_error("Failed to allocate JSON items!\n");
+            hp_exit_failure();
+        }
+        container->items = items;
+    }
+    memset(&container->items[container->num_items], 0, sizeof(json_value_t));
+    container->num_items++;
+}
+
+static int json_parse_container(json_parser_t *parser, json_value_t *value, uint32_t depth)
+{
+    char close = parser->text[parser->pos] == '{' ? '}' : ']';
+    uint32_t capacity = 0;
+    value->type = close == '}' ? JSON_OBJECT : JSON_ARRAY;
+    parser->pos++;
+    json_skip_whitespace(parser);
+    if (parser->text[parser->pos] == close)
+    {
+        parser->pos++;
+        return 0;
+    }
+
+    while (1)
+    {
+        json_add_item(value, &capacity);
+        json_value_t *item = &value->items[value->num_items - 1];
+        json_skip_whitespace(parser);
+        if (value->type == JSON_OBJECT)
+        {
+            if (parser->text[parser->pos] != '"')
+                return json_fail(parser, "Expected member name");
+            if (json_parse_string(parser, &item->key) != 0)
+                return -1;
+            json_skip_whitespace(parser);
+            if (parser->text[parser->pos] != ':')
+                return json_fail(parser, "Expected ':'");
+            parser->pos++;
+        }
+        if (json_parse_value(parser, item, depth + 1) != 0)
+            return -1;
+        json_skip_whitespace(parser);
+        if (parser->text[parser->pos] == ',')
+        {
+            parser->pos++;
+            continue;
+        }
+        if (parser->text[parser->pos] == close)
+        {
+            parser->pos++;
+            return 0;
+        }
+        return json_fail(parser, close == '}' ? "Expected ',' or '}'" : "Expected ',' or ']'");
+    }
+}
+
+static int json_parse_literal(json_parser_t *parser, const char *literal)
+{
+    size_t len = strlen(literal);
+    if (strncmp(&parser->text[parser->pos], literal, len) != 0)
+        return json_fail(parser, "Unexpected token");
+    parser->pos += len;
+    return 0;
+}
+
+static int json_parse_value(json_parser_t *parser, json_value_t *value, uint32_t depth)
+{
+    if (depth > JSON_MAX_DEPTH)
+        return json_fail(parser, "Nesting too deep");
+    json_skip_whitespace(parser);
+    char c = parser->text[parser->pos];
+    if (c == '{' || c == '[')
+        return json_parse_container(parser, value, depth);
+    if (c == '"')
+    {
+        value->type = JSON_STRING;
+        return json_parse_string(parser, &value->string);
+    }
+    if (c == 't' || c == 'f')
+    {
+        value->type = JSON_BOOL;
+        value->boolean = c == 't';
+        return json_parse_literal(parser, c == 't' ? "true" : "false");
+    }
+    if (c == 'n')
+    {
+        value->type = JSON_NULL;
+        return json_parse_literal(parser, "null");
+    }
+    if (c == '-' || (c >= '0' && c <= '9'))
+    {
+        // Numbers are kept as text, they are only ever passed on as option values
+        size_t start = parser->pos;
+        while (strchr("+-0123456789.eE", parser->text[parser->pos]) != NULL && parser->text[parser->pos] != '\0')
+            parser->pos++;
+        value->type = JSON_NUMBER;
+        value->string = malloc(parser->pos - start + 1);
+        if (value->string == NULL)
+        {
+            hp_error("Failed to allocate JSON string!\n");
+            hp_exit_failure();
+        }
+        memcpy(value->string, &parser->text[start], parser->pos - start);
+        value->string[parser->pos - start] = '\0';
+        return 0;
+    }
+    return json_fail(parser, "Unexpected token");
+}
+
+static void json_free_items(json_value_t *value)
+{
+    for (uint32_t i = 0; i < value->num_items; i++)
+        json_free_items(&value->items[i]);
+    free(value->items);
+    free(value->key);
+    free(value->string);
+}
+
+/* Parses a complete JSON document, returns NULL and fills error on failure. */
+json_value_t *json_parse(const char *text, char *error, size_t error_size)
+{
+    json_parser_t parser = {text, 0, error, error_size};
+    json_value_t *value = calloc(1, sizeof(json_value_t));
+    if (value == NULL)
+    {
+        hp_error("Failed to allocate JSON value!\n");
+        hp_exit_failure();
+    }
+    if (json_parse_value(&parser, value, 0) == 0)
+    {
+        json_skip_whitespace(&parser);
+        if (parser.text[parser.pos] == '\0')
+            return value;
+        json_fail(&parser, "Trailing characters");
+    }
+    json_free(value);
+    return NULL;
+}
+
+json_value_t *json_parse_file(FILE *f, char *error, size_t error_size)
+{
+    size_t size = 0;
+    size_t capacity = 0x10000;
+    char *text = malloc(capacity);
+    while (text != NULL)
+    {
+        size += fread(text + size, 1, capacity - size - 1, f);
+        if (size < capacity - 1)
+            break;
+        capacity *= 2;
+        char *grown = realloc(text, capacity);
+        if (grown == NULL)
+            free(text);
+        text = grown;
+    }
+    if (text == NULL)
+    {
+        hp_error("Failed to allocate JSON text!\n");
+        hp_exit_failure();
+    }
+    text[size] = '\0';
+    json_value_t *value = json_parse(text, error, error_size);
+    free(text);
+    return value;
+}
+
+/* Returns the member named key of an object, or NULL. */
+json_value_t *json_get(json_value_t *object, const char *key)
+{
+    if (object == NULL || object->type != JSON_OBJECT)
+        return NULL;
+    for (uint32_t i = 0; i < object->num_items; i++)
+    {
+        if (strcmp(object->items[i].key, key) == 0)
+            return &object->items[i];
+    }
+    return NULL;
+}
+
+void json_free(json_value_t *value)
+{
+    if (value == NULL)
+        return;
+    json_free_items(value);
+    free(value);
+}
+
+/* Writes s as a quoted JSON string. */
+void json_write_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s != '\0'; s++)
+    {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c == '\n')
+            fputs("\\n", f);
+        else if (c == '\r')
+            fputs("\\r", f);
+        else if (c == '\t')
+            fputs("\\t", f);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
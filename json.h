@@ -0,0 +1,33 @@
+#ifndef HACPACK_JSON_H
+#define HACPACK_JSON_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef enum
+{
+    JSON_NULL = 0,
+    JSON_BOOL = 1,
+    JSON_NUMBER = 2,
+    JSON_STRING = 3,
+    JSON_ARRAY = 4,
+    JSON_OBJECT = 5
+} json_type_t;
+
+typedef struct json_value
+{
+    json_type_t type;
+    char *key;    /* Member name when the value is inside an object. */
+    char *string; /* Unescaped string, or the literal text of a number. */
+    uint8_t boolean;
+    struct json_value *items; /* Array elements or object members. */
+    uint32_t num_items;
+} json_value_t;
+
+json_value_t *json_parse(const char *text, char *error, size_t error_size);
+json_value_t *json_parse_file(FILE *f, char *error, size_t error_size);
+json_value_t *json_get(json_value_t *object, const char *key);
+void json_free(json_value_t *value);
+void json_write_string(FILE *f, const char *s);
+
+#endif
@@ -0,0 +1,153 @@
+#include <string.h>
+#include "lz4.h"
+
+static uint32_t lz4_read32(const unsigned char *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz4_hash(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/* Writes the rest of a length that didn't fit in its token nibble. */
+static unsigned char *lz4_write_length(unsigned char *op, uint32_t length)
+{
+    for (; length >= 0xFF; length -= 0xFF)
+        *op++ = 0xFF;
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+/* Appends a sequence, match_length 0 writes the last literals of the block. Returns NULL if it doesn't fit. */
+static unsigned char *lz4_write_sequence(unsigned char *op, unsigned char *op_end, const unsigned char *literals, uint32_t literal_length, uint32_t offset, uint32_t match_length)
+{
+    uint64_t needed = 1 + (literal_length / 0xFF + 1) + literal_length + (match_length ? 2 + (match_length / 0xFF + 1) : 0);
+    if (needed > (uint64_t)(op_end - op))
+        return NULL;
+
+    unsigned char *token = op++;
+    *token = (unsigned char)((literal_length >= 0xF ? 0xF : literal_length) << 4);
+    if (literal_length >= 0xF)
+        op = lz4_write_length(op, literal_length - 0xF);
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+    if (match_length == 0)
+        return op;
+
+    *op++ = (unsigned char)(offset & 0xFF);
+    *op++ = (unsigned char)(offset >> 8);
+    match_length -= LZ4_MIN_MATCH;
+    *token |= (unsigned char)(match_length >= 0xF ? 0xF : match_length);
+    if (match_length >= 0xF)
+        op = lz4_write_length(op, match_length - 0xF);
+    return op;
+}
+
+/* Compresses src as one LZ4 block, greedy matching on a hash of 4 byte sequences.
+   Returns the compressed size, 0 if it doesn't fit in dst_capacity. */
+uint32_t lz4_compress_block(lz4_ctx_t *ctx, const unsigned char *src, uint32_t src_size, unsigned char *dst, uint32_t dst_capacity)
+{
+    unsigned char *op = dst;
+    unsigned char *op_end = dst + dst_capacity;
+    uint32_t anchor = 0;
+
+    if (src_size > LZ4_MATCH_LIMIT)
+    {
+        // Positions are stored plus one, zero is an empty slot
+        memset(ctx->table, 0, sizeof(ctx->table));
+        uint32_t match_end_limit = src_size - LZ4_LAST_LITERALS;
+        uint32_t search_limit = src_size - LZ4_MATCH_LIMIT;
+        uint32_t misses = 0;
+        uint32_t ip = 0;
+        while (ip <= search_limit)
+        {
+            uint32_t sequence = lz4_read32(src + ip);
+            uint32_t hash = lz4_hash(sequence);
+            uint32_t ref = ctx->table[hash];
+            ctx->table[hash] = ip + 1;
+            if (ref == 0 || ip - (ref - 1) > LZ4_MAX_DISTANCE || lz4_read32(src + ref - 1) != sequence)
+            {
+                // Skip ahead faster through data that doesn't match
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+
+            uint32_t match = ref - 1;
+            uint32_t match_length = LZ4_MIN_MATCH;
+            while (ip + match_length < match_end_limit && src[ip + match_length] == src[match + match_length])
+                match_length++;
+
+            op = lz4_write_sequence(op, op_end, src + anchor, ip - anchor, ip - match, match_length);
+            if (op == NULL)
+                return 0;
+            ip += match_length;
+            anchor = ip;
+            misses = 0;
+        }
+    }
+
+    op = lz4_write_sequence(op, op_end, src + anchor, src_size - anchor, 0, 0);
+    if (op == NULL)
+        return 0;
+    return (uint32_t)(op - dst);
+}
+
+/* Reads the rest of a length that didn't fit in its token nibble. Returns 0 if the block ends first. */
+static int lz4_read_length(const unsigned char **ip, const unsigned char *ip_end, uint32_t *length)
+{
+    unsigned char byte;
+    do
+    {
+        if (*ip == ip_end)
+            return 0;
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 0xFF);
+    return 1;
+}
+
+/* Decompresses one LZ4 block written by lz4_compress_block or any other LZ4 block compressor.
+   Returns the decompressed size, 0 if the block is malformed or doesn't fit in dst_capacity. */
+uint32_t lz4_decompress_block(const unsigned char *src, uint32_t src_size, unsigned char *dst, uint32_t dst_capacity)
+{
+    const unsigned char *ip = src;
+    const unsigned char *ip_end = src + src_size;
+    uint32_t op = 0;
+
+    while (ip < ip_end)
+    {
+        unsigned char token = *ip++;
+        uint32_t literal_length = token >> 4;
+        if (literal_length == 0xF && !lz4_read_length(&ip, ip_end, &literal_length))
+            return 0;
+        if (literal_length > (uint32_t)(ip_end - ip) || literal_length > dst_capacity - op)
+            return 0;
+        memcpy(dst + op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+        // The last sequence of a block only has literals
+        if (ip == ip_end)
+            break;
+
+        if (ip_end - ip < 2)
+            return 0;
+        uint32_t offset = (uint32_t)ip[0] | ((uint32_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op)
+            return 0;
+        uint32_t match_length = token & 0xF;
+        if (match_length == 0xF && !lz4_read_length(&ip, ip_end, &match_length))
+            return 0;
+        match_length += LZ4_MIN_MATCH;
+        if (match_length > dst_capacity - op)
+            return 0;
+        // Matches may overlap the bytes they produce, so they're copied forward one byte at a time
+        for (uint32_t i = 0; i < match_length; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+    return op;
+}
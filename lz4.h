@@ -0,0 +1,21 @@
+#ifndef HACPACK_LZ4_H
+#define HACPACK_LZ4_H
+
+#include <stdint.h>
+
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 /* Bytes at the end of a block that are always literals */
+#define LZ4_MATCH_LIMIT 12  /* Last match starts at least this many bytes before the end */
+#define LZ4_MAX_DISTANCE 0xFFFF
+
+/* Match finder state, allocated once per compression job and reused across its blocks. */
+typedef struct
+{
+    uint32_t table[1 << LZ4_HASH_BITS];
+} lz4_ctx_t;
+
+uint32_t lz4_compress_block(lz4_ctx_t *ctx, const unsigned char *src, uint32_t src_size, unsigned char *dst, uint32_t dst_capacity);
+uint32_t lz4_decompress_block(const unsigned char *src, uint32_t src_size, unsigned char *dst, uint32_t dst_capacity);
+
+#endif
@@ -11,6 +11,13 @@
 #include "nacp.h"
 #include "npdm.h"
 #include "pfs0.h"
+#include "nsp.h"
+#include "fio.h"
+#include "report.h"
+#include "batch.h"
+#include "serve.h"
+#include "hacpack.h"
+#include "info.h"
 
 /* hacPack by The-4n */
 
@@ -21,13 +28,30 @@ static void usage(void)
             "Usage: %s [options...]\n\n"
             "Options:\n"
             "General options:\n"
-            "-o, --outdir             Set output directory\n"
+            "-o, --outdir             Set output directory, - streams nsp to stdout\n"
             "-k, --keyset             Set keyset filepath, default filepath is ." OS_PATH_SEPARATOR "keys.dat\n"
             "-h, --help               Display usage\n"
+            "--threads                Set number of worker threads, default is the number of CPUs\n"
+            "--diskjobs               Set number of disk heavy build steps run at the same time, default is 2\n"
+            "--batch                  Build every job of a JSON manifest, results are written to stdout as JSON\n"
+            "--batchmemory            Set memory budget of batch jobs in MB, each job is counted as 256 MB\n"
+            "--serve                  Serve build requests on a Unix socket with the keyset kept loaded\n"
+            "--connect                Send a build request to a --serve socket, use with --request\n"
+            "--request                Set JSON file of the build request sent by --connect\n"
+            "--rekey                  Re-encrypt an existing nca with --keygeneration, --keyareakey or --titlekey, hashes are kept\n"
+            "--rekeytitlekey          Set Titlekey of the nca given to --rekey if it uses titlekey crypto\n"
+            "--patchheader            Patch header fields of an existing nca in place [--disttype, --sdkversion, --keygeneration, --ncasig]\n"
+            "--verify                 Check hashes of an existing nca, or the ncas of an nsp against its cnmt\n"
+            "--extract                Unpack an nsp, the sections of an nca or a romfs image to the output directory\n"
+            "--info                   Print headers and cnmt of an nca, an nsp or every one in a directory\n"
+            "--json                   Write --info as JSON to stdout\n"
             "--type                   Set file type [nca, nsp]\n"
-            "--titleid                Set titleid\n"
+            "--titleid                Set titleid\n",
+            USAGE_PROGRAM_NAME);
+    // Split in parts, a single literal would exceed the length compilers are required to support
+    fprintf(stderr,
             "NCA required options:\n"
-            "--ncatype                Set nca type if file type is nca [program, control, manual, data, publicdata, meta]\n"
+            "--ncatype                Set nca type if file type is nca [program, control, manual, data, publicdata, meta, application]\n"
             "NCA general options:\n"
             "--tempdir                Set temp directory filepath, default filepath is ." OS_PATH_SEPARATOR "hacbpack_temp" OS_PATH_SEPARATOR "\n"
             "--backupdir              Set backup directory filepath, default filepath is ." OS_PATH_SEPARATOR "hacbpack_backup" OS_PATH_SEPARATOR "\n"
@@ -38,6 +62,13 @@ static void usage(void)
             "--ncasig                 Set nca signature type [zero, static, random]. Default is zero\n"
             "--disttype               Set nca distribution type [download, gamecard]. Default is download\n"
             "--ncasig1privatekey      Set private key filepath for signing nca signature 1 with PEM format\n"
+            "--variants               Set JSON file of header and crypto variants written from the same built nca\n"
+            "--baseromfs              Build romfs from an existing nca or romfs image, --romfsdir is merged over it\n"
+            "--basetitlekey           Set Titlekey of the nca given to --baseromfs if it uses titlekey crypto\n"
+            "--compressromfs          Store romfs LZ4 compressed in blocks, needs firmware that reads compressed ncas\n"
+            "--cachedir               Reuse NCAs built from the same inputs and settings from this cache directory\n"
+            "--cachesize              Set cache size limit in MB, least recently used NCAs are evicted\n"
+            "--cacheverify            Rebuild this percentage of cache hits and compare them with the cached NCA\n"
             "Program NCA options:\n"
             "--exefsdir               Set program exefs directory path\n"
             "--romfsdir               Set program romfs directory path\n"
@@ -47,6 +78,7 @@ static void usage(void)
             "--ncasig2privatekey      Set private key filepath for signing nca signature 2 with PEM format\n"
             "--ncasig2modulus         Set modulus filepath for signing nca signature 2\n"
             "--nosignncasig2          Skip patching acid public key in npdm and signing nca header with self-signed keys\n"
+            "--bktr                   Write romfs as a patch of the nca given to --baseromfs, only changed data is stored\n"
             "Control NCA options:\n"
             "--romfsdir               Set control romfs directory path\n"
             "Manual NCA options:\n"
@@ -67,100 +99,101 @@ static void usage(void)
             "--datanca                Set data nca path\n"
             "--cnmt                   Set cnmt path\n"
             "--digest                 Set cnmt digest\n"
+            "--verifysidecars         Hash input ncas even if their hash sidecars are up to date\n");
+    fprintf(stderr,
+            "Application options (--ncatype application, or nsp without --ncadir):\n"
+            "--exefsdir               Set program exefs directory path, --romfsdir and --logodir are used as in program nca\n"
+            "--controldir             Set control romfs directory path\n"
+            "--htmldocdir             Set offline manual romfs directory path\n"
+            "--legaldir               Set legal information romfs directory path\n"
             "NSP options:\n"
-            "--ncadir                 Set input nca directory path\n",
-            USAGE_PROGRAM_NAME);
+            "--ncadir                 Set input nca directory path\n"
+            "--nspsplit               Split nsp into 0xFFFF0000 bytes parts while writing [parts, dir]\n"
+            "--nspoutfd               Stream nsp to an open file descriptor instead of output directory\n"
+            "--nsz                    Write nsz with zstd compressed ncz instead of nsp, needs hacPack built with ZSTD=1\n"
+            "--nszlevel               Set zstd compression level of --nsz, default is 18\n");
     exit(EXIT_FAILURE);
 }
 
-int main(int argc, char **argv)
-{
-    hp_settings_t settings;
-    memset(&settings, 0, sizeof(settings));
-
-    printf("hacPack %s by The-4n\n\n", HACPACK_VERSION);
-
-    filepath_init(&settings.out_dir);
-    filepath_init(&settings.exefs_dir);
-    filepath_init(&settings.romfs_dir);
-    filepath_init(&settings.logo_dir);
-    filepath_init(&settings.programnca);
-    filepath_init(&settings.controlnca);
-    filepath_init(&settings.legalnca);
-    filepath_init(&settings.htmldocnca);
-    filepath_init(&settings.datanca);
-    filepath_init(&settings.publicdatanca);
-    filepath_init(&settings.metanca);
-    filepath_init(&settings.ncadir);
-    filepath_init(&settings.cnmt);
-    filepath_init(&settings.acid_sig_private_key);
-    filepath_init(&settings.nca_sig1_private_key);
-    filepath_init(&settings.nca_sig2_private_key);
-    filepath_init(&settings.nca_sig2_modulus);
-
-    // Hardcode default temp directory
-    filepath_init(&settings.temp_dir);
-    filepath_set(&settings.temp_dir, "hacpack_temp");
-
-    // Hardcode default backup directory
-    filepath_init(&settings.backup_dir);
-    filepath_set(&settings.backup_dir, "hacpack_backup");
-
-    // Keyset
-    filepath_t keypath;
-    filepath_init(&keypath);
-    pki_initialize_keyset(&settings.keyset);
-
-    // Default Settings
-    settings.keygeneration = 1;
-    settings.sdk_version = 0x000C1100;
-    settings.keyareakey = (unsigned char *)calloc(1, 0x10);
-    memset(settings.keyareakey, 4, 0x10);
+static struct option long_options[] =
+    {
+        {"keyset", 1, NULL, 'k'},
+        {"help", 0, NULL, 'h'},
+        {"outdir", 1, NULL, 'o'},
+        {"type", 1, NULL, 1},
+        {"ncatype", 1, NULL, 2},
+        {"titletype", 1, NULL, 3},
+        {"tempdir", 1, NULL, 4},
+        {"exefsdir", 1, NULL, 5},
+        {"romfsdir", 1, NULL, 6},
+        {"logodir", 1, NULL, 7},
+        {"programnca", 1, NULL, 8},
+        {"controlnca", 1, NULL, 9},
+        {"legalnca", 1, NULL, 10},
+        {"htmldocnca", 1, NULL, 11},
+        {"metanca", 1, NULL, 12},
+        {"disttype", 1, NULL, 13},
+        {"noselfsignncasig2", 0, NULL, 14},
+        {"plaintext", 0, NULL, 15},
+        {"keygeneration", 1, NULL, 16},
+        {"sdkversion", 1, NULL, 17},
+        {"keyareakey", 1, NULL, 18},
+        {"titleid", 1, NULL, 19},
+        {"datanca", 1, NULL, 20},
+        {"publicdatanca", 1, NULL, 21},
+        {"ncadir", 1, NULL, 22},
+        {"digest", 1, NULL, 23},
+        {"titleversion", 1, NULL, 24},
+        {"cnmt", 1, NULL, 25},
+        {"titlekey", 1, NULL, 26},
+        {"backupdir", 1, NULL, 27},
+        {"ncasig1privatekey", 1, NULL, 28},
+        {"acidsigprivatekey", 1, NULL, 29},
+        {"ncasig", 1, NULL, 30},
+        {"ncasig2privatekey", 1, NULL, 31},
+        {"ncasig2modulus", 1, NULL, 32},
+        {"threads", 1, NULL, 33},
+        {"nspsplit", 1, NULL, 34},
+        {"nspoutfd", 1, NULL, 35},
+        {"controldir", 1, NULL, 36},
+        {"legaldir", 1, NULL, 37},
+        {"htmldocdir", 1, NULL, 38},
+        {"verifysidecars", 0, NULL, 39},
+        {"batch", 1, NULL, 40},
+        {"batchmemory", 1, NULL, 41},
+        {"serve", 1, NULL, 42},
+        {"connect", 1, NULL, 43},
+        {"request", 1, NULL, 44},
+        {"diskjobs", 1, NULL, 45},
+        {"cachedir", 1, NULL, 46},
+        {"cachesize", 1, NULL, 47},
+        {"cacheverify", 1, NULL, 48},
+        {"rekey", 1, NULL, 49},
+        {"rekeytitlekey", 1, NULL, 50},
+        {"patchheader", 1, NULL, 51},
+        {"variants", 1, NULL, 52},
+        {"baseromfs", 1, NULL, 53},
+        {"basetitlekey", 1, NULL, 54},
+        {"bktr", 0, NULL, 55},
+        {"compressromfs", 0, NULL, 56},
+        {"nsz", 0, NULL, 57},
+        {"nszlevel", 1, NULL, 58},
+        {"verify", 1, NULL, 59},
+        {"extract", 1, NULL, 60},
+        {"info", 1, NULL, 61},
+        {"json", 0, NULL, 62},
+        {NULL, 0, NULL, 0},
+};
 
-    // Parse options
+static void parse_options(int argc, char **argv, hp_settings_t *settings, filepath_t *keypath)
+{
+    // Restart getopt, batch jobs parse their own argument lists
+    optind = 0;
     while (1)
     {
         int option_index;
         int c;
-        static struct option long_options[] =
-            {
-                {"keyset", 1, NULL, 'k'},
-                {"help", 0, NULL, 'h'},
-                {"outdir", 1, NULL, 'o'},
-                {"type", 1, NULL, 1},
-                {"ncatype", 1, NULL, 2},
-                {"titletype", 1, NULL, 3},
-                {"tempdir", 1, NULL, 4},
-                {"exefsdir", 1, NULL, 5},
-                {"romfsdir", 1, NULL, 6},
-                {"logodir", 1, NULL, 7},
-                {"programnca", 1, NULL, 8},
-                {"controlnca", 1, NULL, 9},
-                {"legalnca", 1, NULL, 10},
-                {"htmldocnca", 1, NULL, 11},
-                {"metanca", 1, NULL, 12},
-                {"disttype", 1, NULL, 13},
-                {"noselfsignncasig2", 0, NULL, 14},
-                {"plaintext", 0, NULL, 15},
-                {"keygeneration", 1, NULL, 16},
-                {"sdkversion", 1, NULL, 17},
-                {"keyareakey", 1, NULL, 18},
-                {"titleid", 1, NULL, 19},
-                {"datanca", 1, NULL, 20},
-                {"publicdatanca", 1, NULL, 21},
-                {"ncadir", 1, NULL, 22},
-                {"digest", 1, NULL, 23},
-                {"titleversion", 1, NULL, 24},
-                {"cnmt", 1, NULL, 25},
-                {"titlekey", 1, NULL, 26},
-                {"backupdir", 1, NULL, 27},
-                {"ncasig1privatekey", 1, NULL, 28},
-                {"acidsigprivatekey", 1, NULL, 29},
-                {"ncasig", 1, NULL, 30},
-                {"ncasig2privatekey", 1, NULL, 31},
-                {"ncasig2modulus", 1, NULL, 32},
-                {NULL, 0, NULL, 0},
-            };
+
 
         c = getopt_long(argc, argv, "k:o:h", long_options, &option_index);
         if (c == -1)
@@ -169,19 +202,22 @@ int main(int argc, char **argv)
         switch (c)
         {
         case 'k':
-            filepath_set(&keypath, optarg);
+            filepath_set(keypath, optarg);
             break;
         case 'h':
             usage();
             break;
         case 'o':
-            filepath_set(&settings.out_dir, optarg);
+            if (!strcmp(optarg, "-"))
+                settings->nsp_out_fd = fileno(stdout);
+            else
+                filepath_set(&settings->out_dir, optarg);
             break;
         case 1:
             if (!strcmp(optarg, "nca"))
-                settings.file_type = FILE_TYPE_NCA;
+                settings->file_type = FILE_TYPE_NCA;
             else if (!strcmp(optarg, "nsp"))
-                settings.file_type = FILE_TYPE_NSP;
+                settings->file_type = FILE_TYPE_NSP;
             else
             {
                 fprintf(stderr, "Error: invalid type: %s\n", optarg);
@@ -190,17 +226,19 @@ int main(int argc, char **argv)
             break;
         case 2:
             if (!strcmp(optarg, "program"))
-                settings.nca_type = NCA_TYPE_PROGRAM;
+                settings->nca_type = NCA_TYPE_PROGRAM;
             else if (!strcmp(optarg, "control"))
-                settings.nca_type = NCA_TYPE_CONTROL;
+                settings->nca_type = NCA_TYPE_CONTROL;
             else if (!strcmp(optarg, "manual"))
-                settings.nca_type = NCA_TYPE_MANUAL;
+                settings->nca_type = NCA_TYPE_MANUAL;
             else if (!strcmp(optarg, "data"))
-                settings.nca_type = NCA_TYPE_DATA;
+                settings->nca_type = NCA_TYPE_DATA;
             else if (!strcmp(optarg, "publicdata"))
-                settings.nca_type = NCA_TYPE_PUBLICDATA;
+                settings->nca_type = NCA_TYPE_PUBLICDATA;
             else if (!strcmp(optarg, "meta"))
-                settings.nca_type = NCA_TYPE_META;
+                settings->nca_type = NCA_TYPE_META;
+            else if (!strcmp(optarg, "application"))
+                settings->nca_type = NCA_TYPE_APPLICATION;
             else
             {
                 fprintf(stderr, "Error: invalid ncatype: %s\n", optarg);
@@ -209,15 +247,15 @@ int main(int argc, char **argv)
             break;
         case 3:
             if (!strcmp(optarg, "application"))
-                settings.title_type = TITLE_TYPE_APPLICATION;
+                settings->title_type = TITLE_TYPE_APPLICATION;
             else if (!strcmp(optarg, "addon"))
-                settings.title_type = TITLE_TYPE_ADDON;
+                settings->title_type = TITLE_TYPE_ADDON;
             else if (!strcmp(optarg, "systemprogram"))
-                settings.title_type = TITLE_TYPE_SYSTEMPROGRAM;
+                settings->title_type = TITLE_TYPE_SYSTEMPROGRAM;
             else if (!strcmp(optarg, "systemdata"))
-                settings.title_type = TITLE_TYPE_SYSTEMDATA;
+                settings->title_type = TITLE_TYPE_SYSTEMDATA;
             else if (!strcmp(optarg, "patch"))
-                settings.title_type = TITLE_TYPE_PATCH;
+                settings->title_type = TITLE_TYPE_PATCH;
             else
             {
                 fprintf(stderr, "Error: invalid titletype: %s\n", optarg);
@@ -225,408 +263,336 @@ int main(int argc, char **argv)
             }
             break;
         case 4:
-            filepath_set(&settings.temp_dir, optarg);
+            filepath_set(&settings->temp_dir, optarg);
             break;
         case 5:
-            filepath_set(&settings.exefs_dir, optarg);
+            filepath_set(&settings->exefs_dir, optarg);
             break;
         case 6:
-            filepath_set(&settings.romfs_dir, optarg);
+            filepath_set(&settings->romfs_dir, optarg);
             break;
         case 7:
-            filepath_set(&settings.logo_dir, optarg);
+            filepath_set(&settings->logo_dir, optarg);
             break;
         case 8:
-            filepath_set(&settings.programnca, optarg);
+            filepath_set(&settings->programnca, optarg);
             break;
         case 9:
-            filepath_set(&settings.controlnca, optarg);
+            filepath_set(&settings->controlnca, optarg);
             break;
         case 10:
-            filepath_set(&settings.legalnca, optarg);
+            filepath_set(&settings->legalnca, optarg);
             break;
         case 11:
-            filepath_set(&settings.htmldocnca, optarg);
+            filepath_set(&settings->htmldocnca, optarg);
             break;
         case 12:
-            filepath_set(&settings.metanca, optarg);
+            filepath_set(&settings->metanca, optarg);
             break;
         case 13:
             if (!strcmp(optarg, "download"))
-                settings.nca_disttype = NCA_DISTRIBUTION_DOWNLOAD;
+                settings->nca_disttype = NCA_DISTRIBUTION_DOWNLOAD;
             else if (!strcmp(optarg, "gamecard"))
-                settings.nca_disttype = NCA_DISTRIBUTION_GAMECARD;
+                settings->nca_disttype = NCA_DISTRIBUTION_GAMECARD;
             else
             {
                 fprintf(stderr, "Error: Invalid disttype: %s\n", optarg);
                 usage();
             }
+            settings->header_fields |= HEADER_FIELD_DISTTYPE;
             break;
         case 14:
-            settings.noselfsignncasig2 = 1;
+            settings->noselfsignncasig2 = 1;
             break;
         case 15:
-            settings.plaintext = 1;
+            settings->plaintext = 1;
             break;
         case 16:
-            settings.keygeneration = atoi(optarg);
+            settings->keygeneration = atoi(optarg);
             // Validating Keygeneration
-            if (settings.keygeneration < 1 || settings.keygeneration > 32)
+            if (settings->keygeneration < 1 || settings->keygeneration > 32)
             {
-                fprintf(stderr, "Invalid keygeneration: %i, keygeneration range: 1-32\n", settings.keygeneration);
-                return EXIT_FAILURE;
+                fprintf(stderr, "Invalid keygeneration: %i, keygeneration range: 1-32\n", settings->keygeneration);
+                exit(EXIT_FAILURE);
             }
+            settings->header_fields |= HEADER_FIELD_KEYGENERATION;
             break;
         case 17:
-            settings.sdk_version = strtoul(optarg, NULL, 16);
+            settings->sdk_version = strtoul(optarg, NULL, 16);
             // Validating SDK Version
-            if (settings.sdk_version < 0x000B0000)
+            if (settings->sdk_version < 0x000B0000)
             {
                 fprintf(stderr, "Error: Invalid SDK version: %08" PRIX32 "\n"
                                 "SDK version must be equal or greater than: 000B0000\n",
-                        settings.sdk_version);
+                        settings->sdk_version);
                 exit(EXIT_FAILURE);
             }
+            settings->header_fields |= HEADER_FIELD_SDK_VERSION;
             break;
         case 18:
-            parse_hex_key(settings.keyareakey, optarg, 0x10);
+            parse_hex_key(settings->keyareakey, optarg, 0x10);
+            settings->header_fields |= HEADER_FIELD_KEYAREAKEY;
             break;
         case 19:
-            settings.title_id = strtoull(optarg, NULL, 16);
+            settings->title_id = strtoull(optarg, NULL, 16);
             break;
         case 20:
-            filepath_set(&settings.datanca, optarg);
+            filepath_set(&settings->datanca, optarg);
             break;
         case 21:
-            filepath_set(&settings.publicdatanca, optarg);
+            filepath_set(&settings->publicdatanca, optarg);
             break;
         case 22:
-            filepath_set(&settings.ncadir, optarg);
+            filepath_set(&settings->ncadir, optarg);
             break;
         case 23:
-            parse_hex_key(settings.digest, optarg, 0x20);
+            parse_hex_key(settings->digest, optarg, 0x20);
             break;
         case 24:
-            settings.title_version = strtoul(optarg, NULL, 16);
+            settings->title_version = strtoul(optarg, NULL, 16);
             break;
         case 25:
-            filepath_set(&settings.cnmt, optarg);
+            filepath_set(&settings->cnmt, optarg);
             break;
         case 26:
-            parse_hex_key(settings.title_key, optarg, 0x10);
-            settings.has_title_key = 1;
+            parse_hex_key(settings->title_key, optarg, 0x10);
+            settings->has_title_key = 1;
             break;
         case 27:
-            filepath_set(&settings.backup_dir, optarg);
+            filepath_set(&settings->backup_dir, optarg);
             break;
         case 28:
-            filepath_set(&settings.nca_sig1_private_key, optarg);
+            filepath_set(&settings->nca_sig1_private_key, optarg);
             break;
         case 29:
-            filepath_set(&settings.acid_sig_private_key, optarg);
+            filepath_set(&settings->acid_sig_private_key, optarg);
             break;
         case 30:
             if (!strcmp(optarg, "static"))
-                settings.nca_sig = NCA_SIG_TYPE_STATIC;
+                settings->nca_sig = NCA_SIG_TYPE_STATIC;
             else if (!strcmp(optarg, "zero"))
-                settings.nca_sig = NCA_SIG_TYPE_ZERO;
+                settings->nca_sig = NCA_SIG_TYPE_ZERO;
             else if (!strcmp(optarg, "random"))
-                settings.nca_sig = NCA_SIG_TYPE_RANDOM;
+                settings->nca_sig = NCA_SIG_TYPE_RANDOM;
             else
             {
                 fprintf(stderr, "Error: Invalid ncasig: %s\n", optarg);
                 usage();
             }
+            settings->header_fields |= HEADER_FIELD_NCASIG;
             break;
         case 31:
-            filepath_set(&settings.nca_sig2_private_key, optarg);
+            filepath_set(&settings->nca_sig2_private_key, optarg);
             break;
         case 32:
-            filepath_set(&settings.nca_sig2_modulus, optarg);
+            filepath_set(&settings->nca_sig2_modulus, optarg);
+            break;
+        case 33:
+            settings->num_threads = strtoul(optarg, NULL, 10);
+            break;
+        case 34:
+            if (!strcmp(optarg, "parts"))
+                settings->nsp_split = NSP_SPLIT_PARTS;
+            else if (!strcmp(optarg, "dir"))
+                settings->nsp_split = NSP_SPLIT_DIR;
+            else
+            {
+                fprintf(stderr, "Error: Invalid nspsplit: %s\n", optarg);
+                usage();
+            }
+            break;
+        case 35:
+            settings->nsp_out_fd = (int)strtol(optarg, NULL, 10);
+            break;
+        case 36:
+            filepath_set(&settings->control_dir, optarg);
+            break;
+        case 37:
+            filepath_set(&settings->legal_dir, optarg);
+            break;
+        case 38:
+            filepath_set(&settings->htmldoc_dir, optarg);
+            break;
+        case 39:
+            settings->verify_sidecars = 1;
+            break;
+        case 40:
+            filepath_set(&settings->batch_manifest, optarg);
+            break;
+        case 41:
+            settings->batch_memory = strtoul(optarg, NULL, 10);
+            break;
+        case 42:
+            filepath_set(&settings->serve_socket, optarg);
+            break;
+        case 43:
+            filepath_set(&settings->connect_socket, optarg);
+            break;
+        case 44:
+            filepath_set(&settings->request, optarg);
+            break;
+        case 45:
+            settings->disk_jobs = strtoul(optarg, NULL, 10);
+            break;
+        case 46:
+            filepath_set(&settings->cache_dir, optarg);
+            break;
+        case 47:
+            settings->cache_size = strtoull(optarg, NULL, 10);
+            break;
+        case 48:
+            settings->cache_verify = strtoul(optarg, NULL, 10);
+            break;
+        case 49:
+            filepath_set(&settings->rekey_nca, optarg);
+            break;
+        case 50:
+            parse_hex_key(settings->rekey_title_key, optarg, 0x10);
+            settings->has_rekey_title_key = 1;
+            break;
+        case 51:
+            filepath_set(&settings->patch_nca, optarg);
+            break;
+        case 52:
+            filepath_set(&settings->variants, optarg);
+            break;
+        case 53:
+            filepath_set(&settings->romfs_base, optarg);
+            break;
+        case 54:
+            parse_hex_key(settings->base_title_key, optarg, 0x10);
+            settings->has_base_title_key = 1;
+            break;
+        case 55:
+            settings->bktr = 1;
+            break;
+        case 56:
+            settings->compress_romfs = 1;
+            break;
+        case 57:
+            settings->nsz = 1;
+            break;
+        case 58:
+            settings->nsz_level = atoi(optarg);
+            break;
+        case 59:
+            filepath_set(&settings->verify_path, optarg);
+            break;
+        case 60:
+            filepath_set(&settings->extract_path, optarg);
+            break;
+        case 61:
+            filepath_set(&settings->info_path, optarg);
+            break;
+        case 62:
+            settings->info_json = 1;
             break;
         default:
             usage();
         }
     }
+}
 
-    printf("----> Preparing:\n");
-
-    // Try to populate default keyfile.
-    FILE *keyfile = NULL;
-    if (keypath.valid == VALIDITY_INVALID)
-    {
-        // Locating default key file
-        filepath_set(&keypath, "keys.dat");
-        keyfile = os_fopen(keypath.os_path, OS_MODE_READ);
-        if (keyfile == NULL)
-        {
-            filepath_set(&keypath, "keys.txt");
-            keyfile = os_fopen(keypath.os_path, OS_MODE_READ);
-        }
-        if (keyfile == NULL)
-        {
-            filepath_set(&keypath, "keys.ini");
-            keyfile = os_fopen(keypath.os_path, OS_MODE_READ);
-        }
-        if (keyfile == NULL)
-        {
-            filepath_set(&keypath, "prod.keys");
-            keyfile = os_fopen(keypath.os_path, OS_MODE_READ);
-        }
-        if (keyfile == NULL)
-        {
-            /* Use $HOME/.switch/prod.keys if it exists */
-            char *home = getenv("HOME");
-            if (home == NULL)
-                home = getenv("USERPROFILE");
-            if (home != NULL)
-            {
-                filepath_set(&keypath, home);
-                filepath_append(&keypath, ".switch");
-                filepath_append(&keypath, "prod.keys");
-                keyfile = os_fopen(keypath.os_path, OS_MODE_READ);
-            }
-        }
-    }
-    else if (keypath.valid == VALIDITY_VALID)
-        keyfile = os_fopen(keypath.os_path, OS_MODE_READ);
+/* Builds with the library, invalid settings print usage as before. */
+static int build(hp_settings_t *settings)
+{
+    int ret = hacpack_settings_build(settings);
+    if (ret == HACPACK_ERROR_INVALID)
+        usage();
+    return ret == HACPACK_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-    // Try to populate keyfile.
-    if (keyfile != NULL)
-    {
-        printf("Loading '%s' keyset file\n", keypath.char_path);
-        extkeys_initialize_keyset(&settings.keyset, keyfile);
-        pki_derive_keys(&settings.keyset);
-        fclose(keyfile);
-    }
-    else
+/* Applies the options of one batch job over a copy of the batch settings. */
+static int batch_parse(hp_settings_t *settings, int argc, char **argv)
+{
+    filepath_t keypath;
+    filepath_init(&keypath);
+    parse_options(argc, argv, settings, &keypath);
+    if (keypath.valid == VALIDITY_VALID)
+        printf("Warning: Batch jobs share the batch keyset, ignoring %s\n", keypath.char_path);
+    if (settings->nsp_out_fd >= 0 || settings->batch_manifest.valid == VALIDITY_VALID || settings->serve_socket.valid == VALIDITY_VALID || settings->connect_socket.valid == VALIDITY_VALID)
     {
-        printf("\n");
-        fprintf(stderr, "Error: Unable to open keyset file\n"
-                        "Use -k or --keyset to specify your keyset file path or place your keyset in ." OS_PATH_SEPARATOR "keys.dat\n");
+        fprintf(stderr, "Error: Streaming, nested batches and servers aren't supported in batch jobs\n");
         return EXIT_FAILURE;
     }
+    return 0;
+}
 
-    // Make sure that header_key exists
-    uint8_t has_header_Key = 0;
-    for (unsigned int i = 0; i < 0x10; i++)
-    {
-        if (settings.keyset.header_key[i] != 0)
-        {
-            has_header_Key = 1;
-            break;
-        }
-    }
-    if (has_header_Key == 0)
+int main(int argc, char **argv)
+{
+    hp_settings_t settings;
+    filepath_t keypath;
+    filepath_init(&keypath);
+
+    printf("hacPack %s by The-4n\n\n", HACPACK_VERSION);
+
+    hacpack_settings_init(&settings);
+    parse_options(argc, argv, &settings, &keypath);
+
+    if (settings.info_json && settings.info_path.valid != VALIDITY_VALID)
     {
-        fprintf(stderr, "Error: header_key is not present in keyset file\n");
-        return EXIT_FAILURE;
+        fprintf(stderr, "Error: --json is only supported with --info\n");
+        usage();
     }
 
-    // Make sure that key_area_key_application_keygen exists
-    uint8_t has_kek = 0;
-    for (unsigned int kekc = 0; kekc < 0x10; kekc++)
+    // Batch, request and --info --json results are written to stdout, job logs go to stderr
+    FILE *results_file = NULL;
+    if (settings.batch_manifest.valid == VALIDITY_VALID || settings.connect_socket.valid == VALIDITY_VALID || settings.info_json)
     {
-        if (settings.keyset.key_area_keys[settings.keygeneration - 1][0][kekc] != 0)
+        int results_fd = fio_redirect_stdout();
+        if (results_fd < 0 || (results_file = fdopen(results_fd, "w")) == NULL)
         {
-            has_kek = 1;
-            break;
+            fprintf(stderr, "Error: Failed to redirect stdout\n");
+            return EXIT_FAILURE;
         }
     }
-    if (has_kek == 0)
-    {
-        fprintf(stderr, "Error: key_area_key_application for keygeneration %i is not present in keyset file\n", settings.keygeneration);
-        return EXIT_FAILURE;
-    }
 
-    // Make sure that titlekek_keygen exists if titlekey is specified
-    if (settings.has_title_key == 1)
+    // Keep progress messages out of an nsp streamed to stdout
+    if (settings.nsp_out_fd == fileno(stdout))
     {
-        uint8_t has_titlekek = 0;
-        for (unsigned int tkekc = 0; tkekc < 0x10; tkekc++)
-        {
-            if (settings.keyset.titlekeks[settings.keygeneration - 1][tkekc] != 0)
-            {
-                has_titlekek = 1;
-                break;
-            }
-        }
-        if (has_titlekek == 0)
+        settings.nsp_out_fd = fio_redirect_stdout();
+        if (settings.nsp_out_fd < 0)
         {
-            fprintf(stderr, "Error: titlekek for keygeneration %i is not present in keyset file\n", settings.keygeneration);
+            fprintf(stderr, "Error: Failed to redirect stdout\n");
             return EXIT_FAILURE;
         }
     }
 
-    // Make sure that titleid is within valid range
-    if (settings.title_id < 0x0100000000000000)
+    // The server does the build, the client doesn't need a keyset
+    if (settings.connect_socket.valid == VALIDITY_VALID)
     {
-        fprintf(stderr, "Error: Bad TitleID: %016" PRIx64 "\n"
-                        "Valid TitleID range: 0100000000000000 - ffffffffffffffff\n",
-                settings.title_id);
-        usage();
-    }
-    if (settings.title_id > 0x01ffffffffffffff)
-        printf("Warning: TitleID %" PRIx64 " is greater than 01ffffffffffffff and it's not suggested\n", settings.title_id);
-
-    // Make sure that outout directory is set
-    if (settings.out_dir.valid == VALIDITY_INVALID)
-    {
-        fprintf(stderr, "Error: Output directory is not specified");
-        usage();
-    }
-
-    if (settings.file_type == FILE_TYPE_NCA)
-    {
-        // Remove existing temp directory and create a new one
-        printf("Removing existing temp directory\n");
-        filepath_remove_directory(&settings.temp_dir);
-        printf("Creating temp directory\n");
-        os_makedir(settings.temp_dir.os_path);
-
-        // Create backup directory
-        printf("Creating backup directory\n");
-        os_makedir(settings.backup_dir.os_path);
-        // Add titleid to backup folder path
-        filepath_append(&settings.backup_dir, "%016" PRIx64, settings.title_id);
-        os_makedir(settings.backup_dir.os_path);
+        if (settings.request.valid != VALIDITY_VALID)
+        {
+            fprintf(stderr, "Error: --request is required with --connect\n");
+            usage();
+        }
+        int ret = serve_client(&settings.connect_socket, &settings.request, results_file);
+        fclose(results_file);
+        free(settings.keyareakey);
+        return ret;
     }
 
-    // Create output directory
-    printf("Creating output directory\n");
-    os_makedir(settings.out_dir.os_path);
+    printf("----> Preparing:\n");
 
-    printf("\n");
+    if (hacpack_settings_load_keyset(&settings, &keypath) != HACPACK_OK)
+        return EXIT_FAILURE;
 
-    if (settings.file_type == FILE_TYPE_NCA)
+    int ret;
+    if (settings.info_path.valid == VALIDITY_VALID)
     {
-        switch (settings.nca_type)
-        {
-        case NCA_TYPE_PROGRAM:
-            if (settings.exefs_dir.valid == VALIDITY_INVALID)
-            {
-                fprintf(stderr, "Error: exefs filepath is not set\n");
-                usage();
-            }
-            else if (((settings.nca_sig2_private_key.valid == VALIDITY_VALID) && (settings.nca_sig2_modulus.valid == VALIDITY_INVALID)) || ((settings.nca_sig2_private_key.valid == VALIDITY_INVALID) && (settings.nca_sig2_modulus.valid == VALIDITY_VALID)))
-            {
-                fprintf(stderr, "Error: Both nca signature 2 private key and public key filepaths must be valid\n");
-                usage();
-            }
-            printf("----> Processing NPDM\n");
-            npdm_process(&settings);
-            printf("\n");
-            nca_create_program(&settings);
-            break;
-        case NCA_TYPE_CONTROL:
-            if (settings.romfs_dir.valid == VALIDITY_INVALID)
-                usage();
-            else if (settings.has_title_key)
-            {
-                fprintf(stderr, "Error: Titlekey is not supported for control nca\n");
-                usage();
-            }
-            printf("----> Processing NACP\n");
-            nacp_process(&settings);
-            printf("\n");
-            nca_create_romfs_type(&settings, nca_romfs_get_type(settings.nca_type));
-            break;
-        case NCA_TYPE_DATA:
-            if (settings.romfs_dir.valid == VALIDITY_INVALID)
-                usage();
-            else if (settings.has_title_key)
-            {
-                fprintf(stderr, "Error: Titlekey is not supported for data nca\n");
-                usage();
-            }
-            nca_create_romfs_type(&settings, nca_romfs_get_type(settings.nca_type));
-            break;
-        case NCA_TYPE_MANUAL:
-            if (settings.romfs_dir.valid == VALIDITY_INVALID)
-                usage();
-            nca_create_romfs_type(&settings, nca_romfs_get_type(settings.nca_type));
-            break;
-        case NCA_TYPE_PUBLICDATA:
-            if (settings.romfs_dir.valid == VALIDITY_INVALID)
-                usage();
-            nca_create_romfs_type(&settings, nca_romfs_get_type(settings.nca_type));
-            break;
-        case NCA_TYPE_META:
-            if (settings.cnmt.valid == VALIDITY_VALID)
-                nca_create_meta(&settings);
-            else if (settings.title_type == 0)
-            {
-                fprintf(stderr, "Error: invalid titletype\n");
-                usage();
-            }
-            else if (settings.has_title_key)
-            {
-                fprintf(stderr, "Error: Titlekey is not supported for metadata nca\n");
-                usage();
-            }
-            else if ((settings.programnca.valid == VALIDITY_INVALID || settings.controlnca.valid == VALIDITY_INVALID) && settings.title_type == TITLE_TYPE_APPLICATION)
-            {
-                fprintf(stderr, "Error: --programnca and/or --controlnca is not set\n");
-                usage();
-            }
-            else if (settings.title_type == TITLE_TYPE_ADDON && settings.publicdatanca.valid == VALIDITY_INVALID)
-            {
-                fprintf(stderr, "Error: --publicdatanca is not set\n");
-                usage();
-            }
-            else if (settings.title_type == TITLE_TYPE_SYSTEMPROGRAM && settings.programnca.valid == VALIDITY_INVALID)
-            {
-                fprintf(stderr, "Error: --programnca is not set\n");
-                usage();
-            }
-            else if (settings.title_type == TITLE_TYPE_SYSTEMDATA && settings.datanca.valid == VALIDITY_INVALID)
-            {
-                fprintf(stderr, "Error: --datanca is not set\n");
-                usage();
-            }
-            else
-                nca_create_meta(&settings);
-            break;
-        default:
-            usage();
-        }
+        ret = info_run(&settings, &settings.info_path, results_file) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        if (results_file != NULL)
+            fclose(results_file);
     }
-    else if (settings.file_type == FILE_TYPE_NSP)
+    else if (results_file != NULL)
     {
-        if (settings.ncadir.valid != VALIDITY_INVALID)
-        {
-            // Create NSP
-            printf("----> Creating NSP:\n");
-            filepath_t nsp_file_path;
-            filepath_init(&nsp_file_path);
-            filepath_copy(&nsp_file_path, &settings.out_dir);
-            filepath_append(&nsp_file_path, "%016" PRIx64 ".nsp", settings.title_id);
-            uint64_t pfs0_size;
-            pfs0_build(&settings.ncadir, &nsp_file_path, &pfs0_size);
-            printf("\n----> Created NSP: %s\n", nsp_file_path.char_path);
-        }
-        else
-        {
-            fprintf(stderr, "Error: --ncadir is not set\n");
-            usage();
-        }
+        ret = batch_run(&settings, batch_parse, build, results_file) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        fclose(results_file);
     }
+    else if (settings.serve_socket.valid == VALIDITY_VALID)
+        ret = serve_run(&settings, batch_parse, build) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
     else
-    {
-        fprintf(stderr, "Error: --type is not set\n");
-        usage();
-    }
-
-    // Remove temp directory
-    if (settings.file_type == FILE_TYPE_NCA)
-    {
-        printf("\n");
-        printf("Removing created temp directory\n");
-        filepath_remove_directory(&settings.temp_dir);
-    }
-
-    printf("\nDone.\n");
-
+        ret = build(&settings);
     free(settings.keyareakey);
-    return EXIT_SUCCESS;
+    return ret;
 }
@@ -14,8 +14,8 @@ void nacp_process(hp_settings_t *settings)
     fl = os_fopen(nacp_filepath.os_path, OS_MODE_READ);
     if (fl == NULL)
     {
-        fprintf(stderr, "Failed to open %s!\n", nacp_filepath.char_path);
-        exit(EXIT_FAILURE);
+        hp_error("Failed to open %s!\n", nacp_filepath.char_path);
+        hp_exit_failure();
     }
 
     int tname = 0;
@@ -32,20 +32,20 @@ void nacp_process(hp_settings_t *settings)
             break;
     }
     // Validate Title Name
-    printf("Validating Title Name\n");
+    hp_log("Validating Title Name\n");
     if (tname == 0)
     {
-        fprintf(stderr, "Error: Invalid Title Name in control.nacp\n");
-        exit(EXIT_FAILURE);
+        hp_error("Error: Invalid Title Name in control.nacp\n");
+        hp_exit_failure();
     }
 
     // Validate Author
-    printf("Validating Author\n");
+    hp_log("Validating Author\n");
     if (tauthor == 0)
     {
-        fprintf(stderr, "Error: Invalid Author in control.nacp\n");
-        exit(EXIT_FAILURE);
+        hp_error("Error: Invalid Author in control.nacp\n");
+        hp_exit_failure();
     }
 
-    fclose(fl);
+    os_fclose(fl);
 }
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include <string.h>
 #include <inttypes.h>
 #include <time.h>
+#include <stddef.h>
+#include <sys/stat.h>
 #include "nca.h"
 #include "sha.h"
 #include "filepath.h"
@@ -10,72 +12,41 @@
 #include "cnmt.h"
 #include "ticket.h"
 #include "rsa.h"
-
-void nca_create_romfs_type(hp_settings_t *settings, char *nca_type)
+#include "fio.h"
+#include "npdm.h"
+#include "nacp.h"
+#include "report.h"
+#include "sched.h"
+#include "worker.h"
+#include "cache.h"
+#include "ncareader.h"
+#include "bktr.h"
+#include "compress.h"
+#include "rekey.h"
+
+/* Appends a RomFS-only NCA (control, manual, data, publicdata) to nca_file. */
+void nca_build_romfs_type(hp_settings_t *settings, FILE *nca_file, hp_nca_digest_t *out_digest)
 {
-    printf("----> Creating %s NCA:\n", nca_type);
-    printf("===> Creating NCA header\n");
+    hp_log("===> Creating NCA header\n");
     nca_header_t nca_header;
     memset(&nca_header, 0, sizeof(nca_header));
 
-    filepath_t romfs_nca_path;
-    filepath_init(&romfs_nca_path);
-    filepath_copy(&romfs_nca_path, &settings->out_dir);
-    filepath_append(&romfs_nca_path, "%s.nca", nca_type);
-
-    FILE *romfs_nca_file;
-    romfs_nca_file = os_fopen(romfs_nca_path.os_path, OS_MODE_WRITE_EDIT);
+    // Offsets in the NCA are relative to where it starts in nca_file
+    fseeko64(nca_file, 0, SEEK_END);
+    uint64_t nca_offset = (uint64_t)ftello64(nca_file);
 
     // Write placeholder for NCA header
-    printf("Writing NCA header placeholder to %s\n", romfs_nca_path.char_path);
-    if (romfs_nca_file != NULL)
-        fwrite(&nca_header, 1, sizeof(nca_header), romfs_nca_file);
-    else
-    {
-        fprintf(stderr, "Failed to create %s!\n", romfs_nca_path.char_path);
-        exit(EXIT_FAILURE);
-    }
+    hp_log("Writing NCA header placeholder\n");
+    fwrite(&nca_header, 1, sizeof(nca_header), nca_file);
 
-    printf("\n---> Creating Section 0:");
-
-    // Set IVFC levels temp filepaths
-    filepath_t ivfc_lvls_path[6];
-    for (int a = 0; a < 6; a++)
-    {
-        filepath_init(&ivfc_lvls_path[a]);
-        filepath_copy(&ivfc_lvls_path[a], &settings->temp_dir);
-        filepath_append(&ivfc_lvls_path[a], "%s_sec0_ivfc_lvl%i", nca_type, a + 1);
-    }
+    hp_log("\n---> Creating Section 0:");
 
     //Build RomFS
-    printf("\n===> Building RomFS\n");
-    romfs_build(&settings->romfs_dir, &ivfc_lvls_path[5], &nca_header.fs_headers[0].romfs_superblock.ivfc_header.level_headers[5].hash_data_size);
-    nca_header.fs_headers[0].romfs_superblock.ivfc_header.level_headers[5].block_size = 0x0E; // 0x4000
-
-    // Create IVFC levels
-    printf("\n===> Creating IVFC levels\n");
-    for (int b = 4; b >= 0; b--)
-    {
-        printf("Writing %s\n", ivfc_lvls_path[b].char_path);
-        ivfc_create_level(&ivfc_lvls_path[b], &ivfc_lvls_path[b + 1], &nca_header.fs_headers[0].romfs_superblock.ivfc_header.level_headers[b].hash_data_size);
-        nca_header.fs_headers[0].romfs_superblock.ivfc_header.level_headers[b].block_size = 0x0E; // 0x4000
-    }
-
-    // Set IVFC levels logical offset
-    nca_header.fs_headers[0].romfs_superblock.ivfc_header.level_headers[0].logical_offset = 0;
-    for (int i = 1; i <= 5; i++)
-        nca_header.fs_headers[0].romfs_superblock.ivfc_header.level_headers[i].logical_offset = nca_header.fs_headers[0].romfs_superblock.ivfc_header.level_headers[i - 1].logical_offset + nca_header.fs_headers[0].romfs_superblock.ivfc_header.level_headers[i - 1].hash_data_size;
-
-    // Write IVFC levels
-    printf("\n===> Writing IVFC levels\n");
-    for (int c = 0; c < 6; c++)
-    {
-        printf("Writing %s to %s\n", ivfc_lvls_path[c].char_path, romfs_nca_path.char_path);
-        nca_write_file(romfs_nca_file, &ivfc_lvls_path[c]);
-    }
+    hp_log("\n===> Building RomFS\n");
+    nca_write_romfs_section(settings, nca_file, &nca_header.fs_headers[0]);
 
     // Write Padding if required
-    nca_write_padding(romfs_nca_file);
+    nca_write_padding(nca_file, nca_offset);
 
     // Common values
     nca_header.magic = MAGIC_NCA3;
@@ -87,7 +58,7 @@ void nca_create_romfs_type(hp_settings_t *settings, char *nca_type)
     nca_set_keygen(&nca_header, settings);
 
     nca_header.section_entries[0].media_start_offset = 0x6;                                        // 0xC00 / 0x200
-    nca_header.section_entries[0].media_end_offset = (uint32_t)(ftello64(romfs_nca_file) / 0x200); // Section end offset / 200
+    nca_header.section_entries[0].media_end_offset = (uint32_t)((ftello64(nca_file) - nca_offset) / 0x200); // Section end offset / 200
     nca_header.section_entries[0]._0x8[0] = 0x1;                                                   // Always 1
 
     nca_header.fs_headers[0].hash_type = HASH_TYPE_ROMFS;
@@ -102,13 +73,11 @@ void nca_create_romfs_type(hp_settings_t *settings, char *nca_type)
         nca_header.fs_headers[0].crypt_type = CRYPT_NONE;
 
     // Calculate master hash and section hash
-    printf("\n===> Calculating Hashes:\n");
-    printf("Calculating Master hash\n");
-    ivfc_calculate_master_hash(&ivfc_lvls_path[0], nca_header.fs_headers[0].romfs_superblock.ivfc_header.master_hash);
-    printf("Calculating Section hash\n");
+    hp_log("\n===> Calculating Hashes:\n");
+    hp_log("Calculating Section hash\n");
     nca_calculate_section_hash(&nca_header.fs_headers[0], nca_header.section_hashes[0]);
 
-    printf("\n---> Finalizing:\n");
+    hp_log("\n---> Finalizing:\n");
 
     if (settings->has_title_key == 0)
         // Set encrypted key area key 2
@@ -123,126 +92,202 @@ void nca_create_romfs_type(hp_settings_t *settings, char *nca_type)
         nca_header.rights_id[15] = (uint8_t)settings->keygeneration;
     }
 
-    printf("===> Encrypting NCA\n");
+    hp_log("===> Encrypting NCA\n");
     if (settings->plaintext == 0)
     {
         // Encrypt section 0
-        printf("Encrypting section 0\n");
-        nca_encrypt_section(romfs_nca_file, &nca_header, 0, settings);
+        hp_log("Encrypting section 0\n");
+        nca_encrypt_section(nca_file, nca_offset, &nca_header, 0, settings);
     }
 
     // Crypto type
-    printf("Getting NCA file size\n");
-    fseeko64(romfs_nca_file, 0, SEEK_END);
-    nca_header.nca_size = (uint64_t)ftello64(romfs_nca_file);
+    hp_log("Getting NCA file size\n");
+    fseeko64(nca_file, 0, SEEK_END);
+    nca_header.nca_size = (uint64_t)ftello64(nca_file) - nca_offset;
     if (settings->has_title_key == 0)
     {
-        printf("Encrypting key area\n");
+        hp_log("Encrypting key area\n");
         nca_encrypt_key_area(&nca_header, settings);
     }
-    else
-    {
-        // Create cert and tik
-        ticket_create_cert(settings);
-        ticket_create_tik(settings);
-    }
 
     // Fill NCA signature
     if (settings->nca_sig1_private_key.valid == VALIDITY_INVALID)
     {
-        printf("Generating signature\n");
+        hp_log("Generating signature\n");
         nca_generate_sig(nca_header.fixed_key_sig, settings);
     }
     else
     {
         // Sign header with specified private key
-        printf("Signing NCA header\n");
+        hp_log("Signing NCA header\n");
         rsa_sign_with_file(&nca_header.magic, 0x200, nca_header.fixed_key_sig, 0x100, settings->nca_sig1_private_key.char_path);
     }
 
     // Encrypt header
-    printf("Encrypting header\n");
+    hp_log("Encrypting header\n");
     nca_encrypt_header(&nca_header, settings);
 
     // Write NCA header
-    printf("\n===> Writing NCA header\n");
-    printf("Writing NCA header to %s\n", romfs_nca_path.char_path);
-    fseeko64(romfs_nca_file, 0, SEEK_SET);
-    fwrite(&nca_header, 1, sizeof(nca_header), romfs_nca_file);
+    hp_log("\n===> Writing NCA header\n");
+    hp_log("Writing NCA header\n");
+    fseeko64(nca_file, nca_offset, SEEK_SET);
+    fwrite(&nca_header, 1, sizeof(nca_header), nca_file);
 
     // Calculate hash and nca size
-    printf("\n===> Post creation process\n");
-    printf("Calculating NCA hash\n");
-    unsigned char nca_hash[0x20];
-    nca_calculate_hash(romfs_nca_file, nca_hash);
-
-    fclose(romfs_nca_file);
+    hp_log("\n===> Post creation process\n");
+    hp_log("Calculating NCA hash\n");
+    nca_set_digest(nca_file, nca_offset, out_digest);
+}
 
-    // Rename ncatype.nca to ncaid.nca
+void nca_create_romfs_type(hp_settings_t *settings, char *nca_type, hp_nca_digest_t *out_digest)
+{
+    hp_log("----> Creating %s NCA:\n", nca_type);
+    cache_entry_t cache_entry;
+    cache_init(settings, &cache_entry);
     filepath_t romfs_nca_final_path;
-    filepath_init(&romfs_nca_final_path);
-    filepath_copy(&romfs_nca_final_path, &settings->out_dir);
-    char romfs_nca_name[37];
-    hexBinaryString(nca_hash, 16, romfs_nca_name, 33);
-    strcat(romfs_nca_name, ".nca");
-    romfs_nca_name[36] = '\0';
-    printf("Renaming %s.nca to %s\n", nca_type, romfs_nca_name);
-    filepath_append(&romfs_nca_final_path, "%s", romfs_nca_name);
-    os_rename(romfs_nca_path.os_path, romfs_nca_final_path.os_path);
-    printf("\n----> Created %s NCA: %s\n", nca_type, romfs_nca_final_path.char_path);
-}
-
-void nca_create_program(hp_settings_t *settings)
-{
-    printf("----> Creating Program NCA:\n");
-    printf("===> Creating NCA header\n");
-    nca_header_t nca_header;
-    memset(&nca_header, 0, sizeof(nca_header));
+    hp_nca_digest_t digest;
+    if (cache_lookup(settings, &cache_entry, &romfs_nca_final_path, &digest) == 0)
+    {
+        filepath_t romfs_nca_path;
+        filepath_init(&romfs_nca_path);
+        filepath_copy(&romfs_nca_path, &settings->out_dir);
+        filepath_append(&romfs_nca_path, "%s.nca", nca_type);
+
+        FILE *romfs_nca_file;
+        romfs_nca_file = os_fopen(romfs_nca_path.os_path, OS_MODE_WRITE_EDIT);
+        if (romfs_nca_file == NULL)
+        {
+            hp_error("Failed to create %s!\n", romfs_nca_path.char_path);
+            hp_exit_failure();
+        }
 
-    filepath_t program_nca_path;
-    filepath_init(&program_nca_path);
-    filepath_copy(&program_nca_path, &settings->out_dir);
-    filepath_append(&program_nca_path, "Program.nca");
+        // Variants are encrypted from the plaintext sections of this build
+        if (settings->variants.valid == VALIDITY_VALID)
+            settings->variant_writer = rekey_variants_open(settings);
+        nca_build_romfs_type(settings, romfs_nca_file, &digest);
+        os_fclose(romfs_nca_file);
 
-    FILE *program_nca_file;
-    program_nca_file = os_fopen(program_nca_path.os_path, OS_MODE_WRITE_EDIT);
+        // Rename ncatype.nca to ncaid.nca
+        nca_rename_to_id(settings, &romfs_nca_path, &digest, 0, &romfs_nca_final_path);
+        cache_store(settings, &cache_entry, &romfs_nca_final_path, &digest);
+    }
 
-    // Write placeholder for NCA header
-    printf("Writing NCA header placeholder to %s\n", program_nca_path.char_path);
-    if (program_nca_file != NULL)
-        fwrite(&nca_header, 1, sizeof(nca_header), program_nca_file);
-    else
+    if (settings->has_title_key == 1)
     {
-        fprintf(stderr, "Failed to create %s!\n", program_nca_path.char_path);
-        exit(EXIT_FAILURE);
+        // Create cert and tik
+        ticket_create_cert(settings);
+        ticket_create_tik(settings);
     }
 
-    printf("\n---> Creating Section 0:");
+    nca_write_sidecar(settings, &romfs_nca_final_path, &digest);
+    hp_log("\n----> Created %s NCA: %s\n", nca_type, romfs_nca_final_path.char_path);
+    if (out_digest != NULL)
+        *out_digest = digest;
+}
 
-    //Build ExeFS
-    filepath_t program_exefs;
-    filepath_init(&program_exefs);
-    filepath_copy(&program_exefs, &settings->temp_dir);
-    filepath_append(&program_exefs, "program_sec0_exefs");
-    filepath_t program_exefs_hash_table;
-    filepath_init(&program_exefs_hash_table);
-    filepath_copy(&program_exefs_hash_table, &settings->temp_dir);
-    filepath_append(&program_exefs_hash_table, "program_sec0_exefs_hashtable");
-    uint32_t exefs_hash_block_size = PFS0_EXEFS_HASH_BLOCK_SIZE;
-    printf("\n===> Building ExeFS\n");
-    pfs0_build(&settings->exefs_dir, &program_exefs, &nca_header.fs_headers[0].pfs0_superblock.pfs0_size);
-    printf("Calculating hash table\n");
-    pfs0_create_hashtable(&program_exefs, &program_exefs_hash_table, exefs_hash_block_size, &nca_header.fs_headers[0].pfs0_superblock.hash_table_size, &nca_header.fs_headers[0].pfs0_superblock.pfs0_offset);
+/* Section inputs of a program NCA, prepared side by side before the sections are written. */
+typedef struct
+{
+    hp_settings_t *settings;
+    nca_header_t *nca_header;
+    filepath_t exefs;
+    filepath_t exefs_hash_table;
+    filepath_t logo;
+    filepath_t logo_hash_table;
+    romfs_ctx_t romfs_ctx;
+} nca_program_sections_t;
+
+static uint32_t nca_get_num_threads(hp_settings_t *settings)
+{
+    return settings->num_threads ? settings->num_threads : worker_get_cpu_count();
+}
+
+/* The RomFS section is built from --romfsdir, --baseromfs or both. */
+static int nca_has_romfs(hp_settings_t *settings)
+{
+    return settings->romfs_dir.valid == VALIDITY_VALID || settings->romfs_base.valid == VALIDITY_VALID;
+}
+
+static void nca_build_exefs_task(void *ctx)
+{
+    nca_program_sections_t *sections = (nca_program_sections_t *)ctx;
+    pfs0_superblock_t *superblock = &sections->nca_header->fs_headers[0].pfs0_superblock;
+    hp_log("\n===> Building ExeFS\n");
+    pfs0_build(&sections->settings->exefs_dir, &sections->exefs, &superblock->pfs0_size);
+    hp_log("Calculating hash table\n");
+    pfs0_create_hashtable(&sections->exefs, &sections->exefs_hash_table, PFS0_EXEFS_HASH_BLOCK_SIZE, &superblock->hash_table_size, &superblock->pfs0_offset);
+}
+
+static void nca_scan_romfs_task(void *ctx)
+{
+    nca_program_sections_t *sections = (nca_program_sections_t *)ctx;
+    hp_log("\n===> Scanning RomFS\n");
+    nca_prepare_romfs_section(sections->settings, &sections->romfs_ctx, &sections->nca_header->fs_headers[1].romfs_superblock.ivfc_header);
+}
+
+static void nca_build_logo_task(void *ctx)
+{
+    nca_program_sections_t *sections = (nca_program_sections_t *)ctx;
+    pfs0_superblock_t *superblock = &sections->nca_header->fs_headers[2].pfs0_superblock;
+    hp_log("\n===> Building PFS0\n");
+    pfs0_build(&sections->settings->logo_dir, &sections->logo, &superblock->pfs0_size);
+    hp_log("Calculating hash table\n");
+    pfs0_create_hashtable(&sections->logo, &sections->logo_hash_table, PFS0_LOGO_HASH_BLOCK_SIZE, &superblock->hash_table_size, &superblock->pfs0_offset);
+}
+
+/* Appends a program NCA to nca_file. */
+void nca_build_program(hp_settings_t *settings, FILE *nca_file, hp_nca_digest_t *out_digest)
+{
+    hp_log("===> Creating NCA header\n");
+    nca_header_t nca_header;
+    memset(&nca_header, 0, sizeof(nca_header));
+
+    // Offsets in the NCA are relative to where it starts in nca_file
+    fseeko64(nca_file, 0, SEEK_END);
+    uint64_t nca_offset = (uint64_t)ftello64(nca_file);
+
+    // Write placeholder for NCA header
+    hp_log("Writing NCA header placeholder\n");
+    fwrite(&nca_header, 1, sizeof(nca_header), nca_file);
+
+    // ExeFS and logo are built in the temp directory while the RomFS tree is scanned, sections are written in order after that
+    nca_program_sections_t sections;
+    sections.settings = settings;
+    sections.nca_header = &nca_header;
+    filepath_init(&sections.exefs);
+    filepath_copy(&sections.exefs, &settings->temp_dir);
+    filepath_append(&sections.exefs, "program_sec0_exefs");
+    filepath_init(&sections.exefs_hash_table);
+    filepath_copy(&sections.exefs_hash_table, &settings->temp_dir);
+    filepath_append(&sections.exefs_hash_table, "program_sec0_exefs_hashtable");
+    filepath_init(&sections.logo);
+    filepath_copy(&sections.logo, &settings->temp_dir);
+    filepath_append(&sections.logo, "program_sec2_logo");
+    filepath_init(&sections.logo_hash_table);
+    filepath_copy(&sections.logo_hash_table, &settings->temp_dir);
+    filepath_append(&sections.logo_hash_table, "program_sec2_logo_hashtable");
+
+    sched_t sched;
+    sched_init(&sched);
+    sched_add(&sched, nca_build_exefs_task, &sections, 1);
+    if (nca_has_romfs(settings))
+        sched_add(&sched, nca_scan_romfs_task, &sections, 0);
+    if (settings->logo_dir.valid == VALIDITY_VALID)
+        sched_add(&sched, nca_build_logo_task, &sections, 1);
+    sched_run(&sched, nca_get_num_threads(settings), settings->disk_jobs);
+    sched_free(&sched);
+
+    hp_log("\n---> Creating Section 0:");
 
     // Write ExeFS
-    printf("\n===> Writing ExeFS\n");
-    printf("Writing PFS0 hash table\n");
-    nca_write_file(program_nca_file, &program_exefs_hash_table);
-    printf("Writing PFS0\n");
-    nca_write_file(program_nca_file, &program_exefs);
+    hp_log("\n===> Writing ExeFS\n");
+    hp_log("Writing PFS0 hash table\n");
+    nca_write_file(nca_file, &sections.exefs_hash_table);
+    hp_log("Writing PFS0\n");
+    nca_write_file(nca_file, &sections.exefs);
 
     // Write Padding if required
-    nca_write_padding(program_nca_file);
+    nca_write_padding(nca_file, nca_offset);
 
     // Common values
     nca_header.magic = MAGIC_NCA3;
@@ -254,73 +299,46 @@ void nca_create_program(hp_settings_t *settings)
     nca_set_keygen(&nca_header, settings);
 
     nca_header.section_entries[0].media_start_offset = 0x6;                                          // 0xC00 / 0x200
-    nca_header.section_entries[0].media_end_offset = (uint32_t)(ftello64(program_nca_file) / 0x200); // Section end offset / 200
+    nca_header.section_entries[0].media_end_offset = (uint32_t)((ftello64(nca_file) - nca_offset) / 0x200); // Section end offset / 200
     nca_header.section_entries[0]._0x8[0] = 0x1;                                                     // Always 1
 
     nca_header.fs_headers[0].hash_type = HASH_TYPE_PFS0;
     nca_header.fs_headers[0].fs_type = FS_TYPE_PFS0;
     nca_header.fs_headers[0].version = 0x2; // Always 2
     nca_header.fs_headers[0].pfs0_superblock.always_2 = 0x2;
-    nca_header.fs_headers[0].pfs0_superblock.block_size = exefs_hash_block_size;
+    nca_header.fs_headers[0].pfs0_superblock.block_size = PFS0_EXEFS_HASH_BLOCK_SIZE;
     if (settings->plaintext == 0)
         nca_header.fs_headers[0].crypt_type = CRYPT_CTR;
     else
         nca_header.fs_headers[0].crypt_type = CRYPT_NONE;
 
     // Calculate master hash and section hash
-    printf("\n===> Calculating Hashes:\n");
-    printf("Calculating Master hash\n");
-    pfs0_calculate_master_hash(&program_exefs_hash_table, nca_header.fs_headers[0].pfs0_superblock.hash_table_size, nca_header.fs_headers[0].pfs0_superblock.master_hash);
-    printf("Calculating Section hash\n");
+    hp_log("\n===> Calculating Hashes:\n");
+    hp_log("Calculating Master hash\n");
+    pfs0_calculate_master_hash(&sections.exefs_hash_table, nca_header.fs_headers[0].pfs0_superblock.hash_table_size, nca_header.fs_headers[0].pfs0_superblock.master_hash);
+    hp_log("Calculating Section hash\n");
     nca_calculate_section_hash(&nca_header.fs_headers[0], nca_header.section_hashes[0]);
 
-    if (settings->romfs_dir.valid == VALIDITY_VALID)
+    if (nca_has_romfs(settings))
     {
 
-        printf("\n---> Creating Section 1:");
-
-        // Set IVFC levels temp filepaths
-        filepath_t ivfc_lvls_path[6];
-        for (int a = 0; a < 6; a++)
-        {
-            filepath_init(&ivfc_lvls_path[a]);
-            filepath_copy(&ivfc_lvls_path[a], &settings->temp_dir);
-            filepath_append(&ivfc_lvls_path[a], "program_sec1_ivfc_lvl%i", a + 1);
-        }
+        hp_log("\n---> Creating Section 1:");
 
         //Build RomFS
-        printf("\n===> Building RomFS\n");
-        romfs_build(&settings->romfs_dir, &ivfc_lvls_path[5], &nca_header.fs_headers[1].romfs_superblock.ivfc_header.level_headers[5].hash_data_size);
-        nca_header.fs_headers[1].romfs_superblock.ivfc_header.level_headers[5].block_size = 0x0E; // 0x4000
-
-        // Create IVFC levels
-        printf("\n===> Creating IVFC levels\n");
-        for (int b = 4; b >= 0; b--)
-        {
-            printf("Writing %s\n", ivfc_lvls_path[b].char_path);
-            ivfc_create_level(&ivfc_lvls_path[b], &ivfc_lvls_path[b + 1], &nca_header.fs_headers[1].romfs_superblock.ivfc_header.level_headers[b].hash_data_size);
-            nca_header.fs_headers[1].romfs_superblock.ivfc_header.level_headers[b].block_size = 0x0E; // 0x4000
-        }
-
-        // Set IVFC levels logical offset
-        nca_header.fs_headers[1].romfs_superblock.ivfc_header.level_headers[0].logical_offset = 0;
-        for (int i = 1; i <= 5; i++)
-            nca_header.fs_headers[1].romfs_superblock.ivfc_header.level_headers[i].logical_offset = nca_header.fs_headers[1].romfs_superblock.ivfc_header.level_headers[i - 1].logical_offset + nca_header.fs_headers[1].romfs_superblock.ivfc_header.level_headers[i - 1].hash_data_size;
-
-        // Write IVFC levels
-        printf("\n===> Writing IVFC levels\n");
-        for (int c = 0; c < 6; c++)
-        {
-            printf("Writing %s to %s\n", ivfc_lvls_path[c].char_path, program_nca_path.char_path);
-            nca_write_file(program_nca_file, &ivfc_lvls_path[c]);
-        }
+        hp_log("\n===> Building RomFS\n");
+        if (settings->bktr == 1)
+            bktr_write_romfs_section(settings, nca_file, &sections.romfs_ctx, &nca_header.fs_headers[1]);
+        else if (settings->compress_romfs == 1)
+            compress_write_romfs_section(settings, nca_file, &sections.romfs_ctx, &nca_header.fs_headers[1]);
+        else
+            nca_write_prepared_romfs_section(nca_file, &sections.romfs_ctx, &nca_header.fs_headers[1].romfs_superblock.ivfc_header);
 
         // Write Padding if required
-        nca_write_padding(program_nca_file);
+        nca_write_padding(nca_file, nca_offset);
 
         // Set header values
         nca_header.section_entries[1].media_start_offset = nca_header.section_entries[0].media_end_offset;
-        nca_header.section_entries[1].media_end_offset = (uint32_t)(ftello64(program_nca_file) / 0x200);
+        nca_header.section_entries[1].media_end_offset = (uint32_t)((ftello64(nca_file) - nca_offset) / 0x200);
         nca_header.section_entries[1]._0x8[0] = 0x1; // Always 1
 
         nca_header.fs_headers[1].hash_type = HASH_TYPE_ROMFS;
@@ -329,54 +347,39 @@ void nca_create_program(hp_settings_t *settings)
         nca_header.fs_headers[1].romfs_superblock.ivfc_header.id = 0x20000; //Always 0x20000
         nca_header.fs_headers[1].romfs_superblock.ivfc_header.master_hash_size = 0x20;
         nca_header.fs_headers[1].romfs_superblock.ivfc_header.num_levels = 0x7;
-        if (settings->plaintext == 0)
+        if (settings->bktr == 1)
+            nca_header.fs_headers[1].crypt_type = CRYPT_BKTR;
+        else if (settings->plaintext == 0)
             nca_header.fs_headers[1].crypt_type = CRYPT_CTR;
         else
             nca_header.fs_headers[1].crypt_type = CRYPT_NONE;
 
         // Calculate master hash and section hash
-        printf("\n===> Calculating Hashes:\n");
-        printf("Calculating Master hash\n");
-        ivfc_calculate_master_hash(&ivfc_lvls_path[0], nca_header.fs_headers[1].romfs_superblock.ivfc_header.master_hash);
-        printf("Calculating Section hash\n");
+        hp_log("\n===> Calculating Hashes:\n");
+        hp_log("Calculating Section hash\n");
         nca_calculate_section_hash(&nca_header.fs_headers[1], nca_header.section_hashes[1]);
     }
 
     if (settings->logo_dir.valid == VALIDITY_VALID)
     {
-        printf("\n---> Creating Section 2:");
-
-        //Build logo
-        filepath_t program_logo;
-        filepath_init(&program_logo);
-        filepath_copy(&program_logo, &settings->temp_dir);
-        filepath_append(&program_logo, "program_sec2_logo");
-        filepath_t program_logo_hash_table;
-        filepath_init(&program_logo_hash_table);
-        filepath_copy(&program_logo_hash_table, &settings->temp_dir);
-        filepath_append(&program_logo_hash_table, "program_sec2_logo_hashtable");
-        uint32_t logo_hash_block_size = PFS0_LOGO_HASH_BLOCK_SIZE;
-        printf("\n===> Building PFS0\n");
-        pfs0_build(&settings->logo_dir, &program_logo, &nca_header.fs_headers[2].pfs0_superblock.pfs0_size);
-        printf("Calculating hash table\n");
-        pfs0_create_hashtable(&program_logo, &program_logo_hash_table, logo_hash_block_size, &nca_header.fs_headers[2].pfs0_superblock.hash_table_size, &nca_header.fs_headers[2].pfs0_superblock.pfs0_offset);
+        hp_log("\n---> Creating Section 2:");
 
         // Write PFS0
-        printf("\n===> Writing Logo\n");
-        printf("Writing PFS0 hash table\n");
-        nca_write_file(program_nca_file, &program_logo_hash_table);
-        printf("Writing PFS0\n");
-        nca_write_file(program_nca_file, &program_logo);
+        hp_log("\n===> Writing Logo\n");
+        hp_log("Writing PFS0 hash table\n");
+        nca_write_file(nca_file, &sections.logo_hash_table);
+        hp_log("Writing PFS0\n");
+        nca_write_file(nca_file, &sections.logo);
 
         // Write Padding if required
-        nca_write_padding(program_nca_file);
+        nca_write_padding(nca_file, nca_offset);
 
-        if (settings->romfs_dir.valid == VALIDITY_VALID)
+        if (nca_has_romfs(settings))
             nca_header.section_entries[2].media_start_offset = nca_header.section_entries[1].media_end_offset;
         else
             nca_header.section_entries[2].media_start_offset = nca_header.section_entries[0].media_end_offset;
 
-        nca_header.section_entries[2].media_end_offset = (uint32_t)(ftello64(program_nca_file) / 0x200); // Section end offset / 200
+        nca_header.section_entries[2].media_end_offset = (uint32_t)((ftello64(nca_file) - nca_offset) / 0x200); // Section end offset / 200
         nca_header.section_entries[2]._0x8[0] = 0x1;                                                     // Always 1
 
         nca_header.fs_headers[2].hash_type = HASH_TYPE_PFS0;
@@ -384,17 +387,17 @@ void nca_create_program(hp_settings_t *settings)
         nca_header.fs_headers[2].version = 0x2;    // Always 2
         nca_header.fs_headers[2].crypt_type = 0x1; // Plain text
         nca_header.fs_headers[2].pfs0_superblock.always_2 = 0x2;
-        nca_header.fs_headers[2].pfs0_superblock.block_size = logo_hash_block_size;
+        nca_header.fs_headers[2].pfs0_superblock.block_size = PFS0_LOGO_HASH_BLOCK_SIZE;
 
         // Calculate master hash and section hash
-        printf("\n===> Calculating Hashes:\n");
-        printf("Calculating Master hash\n");
-        pfs0_calculate_master_hash(&program_logo_hash_table, nca_header.fs_headers[2].pfs0_superblock.hash_table_size, nca_header.fs_headers[2].pfs0_superblock.master_hash);
-        printf("Calculating Section hash\n");
+        hp_log("\n===> Calculating Hashes:\n");
+        hp_log("Calculating Master hash\n");
+        pfs0_calculate_master_hash(&sections.logo_hash_table, nca_header.fs_headers[2].pfs0_superblock.hash_table_size, nca_header.fs_headers[2].pfs0_superblock.master_hash);
+        hp_log("Calculating Section hash\n");
         nca_calculate_section_hash(&nca_header.fs_headers[2], nca_header.section_hashes[2]);
     }
 
-    printf("\n---> Finalizing:\n");
+    hp_log("\n---> Finalizing:\n");
 
     if (settings->has_title_key == 0)
         // Set encrypted key area key 2
@@ -409,113 +412,127 @@ void nca_create_program(hp_settings_t *settings)
         nca_header.rights_id[15] = (uint8_t)settings->keygeneration;
     }
 
-    printf("===> Encrypting NCA\n");
+    hp_log("===> Encrypting NCA\n");
     // Encrypt sections
     if (settings->plaintext == 0)
     {
-        printf("Encrypting section 0\n");
-        nca_encrypt_section(program_nca_file, &nca_header, 0, settings);
-        if (settings->romfs_dir.valid == VALIDITY_VALID)
+        hp_log("Encrypting section 0\n");
+        nca_encrypt_section(nca_file, nca_offset, &nca_header, 0, settings);
+        if (nca_has_romfs(settings))
         {
-            printf("Encrypting section 1\n");
-            nca_encrypt_section(program_nca_file, &nca_header, 1, settings);
+            hp_log("Encrypting section 1\n");
+            nca_encrypt_section(nca_file, nca_offset, &nca_header, 1, settings);
         }
     }
 
     // Crypto type
-    printf("Getting NCA file size\n");
-    fseeko64(program_nca_file, 0, SEEK_END);
-    nca_header.nca_size = (uint64_t)ftello64(program_nca_file);
+    hp_log("Getting NCA file size\n");
+    fseeko64(nca_file, 0, SEEK_END);
+    nca_header.nca_size = (uint64_t)ftello64(nca_file) - nca_offset;
     if (settings->has_title_key == 0)
     {
-        printf("Encrypting key area\n");
+        hp_log("Encrypting key area\n");
         nca_encrypt_key_area(&nca_header, settings);
     }
-    else
-    {
-        // Create cert and tik
-        ticket_create_cert(settings);
-        ticket_create_tik(settings);
-    }
 
     // Fill NCA signature
     if (settings->nca_sig1_private_key.valid == VALIDITY_INVALID)
     {
-        printf("Generating signature\n");
+        hp_log("Generating signature\n");
         nca_generate_sig(nca_header.fixed_key_sig, settings);
     }
     else
     {
         // Sign header with specified private key
-        printf("Signing NCA header\n");
+        hp_log("Signing NCA header\n");
         rsa_sign_with_file(&nca_header.magic, 0x200, nca_header.fixed_key_sig, 0x100, settings->nca_sig1_private_key.char_path);
     }
 
     // Sign header with acid public key (signature 2)
     if ((settings->noselfsignncasig2) == 0 || (settings->nca_sig2_private_key.valid == VALIDITY_VALID))
     {
-        printf("Signing NCA header signature 2\n");
+        hp_log("Signing NCA header signature 2\n");
         if (settings->nca_sig2_private_key.valid == VALIDITY_VALID)
             rsa_sign_with_file(&nca_header.magic, 0x200, (unsigned char *)&nca_header.npdm_key_sig, 0x100, settings->nca_sig2_private_key.char_path);
         else
             rsa_sign(&nca_header.magic, 0x200, (unsigned char *)&nca_header.npdm_key_sig, 0x100, (char *)rsa_get_acid_private_key());
     }
 
-    printf("Encrypting header\n");
+    hp_log("Encrypting header\n");
     nca_encrypt_header(&nca_header, settings);
 
     // Write NCA header
-    printf("\n===> Writing NCA header\n");
-    printf("Writing NCA header to %s\n", program_nca_path.char_path);
-    fseeko64(program_nca_file, 0, SEEK_SET);
-    fwrite(&nca_header, 1, sizeof(nca_header), program_nca_file);
+    hp_log("\n===> Writing NCA header\n");
+    hp_log("Writing NCA header\n");
+    fseeko64(nca_file, nca_offset, SEEK_SET);
+    fwrite(&nca_header, 1, sizeof(nca_header), nca_file);
 
     // Calculate hash and nca size
-    printf("\n===> Post creation process\n");
-    printf("Calculating NCA hash\n");
-    unsigned char nca_hash[0x20];
-    nca_calculate_hash(program_nca_file, nca_hash);
-
-    fclose(program_nca_file);
+    hp_log("\n===> Post creation process\n");
+    hp_log("Calculating NCA hash\n");
+    nca_set_digest(nca_file, nca_offset, out_digest);
+}
 
-    // Rename Program.nca to ncaid.nca
+void nca_create_program(hp_settings_t *settings, hp_nca_digest_t *out_digest)
+{
+    hp_log("----> Creating Program NCA:\n");
+    cache_entry_t cache_entry;
+    cache_init(settings, &cache_entry);
     filepath_t program_nca_final_path;
-    filepath_init(&program_nca_final_path);
-    filepath_copy(&program_nca_final_path, &settings->out_dir);
-    char program_nca_name[37];
-    hexBinaryString(nca_hash, 16, program_nca_name, 33);
-    strcat(program_nca_name, ".nca");
-    program_nca_name[36] = '\0';
-    printf("Renaming Program.nca to %s\n", program_nca_name);
-    filepath_append(&program_nca_final_path, "%s", program_nca_name);
-    os_rename(program_nca_path.os_path, program_nca_final_path.os_path);
-    printf("\n----> Created Program NCA: %s\n", program_nca_final_path.char_path);
+    hp_nca_digest_t digest;
+    if (cache_lookup(settings, &cache_entry, &program_nca_final_path, &digest) == 0)
+    {
+        filepath_t program_nca_path;
+        filepath_init(&program_nca_path);
+        filepath_copy(&program_nca_path, &settings->out_dir);
+        filepath_append(&program_nca_path, "Program.nca");
+
+        FILE *program_nca_file;
+        program_nca_file = os_fopen(program_nca_path.os_path, OS_MODE_WRITE_EDIT);
+        if (program_nca_file == NULL)
+        {
+            hp_error("Failed to create %s!\n", program_nca_path.char_path);
+            hp_exit_failure();
+        }
+
+        // Variants are encrypted from the plaintext sections of this build
+        if (settings->variants.valid == VALIDITY_VALID)
+            settings->variant_writer = rekey_variants_open(settings);
+        nca_build_program(settings, program_nca_file, &digest);
+        os_fclose(program_nca_file);
+
+        // Rename Program.nca to ncaid.nca
+        nca_rename_to_id(settings, &program_nca_path, &digest, 0, &program_nca_final_path);
+        cache_store(settings, &cache_entry, &program_nca_final_path, &digest);
+    }
+
+    if (settings->has_title_key == 1)
+    {
+        // Create cert and tik
+        ticket_create_cert(settings);
+        ticket_create_tik(settings);
+    }
+
+    nca_write_sidecar(settings, &program_nca_final_path, &digest);
+    hp_log("\n----> Created Program NCA: %s\n", program_nca_final_path.char_path);
+    if (out_digest != NULL)
+        *out_digest = digest;
 }
 
-void nca_create_meta(hp_settings_t *settings)
+/* Appends a metadata NCA to nca_file. */
+void nca_build_meta(hp_settings_t *settings, FILE *nca_file, hp_nca_digest_t *out_digest)
 {
-    printf("----> Creating metadata NCA:\n");
-    printf("===> Creating NCA header\n");
+    hp_log("===> Creating NCA header\n");
     nca_header_t nca_header;
     memset(&nca_header, 0, sizeof(nca_header));
 
-    filepath_t meta_nca_path;
-    filepath_init(&meta_nca_path);
-    filepath_copy(&meta_nca_path, &settings->out_dir);
-    filepath_append(&meta_nca_path, "Meta.nca");
-
-    FILE *meta_nca_file;
-    meta_nca_file = os_fopen(meta_nca_path.os_path, OS_MODE_WRITE_EDIT);
+    // Offsets in the NCA are relative to where it starts in nca_file
+    fseeko64(nca_file, 0, SEEK_END);
+    uint64_t nca_offset = (uint64_t)ftello64(nca_file);
 
     // Write placeholder for NCA header
-    printf("Writing NCA header placeholder to %s\n", meta_nca_path.char_path);
-    if (meta_nca_file != NULL)
-        fwrite(&nca_header, 1, sizeof(nca_header), meta_nca_file);
-    else
-    {
-        fprintf(stderr, "Failed to create %s!\n", meta_nca_path.char_path);
-        exit(EXIT_FAILURE);
-    }
+    hp_log("Writing NCA header placeholder\n");
+    fwrite(&nca_header, 1, sizeof(nca_header), nca_file);
 
     filepath_t cnmt_path;
     filepath_init(&cnmt_path);
@@ -527,13 +544,13 @@ void nca_create_meta(hp_settings_t *settings)
     // Create cnmt directory if required
     os_makedir(cnmt_dir_path.os_path);
     // Cnmt filename = titletype_tid.cnmt
-    printf("\n===> Creating Metadata file\n");
+    hp_log("\n===> Creating Metadata file\n");
     if (settings->title_type == TITLE_TYPE_APPLICATION)
     {
         filepath_append(&cnmt_path, "Application_%016" PRIx64 ".cnmt", settings->title_id);
         if (settings->cnmt.valid == VALIDITY_VALID)
         {
-            printf("Copying %s to %s\n", settings->cnmt.char_path, cnmt_path.char_path);
+            hp_log("Copying %s to %s\n", settings->cnmt.char_path, cnmt_path.char_path);
             filepath_copy_file(&settings->cnmt, &cnmt_path);
         }
         else
@@ -544,7 +561,7 @@ void nca_create_meta(hp_settings_t *settings)
         filepath_append(&cnmt_path, "AddOnContent_%016" PRIx64 ".cnmt", settings->title_id);
         if (settings->cnmt.valid == VALIDITY_VALID)
         {
-            printf("Copying %s to %s\n", settings->cnmt.char_path, cnmt_path.char_path);
+            hp_log("Copying %s to %s\n", settings->cnmt.char_path, cnmt_path.char_path);
             filepath_copy_file(&settings->cnmt, &cnmt_path);
         }
         else
@@ -555,7 +572,7 @@ void nca_create_meta(hp_settings_t *settings)
         filepath_append(&cnmt_path, "SystemProgram_%016" PRIx64 ".cnmt", settings->title_id);
         if (settings->cnmt.valid == VALIDITY_VALID)
         {
-            printf("Copying %s to %s\n", settings->cnmt.char_path, cnmt_path.char_path);
+            hp_log("Copying %s to %s\n", settings->cnmt.char_path, cnmt_path.char_path);
             filepath_copy_file(&settings->cnmt, &cnmt_path);
         }
         else
@@ -566,7 +583,7 @@ void nca_create_meta(hp_settings_t *settings)
         filepath_append(&cnmt_path, "SystemData_%016" PRIx64 ".cnmt", settings->title_id);
         if (settings->cnmt.valid == VALIDITY_VALID)
         {
-            printf("Copying %s to %s\n", settings->cnmt.char_path, cnmt_path.char_path);
+            hp_log("Copying %s to %s\n", settings->cnmt.char_path, cnmt_path.char_path);
             filepath_copy_file(&settings->cnmt, &cnmt_path);
         }
         else
@@ -577,14 +594,11 @@ void nca_create_meta(hp_settings_t *settings)
         filepath_append(&cnmt_path, "Patch_%016" PRIx64 ".cnmt", settings->title_id);
         if (settings->cnmt.valid == VALIDITY_VALID)
         {
-            printf("Copying %s to %s\n", settings->cnmt.char_path, cnmt_path.char_path);
+            hp_log("Copying %s to %s\n", settings->cnmt.char_path, cnmt_path.char_path);
             filepath_copy_file(&settings->cnmt, &cnmt_path);
         }
         else
-        {
-            fprintf(stderr, "Creating Patch metadata without providing cnmt is not supported yet!\n");
-            exit(EXIT_FAILURE);
-        }
+            cnmt_create_patch(&cnmt_path, settings);
     }
 
     //Build PFS0
@@ -597,20 +611,20 @@ void nca_create_meta(hp_settings_t *settings)
     filepath_copy(&meta_pfs0_hash_table, &settings->temp_dir);
     filepath_append(&meta_pfs0_hash_table, "meta_sec0_pfs0_hashtable");
     uint32_t meta_hash_block_size = PFS0_META_HASH_BLOCK_SIZE;
-    printf("\n===> Building PFS0\n");
+    hp_log("\n===> Building PFS0\n");
     pfs0_build(&cnmt_dir_path, &meta_pfs0, &nca_header.fs_headers[0].pfs0_superblock.pfs0_size);
-    printf("Calculating hash table\n");
+    hp_log("Calculating hash table\n");
     pfs0_create_hashtable(&meta_pfs0, &meta_pfs0_hash_table, meta_hash_block_size, &nca_header.fs_headers[0].pfs0_superblock.hash_table_size, &nca_header.fs_headers[0].pfs0_superblock.pfs0_offset);
 
     // Write ExeFS
-    printf("\n===> Writing PFS0 section\n");
-    printf("Writing PFS0 hash table\n");
-    nca_write_file(meta_nca_file, &meta_pfs0_hash_table);
-    printf("Writing PFS0\n");
-    nca_write_file(meta_nca_file, &meta_pfs0);
+    hp_log("\n===> Writing PFS0 section\n");
+    hp_log("Writing PFS0 hash table\n");
+    nca_write_file(nca_file, &meta_pfs0_hash_table);
+    hp_log("Writing PFS0\n");
+    nca_write_file(nca_file, &meta_pfs0);
 
     // Write Padding if required
-    nca_write_padding(meta_nca_file);
+    nca_write_padding(nca_file, nca_offset);
 
     // Common values
     nca_header.magic = MAGIC_NCA3;
@@ -622,7 +636,7 @@ void nca_create_meta(hp_settings_t *settings)
     nca_set_keygen(&nca_header, settings);
 
     nca_header.section_entries[0].media_start_offset = 0x6;                                       // 0xC00 / 0x200
-    nca_header.section_entries[0].media_end_offset = (uint32_t)(ftello64(meta_nca_file) / 0x200); // Section end offset / 200
+    nca_header.section_entries[0].media_end_offset = (uint32_t)((ftello64(nca_file) - nca_offset) / 0x200); // Section end offset / 200
     nca_header.section_entries[0]._0x8[0] = 0x1;                                                  // Always 1
 
     nca_header.fs_headers[0].hash_type = HASH_TYPE_PFS0;
@@ -636,125 +650,361 @@ void nca_create_meta(hp_settings_t *settings)
         nca_header.fs_headers[0].crypt_type = CRYPT_NONE;
 
     // Calculate master hash and section hash
-    printf("\n===> Calculating Hashes:\n");
-    printf("Calculating Master hash\n");
+    hp_log("\n===> Calculating Hashes:\n");
+    hp_log("Calculating Master hash\n");
     pfs0_calculate_master_hash(&meta_pfs0_hash_table, nca_header.fs_headers[0].pfs0_superblock.hash_table_size, nca_header.fs_headers[0].pfs0_superblock.master_hash);
-    printf("Calculating Section hash\n");
+    hp_log("Calculating Section hash\n");
     nca_calculate_section_hash(&nca_header.fs_headers[0], nca_header.section_hashes[0]);
 
-    printf("\n---> Finalizing:\n");
+    hp_log("\n---> Finalizing:\n");
 
     // Set encrypted key area key 2
     memcpy(nca_header.encrypted_keys[2], settings->keyareakey, 0x10);
 
-    printf("===> Encrypting NCA\n");
+    hp_log("===> Encrypting NCA\n");
     if (settings->plaintext == 0)
     {
         // Encrypt section 0
-        printf("Encrypting section 0\n");
-        nca_encrypt_section(meta_nca_file, &nca_header, 0, settings);
+        hp_log("Encrypting section 0\n");
+        nca_encrypt_section(nca_file, nca_offset, &nca_header, 0, settings);
     }
 
     // Encrypt kek
-    printf("Getting NCA file size\n");
-    fseeko64(meta_nca_file, 0, SEEK_END);
-    nca_header.nca_size = (uint64_t)ftello64(meta_nca_file);
-    printf("Encrypting key area\n");
+    hp_log("Getting NCA file size\n");
+    fseeko64(nca_file, 0, SEEK_END);
+    nca_header.nca_size = (uint64_t)ftello64(nca_file) - nca_offset;
+    hp_log("Encrypting key area\n");
     nca_encrypt_key_area(&nca_header, settings);
 
     // Fill NCA signature
     if (settings->nca_sig1_private_key.valid == VALIDITY_INVALID)
     {
-        printf("Generating signature\n");
+        hp_log("Generating signature\n");
         nca_generate_sig(nca_header.fixed_key_sig, settings);
     }
     else
     {
         // Sign header with specified private key
-        printf("Signing NCA header\n");
+        hp_log("Signing NCA header\n");
         rsa_sign_with_file(&nca_header.magic, 0x200, nca_header.fixed_key_sig, 0x100, settings->nca_sig1_private_key.char_path);
     }
 
     // Encrypt header
-    printf("Encrypting header\n");
+    hp_log("Encrypting header\n");
     nca_encrypt_header(&nca_header, settings);
 
     // Write NCA header
-    printf("\n===> Writing NCA header\n");
-    printf("Writing NCA header to %s\n", meta_nca_path.char_path);
-    fseeko64(meta_nca_file, 0, SEEK_SET);
-    fwrite(&nca_header, 1, sizeof(nca_header), meta_nca_file);
+    hp_log("\n===> Writing NCA header\n");
+    hp_log("Writing NCA header\n");
+    fseeko64(nca_file, nca_offset, SEEK_SET);
+    fwrite(&nca_header, 1, sizeof(nca_header), nca_file);
 
     // Calculate hash and nca size
-    printf("\n===> Post creation process\n");
-    printf("Calculating NCA hash\n");
-    unsigned char nca_hash[0x20];
-    nca_calculate_hash(meta_nca_file, nca_hash);
+    hp_log("\n===> Post creation process\n");
+    hp_log("Calculating NCA hash\n");
+    nca_set_digest(nca_file, nca_offset, out_digest);
+}
 
-    fclose(meta_nca_file);
+static void nca_load_sidecar(filepath_t *nca_path, hp_nca_digest_t *digest)
+{
+    if (nca_path->valid != VALIDITY_VALID || digest->valid)
+        return;
+    if (nca_read_sidecar(nca_path, digest) == 0)
+        hp_log("Using hash sidecar of %s\n", nca_path->char_path);
+    else
+        hp_log("No valid hash sidecar for %s, it will be hashed\n", nca_path->char_path);
+}
+
+void nca_create_meta(hp_settings_t *settings)
+{
+    hp_log("----> Creating metadata NCA:\n");
+    filepath_t meta_nca_path;
+    filepath_init(&meta_nca_path);
+    filepath_copy(&meta_nca_path, &settings->out_dir);
+    filepath_append(&meta_nca_path, "Meta.nca");
+
+    FILE *meta_nca_file;
+    meta_nca_file = os_fopen(meta_nca_path.os_path, OS_MODE_WRITE_EDIT);
+    if (meta_nca_file == NULL)
+    {
+        hp_error("Failed to create %s!\n", meta_nca_path.char_path);
+        hp_exit_failure();
+    }
+
+    // Content records of ncas built earlier come from their sidecars when those are still current
+    hp_settings_t meta_settings = *settings;
+    if (settings->verify_sidecars == 0)
+    {
+        nca_load_sidecar(&meta_settings.programnca, &meta_settings.programnca_digest);
+        nca_load_sidecar(&meta_settings.controlnca, &meta_settings.controlnca_digest);
+        nca_load_sidecar(&meta_settings.legalnca, &meta_settings.legalnca_digest);
+        nca_load_sidecar(&meta_settings.htmldocnca, &meta_settings.htmldocnca_digest);
+        nca_load_sidecar(&meta_settings.datanca, &meta_settings.datanca_digest);
+        nca_load_sidecar(&meta_settings.publicdatanca, &meta_settings.publicdatanca_digest);
+    }
+
+    hp_nca_digest_t digest;
+    nca_build_meta(&meta_settings, meta_nca_file, &digest);
+    os_fclose(meta_nca_file);
 
     // Rename Meta.nca to ncaid.cnmt.nca
     filepath_t meta_nca_final_path;
-    filepath_init(&meta_nca_final_path);
-    filepath_copy(&meta_nca_final_path, &settings->out_dir);
-    char meta_nca_name[42];
-    hexBinaryString(nca_hash, 16, meta_nca_name, 33);
-    strcat(meta_nca_name, ".cnmt.nca");
-    meta_nca_name[41] = '\0';
-    printf("Renaming Meta.nca to %s\n", meta_nca_name);
-    filepath_append(&meta_nca_final_path, "%s", meta_nca_name);
-    os_rename(meta_nca_path.os_path, meta_nca_final_path.os_path);
-    printf("\n----> Created metadata NCA: %s\n", meta_nca_final_path.char_path);
+    nca_rename_to_id(settings, &meta_nca_path, &digest, 1, &meta_nca_final_path);
+    nca_write_sidecar(settings, &meta_nca_final_path, &digest);
+    hp_log("\n----> Created metadata NCA: %s\n", meta_nca_final_path.char_path);
 }
 
-void nca_write_file(FILE *nca_file, filepath_t *file_path)
+/* One NCA of an application, built on its own copy of the settings. */
+typedef struct
 {
-    uint64_t file_size;
-    FILE *fl;
-    fl = os_fopen(file_path->os_path, OS_MODE_READ);
+    hp_settings_t settings;
+    char *name;
+    hp_nca_digest_t *out_digest;
+} nca_application_task_t;
+
+static void nca_program_task(void *ctx)
+{
+    nca_application_task_t *task = (nca_application_task_t *)ctx;
+    hp_log("----> Processing NPDM\n");
+    npdm_process(&task->settings);
+    hp_log("\n");
+    nca_create_program(&task->settings, task->out_digest);
+}
 
-    if (fl == NULL)
+static void nca_control_task(void *ctx)
+{
+    nca_application_task_t *task = (nca_application_task_t *)ctx;
+    hp_log("\n----> Processing NACP\n");
+    nacp_process(&task->settings);
+    hp_log("\n");
+    nca_create_romfs_type(&task->settings, task->name, task->out_digest);
+}
+
+static void nca_manual_task(void *ctx)
+{
+    nca_application_task_t *task = (nca_application_task_t *)ctx;
+    hp_log("\n");
+    nca_create_romfs_type(&task->settings, task->name, task->out_digest);
+}
+
+/* Builds program, control, manual and metadata NCAs of an application in one process.
+   Program, control and manual NCAs don't depend on each other and are built side by side, the metadata NCA joins them.
+   Content records are filled from the digests captured while building, so no NCA is read back. */
+void nca_create_application(hp_settings_t *settings)
+{
+    nca_application_task_t *tasks = calloc(4, sizeof(nca_application_task_t));
+    if (tasks == NULL)
     {
-        fprintf(stderr, "Failed to open %s!\n", file_path->char_path);
-        exit(EXIT_FAILURE);
+        hp_error("Failed to allocate application tasks!\n");
+        hp_exit_failure();
+    }
+    sched_t sched;
+    sched_init(&sched);
+
+    tasks[0].settings = *settings;
+    tasks[0].settings.nca_type = NCA_TYPE_PROGRAM;
+    tasks[0].out_digest = &settings->programnca_digest;
+    uint32_t program_task = sched_add(&sched, nca_program_task, &tasks[0], 1);
+
+    // Control and legal information never use titlekey crypto or a compressed RomFS
+    tasks[1].settings = *settings;
+    tasks[1].settings.nca_type = NCA_TYPE_CONTROL;
+    tasks[1].settings.romfs_dir = settings->control_dir;
+    tasks[1].settings.romfs_base.valid = VALIDITY_INVALID;
+    tasks[1].settings.compress_romfs = 0;
+    tasks[1].settings.has_title_key = 0;
+    tasks[1].name = "Control";
+    tasks[1].out_digest = &settings->controlnca_digest;
+    sched_add(&sched, nca_control_task, &tasks[1], 1);
+
+    if (settings->htmldoc_dir.valid == VALIDITY_VALID)
+    {
+        tasks[2].settings = *settings;
+        tasks[2].settings.nca_type = NCA_TYPE_MANUAL;
+        tasks[2].settings.romfs_dir = settings->htmldoc_dir;
+        tasks[2].settings.romfs_base.valid = VALIDITY_INVALID;
+        tasks[2].name = "HtmlDocument";
+        tasks[2].out_digest = &settings->htmldocnca_digest;
+        uint32_t htmldoc_task = sched_add(&sched, nca_manual_task, &tasks[2], 1);
+        // Both write the same ticket and certificate
+        if (settings->has_title_key)
+            sched_add_dep(&sched, htmldoc_task, program_task);
+    }
+    if (settings->legal_dir.valid == VALIDITY_VALID)
+    {
+        tasks[3].settings = *settings;
+        tasks[3].settings.nca_type = NCA_TYPE_MANUAL;
+        tasks[3].settings.romfs_dir = settings->legal_dir;
+        tasks[3].settings.romfs_base.valid = VALIDITY_INVALID;
+        tasks[3].settings.compress_romfs = 0;
+        tasks[3].settings.has_title_key = 0;
+        tasks[3].name = "LegalInformation";
+        tasks[3].out_digest = &settings->legalnca_digest;
+        sched_add(&sched, nca_manual_task, &tasks[3], 1);
     }
 
-    // Get IVFC level file filesize
-    fseeko64(fl, 0, SEEK_END);
-    file_size = ftello64(fl);
-    fseeko64(fl, 0, SEEK_SET);
+    sched_run(&sched, nca_get_num_threads(settings), settings->disk_jobs);
+    sched_free(&sched);
+    free(tasks);
 
-    uint64_t read_size = 0x61A8000; // 100 MB buffer.
-    unsigned char *buf = malloc(read_size);
-    if (buf == NULL)
+    hp_settings_t nca_settings = *settings;
+    nca_settings.nca_type = NCA_TYPE_META;
+    nca_settings.title_type = TITLE_TYPE_APPLICATION;
+    nca_settings.has_title_key = 0;
+    hp_log("\n");
+    nca_create_meta(&nca_settings);
+}
+
+/* Lays out a RomFS section at the end of nca_file and writes it in place, level 6 first so no temp files are needed.
+   Compressed sections are built in the temp directory. */
+void nca_write_romfs_section(hp_settings_t *settings, FILE *nca_file, nca_fs_header_t *fs_header)
+{
+    romfs_ctx_t romfs_ctx;
+    ivfc_hdr_t *ivfc_header = &fs_header->romfs_superblock.ivfc_header;
+    nca_prepare_romfs_section(settings, &romfs_ctx, ivfc_header);
+    if (settings->compress_romfs == 1)
+        compress_write_romfs_section(settings, nca_file, &romfs_ctx, fs_header);
+    else
+        nca_write_prepared_romfs_section(nca_file, &romfs_ctx, ivfc_header);
+}
+
+/* Decrypted image of a base RomFS, read from an NCA section or a plain RomFS file. */
+typedef struct
+{
+    romfs_base_t base;
+    ncareader_t reader;
+    int8_t section_index; /* -1 for a plain RomFS file */
+    uint64_t data_offset; /* Offset of the RomFS in the file or section */
+} nca_romfs_base_t;
+
+static int nca_romfs_base_read(void *read_ctx, void *buf, uint64_t size, uint64_t offset)
+{
+    nca_romfs_base_t *romfs_base = (nca_romfs_base_t *)read_ctx;
+    if (romfs_base->section_index < 0)
+        return fio_pread(romfs_base->reader.fd, buf, size, romfs_base->data_offset + offset);
+    return ncareader_read_section(&romfs_base->reader, (uint8_t)romfs_base->section_index, buf, size, romfs_base->data_offset + offset);
+}
+
+static void nca_romfs_base_close(void *read_ctx)
+{
+    nca_romfs_base_t *romfs_base = (nca_romfs_base_t *)read_ctx;
+    ncareader_close(&romfs_base->reader);
+    free(romfs_base);
+}
+
+/* Opens --baseromfs, an NCA with a RomFS section or a decrypted RomFS image, and reads its tables. */
+static romfs_base_t *nca_open_romfs_base(hp_settings_t *settings)
+{
+    nca_romfs_base_t *romfs_base = calloc(1, sizeof(nca_romfs_base_t));
+    if (romfs_base == NULL)
     {
-        fprintf(stderr, "Failed to allocate file-read buffer!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Failed to allocate base RomFS!\n");
+        hp_exit_failure();
     }
-
-    uint64_t ofs = 0;
-    while (ofs < file_size)
+    romfs_base_t *base = &romfs_base->base;
+    filepath_copy(&base->path, &settings->romfs_base);
+    base->read_func = nca_romfs_base_read;
+    base->close_func = nca_romfs_base_close;
+    base->read_ctx = romfs_base;
+    base->num_threads = nca_get_num_threads(settings);
+
+    // A RomFS image starts with its header size, an NCA with a signature
+    uint64_t header_size = 0;
+    int fd = fio_open(&settings->romfs_base, FIO_MODE_READ);
+    if (fd < 0 || fio_pread(fd, &header_size, sizeof(header_size), 0) != 0)
     {
-        if (ofs + read_size >= file_size)
-            read_size = file_size - ofs;
-        if (fread(buf, 1, read_size, fl) != read_size)
+        hp_error("Failed to read %s!\n", settings->romfs_base.char_path);
+        hp_exit_failure();
+    }
+    if (le_dword(header_size) == sizeof(romfs_header_t))
+    {
+        hp_log("Using RomFS image %s as base\n", settings->romfs_base.char_path);
+        romfs_base->reader.fd = fd;
+        romfs_base->section_index = -1;
+        if (fio_get_size(fd, &base->size) != 0)
         {
-            fprintf(stderr, "Failed to read file %s\n", file_path->char_path);
-            exit(EXIT_FAILURE);
+            hp_error("Failed to read %s!\n", settings->romfs_base.char_path);
+            hp_exit_failure();
         }
-        fwrite(buf, read_size, 1, nca_file);
-        ofs += read_size;
+    }
+    else
+    {
+        fio_close(fd);
+        hp_log("Using RomFS of NCA %s as base\n", settings->romfs_base.char_path);
+        ncareader_open(settings, &settings->romfs_base, settings->has_base_title_key ? settings->base_title_key : NULL, &romfs_base->reader);
+        if (romfs_base->reader.has_key == 0)
+        {
+            hp_error("Error: %s uses titlekey crypto, set its titlekey with --basetitlekey\n", settings->romfs_base.char_path);
+            hp_exit_failure();
+        }
+        int section_index = ncareader_find_section(&romfs_base->reader, FS_TYPE_ROMFS, HASH_TYPE_ROMFS);
+        nca_fs_header_t *fs_header = &romfs_base->reader.header.fs_headers[section_index < 0 ? 0 : section_index];
+        if (section_index < 0 || fs_header->romfs_superblock.ivfc_header.magic != MAGIC_IVFC ||
+            (fs_header->crypt_type != CRYPT_NONE && fs_header->crypt_type != CRYPT_CTR))
+        {
+            hp_error("Error: %s doesn't have a RomFS section hacPack can read\n", settings->romfs_base.char_path);
+            hp_exit_failure();
+        }
+        ivfc_level_hdr_t *data_level = &fs_header->romfs_superblock.ivfc_header.level_headers[IVFC_MAX_LEVEL - 1];
+        romfs_base->section_index = (int8_t)section_index;
+        romfs_base->data_offset = data_level->logical_offset;
+        base->size = data_level->hash_data_size;
     }
 
-    free(buf);
-    fclose(fl);
+    romfs_base_load(base);
+    return base;
+}
+
+/* Scans the RomFS tree and lays out the IVFC levels, nothing is written yet. */
+void nca_prepare_romfs_section(hp_settings_t *settings, romfs_ctx_t *romfs_ctx, ivfc_hdr_t *ivfc_header)
+{
+    romfs_base_t *base = settings->romfs_base.valid == VALIDITY_VALID ? nca_open_romfs_base(settings) : NULL;
+    uint64_t romfs_size = romfs_prepare(&settings->romfs_dir, base, romfs_ctx);
+    ivfc_calculate_layout(ivfc_header, romfs_size);
+}
+
+/* Writes a prepared RomFS section at the end of nca_file and frees romfs_ctx. */
+void nca_write_prepared_romfs_section(FILE *nca_file, romfs_ctx_t *romfs_ctx, ivfc_hdr_t *ivfc_header)
+{
+    fseeko64(nca_file, 0, SEEK_END);
+    uint64_t section_offset = (uint64_t)ftello64(nca_file);
+    uint64_t data_offset = ivfc_header->level_headers[IVFC_MAX_LEVEL - 1].logical_offset;
+
+    hp_log("Writing RomFS\n");
+    romfs_write(romfs_ctx, nca_file, section_offset + data_offset);
+
+    hp_log("\n===> Creating IVFC levels\n");
+    ivfc_create_levels(nca_file, section_offset, ivfc_header);
+}
+
+void nca_write_file(FILE *nca_file, filepath_t *file_path)
+{
+    uint64_t file_size;
+    int fd = fio_open(file_path, FIO_MODE_READ);
+    if (fd < 0 || fio_get_size(fd, &file_size) != 0)
+    {
+        hp_error("Failed to open %s!\n", file_path->char_path);
+        hp_exit_failure();
+    }
+
+    // Copy at the current position of nca_file, in-kernel where possible
+    fflush(nca_file);
+    uint64_t offset = (uint64_t)ftello64(nca_file);
+    if (fio_copy_range(fd, 0, fileno(nca_file), offset, file_size, NULL) != 0)
+    {
+        hp_error("Failed to read file %s\n", file_path->char_path);
+        hp_exit_failure();
+    }
+    fseeko64(nca_file, offset + file_size, SEEK_SET);
+
+    fio_close(fd);
 }
 
 // Write padding for media_end_offset
-void nca_write_padding(FILE *nca_file)
+void nca_write_padding(FILE *nca_file, uint64_t nca_offset)
 {
     unsigned char *buf = (unsigned char *)calloc(1, 0x200);
-    uint64_t curr_offset = ftello64(nca_file);
+    uint64_t curr_offset = ftello64(nca_file) - nca_offset;
     uint64_t block_size = 0x200;
     uint64_t padding_size = block_size - (curr_offset % block_size);
     if (curr_offset % block_size != 0)
@@ -785,7 +1035,7 @@ void nca_encrypt_header(nca_header_t *nca_header, hp_settings_t *settings)
     free_aes_ctx(hdr_aes_ctx);
 }
 
-void nca_encrypt_section(FILE *nca_file, nca_header_t *nca_header, uint8_t section_index, hp_settings_t *settings)
+void nca_encrypt_section(FILE *nca_file, uint64_t nca_offset, nca_header_t *nca_header, uint8_t section_index, hp_settings_t *settings)
 {
     uint64_t start_offset = nca_header->section_entries[section_index].media_start_offset;
     start_offset *= 0x200;
@@ -804,11 +1054,11 @@ void nca_encrypt_section(FILE *nca_file, nca_header_t *nca_header, uint8_t secti
     }
 
     uint64_t read_size = 0x6000000; //~100 MB buffer.
-    unsigned char *buf = malloc(read_size);
+    unsigned char *buf = hp_track_buffer(malloc(read_size));
     if (buf == NULL)
     {
-        fprintf(stderr, "Failed to allocate file-read buffer!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Failed to allocate file-read buffer!\n");
+        hp_exit_failure();
     }
 
     // Set Section encryption key
@@ -820,17 +1070,20 @@ void nca_encrypt_section(FILE *nca_file, nca_header_t *nca_header, uint8_t secti
     aes_ctx_t *aes_ctx = new_aes_ctx(enc_key, 16, AES_MODE_CTR);
 
     uint64_t ofs = 0;
-    fseeko64(nca_file, start_offset, SEEK_SET);
+    fseeko64(nca_file, nca_offset + start_offset, SEEK_SET);
     while (ofs < filesize)
     {
         if (ofs + read_size >= filesize)
             read_size = filesize - ofs;
         if (fread(buf, 1, read_size, nca_file) != read_size)
         {
-            fprintf(stderr, "Failed to read file!\n");
-            exit(EXIT_FAILURE);
+            hp_error("Failed to read file!\n");
+            hp_exit_failure();
         }
-        fseeko64(nca_file, start_offset + ofs, SEEK_SET);
+        fseeko64(nca_file, nca_offset + start_offset + ofs, SEEK_SET);
+        // Variants get the plaintext before it's encrypted for this NCA
+        if (settings->variant_writer != NULL)
+            rekey_variants_write(settings->variant_writer, nca_header, section_index, buf, read_size, start_offset + ofs);
         aes_setiv(aes_ctx, ctr, 0x10);
         aes_encrypt(aes_ctx, buf, buf, read_size);
         fwrite(buf, 1, read_size, nca_file);
@@ -838,7 +1091,7 @@ void nca_encrypt_section(FILE *nca_file, nca_header_t *nca_header, uint8_t secti
         nca_update_ctr(ctr, start_offset + ofs);
     }
 
-    free(buf);
+    hp_free(buf);
     free_aes_ctx(aes_ctx);
 }
 
@@ -853,22 +1106,23 @@ void nca_update_ctr(unsigned char *ctr, uint64_t ofs)
     }
 }
 
-void nca_calculate_hash(FILE *nca_file, unsigned char *out_nca_hash)
+/* Hashes the NCA starting at nca_offset and ending at the end of nca_file. */
+void nca_calculate_hash(FILE *nca_file, uint64_t nca_offset, unsigned char *out_nca_hash)
 {
     uint64_t file_size;
-    // Get source file size
+    // Get NCA size
     fseeko64(nca_file, 0, SEEK_END);
-    file_size = (uint64_t)ftello64(nca_file);
+    file_size = (uint64_t)ftello64(nca_file) - nca_offset;
 
     sha_ctx_t *sha_ctx = new_sha_ctx(HASH_TYPE_SHA256, 0);
     uint64_t read_size = 0x61A8000; // 100 MB buffer.
-    unsigned char *buf = malloc(read_size);
-    fseeko64(nca_file, 0, SEEK_SET);
+    unsigned char *buf = hp_track_buffer(malloc(read_size));
+    fseeko64(nca_file, nca_offset, SEEK_SET);
 
     if (buf == NULL)
     {
-        fprintf(stderr, "Failed to allocate file-read buffer!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Failed to allocate file-read buffer!\n");
+        hp_exit_failure();
     }
 
     uint64_t ofs = 0;
@@ -878,18 +1132,140 @@ void nca_calculate_hash(FILE *nca_file, unsigned char *out_nca_hash)
             read_size = file_size - ofs;
         if (fread(buf, 1, read_size, nca_file) != read_size)
         {
-            fprintf(stderr, "Failed to read file!\n");
-            exit(EXIT_FAILURE);
+            hp_error("Failed to read file!\n");
+            hp_exit_failure();
         }
         sha_update(sha_ctx, buf, read_size);
         ofs += read_size;
     }
     sha_get_hash(sha_ctx, out_nca_hash);
 
-    free(buf);
+    hp_free(buf);
     free_sha_ctx(sha_ctx);
 }
 
+/* Captures the hash and size of the NCA ending at the end of nca_file. */
+void nca_set_digest(FILE *nca_file, uint64_t nca_offset, hp_nca_digest_t *out_digest)
+{
+    memset(out_digest, 0, sizeof(*out_digest));
+    nca_calculate_hash(nca_file, nca_offset, out_digest->hash);
+    fseeko64(nca_file, 0, SEEK_END);
+    out_digest->size = (uint64_t)ftello64(nca_file) - nca_offset;
+    out_digest->valid = 1;
+}
+
+/* NCA file name, ncaid.nca or ncaid.cnmt.nca for metadata NCAs. */
+void nca_get_filename(hp_nca_digest_t *digest, uint8_t is_meta, char *out_name)
+{
+    hexBinaryString(digest->hash, 16, out_name, 33);
+    strcat(out_name, is_meta ? ".cnmt.nca" : ".nca");
+}
+
+/* Renames a built NCA in out_dir to its NCA ID. */
+void nca_rename_to_id(hp_settings_t *settings, filepath_t *nca_path, hp_nca_digest_t *digest, uint8_t is_meta, filepath_t *out_final_path)
+{
+    char nca_name[42];
+    nca_get_filename(digest, is_meta, nca_name);
+    filepath_init(out_final_path);
+    filepath_copy(out_final_path, &settings->out_dir);
+    hp_log("Renaming %s to %s\n", nca_path->char_path, nca_name);
+    filepath_append(out_final_path, "%s", nca_name);
+    os_rename(nca_path->os_path, out_final_path->os_path);
+    report_add_output(nca_get_content_type_name(settings->nca_type), out_final_path->char_path, digest->hash, digest->size);
+}
+
+/* Sub-second part of the modification time, an NCA rewritten within the second of its sidecar must not match it. */
+static uint32_t nca_get_mtime_nsec(os_stat64_t *st)
+{
+#if defined(__APPLE__)
+    return (uint32_t)st->st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+    return (uint32_t)st->st_mtim.tv_nsec;
+#else
+    (void)st;
+    return 0;
+#endif
+}
+
+static void nca_sidecar_get_path(filepath_t *nca_path, filepath_t *out_path)
+{
+    char path[MAX_PATH + sizeof(NCA_SIDECAR_EXTENSION)];
+    snprintf(path, sizeof(path), "%s" NCA_SIDECAR_EXTENSION, nca_path->char_path);
+    filepath_init(out_path);
+    filepath_set(out_path, path);
+}
+
+/* Writes ncaid.nca.hash next to a built NCA. */
+void nca_write_sidecar(hp_settings_t *settings, filepath_t *nca_path, hp_nca_digest_t *digest)
+{
+    nca_sidecar_t sidecar;
+    memset(&sidecar, 0, sizeof(sidecar));
+    sidecar.magic = MAGIC_HPSC;
+    sidecar.version = NCA_SIDECAR_VERSION;
+    memcpy(sidecar.ncaid, digest->hash, 0x10);
+    memcpy(sidecar.hash, digest->hash, 0x20);
+    sidecar.size = digest->size;
+    sidecar.content_type = (uint8_t)settings->nca_type;
+    sidecar.keygeneration = settings->keygeneration;
+    os_stat64_t st;
+    if (os_stat(nca_path->os_path, &st) != 0)
+    {
+        hp_error("Failed to stat %s!\n", nca_path->char_path);
+        hp_exit_failure();
+    }
+    sidecar.mtime = (int64_t)st.st_mtime;
+    sidecar.mtime_nsec = nca_get_mtime_nsec(&st);
+    sha256_hash_buffer(sidecar.checksum, &sidecar, offsetof(nca_sidecar_t, checksum));
+
+    filepath_t sidecar_path;
+    nca_sidecar_get_path(nca_path, &sidecar_path);
+    hp_log("Writing hash sidecar %s\n", sidecar_path.char_path);
+    FILE *sidecar_file = os_fopen(sidecar_path.os_path, OS_MODE_WRITE);
+    if (sidecar_file == NULL)
+    {
+        hp_error("Failed to create %s!\n", sidecar_path.char_path);
+        hp_exit_failure();
+    }
+    size_t write_size = fwrite(&sidecar, 1, sizeof(sidecar), sidecar_file);
+    if (os_fclose(sidecar_file) != 0 || write_size != sizeof(sidecar))
+    {
+        hp_error("Failed to write %s!\n", sidecar_path.char_path);
+        hp_exit_failure();
+    }
+}
+
+/* Fills out_digest from an NCA's sidecar, returns 0 only if the sidecar is intact and the NCA's size and mtime still match. */
+int nca_read_sidecar(filepath_t *nca_path, hp_nca_digest_t *out_digest)
+{
+    filepath_t sidecar_path;
+    nca_sidecar_get_path(nca_path, &sidecar_path);
+    FILE *sidecar_file = os_fopen(sidecar_path.os_path, OS_MODE_READ);
+    if (sidecar_file == NULL)
+        return -1;
+
+    nca_sidecar_t sidecar;
+    size_t read_size = fread(&sidecar, 1, sizeof(sidecar), sidecar_file);
+    os_fclose(sidecar_file);
+    if (read_size != sizeof(sidecar) || sidecar.magic != MAGIC_HPSC || sidecar.version != NCA_SIDECAR_VERSION)
+        return -1;
+
+    unsigned char checksum[0x20];
+    sha256_hash_buffer(checksum, &sidecar, offsetof(nca_sidecar_t, checksum));
+    if (memcmp(checksum, sidecar.checksum, 0x20) != 0 || memcmp(sidecar.ncaid, sidecar.hash, 0x10) != 0)
+        return -1;
+
+    os_stat64_t st;
+    if (os_stat(nca_path->os_path, &st) != 0 || (uint64_t)st.st_size != sidecar.size || (int64_t)st.st_mtime != sidecar.mtime ||
+        nca_get_mtime_nsec(&st) != sidecar.mtime_nsec)
+        return -1;
+
+    memset(out_digest, 0, sizeof(*out_digest));
+    memcpy(out_digest->hash, sidecar.hash, 0x20);
+    out_digest->size = sidecar.size;
+    out_digest->valid = 1;
+    return 0;
+}
+
 void nca_set_keygen(nca_header_t *nca_header, hp_settings_t *settings)
 {
     if (settings->keygeneration != 1)
@@ -921,6 +1297,14 @@ void nca_generate_sig(uint8_t *nca_sig, hp_settings_t *settings)
     }
 }
 
+char *nca_get_content_type_name(uint8_t type)
+{
+    static char *names[] = {"program", "meta", "control", "manual", "data", "publicdata"};
+    if (type < sizeof(names) / sizeof(names[0]))
+        return names[type];
+    return "unknown";
+}
+
 char *nca_romfs_get_type(uint8_t type)
 {
     switch (type)
@@ -938,7 +1322,7 @@ char *nca_romfs_get_type(uint8_t type)
         return "PublicData";
         break;
     default:
-        fprintf(stderr, "Unknown NCA type\n");
-        exit(EXIT_FAILURE);
+        hp_error("Unknown NCA type\n");
+        hp_exit_failure();
     }
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -9,6 +9,9 @@
 #include "ivfc.h"
 
 #define MAGIC_NCA3 0x3341434E /* "NCA3" */
+#define MAGIC_HPSC 0x43535048 /* "HPSC" */
+#define NCA_SIDECAR_EXTENSION ".hash"
+#define NCA_SIDECAR_VERSION 2 /* 2 added mtime_nsec */
 
 #pragma pack(push, 1)
 typedef struct
@@ -39,6 +42,32 @@ typedef enum
     CRYPT_BKTR = 4,
 } section_crypt_type_t;
 
+#define MAGIC_BKTR 0x52544B42 /* "BKTR" */
+
+/* Bucket tree table of a BKTR section, offset is in the section. */
+#pragma pack(push, 1)
+typedef struct
+{
+    uint64_t offset;
+    uint64_t size;
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_entries;
+    uint32_t _0x1C;
+} bktr_header_t;
+#pragma pack(pop)
+
+/* Superblock of a patch RomFS section, the IVFC header describes the patched RomFS. */
+#pragma pack(push, 1)
+typedef struct
+{
+    ivfc_hdr_t ivfc_header;
+    uint8_t _0xE0[0x18];
+    bktr_header_t relocation_header;
+    bktr_header_t subsection_header;
+} bktr_superblock_t;
+#pragma pack(pop)
+
 /* NCA FS header. */
 #pragma pack(push, 1)
 typedef struct
@@ -51,12 +80,33 @@ typedef struct
     union { /* FS-specific superblock. Size = 0x138. */
         pfs0_superblock_t pfs0_superblock;
         romfs_superblock_t romfs_superblock;
+        bktr_superblock_t bktr_superblock;
     };
     uint8_t section_ctr[0x8];
-    uint8_t _0x148[0xB8]; /* Padding. */
+    uint8_t _0x148[0x30]; /* Sparse info. */
+    bktr_header_t compression_header; /* Compressed RomFS table, offset is in the IVFC data level. */
+    uint8_t _0x198[0x68]; /* Padding. */
 } nca_fs_header_t;
 #pragma pack(pop)
 
+/* Hash sidecar written next to every built NCA, lets metadata builds skip hashing it again. */
+#pragma pack(push, 1)
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint8_t ncaid[0x10];
+    uint8_t hash[0x20];   /* SHA-256 of the whole NCA. */
+    uint64_t size;
+    int64_t mtime;        /* NCA modification time when the sidecar was written. */
+    uint8_t content_type;
+    uint8_t keygeneration;
+    uint32_t mtime_nsec;  /* Nanoseconds of mtime, 0 where the OS doesn't have them. */
+    uint8_t _0x4E[0x2];   /* Padding. */
+    uint8_t checksum[0x20]; /* SHA-256 of the fields above. */
+} nca_sidecar_t;
+#pragma pack(pop)
+
 /* Nintendo content archive header. */
 #pragma pack(push, 1)
 typedef struct
@@ -92,19 +142,32 @@ typedef struct
 } nca_header_t;
 #pragma pack(pop)
 
-void nca_create_romfs_type(hp_settings_t *settings, char *nca_type);
-void nca_create_program(hp_settings_t *settings);
+void nca_build_romfs_type(hp_settings_t *settings, FILE *nca_file, hp_nca_digest_t *out_digest);
+void nca_build_program(hp_settings_t *settings, FILE *nca_file, hp_nca_digest_t *out_digest);
+void nca_build_meta(hp_settings_t *settings, FILE *nca_file, hp_nca_digest_t *out_digest);
+void nca_create_romfs_type(hp_settings_t *settings, char *nca_type, hp_nca_digest_t *out_digest);
+void nca_create_program(hp_settings_t *settings, hp_nca_digest_t *out_digest);
 void nca_create_meta(hp_settings_t *settings);
-void nca_write_padding(FILE *nca_file);
-void nca_write_file(FILE *nca_file, filepath_t *ivfc_level_path);
+void nca_create_application(hp_settings_t *settings);
+void nca_write_padding(FILE *nca_file, uint64_t nca_offset);
+void nca_write_romfs_section(hp_settings_t *settings, FILE *nca_file, nca_fs_header_t *fs_header);
+void nca_prepare_romfs_section(hp_settings_t *settings, romfs_ctx_t *romfs_ctx, ivfc_hdr_t *ivfc_header);
+void nca_write_prepared_romfs_section(FILE *nca_file, romfs_ctx_t *romfs_ctx, ivfc_hdr_t *ivfc_header);
+void nca_write_file(FILE *nca_file, filepath_t *file_path);
 void nca_calculate_section_hash(nca_fs_header_t *fs_header, uint8_t *out_section_hash);
-void nca_calculate_hash(FILE *nca_file, unsigned char *out_nca_hash);
+void nca_calculate_hash(FILE *nca_file, uint64_t nca_offset, unsigned char *out_nca_hash);
+void nca_set_digest(FILE *nca_file, uint64_t nca_offset, hp_nca_digest_t *out_digest);
+void nca_get_filename(hp_nca_digest_t *digest, uint8_t is_meta, char *out_name);
+void nca_rename_to_id(hp_settings_t *settings, filepath_t *nca_path, hp_nca_digest_t *digest, uint8_t is_meta, filepath_t *out_final_path);
+void nca_write_sidecar(hp_settings_t *settings, filepath_t *nca_path, hp_nca_digest_t *digest);
+int nca_read_sidecar(filepath_t *nca_path, hp_nca_digest_t *out_digest);
 void nca_encrypt_key_area(nca_header_t *nca_header, hp_settings_t *settings);
 void nca_encrypt_header(nca_header_t *nca_header, hp_settings_t *settings);
-void nca_encrypt_section(FILE *nca_file, nca_header_t *nca_header, uint8_t section_index, hp_settings_t *settings);
+void nca_encrypt_section(FILE *nca_file, uint64_t nca_offset, nca_header_t *nca_header, uint8_t section_index, hp_settings_t *settings);
 void nca_update_ctr(unsigned char *ctr, uint64_t ofs);
 void nca_set_keygen(nca_header_t *nca_header, hp_settings_t *settings);
 void nca_generate_sig(uint8_t *nca_sig, hp_settings_t *settings);
+char *nca_get_content_type_name(uint8_t type);
 char *nca_romfs_get_type(uint8_t type);
 
 #endif
@@ -0,0 +1,640 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "ncareader.h"
+#include "types.h"
+#include "aes.h"
+#include "fio.h"
+#include "utils.h"
+
+typedef struct
+{
+    uint64_t offset; /* In the section */
+    uint32_t size;
+    uint32_t last_used;
+    uint8_t section_index;
+    uint8_t valid;
+    unsigned char *data;
+} ncareader_cache_block_t;
+
+/* Small LRU cache of decrypted blocks, shared by the threads reading through one reader. */
+struct ncareader_cache
+{
+    pthread_mutex_t lock;
+    uint32_t num_blocks;
+    uint32_t clock;
+    ncareader_cache_block_t *blocks;
+    unsigned char *data;
+};
+
+uint8_t ncareader_has_rights_id(nca_header_t *nca_header)
+{
+    for (unsigned int i = 0; i < 0x10; i++)
+    {
+        if (nca_header->rights_id[i] != 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Keygeneration an NCA header was made with, the inverse of nca_set_keygen. */
+int ncareader_get_keygeneration(nca_header_t *nca_header)
+{
+    int keygeneration = nca_header->crypto_type2 > nca_header->crypto_type ? nca_header->crypto_type2 : nca_header->crypto_type;
+    return keygeneration ? keygeneration : 1;
+}
+
+/* Decrypts an NCA header in place, returns 0 if it's an NCA3 of size bytes. */
+static int ncareader_try_decrypt_header(hp_settings_t *settings, nca_header_t *header, uint64_t size)
+{
+    aes_ctx_t *hdr_aes_ctx = new_aes_ctx(settings->keyset.header_key, 32, AES_MODE_XTS);
+    aes_xts_decrypt(hdr_aes_ctx, header, header, 0xC00, 0, 0x200);
+    free_aes_ctx(hdr_aes_ctx);
+    return header->magic == MAGIC_NCA3 && header->nca_size == size ? 0 : -1;
+}
+
+static void ncareader_decrypt_header(hp_settings_t *settings, filepath_t *nca_path, nca_header_t *header, uint64_t size)
+{
+    hp_log("===> Decrypting NCA header\n");
+    if (ncareader_try_decrypt_header(settings, header, size) == 0)
+        return;
+    if (header->magic != MAGIC_NCA3)
+        hp_error("Error: %s is not an NCA3 or header_key is wrong\n", nca_path->char_path);
+    else
+        hp_error("Error: %s is 0x%" PRIx64 " bytes but its header says 0x%" PRIx64 "\n", nca_path->char_path, size, header->nca_size);
+    hp_exit_failure();
+}
+
+/* Reads and decrypts the header of nca_path, the NCA must be an NCA3 of its stated size. */
+void ncareader_read_header(hp_settings_t *settings, filepath_t *nca_path, int fd, nca_header_t *out_header, uint64_t *out_size)
+{
+    if (fio_get_size(fd, out_size) != 0 || *out_size < sizeof(*out_header) || fio_pread(fd, out_header, sizeof(*out_header), 0) != 0)
+    {
+        hp_error("Failed to read NCA header of %s!\n", nca_path->char_path);
+        hp_exit_failure();
+    }
+    ncareader_decrypt_header(settings, nca_path, out_header, *out_size);
+}
+
+/* Key area encryption key of keygeneration for the key area index of nca_header. */
+unsigned char *ncareader_get_kek(hp_settings_t *settings, nca_header_t *nca_header, int keygeneration)
+{
+    if (keygeneration < 1 || keygeneration > 0x20 || nca_header->kaek_ind >= 3)
+    {
+        hp_error("Error: Unsupported key area, keygeneration %i, key area key index %u\n", keygeneration, nca_header->kaek_ind);
+        hp_exit_failure();
+    }
+
+    unsigned char *kek = settings->keyset.key_area_keys[keygeneration - 1][nca_header->kaek_ind];
+    for (unsigned int i = 0; i < 0x10; i++)
+    {
+        if (kek[i] != 0)
+            return kek;
+    }
+    hp_error("Error: key area key for keygeneration %i is not present in keyset file\n", keygeneration);
+    hp_exit_failure();
+}
+
+void ncareader_decrypt_key_area(hp_settings_t *settings, nca_header_t *nca_header, unsigned char (*out_keys)[0x10])
+{
+    int keygeneration = ncareader_get_keygeneration(nca_header);
+    hp_log("Decrypting key area, keygeneration %i\n", keygeneration);
+    aes_ctx_t *aes_ctx = new_aes_ctx(ncareader_get_kek(settings, nca_header, keygeneration), 16, AES_MODE_ECB);
+    aes_decrypt(aes_ctx, out_keys, nca_header->encrypted_keys, 0x40);
+    free_aes_ctx(aes_ctx);
+}
+
+static void ncareader_find_key(hp_settings_t *settings, const unsigned char *title_key, ncareader_t *reader)
+{
+    if (ncareader_has_rights_id(&reader->header) == 1)
+    {
+        if (title_key != NULL)
+        {
+            memcpy(reader->key, title_key, 0x10);
+            reader->has_key = 1;
+        }
+        return;
+    }
+
+    ncareader_decrypt_key_area(settings, &reader->header, reader->key_area);
+    memcpy(reader->key, reader->key_area[2], 0x10);
+    reader->has_key = 1;
+}
+
+/* Opens nca_path and finds its section key, title_key is only used for titlekey crypto and may be NULL.
+   has_key is left clear if the NCA uses titlekey crypto and no titlekey is given. */
+void ncareader_open(hp_settings_t *settings, filepath_t *nca_path, const unsigned char *title_key, ncareader_t *reader)
+{
+    memset(reader, 0, sizeof(*reader));
+    filepath_copy(&reader->path, nca_path);
+    reader->fd = fio_open(nca_path, FIO_MODE_READ);
+    if (reader->fd < 0)
+    {
+        hp_error("Failed to open %s!\n", nca_path->char_path);
+        hp_exit_failure();
+    }
+    ncareader_read_header(settings, nca_path, reader->fd, &reader->header, &reader->size);
+    ncareader_find_key(settings, title_key, reader);
+}
+
+/* Opens the NCA of size bytes at offset in nca_path like ncareader_open, for NCAs stored in an NSP. */
+void ncareader_open_at(hp_settings_t *settings, filepath_t *nca_path, uint64_t offset, uint64_t size, const unsigned char *title_key, ncareader_t *reader)
+{
+    memset(reader, 0, sizeof(*reader));
+    filepath_copy(&reader->path, nca_path);
+    reader->offset = offset;
+    reader->size = size;
+    reader->fd = fio_open(nca_path, FIO_MODE_READ);
+    uint64_t file_size;
+    if (reader->fd < 0 || fio_get_size(reader->fd, &file_size) != 0 || offset > file_size || size > file_size - offset || size < sizeof(reader->header) ||
+        fio_pread(reader->fd, &reader->header, sizeof(reader->header), offset) != 0)
+    {
+        hp_error("Failed to read NCA header at 0x%" PRIx64 " of %s!\n", offset, nca_path->char_path);
+        hp_exit_failure();
+    }
+    ncareader_decrypt_header(settings, nca_path, &reader->header, size);
+    ncareader_find_key(settings, title_key, reader);
+}
+
+/* Opens the NCA of size bytes at offset in nca_path like ncareader_open_at, but quietly and returning -1 instead of exiting
+   if it isn't a readable NCA, for scanning many files. has_key is also left clear if the keyset lacks its key area key. */
+int ncareader_try_open_at(hp_settings_t *settings, filepath_t *nca_path, uint64_t offset, uint64_t size, const unsigned char *title_key, ncareader_t *reader)
+{
+    memset(reader, 0, sizeof(*reader));
+    filepath_copy(&reader->path, nca_path);
+    reader->offset = offset;
+    reader->size = size;
+    reader->fd = fio_open(nca_path, FIO_MODE_READ);
+    if (reader->fd < 0 || size < sizeof(reader->header) || fio_pread(reader->fd, &reader->header, sizeof(reader->header), offset) != 0 ||
+        ncareader_try_decrypt_header(settings, &reader->header, size) != 0)
+    {
+        ncareader_close(reader);
+        return -1;
+    }
+    if (ncareader_has_rights_id(&reader->header) == 1)
+    {
+        if (title_key != NULL)
+        {
+            memcpy(reader->key, title_key, 0x10);
+            reader->has_key = 1;
+        }
+        return 0;
+    }
+
+    int keygeneration = ncareader_get_keygeneration(&reader->header);
+    if (keygeneration > 0x20 || reader->header.kaek_ind >= 3)
+        return 0;
+    unsigned char *kek = settings->keyset.key_area_keys[keygeneration - 1][reader->header.kaek_ind];
+    unsigned char empty_key[0x10] = {0};
+    if (memcmp(kek, empty_key, sizeof(empty_key)) == 0)
+        return 0;
+    unsigned char keys[4][0x10];
+    aes_ctx_t *aes_ctx = new_aes_ctx(kek, 16, AES_MODE_ECB);
+    aes_decrypt(aes_ctx, keys, reader->header.encrypted_keys, 0x40);
+    free_aes_ctx(aes_ctx);
+    memcpy(reader->key, keys[2], 0x10);
+    reader->has_key = 1;
+    return 0;
+}
+
+/* Finds the titlekey of a titlekey crypto NCA in its ticket, <rights id>.tik in tik_dirpath. */
+int ncareader_load_ticket(hp_settings_t *settings, filepath_t *tik_dirpath, ncareader_t *reader)
+{
+    char rights_id[33];
+    hexBinaryString(reader->header.rights_id, 0x10, rights_id, sizeof(rights_id));
+    filepath_t tik_path;
+    filepath_init(&tik_path);
+    filepath_copy(&tik_path, tik_dirpath);
+    filepath_append(&tik_path, "%s.tik", rights_id);
+
+    unsigned char tik[0x2C0];
+    int fd = fio_open(&tik_path, FIO_MODE_READ);
+    if (fd < 0)
+        return -1;
+    int ret = fio_pread(fd, tik, sizeof(tik), 0);
+    fio_close(fd);
+    uint8_t keygeneration = tik[0x285] ? tik[0x285] : 1;
+    if (ret != 0 || keygeneration > 0x20)
+        return -1;
+
+    aes_ctx_t *aes_ctx = new_aes_ctx(settings->keyset.titlekeks[keygeneration - 1], 16, AES_MODE_ECB);
+    aes_decrypt(aes_ctx, reader->key, tik + 0x180, 0x10);
+    free_aes_ctx(aes_ctx);
+    reader->has_key = 1;
+    return 0;
+}
+
+/* Finds the titlekey in the ticket next to the NCA, as an extracted NSP has it. */
+int ncareader_load_sibling_ticket(hp_settings_t *settings, ncareader_t *reader)
+{
+    char nca_dir[MAX_PATH];
+    snprintf(nca_dir, sizeof(nca_dir), "%s", reader->path.char_path);
+    char *separator = strrchr(nca_dir, OS_PATH_SEPARATOR[0]);
+    if (separator == NULL)
+        strcpy(nca_dir, ".");
+    else
+        separator[separator == nca_dir ? 1 : 0] = '\0';
+    filepath_t tik_dirpath;
+    filepath_init(&tik_dirpath);
+    filepath_set(&tik_dirpath, nca_dir);
+    return ncareader_load_ticket(settings, &tik_dirpath, reader);
+}
+
+/* Index of the first section with fs_type and hash_type, -1 if there is none. */
+int ncareader_find_section(ncareader_t *reader, uint8_t fs_type, uint8_t hash_type)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        nca_section_entry_t *entry = &reader->header.section_entries[i];
+        nca_fs_header_t *fs_header = &reader->header.fs_headers[i];
+        if (entry->media_end_offset > entry->media_start_offset && fs_header->fs_type == fs_type && fs_header->hash_type == hash_type)
+            return i;
+    }
+    return -1;
+}
+
+/* Reads and decrypts size bytes at offset of a section, offset and size are already checked. */
+static int ncareader_read_raw(ncareader_t *reader, uint8_t section_index, void *buf, uint64_t size, uint64_t offset)
+{
+    nca_fs_header_t *fs_header = &reader->header.fs_headers[section_index];
+    uint64_t section_offset = (uint64_t)reader->header.section_entries[section_index].media_start_offset * 0x200;
+    if (fs_header->crypt_type == CRYPT_NONE)
+        return fio_pread(reader->fd, buf, size, reader->offset + section_offset + offset);
+    if (fs_header->crypt_type != CRYPT_CTR || reader->has_key == 0)
+        return -1;
+
+    // CTR runs on 0x10 byte blocks, an unaligned read starts at the block before it
+    uint64_t nca_offset = section_offset + offset;
+    uint64_t skip = nca_offset & 0xF;
+    unsigned char *crypt_buf = skip ? malloc(size + skip) : buf;
+    if (crypt_buf == NULL || fio_pread(reader->fd, crypt_buf, size + skip, reader->offset + nca_offset - skip) != 0)
+    {
+        if (crypt_buf != buf)
+            free(crypt_buf);
+        return -1;
+    }
+
+    unsigned char ctr[0x10];
+    for (unsigned int j = 0; j < 0x8; j++)
+        ctr[j] = fs_header->section_ctr[0x8 - j - 1];
+    nca_update_ctr(ctr, nca_offset - skip);
+    aes_ctx_t *aes_ctx = new_aes_ctx(reader->key, 16, AES_MODE_CTR);
+    aes_setiv(aes_ctx, ctr, 0x10);
+    aes_decrypt(aes_ctx, crypt_buf, crypt_buf, size + skip);
+    free_aes_ctx(aes_ctx);
+
+    if (crypt_buf != buf)
+    {
+        memcpy(buf, crypt_buf + skip, size);
+        free(crypt_buf);
+    }
+    return 0;
+}
+
+static ncareader_cache_block_t *ncareader_cache_find(ncareader_cache_t *cache, uint8_t section_index, uint64_t offset)
+{
+    for (uint32_t i = 0; i < cache->num_blocks; i++)
+    {
+        ncareader_cache_block_t *block = &cache->blocks[i];
+        if (block->valid && block->section_index == section_index && block->offset == offset)
+            return block;
+    }
+    return NULL;
+}
+
+/* Reads through the block cache, blocks are decrypted outside the lock so threads missing different blocks don't wait on each other. */
+static int ncareader_read_cached(ncareader_t *reader, uint8_t section_index, unsigned char *buf, uint64_t size, uint64_t offset, uint64_t section_size)
+{
+    ncareader_cache_t *cache = reader->cache;
+    unsigned char *data = NULL;
+    while (size > 0)
+    {
+        uint64_t block_offset = offset & ~(uint64_t)(NCAREADER_CACHE_BLOCK_SIZE - 1);
+        uint32_t block_size = (uint32_t)(section_size - block_offset < NCAREADER_CACHE_BLOCK_SIZE ? section_size - block_offset : NCAREADER_CACHE_BLOCK_SIZE);
+        uint64_t copy_size = block_size - (offset - block_offset) < size ? block_size - (offset - block_offset) : size;
+
+        pthread_mutex_lock(&cache->lock);
+        ncareader_cache_block_t *block = ncareader_cache_find(cache, section_index, block_offset);
+        if (block != NULL)
+        {
+            memcpy(buf, block->data + (offset - block_offset), copy_size);
+            block->last_used = ++cache->clock;
+            pthread_mutex_unlock(&cache->lock);
+        }
+        else
+        {
+            pthread_mutex_unlock(&cache->lock);
+            if (data == NULL && (data = hp_track_buffer(malloc(NCAREADER_CACHE_BLOCK_SIZE))) == NULL)
+                return -1;
+            if (ncareader_read_raw(reader, section_index, data, block_size, block_offset) != 0)
+            {
+                hp_free(data);
+                return -1;
+            }
+            memcpy(buf, data + (offset - block_offset), copy_size);
+
+            // Another thread may have added the block meanwhile, otherwise it replaces the least recently used one
+            pthread_mutex_lock(&cache->lock);
+            if (ncareader_cache_find(cache, section_index, block_offset) == NULL)
+            {
+                block = &cache->blocks[0];
+                for (uint32_t i = 1; i < cache->num_blocks && block->valid; i++)
+                {
+                    if (!cache->blocks[i].valid || cache->blocks[i].last_used < block->last_used)
+                        block = &cache->blocks[i];
+                }
+                memcpy(block->data, data, block_size);
+                block->offset = block_offset;
+                block->size = block_size;
+                block->section_index = section_index;
+                block->valid = 1;
+                block->last_used = ++cache->clock;
+            }
+            pthread_mutex_unlock(&cache->lock);
+        }
+        buf += copy_size;
+        offset += copy_size;
+        size -= copy_size;
+    }
+    hp_free(data);
+    return 0;
+}
+
+/* Reads size bytes at offset in a section and decrypts them, returns 0 on success.
+   Reads are positional and only share the block cache, which is locked, so a reader can be used from several threads.
+   With the cache enabled, reads smaller than a cache block are served from it and large reads go straight to the file. */
+int ncareader_read_section(ncareader_t *reader, uint8_t section_index, void *buf, uint64_t size, uint64_t offset)
+{
+    if (section_index >= 4)
+        return -1;
+    nca_section_entry_t *entry = &reader->header.section_entries[section_index];
+    uint64_t section_offset = (uint64_t)entry->media_start_offset * 0x200;
+    uint64_t section_end = (uint64_t)entry->media_end_offset * 0x200;
+    if (section_end < section_offset || offset > section_end - section_offset || size > section_end - section_offset - offset)
+        return -1;
+
+    if (reader->cache != NULL && size < NCAREADER_CACHE_BLOCK_SIZE)
+        return ncareader_read_cached(reader, section_index, buf, size, offset, section_end - section_offset);
+    return ncareader_read_raw(reader, section_index, buf, size, offset);
+}
+
+/* Reads the header of the PFS0 in a PFS0 section, returns 0 on success. File offsets are after pfs0_offset and the header. */
+int ncareader_read_pfs0_header(ncareader_t *reader, uint8_t section_index, pfs0_ctx_t *pfs0_ctx)
+{
+    memset(pfs0_ctx, 0, sizeof(*pfs0_ctx));
+    if (section_index >= 4 || reader->header.fs_headers[section_index].hash_type != HASH_TYPE_PFS0)
+        return -1;
+    pfs0_superblock_t *superblock = &reader->header.fs_headers[section_index].pfs0_superblock;
+    pfs0_header_t pfs0_header;
+    if (superblock->pfs0_size < sizeof(pfs0_header) || ncareader_read_section(reader, section_index, &pfs0_header, sizeof(pfs0_header), superblock->pfs0_offset) != 0)
+        return -1;
+    uint64_t header_size = pfs0_get_header_size(&pfs0_header);
+    if (header_size == 0 || header_size > superblock->pfs0_size)
+        return -1;
+    unsigned char *header = malloc(header_size);
+    if (header == NULL || ncareader_read_section(reader, section_index, header, header_size, superblock->pfs0_offset) != 0 ||
+        pfs0_parse_header(pfs0_ctx, header, superblock->pfs0_size) != 0)
+    {
+        free(header);
+        return -1;
+    }
+    free(header);
+    return 0;
+}
+
+/* Reads the first file of the PFS0 in a PFS0 section whose name ends with suffix, returns it malloc'd or NULL. */
+unsigned char *ncareader_read_pfs0_file(ncareader_t *reader, uint8_t section_index, const char *suffix, uint64_t *out_size)
+{
+    pfs0_ctx_t pfs0_ctx;
+    if (ncareader_read_pfs0_header(reader, section_index, &pfs0_ctx) != 0)
+        return NULL;
+    pfs0_superblock_t *superblock = &reader->header.fs_headers[section_index].pfs0_superblock;
+
+    unsigned char *file = NULL;
+    size_t suffix_len = strlen(suffix);
+    for (uint32_t i = 0; i < pfs0_ctx.num_files && file == NULL; i++)
+    {
+        pfs0_file_ctx_t *entry = &pfs0_ctx.files[i];
+        size_t name_len = strlen(entry->name);
+        if (name_len < suffix_len || strcmp(entry->name + name_len - suffix_len, suffix) != 0)
+            continue;
+        file = malloc(entry->size ? entry->size : 1);
+        if (file != NULL && ncareader_read_section(reader, section_index, file, entry->size, superblock->pfs0_offset + pfs0_ctx.header_size + entry->offset) != 0)
+        {
+            free(file);
+            file = NULL;
+            break;
+        }
+        *out_size = entry->size;
+    }
+    pfs0_free_ctx(&pfs0_ctx);
+    return file;
+}
+
+/* Caches num_blocks decrypted blocks of NCAREADER_CACHE_BLOCK_SIZE for small reads, for lookups and small files read at random. */
+void ncareader_enable_cache(ncareader_t *reader, uint32_t num_blocks)
+{
+    if (reader->cache != NULL || num_blocks == 0)
+        return;
+    ncareader_cache_t *cache = calloc(1, sizeof(ncareader_cache_t));
+    if (cache == NULL || (cache->blocks = calloc(num_blocks, sizeof(ncareader_cache_block_t))) == NULL ||
+        (cache->data = malloc((size_t)num_blocks * NCAREADER_CACHE_BLOCK_SIZE)) == NULL)
+    {
+        hp_error("Failed to allocate NCA block cache!\n");
+        hp_exit_failure();
+    }
+    for (uint32_t i = 0; i < num_blocks; i++)
+        cache->blocks[i].data = cache->data + (size_t)i * NCAREADER_CACHE_BLOCK_SIZE;
+    cache->num_blocks = num_blocks;
+    pthread_mutex_init(&cache->lock, NULL);
+    reader->cache = cache;
+}
+
+/* Loads the RomFS of an IVFC section, returns 0 on success. Compressed RomFS sections and BKTR patches can't be read in place.
+   RomFS files are mostly small, so the block cache of reader is enabled if it isn't yet. */
+int ncareader_open_romfs(ncareader_t *reader, uint8_t section_index, ncareader_romfs_t *romfs)
+{
+    memset(romfs, 0, sizeof(*romfs));
+    if (section_index >= 4)
+        return -1;
+    nca_fs_header_t *fs_header = &reader->header.fs_headers[section_index];
+    if (fs_header->hash_type != HASH_TYPE_ROMFS || fs_header->romfs_superblock.ivfc_header.magic != MAGIC_IVFC ||
+        (fs_header->crypt_type != CRYPT_NONE && fs_header->crypt_type != CRYPT_CTR) || fs_header->compression_header.magic == MAGIC_BKTR)
+        return -1;
+    ivfc_level_hdr_t *data_level = &fs_header->romfs_superblock.ivfc_header.level_headers[IVFC_MAX_LEVEL - 1];
+    romfs->reader = reader;
+    romfs->section_index = section_index;
+    romfs->data_offset = data_level->logical_offset;
+    romfs->size = data_level->hash_data_size;
+
+    ncareader_enable_cache(reader, NCAREADER_CACHE_BLOCKS);
+    romfs_header_t *header = &romfs->header;
+    if (romfs->size < sizeof(romfs_header_t) || ncareader_read_section(reader, section_index, header, sizeof(romfs_header_t), romfs->data_offset) != 0)
+        return -1;
+    header->header_size = le_dword(header->header_size);
+    header->dir_hash_table_ofs = le_dword(header->dir_hash_table_ofs);
+    header->dir_hash_table_size = le_dword(header->dir_hash_table_size);
+    header->dir_table_ofs = le_dword(header->dir_table_ofs);
+    header->dir_table_size = le_dword(header->dir_table_size);
+    header->file_hash_table_ofs = le_dword(header->file_hash_table_ofs);
+    header->file_hash_table_size = le_dword(header->file_hash_table_size);
+    header->file_table_ofs = le_dword(header->file_table_ofs);
+    header->file_table_size = le_dword(header->file_table_size);
+    header->file_partition_ofs = le_dword(header->file_partition_ofs);
+    if (header->header_size != sizeof(romfs_header_t) || header->dir_table_size < sizeof(romfs_direntry_t) ||
+        header->dir_hash_table_ofs > romfs->size || header->dir_hash_table_size > romfs->size - header->dir_hash_table_ofs ||
+        header->dir_table_ofs > romfs->size || header->dir_table_size > romfs->size - header->dir_table_ofs ||
+        header->file_hash_table_ofs > romfs->size || header->file_hash_table_size > romfs->size - header->file_hash_table_ofs ||
+        header->file_table_ofs > romfs->size || header->file_table_size > romfs->size - header->file_table_ofs ||
+        header->file_partition_ofs > romfs->size)
+        return -1;
+
+    // Tables are read whole, they are a small part of the RomFS and every lookup needs them
+    romfs->dir_hash_table = malloc(header->dir_hash_table_size ? header->dir_hash_table_size : 1);
+    romfs->dir_table = malloc(header->dir_table_size);
+    romfs->file_hash_table = malloc(header->file_hash_table_size ? header->file_hash_table_size : 1);
+    romfs->file_table = malloc(header->file_table_size ? header->file_table_size : 1);
+    if (romfs->dir_hash_table == NULL || romfs->dir_table == NULL || romfs->file_hash_table == NULL || romfs->file_table == NULL ||
+        ncareader_read_section(reader, section_index, romfs->dir_hash_table, header->dir_hash_table_size, romfs->data_offset + header->dir_hash_table_ofs) != 0 ||
+        ncareader_read_section(reader, section_index, romfs->dir_table, header->dir_table_size, romfs->data_offset + header->dir_table_ofs) != 0 ||
+        ncareader_read_section(reader, section_index, romfs->file_hash_table, header->file_hash_table_size, romfs->data_offset + header->file_hash_table_ofs) != 0 ||
+        ncareader_read_section(reader, section_index, romfs->file_table, header->file_table_size, romfs->data_offset + header->file_table_ofs) != 0)
+    {
+        ncareader_close_romfs(romfs);
+        return -1;
+    }
+    return 0;
+}
+
+/* Finds the directory or file entry named name in the directory at parent through its hash table bucket, returns its offset or ROMFS_ENTRY_EMPTY. */
+static uint32_t ncareader_romfs_lookup(ncareader_romfs_t *romfs, int is_file, uint32_t parent, const char *name, size_t name_len)
+{
+    uint32_t *hash_table = is_file ? romfs->file_hash_table : romfs->dir_hash_table;
+    uint64_t hash_table_count = (is_file ? romfs->header.file_hash_table_size : romfs->header.dir_hash_table_size) / sizeof(uint32_t);
+    unsigned char *table = is_file ? (unsigned char *)romfs->file_table : (unsigned char *)romfs->dir_table;
+    uint64_t table_size = is_file ? romfs->header.file_table_size : romfs->header.dir_table_size;
+    uint64_t entry_size = is_file ? sizeof(romfs_fentry_t) : sizeof(romfs_direntry_t);
+    if (hash_table_count == 0)
+        return ROMFS_ENTRY_EMPTY;
+
+    // Chains can't be longer than the table has entries, a looped chain ends there
+    uint32_t offset = le_word(hash_table[calc_path_hash(parent, (const unsigned char *)name, 0, name_len) % hash_table_count]);
+    for (uint64_t i = 0; offset != ROMFS_ENTRY_EMPTY && i <= table_size / entry_size; i++)
+    {
+        if ((uint64_t)offset + entry_size > table_size)
+            return ROMFS_ENTRY_EMPTY;
+        uint32_t entry_parent, name_size, next;
+        const char *entry_name;
+        if (is_file)
+        {
+            romfs_fentry_t *entry = (romfs_fentry_t *)(table + offset);
+            entry_parent = le_word(entry->parent);
+            name_size = le_word(entry->name_size);
+            next = le_word(entry->hash);
+            entry_name = entry->name;
+        }
+        else
+        {
+            romfs_direntry_t *entry = (romfs_direntry_t *)(table + offset);
+            entry_parent = le_word(entry->parent);
+            name_size = le_word(entry->name_size);
+            next = le_word(entry->hash);
+            entry_name = entry->name;
+        }
+        if (name_size > table_size - offset - entry_size)
+            return ROMFS_ENTRY_EMPTY;
+        if (entry_parent == parent && name_size == name_len && memcmp(entry_name, name, name_len) == 0)
+            return offset;
+        offset = next;
+    }
+    return ROMFS_ENTRY_EMPTY;
+}
+
+/* Looks up the directories leading to the last component of path, separators are '/' and the leading one is optional.
+   out_name is NULL for the root directory. */
+static int ncareader_romfs_walk(ncareader_romfs_t *romfs, const char *path, uint32_t *out_dir_offset, const char **out_name, size_t *out_name_len)
+{
+    uint32_t dir_offset = 0;
+    const char *name = NULL;
+    size_t name_len = 0;
+    while (*path != '\0')
+    {
+        if (*path == '/')
+        {
+            path++;
+            continue;
+        }
+        size_t len = strcspn(path, "/");
+        if (name != NULL && (dir_offset = ncareader_romfs_lookup(romfs, 0, dir_offset, name, name_len)) == ROMFS_ENTRY_EMPTY)
+            return -1;
+        name = path;
+        name_len = len;
+        path += len;
+    }
+    *out_dir_offset = dir_offset;
+    *out_name = name;
+    *out_name_len = name_len;
+    return 0;
+}
+
+/* Finds the directory at path, out_dir_offset is its offset in romfs->dir_table. Returns 0 if it exists. */
+int ncareader_romfs_find_dir(ncareader_romfs_t *romfs, const char *path, uint32_t *out_dir_offset)
+{
+    const char *name;
+    size_t name_len;
+    if (ncareader_romfs_walk(romfs, path, out_dir_offset, &name, &name_len) != 0)
+        return -1;
+    if (name != NULL && (*out_dir_offset = ncareader_romfs_lookup(romfs, 0, *out_dir_offset, name, name_len)) == ROMFS_ENTRY_EMPTY)
+        return -1;
+    return 0;
+}
+
+/* Finds the file at path, every component is a single hash table lookup. Returns 0 if it exists,
+   out_offset is in the section so the file can be read with ncareader_read_section. */
+int ncareader_romfs_find_file(ncareader_romfs_t *romfs, const char *path, uint64_t *out_offset, uint64_t *out_size)
+{
+    uint32_t dir_offset;
+    const char *name;
+    size_t name_len;
+    if (ncareader_romfs_walk(romfs, path, &dir_offset, &name, &name_len) != 0 || name == NULL)
+        return -1;
+    uint32_t file_offset = ncareader_romfs_lookup(romfs, 1, dir_offset, name, name_len);
+    if (file_offset == ROMFS_ENTRY_EMPTY)
+        return -1;
+
+    romfs_fentry_t *entry = (romfs_fentry_t *)((unsigned char *)romfs->file_table + file_offset);
+    uint64_t partition_size = romfs->size - romfs->header.file_partition_ofs;
+    uint64_t offset = le_dword(entry->offset);
+    uint64_t size = le_dword(entry->size);
+    if (offset > partition_size || size > partition_size - offset)
+        return -1;
+    *out_offset = romfs->data_offset + romfs->header.file_partition_ofs + offset;
+    *out_size = size;
+    return 0;
+}
+
+void ncareader_close_romfs(ncareader_romfs_t *romfs)
+{
+    free(romfs->dir_hash_table);
+    free(romfs->dir_table);
+    free(romfs->file_hash_table);
+    free(romfs->file_table);
+    memset(romfs, 0, sizeof(*romfs));
+}
+
+void ncareader_close(ncareader_t *reader)
+{
+    if (reader->fd >= 0)
+        fio_close(reader->fd);
+    reader->fd = -1;
+    if (reader->cache != NULL)
+    {
+        pthread_mutex_destroy(&reader->cache->lock);
+        free(reader->cache->blocks);
+        free(reader->cache->data);
+        free(reader->cache);
+        reader->cache = NULL;
+    }
+}
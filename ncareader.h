@@ -0,0 +1,64 @@
+#ifndef HACPACK_NCAREADER_H
+#define HACPACK_NCAREADER_H
+
+#include "settings.h"
+#include "filepath.h"
+#include "nca.h"
+#include "pfs0.h"
+#include "romfs.h"
+
+#define NCAREADER_CACHE_BLOCK_SIZE 0x4000 // 16 KB
+#define NCAREADER_CACHE_BLOCKS 64 /* Default number of cached blocks, 1 MB */
+
+typedef struct ncareader_cache ncareader_cache_t;
+
+/* An existing NCA opened for reading, sections are decrypted as they are read. */
+typedef struct
+{
+    filepath_t path;
+    int fd;
+    uint64_t offset; /* Of the NCA in the file, NCAs in an NSP are read in place */
+    uint64_t size;
+    nca_header_t header; /* Decrypted header */
+    uint8_t has_key;
+    unsigned char key[0x10]; /* Section key, the titlekey or key area key 2 */
+    unsigned char key_area[4][0x10]; /* Decrypted key area, zero with titlekey crypto */
+    ncareader_cache_t *cache; /* Decrypted blocks of small reads, NULL until ncareader_enable_cache */
+} ncareader_t;
+
+/* The RomFS of an NCA section with its hash and entry tables held in memory, tables are kept in on-disk order. */
+typedef struct
+{
+    ncareader_t *reader;
+    uint8_t section_index;
+    uint64_t data_offset; /* Of the RomFS in the section */
+    uint64_t size;
+    romfs_header_t header; /* In host order */
+    uint32_t *dir_hash_table;
+    romfs_direntry_t *dir_table;
+    uint32_t *file_hash_table;
+    romfs_fentry_t *file_table;
+} ncareader_romfs_t;
+
+uint8_t ncareader_has_rights_id(nca_header_t *nca_header);
+int ncareader_get_keygeneration(nca_header_t *nca_header);
+void ncareader_read_header(hp_settings_t *settings, filepath_t *nca_path, int fd, nca_header_t *out_header, uint64_t *out_size);
+unsigned char *ncareader_get_kek(hp_settings_t *settings, nca_header_t *nca_header, int keygeneration);
+void ncareader_decrypt_key_area(hp_settings_t *settings, nca_header_t *nca_header, unsigned char (*out_keys)[0x10]);
+void ncareader_open(hp_settings_t *settings, filepath_t *nca_path, const unsigned char *title_key, ncareader_t *reader);
+void ncareader_open_at(hp_settings_t *settings, filepath_t *nca_path, uint64_t offset, uint64_t size, const unsigned char *title_key, ncareader_t *reader);
+int ncareader_try_open_at(hp_settings_t *settings, filepath_t *nca_path, uint64_t offset, uint64_t size, const unsigned char *title_key, ncareader_t *reader);
+int ncareader_load_ticket(hp_settings_t *settings, filepath_t *tik_dirpath, ncareader_t *reader);
+int ncareader_load_sibling_ticket(hp_settings_t *settings, ncareader_t *reader);
+int ncareader_find_section(ncareader_t *reader, uint8_t fs_type, uint8_t hash_type);
+int ncareader_read_section(ncareader_t *reader, uint8_t section_index, void *buf, uint64_t size, uint64_t offset);
+int ncareader_read_pfs0_header(ncareader_t *reader, uint8_t section_index, pfs0_ctx_t *pfs0_ctx);
+unsigned char *ncareader_read_pfs0_file(ncareader_t *reader, uint8_t section_index, const char *suffix, uint64_t *out_size);
+void ncareader_enable_cache(ncareader_t *reader, uint32_t num_blocks);
+int ncareader_open_romfs(ncareader_t *reader, uint8_t section_index, ncareader_romfs_t *romfs);
+int ncareader_romfs_find_dir(ncareader_romfs_t *romfs, const char *path, uint32_t *out_dir_offset);
+int ncareader_romfs_find_file(ncareader_romfs_t *romfs, const char *path, uint64_t *out_offset, uint64_t *out_size);
+void ncareader_close_romfs(ncareader_romfs_t *romfs);
+void ncareader_close(ncareader_t *reader);
+
+#endif
@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "ncz.h"
+#include "ncareader.h"
+#include "nsp.h"
+#include "pfs0.h"
+#include "fio.h"
+#include "worker.h"
+#include "utils.h"
+
+typedef struct
+{
+    uint64_t offset; /* In the NCA */
+    uint64_t size;
+    unsigned char *out;
+    uint64_t out_size;
+    int failed;
+} ncz_job_t;
+
+typedef struct
+{
+    ncareader_t *reader;
+    ncz_section_t *sections;
+    int8_t *section_indexes; /* NCA section of every NCZ section, -1 between sections */
+    uint64_t *section_starts; /* Start of the NCA section, NCZ sections don't start before NCZ_HEADER_SIZE */
+    uint32_t num_sections;
+    int level;
+    ncz_job_t *jobs;
+} ncz_ctx_t;
+
+/* NSZ output needs hacPack built with zstd. */
+int ncz_is_supported(void)
+{
+#ifdef HAVE_ZSTD
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+#ifdef HAVE_ZSTD
+/* Reads the decrypted NCA at offset, ranges of NCA sections are decrypted and the rest is read as it is. */
+static int ncz_read_plain(ncz_ctx_t *ctx, unsigned char *buf, uint64_t size, uint64_t offset)
+{
+    for (uint32_t i = 0; i < ctx->num_sections; i++)
+    {
+        ncz_section_t *section = &ctx->sections[i];
+        uint64_t start = offset > section->offset ? offset : section->offset;
+        uint64_t end = offset + size < section->offset + section->size ? offset + size : section->offset + section->size;
+        if (start >= end)
+            continue;
+
+        int ret;
+        if (ctx->section_indexes[i] < 0)
+            ret = fio_pread(ctx->reader->fd, buf + (start - offset), end - start, start);
+        else
+            ret = ncareader_read_section(ctx->reader, (uint8_t)ctx->section_indexes[i], buf + (start - offset), end - start, start - ctx->section_starts[i]);
+        if (ret != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void ncz_compress_job(void *ctx, uint32_t index)
+{
+    ncz_ctx_t *ncz_ctx = (ncz_ctx_t *)ctx;
+    ncz_job_t *job = &ncz_ctx->jobs[index];
+
+    size_t bound = ZSTD_compressBound(job->size);
+    unsigned char *in = hp_track_buffer(malloc(job->size));
+    job->out = hp_track_buffer(malloc(bound > job->size ? bound : job->size));
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    if (in == NULL || job->out == NULL || cctx == NULL || ncz_read_plain(ncz_ctx, in, job->size, job->offset) != 0)
+    {
+        hp_free(in);
+        ZSTD_freeCCtx(cctx);
+        job->failed = 1;
+        return;
+    }
+
+    // Blocks that don't get smaller are stored decrypted but uncompressed
+    size_t compressed_size = ZSTD_compressCCtx(cctx, job->out, bound, in, job->size, ncz_ctx->level);
+    if (ZSTD_isError(compressed_size) || compressed_size >= job->size)
+    {
+        memcpy(job->out, in, job->size);
+        job->out_size = job->size;
+    }
+    else
+        job->out_size = compressed_size;
+    hp_free(in);
+    ZSTD_freeCCtx(cctx);
+}
+
+/* Adds the range [offset, end) of the NCA to the NCZ sections, section_index -1 stores it as it is. */
+static void ncz_add_section(ncz_ctx_t *ctx, ncareader_t *reader, int section_index, uint64_t offset, uint64_t end)
+{
+    if (end <= offset)
+        return;
+    ncz_section_t *section = &ctx->sections[ctx->num_sections];
+    memset(section, 0, sizeof(*section));
+    section->offset = offset;
+    section->size = end - offset;
+    section->crypto_type = NCZ_CRYPTO_NONE;
+    ctx->section_indexes[ctx->num_sections] = (int8_t)section_index;
+    ctx->section_starts[ctx->num_sections] = offset;
+    if (section_index >= 0)
+    {
+        nca_fs_header_t *fs_header = &reader->header.fs_headers[section_index];
+        ctx->section_starts[ctx->num_sections] = (uint64_t)reader->header.section_entries[section_index].media_start_offset * 0x200;
+        if (fs_header->crypt_type == CRYPT_CTR)
+        {
+            section->crypto_type = NCZ_CRYPTO_CTR;
+            memcpy(section->crypto_key, reader->key, 0x10);
+            for (unsigned int j = 0; j < 0x8; j++)
+                section->crypto_counter[j] = fs_header->section_ctr[0x8 - j - 1];
+        }
+    }
+    ctx->num_sections++;
+}
+
+/* Writes nca_path as an NCZ: the first NCZ_HEADER_SIZE bytes as they are, the sections and the rest decrypted in zstd compressed blocks.
+   Returns 1 without writing if the NCA can't be stored as an NCZ, it's then stored as it is. */
+int ncz_write(hp_settings_t *settings, filepath_t *nca_path, filepath_t *tik_dirpath, filepath_t *out_ncz_path, ncz_stats_t *stats)
+{
+    double start_time = hp_get_time();
+    ncareader_t reader;
+    ncareader_open(settings, nca_path, settings->has_title_key ? settings->title_key : NULL, &reader);
+    if (reader.has_key == 0 && ncareader_load_ticket(settings, tik_dirpath, &reader) != 0)
+    {
+        hp_log("No titlekey for %s, storing it uncompressed\n", nca_path->char_path);
+        ncareader_close(&reader);
+        return 1;
+    }
+    if (reader.size <= NCZ_HEADER_SIZE)
+    {
+        ncareader_close(&reader);
+        return 1;
+    }
+
+    // Sections in NCA order, ranges between them and after the last one are stored as they are
+    ncz_section_t sections[9];
+    int8_t section_indexes[9];
+    uint64_t section_starts[9];
+    ncz_ctx_t ncz_ctx;
+    memset(&ncz_ctx, 0, sizeof(ncz_ctx));
+    ncz_ctx.reader = &reader;
+    ncz_ctx.sections = sections;
+    ncz_ctx.section_indexes = section_indexes;
+    ncz_ctx.section_starts = section_starts;
+    ncz_ctx.level = settings->nsz_level ? settings->nsz_level : NCZ_DEFAULT_LEVEL;
+    uint64_t cursor = NCZ_HEADER_SIZE;
+    while (1)
+    {
+        int next = -1;
+        for (int i = 0; i < 4; i++)
+        {
+            nca_section_entry_t *entry = &reader.header.section_entries[i];
+            uint64_t end = (uint64_t)entry->media_end_offset * 0x200;
+            if (entry->media_end_offset > entry->media_start_offset && end > cursor &&
+                (next < 0 || entry->media_start_offset < reader.header.section_entries[next].media_start_offset))
+                next = i;
+        }
+        if (next < 0)
+            break;
+
+        uint8_t crypt_type = reader.header.fs_headers[next].crypt_type;
+        uint64_t start = (uint64_t)reader.header.section_entries[next].media_start_offset * 0x200;
+        uint64_t end = (uint64_t)reader.header.section_entries[next].media_end_offset * 0x200;
+        if ((crypt_type != CRYPT_NONE && crypt_type != CRYPT_CTR) || (start < cursor && cursor > NCZ_HEADER_SIZE) || end > reader.size)
+        {
+            hp_log("Section %i of %s can't be stored in an NCZ, storing it uncompressed\n", next, nca_path->char_path);
+            ncareader_close(&reader);
+            return 1;
+        }
+        ncz_add_section(&ncz_ctx, &reader, -1, cursor, start);
+        ncz_add_section(&ncz_ctx, &reader, next, start > cursor ? start : cursor, end);
+        cursor = end;
+    }
+    ncz_add_section(&ncz_ctx, &reader, -1, cursor, reader.size);
+
+    int out_fd = fio_open(out_ncz_path, FIO_MODE_WRITE);
+    if (out_fd < 0)
+    {
+        hp_error("Failed to create %s!\n", out_ncz_path->char_path);
+        hp_exit_failure();
+    }
+
+    hp_log("Compressing %s\n", nca_path->char_path);
+    ncz_header_t ncz_header;
+    ncz_header.magic = MAGIC_NCZSECTN;
+    ncz_header.num_sections = ncz_ctx.num_sections;
+    uint64_t decompressed_size = reader.size - NCZ_HEADER_SIZE;
+    uint64_t block_size = 1ULL << NCZ_BLOCK_SIZE_EXPONENT;
+    ncz_block_header_t block_header;
+    memset(&block_header, 0, sizeof(block_header));
+    block_header.magic = MAGIC_NCZBLOCK;
+    block_header.version = 2;
+    block_header.type = 1;
+    block_header.block_size_exponent = NCZ_BLOCK_SIZE_EXPONENT;
+    block_header.num_blocks = (uint32_t)((decompressed_size + block_size - 1) / block_size);
+    block_header.decompressed_size = decompressed_size;
+    uint32_t *block_sizes = calloc(block_header.num_blocks, sizeof(uint32_t));
+    uint64_t block_header_offset = NCZ_HEADER_SIZE + sizeof(ncz_header) + ncz_ctx.num_sections * sizeof(ncz_section_t);
+    uint64_t out_offset = block_header_offset + sizeof(block_header) + (uint64_t)block_header.num_blocks * sizeof(uint32_t);
+    if (block_sizes == NULL || fio_copy_range(reader.fd, 0, out_fd, 0, NCZ_HEADER_SIZE, NULL) != 0 ||
+        fio_pwrite(out_fd, &ncz_header, sizeof(ncz_header), NCZ_HEADER_SIZE) != 0 ||
+        fio_pwrite(out_fd, sections, ncz_ctx.num_sections * sizeof(ncz_section_t), NCZ_HEADER_SIZE + sizeof(ncz_header)) != 0 ||
+        fio_pwrite(out_fd, &block_header, sizeof(block_header), block_header_offset) != 0)
+    {
+        hp_error("Failed to write %s!\n", out_ncz_path->char_path);
+        hp_exit_failure();
+    }
+
+    // Blocks are compressed a window at a time and written in order
+    uint32_t num_threads = settings->num_threads ? settings->num_threads : worker_get_cpu_count();
+    uint32_t window = num_threads * NCZ_JOBS_PER_THREAD;
+    ncz_ctx.jobs = calloc(window, sizeof(ncz_job_t));
+    if (ncz_ctx.jobs == NULL)
+    {
+        hp_error("Failed to allocate NCZ jobs!\n");
+        hp_exit_failure();
+    }
+    for (uint32_t first_block = 0; first_block < block_header.num_blocks; first_block += window)
+    {
+        uint32_t count = block_header.num_blocks - first_block < window ? block_header.num_blocks - first_block : window;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            ncz_job_t *job = &ncz_ctx.jobs[i];
+            uint64_t offset = (uint64_t)(first_block + i) * block_size;
+            memset(job, 0, sizeof(*job));
+            job->offset = NCZ_HEADER_SIZE + offset;
+            job->size = decompressed_size - offset < block_size ? decompressed_size - offset : block_size;
+        }
+        worker_run(ncz_compress_job, &ncz_ctx, count, num_threads);
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            ncz_job_t *job = &ncz_ctx.jobs[i];
+            if (job->failed || fio_pwrite(out_fd, job->out, job->out_size, out_offset) != 0)
+            {
+                hp_error("Failed to compress %s!\n", nca_path->char_path);
+                hp_exit_failure();
+            }
+            block_sizes[first_block + i] = (uint32_t)job->out_size;
+            out_offset += job->out_size;
+            hp_free(job->out);
+        }
+    }
+    if (fio_pwrite(out_fd, block_sizes, (uint64_t)block_header.num_blocks * sizeof(uint32_t), block_header_offset + sizeof(block_header)) != 0)
+    {
+        hp_error("Failed to write %s!\n", out_ncz_path->char_path);
+        hp_exit_failure();
+    }
+    free(ncz_ctx.jobs);
+    free(block_sizes);
+    fio_close(out_fd);
+    ncareader_close(&reader);
+
+    double seconds = hp_get_time() - start_time;
+    hp_log("Compressed 0x%" PRIx64 " to 0x%" PRIx64 " bytes (%.1f%%) in %.2f s, %.1f MB/s\n", reader.size, out_offset,
+           (double)out_offset * 100.0 / (double)reader.size, seconds, seconds > 0 ? (double)reader.size / seconds / 1048576.0 : 0.0);
+    stats->in_size += reader.size;
+    stats->out_size += out_offset;
+    stats->seconds += seconds;
+    return 0;
+}
+#else
+int ncz_write(hp_settings_t *settings, filepath_t *nca_path, filepath_t *tik_dirpath, filepath_t *out_ncz_path, ncz_stats_t *stats)
+{
+    (void)settings;
+    (void)tik_dirpath;
+    (void)out_ncz_path;
+    (void)stats;
+    hp_log("hacPack is built without zstd, storing %s uncompressed\n", nca_path->char_path);
+    return 1;
+}
+#endif
+
+/* Stores the NCAs of in_dirpath as NCZs in the temp directory and builds the NSZ from there like an NSP.
+   Metadata NCAs and NCAs that can't be stored as NCZs are copied as they are. */
+int ncz_build_nsz(filepath_t *in_dirpath, filepath_t *out_nsz_filepath, hp_settings_t *settings, uint64_t *out_nsz_size)
+{
+    pfs0_ctx_t pfs0_ctx;
+    if (pfs0_visit_dir(&pfs0_ctx, in_dirpath) != 0)
+        return 1;
+
+    filepath_t nsz_dir;
+    filepath_init(&nsz_dir);
+    filepath_copy(&nsz_dir, &settings->temp_dir);
+    filepath_append(&nsz_dir, "nsz");
+    os_makedir(settings->temp_dir.os_path);
+    os_makedir(nsz_dir.os_path);
+
+    ncz_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    uint32_t num_ncz = 0;
+    for (uint32_t i = 0; i < pfs0_ctx.num_files; i++)
+    {
+        const char *name = pfs0_ctx.files[i].name;
+        size_t name_len = strlen(name);
+        filepath_t src_path;
+        filepath_init(&src_path);
+        filepath_copy(&src_path, in_dirpath);
+        filepath_append(&src_path, "%s", name);
+
+        // Hash sidecars are left out of the NSZ as they are of NSPs
+        if (name_len > strlen(NCA_SIDECAR_EXTENSION) && strcmp(name + name_len - strlen(NCA_SIDECAR_EXTENSION), NCA_SIDECAR_EXTENSION) == 0)
+            continue;
+        if (name_len > 4 && strcmp(name + name_len - 4, ".nca") == 0 && (name_len < 9 || strcmp(name + name_len - 9, ".cnmt.nca") != 0))
+        {
+            filepath_t ncz_path;
+            filepath_init(&ncz_path);
+            filepath_copy(&ncz_path, &nsz_dir);
+            filepath_append(&ncz_path, "%.*s.ncz", (int)(name_len - 4), name);
+            if (ncz_write(settings, &src_path, in_dirpath, &ncz_path, &stats) == 0)
+            {
+                num_ncz++;
+                continue;
+            }
+        }
+
+        filepath_t dst_path;
+        filepath_init(&dst_path);
+        filepath_copy(&dst_path, &nsz_dir);
+        filepath_append(&dst_path, "%s", name);
+        int src_fd = fio_open(&src_path, FIO_MODE_READ);
+        int dst_fd = fio_open(&dst_path, FIO_MODE_WRITE);
+        if (src_fd < 0 || dst_fd < 0 || fio_copy_range(src_fd, 0, dst_fd, 0, pfs0_ctx.files[i].size, NULL) != 0)
+        {
+            hp_error("Failed to copy %s!\n", src_path.char_path);
+            hp_exit_failure();
+        }
+        fio_close(src_fd);
+        fio_close(dst_fd);
+    }
+    pfs0_free_ctx(&pfs0_ctx);
+
+    if (num_ncz > 0)
+        hp_log("\n===> Compressed %" PRIu32 " NCAs from 0x%" PRIx64 " to 0x%" PRIx64 " bytes (%.1f%%) in %.2f s, %.1f MB/s\n", num_ncz, stats.in_size, stats.out_size,
+               (double)stats.out_size * 100.0 / (double)stats.in_size, stats.seconds, stats.seconds > 0 ? (double)stats.in_size / stats.seconds / 1048576.0 : 0.0);
+    int ret = nsp_build(&nsz_dir, out_nsz_filepath, settings, out_nsz_size);
+    filepath_remove_directory(&nsz_dir);
+    return ret;
+}
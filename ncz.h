@@ -0,0 +1,66 @@
+#ifndef HACPACK_NCZ_H
+#define HACPACK_NCZ_H
+
+#include <stdint.h>
+#include "settings.h"
+#include "filepath.h"
+
+#define NCZ_HEADER_SIZE 0x4000 /* Start of the NCA, kept as it is */
+#define NCZ_BLOCK_SIZE_EXPONENT 20 // 1 MB blocks
+#define NCZ_DEFAULT_LEVEL 18
+#define NCZ_JOBS_PER_THREAD 4 /* Blocks held in memory at once, per worker thread */
+
+#define MAGIC_NCZSECTN 0x4E544345535A434E /* "NCZSECTN" */
+#define MAGIC_NCZBLOCK 0x4B434F4C425A434E /* "NCZBLOCK" */
+
+#define NCZ_CRYPTO_NONE 1
+#define NCZ_CRYPTO_CTR 3
+
+#pragma pack(push, 1)
+typedef struct
+{
+    uint64_t magic;
+    uint64_t num_sections;
+} ncz_header_t;
+#pragma pack(pop)
+
+/* A range of the NCA after NCZ_HEADER_SIZE and how to encrypt it again, ranges between NCA sections are stored with NCZ_CRYPTO_NONE. */
+#pragma pack(push, 1)
+typedef struct
+{
+    uint64_t offset;
+    uint64_t size;
+    uint64_t crypto_type;
+    uint64_t _0x18;
+    uint8_t crypto_key[0x10];
+    uint8_t crypto_counter[0x10];
+} ncz_section_t;
+#pragma pack(pop)
+
+/* Followed by the compressed size of every block, a block as large as its data is stored uncompressed. */
+#pragma pack(push, 1)
+typedef struct
+{
+    uint64_t magic;
+    uint8_t version;
+    uint8_t type;
+    uint8_t _0xA;
+    uint8_t block_size_exponent;
+    uint32_t num_blocks;
+    uint64_t decompressed_size;
+} ncz_block_header_t;
+#pragma pack(pop)
+
+/* Sizes and time of NCZ writes, for throughput. */
+typedef struct
+{
+    uint64_t in_size;
+    uint64_t out_size;
+    double seconds;
+} ncz_stats_t;
+
+int ncz_is_supported(void);
+int ncz_write(hp_settings_t *settings, filepath_t *nca_path, filepath_t *tik_dirpath, filepath_t *out_ncz_path, ncz_stats_t *stats);
+int ncz_build_nsz(filepath_t *in_dirpath, filepath_t *out_nsz_filepath, hp_settings_t *settings, uint64_t *out_nsz_size);
+
+#endif
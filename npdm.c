@@ -18,8 +18,8 @@ void npdm_process(hp_settings_t *settings)
     fl = os_fopen(npdm_filepath.os_path, OS_MODE_EDIT);
     if (fl == NULL)
     {
-        fprintf(stderr, "Failed to open %s!\n", npdm_filepath.char_path);
-        exit(EXIT_FAILURE);
+        hp_error("Failed to open %s!\n", npdm_filepath.char_path);
+        hp_exit_failure();
     }
 
     // Read NPDM Header
@@ -27,17 +27,17 @@ void npdm_process(hp_settings_t *settings)
     memset(&npdm, 0, sizeof(npdm));
     if (fread(&npdm, 1, sizeof(npdm_t), fl) != sizeof(npdm_t))
     {
-        fprintf(stderr, "Failed to read NPDM header!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Failed to read NPDM header!\n");
+        hp_exit_failure();
     }
 
-    printf("Validating NPDM\n");
+    hp_log("Validating NPDM\n");
 
     // Verify NPDM magic
     if (npdm.magic != MAGIC_META)
     {
-        fprintf(stderr, "Invalid NPDM magic!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Invalid NPDM magic!\n");
+        hp_exit_failure();
     }
 
     // Read ACID
@@ -45,15 +45,15 @@ void npdm_process(hp_settings_t *settings)
     fseeko64(fl, npdm.acid_offset, SEEK_SET);
     if (fread(&acid, 1, sizeof(npdm_acid_t), fl) != sizeof(npdm_acid_t))
     {
-        fprintf(stderr, "Failed to read NPDM ACID!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Failed to read NPDM ACID!\n");
+        hp_exit_failure();
     }
 
     // Validate ACID MAGIC
     if (acid.magic != MAGIC_ACID)
     {
-        fprintf(stderr, "Invalid ACID magic!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Invalid ACID magic!\n");
+        hp_exit_failure();
     }
 
     // Read ACI0
@@ -61,24 +61,24 @@ void npdm_process(hp_settings_t *settings)
     fseeko64(fl, npdm.aci0_offset, SEEK_SET);
     if (fread(&aci0, 1, sizeof(npdm_aci0_t), fl) != sizeof(npdm_aci0_t))
     {
-        fprintf(stderr, "Failed to read NPDM ACI0!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Failed to read NPDM ACI0!\n");
+        hp_exit_failure();
     }
 
     // Validate ACI0 MAGIC
     if (aci0.magic != MAGIC_ACI0)
     {
-        fprintf(stderr, "Invalid ACI0 magic!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Invalid ACI0 magic!\n");
+        hp_exit_failure();
     }
 
     // Validate TitleID
     if (settings->title_id != aci0.title_id)
     {
-        fprintf(stderr, "TitleID mismatch!\n"
+        hp_error("TitleID mismatch!\n"
                         "ACI0 TitleID: %016" PRIx64 "\n",
                 aci0.title_id);
-        exit(EXIT_FAILURE);
+        hp_exit_failure();
     }
 
     if ((settings->noselfsignncasig2 == 0) || (settings->nca_sig2_modulus.valid == VALIDITY_VALID))
@@ -87,14 +87,14 @@ void npdm_process(hp_settings_t *settings)
         struct timeval ct;
         gettimeofday(&ct, NULL);
         filepath_t bkup_npdm_filepath;
-        printf("Backing up main.npdm\n");
+        hp_log("Backing up main.npdm\n");
         filepath_init(&bkup_npdm_filepath);
         filepath_copy(&bkup_npdm_filepath, &settings->backup_dir);
         filepath_append(&bkup_npdm_filepath, "%" PRIu64 "_main.npdm", ct.tv_sec);
         filepath_copy_file(&npdm_filepath, &bkup_npdm_filepath);
 
         // Patch ACID public key
-        printf("Patching ACID public key\n");
+        hp_log("Patching ACID public key\n");
         fseeko(fl, npdm.acid_offset + 0x100, SEEK_SET);
         if (settings->nca_sig2_modulus.valid == VALIDITY_VALID)
         {
@@ -104,17 +104,17 @@ void npdm_process(hp_settings_t *settings)
 
             if (flmodulus == NULL)
             {
-                fprintf(stderr, "Failed to open %s!\n", settings->nca_sig2_modulus.char_path);
-                exit(EXIT_FAILURE);
+                hp_error("Failed to open %s!\n", settings->nca_sig2_modulus.char_path);
+                hp_exit_failure();
             }
 
             if (fread(modulus, 1, 0x100, flmodulus) != 0x100)
             {
-                fprintf(stderr, "Failed to read nca signature 2 modulus from: %s\n", settings->nca_sig2_modulus.char_path);
-                exit(EXIT_FAILURE);
+                hp_error("Failed to read nca signature 2 modulus from: %s\n", settings->nca_sig2_modulus.char_path);
+                hp_exit_failure();
             }
 
-            fclose(flmodulus);
+            os_fclose(flmodulus);
 
             fwrite(modulus, 1, 0x100, fl);
         }
@@ -124,13 +124,13 @@ void npdm_process(hp_settings_t *settings)
 
     if (settings->acid_sig_private_key.valid == VALIDITY_VALID)
     {
-        printf("Signing ACID\n");
+        hp_log("Signing ACID\n");
         fseeko(fl, npdm.acid_offset + 0x100, SEEK_SET);
         unsigned char *acid_buff = (unsigned char *)malloc(acid.size);
         if (fread(acid_buff, 1, acid.size, fl) != acid.size)
         {
-            fprintf(stderr, "Failed to read NPDM!\n");
-            exit(EXIT_FAILURE);
+            hp_error("Failed to read NPDM!\n");
+            hp_exit_failure();
         }
         rsa_sign_with_file(acid_buff, acid.size, acid.signature, 0x100, settings->acid_sig_private_key.char_path);
         fseeko(fl, npdm.acid_offset, SEEK_SET);
@@ -138,5 +138,5 @@ void npdm_process(hp_settings_t *settings)
         free(acid_buff);
     }
 
-    fclose(fl);
+    os_fclose(fl);
 }
\ No newline at end of file
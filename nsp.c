@@ -0,0 +1,499 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "nsp.h"
+#include "pfs0.h"
+#include "fio.h"
+#include "worker.h"
+#include "nca.h"
+#include "npdm.h"
+#include "nacp.h"
+#include "ticket.h"
+
+typedef struct
+{
+    uint32_t file_index;
+    uint64_t offset; /* Relative to the file. */
+    uint64_t size;
+    fio_copy_stats_t stats;
+    int failed;
+} nsp_copy_job_t;
+
+/* NSP output, either a single file or consecutive parts of part_size bytes. */
+typedef struct
+{
+    int *fds;
+    uint32_t num_parts;
+    uint64_t part_size;
+} nsp_out_t;
+
+typedef struct
+{
+    pfs0_ctx_t *pfs0_ctx;
+    nsp_copy_job_t *jobs;
+    nsp_out_t *out;
+} nsp_copy_ctx_t;
+
+static void nsp_out_close(nsp_out_t *out)
+{
+    for (uint32_t i = 0; i < out->num_parts; i++)
+    {
+        if (out->fds[i] >= 0)
+            fio_close(out->fds[i]);
+    }
+    free(out->fds);
+    memset(out, 0, sizeof(*out));
+}
+
+/* Creates all outputs with their final sizes, parts are named <nsp>.00, <nsp>.01... or <nsp>/00, <nsp>/01... */
+static int nsp_out_open(nsp_out_t *out, filepath_t *out_nsp_filepath, enum nsp_split_type split, uint64_t nsp_size)
+{
+    memset(out, 0, sizeof(*out));
+    out->part_size = split == NSP_SPLIT_NONE ? nsp_size : NSP_SPLIT_PART_SIZE;
+    out->num_parts = split == NSP_SPLIT_NONE ? 1 : (uint32_t)((nsp_size + NSP_SPLIT_PART_SIZE - 1) / NSP_SPLIT_PART_SIZE);
+    if (out->num_parts == 0)
+        out->num_parts = 1;
+    if (out->num_parts > 100)
+    {
+        hp_error("NSP is too large to be split into 100 parts!\n");
+        return 1;
+    }
+
+    out->fds = malloc(out->num_parts * sizeof(int));
+    if (out->fds == NULL)
+    {
+        hp_error("Failed to allocate NSP parts!\n");
+        hp_exit_failure();
+    }
+    for (uint32_t i = 0; i < out->num_parts; i++)
+        out->fds[i] = -1;
+
+    if (split == NSP_SPLIT_DIR)
+    {
+        os_makedir(out_nsp_filepath->os_path);
+#ifdef _WIN32
+        // Horizon only treats a split directory as a file when its archive bit is set
+        SetFileAttributesW(out_nsp_filepath->os_path, FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_ARCHIVE);
+#endif
+    }
+
+    for (uint32_t i = 0; i < out->num_parts; i++)
+    {
+        char part_name[4351];
+        filepath_t part_path;
+        if (split == NSP_SPLIT_PARTS)
+            snprintf(part_name, sizeof(part_name), "%s.%02" PRIu32, out_nsp_filepath->char_path, i);
+        else if (split == NSP_SPLIT_DIR)
+            snprintf(part_name, sizeof(part_name), "%s%s%02" PRIu32, out_nsp_filepath->char_path, OS_PATH_SEPARATOR, i);
+        else
+            snprintf(part_name, sizeof(part_name), "%s", out_nsp_filepath->char_path);
+        filepath_init(&part_path);
+        filepath_set(&part_path, part_name);
+
+        uint64_t part_size = nsp_size - (uint64_t)i * out->part_size;
+        if (part_size > out->part_size)
+            part_size = out->part_size;
+        out->fds[i] = fio_open(&part_path, FIO_MODE_WRITE);
+        if (out->fds[i] < 0 || fio_set_size(out->fds[i], part_size) != 0)
+        {
+            hp_error("Failed to create %s!\n", part_path.char_path);
+            nsp_out_close(out);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int nsp_out_write(nsp_out_t *out, const void *buf, uint64_t size, uint64_t offset)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    while (size > 0)
+    {
+        uint32_t part = (uint32_t)(offset / out->part_size);
+        uint64_t part_offset = offset % out->part_size;
+        uint64_t write_size = out->part_size - part_offset < size ? out->part_size - part_offset : size;
+        if (part >= out->num_parts || fio_pwrite(out->fds[part], p, write_size, part_offset) != 0)
+            return -1;
+        p += write_size;
+        offset += write_size;
+        size -= write_size;
+    }
+    return 0;
+}
+
+static int nsp_out_copy(nsp_out_t *out, int src_fd, uint64_t src_offset, uint64_t offset, uint64_t size, fio_copy_stats_t *stats)
+{
+    while (size > 0)
+    {
+        uint32_t part = (uint32_t)(offset / out->part_size);
+        uint64_t part_offset = offset % out->part_size;
+        uint64_t copy_size = out->part_size - part_offset < size ? out->part_size - part_offset : size;
+        if (part >= out->num_parts || fio_copy_range(src_fd, src_offset, out->fds[part], part_offset, copy_size, stats) != 0)
+            return -1;
+        src_offset += copy_size;
+        offset += copy_size;
+        size -= copy_size;
+    }
+    return 0;
+}
+
+static void nsp_copy_job(void *ctx, uint32_t index)
+{
+    nsp_copy_ctx_t *copy_ctx = (nsp_copy_ctx_t *)ctx;
+    nsp_copy_job_t *job = &copy_ctx->jobs[index];
+    pfs0_file_ctx_t *file = &copy_ctx->pfs0_ctx->files[job->file_index];
+
+    char objpath[4351];
+    filepath_t src_path;
+    snprintf(objpath, sizeof(objpath), "%s%s", copy_ctx->pfs0_ctx->dirpath.char_path, file->name);
+    filepath_init(&src_path);
+    filepath_set(&src_path, objpath);
+
+    int src_fd = fio_open(&src_path, FIO_MODE_READ);
+    if (src_fd < 0)
+    {
+        hp_error("Failed to open %s!\n", src_path.char_path);
+        job->failed = 1;
+        return;
+    }
+
+    if (job->offset == 0)
+        hp_log("Writing %s\n", src_path.char_path);
+
+    uint64_t dst_offset = copy_ctx->pfs0_ctx->header_size + file->offset + job->offset;
+    if (nsp_out_copy(copy_ctx->out, src_fd, job->offset, dst_offset, job->size, &job->stats) != 0)
+    {
+        hp_error("Failed to copy %s!\n", src_path.char_path);
+        job->failed = 1;
+    }
+
+    fio_close(src_fd);
+}
+
+/* Emits the PFS0 strictly sequentially, for pipes and other non-seekable outputs. */
+static int nsp_stream(pfs0_ctx_t *pfs0_ctx, int out_fd)
+{
+    unsigned char *header = pfs0_create_header(pfs0_ctx);
+    if (fio_write(out_fd, header, pfs0_ctx->header_size) != 0)
+    {
+        hp_error("Failed to write NSP header!\n");
+        free(header);
+        return 1;
+    }
+    free(header);
+
+    static const unsigned char zeros[NSP_DATA_ALIGNMENT] = {0};
+    uint64_t data_offset = 0;
+    fio_copy_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    for (uint32_t i = 0; i < pfs0_ctx->num_files; i++)
+    {
+        // Gaps between aligned entries are written out, the layout is the same as a file's
+        if (fio_write(out_fd, zeros, pfs0_ctx->files[i].offset - data_offset) != 0)
+        {
+            hp_error("Failed to write NSP padding!\n");
+            return 1;
+        }
+        data_offset = pfs0_ctx->files[i].offset + pfs0_ctx->files[i].size;
+
+        char objpath[4351];
+        filepath_t src_path;
+        snprintf(objpath, sizeof(objpath), "%s%s", pfs0_ctx->dirpath.char_path, pfs0_ctx->files[i].name);
+        filepath_init(&src_path);
+        filepath_set(&src_path, objpath);
+
+        int src_fd = fio_open(&src_path, FIO_MODE_READ);
+        if (src_fd < 0)
+        {
+            hp_error("Failed to open %s!\n", src_path.char_path);
+            return 1;
+        }
+
+        hp_log("Writing %s\n", src_path.char_path);
+        if (fio_stream_copy(src_fd, 0, out_fd, pfs0_ctx->files[i].size, &stats) != 0)
+        {
+            hp_error("Failed to copy %s!\n", src_path.char_path);
+            fio_close(src_fd);
+            return 1;
+        }
+        fio_close(src_fd);
+    }
+    fio_print_copy_stats(&stats);
+    return 0;
+}
+
+/* Drops NCA hash sidecars, they are build metadata and don't belong in the NSP. */
+static void nsp_skip_sidecars(pfs0_ctx_t *pfs0_ctx)
+{
+    size_t ext_len = strlen(NCA_SIDECAR_EXTENSION);
+    uint32_t num_files = 0;
+    for (uint32_t i = 0; i < pfs0_ctx->num_files; i++)
+    {
+        size_t name_len = strlen(pfs0_ctx->files[i].name);
+        if (name_len > ext_len && strcmp(pfs0_ctx->files[i].name + name_len - ext_len, NCA_SIDECAR_EXTENSION) == 0)
+        {
+            hp_log("Skipping hash sidecar %s\n", pfs0_ctx->files[i].name);
+            free(pfs0_ctx->files[i].name);
+            continue;
+        }
+        pfs0_ctx->files[num_files++] = pfs0_ctx->files[i];
+    }
+    if (num_files != pfs0_ctx->num_files)
+    {
+        pfs0_ctx->num_files = num_files;
+        pfs0_calculate_layout(pfs0_ctx);
+    }
+}
+
+/* Builds a PFS0 from in_dirpath, every entry region is filled independently with positional writes unless the NSP is streamed. */
+int nsp_build(filepath_t *in_dirpath, filepath_t *out_nsp_filepath, hp_settings_t *settings, uint64_t *out_nsp_size)
+{
+    pfs0_ctx_t pfs0_ctx;
+    if (pfs0_visit_dir(&pfs0_ctx, in_dirpath) != 0)
+        return 1;
+    nsp_skip_sidecars(&pfs0_ctx);
+    pfs0_ctx.data_alignment = NSP_DATA_ALIGNMENT;
+    pfs0_calculate_layout(&pfs0_ctx);
+
+    // All offsets are known at this point, size the outputs and write the header up front
+    uint64_t nsp_size = pfs0_ctx.header_size + pfs0_ctx.data_size;
+    if (settings->nsp_out_fd >= 0)
+    {
+        hp_log("Streaming %" PRIu32 " entries to descriptor %d\n", pfs0_ctx.num_files, settings->nsp_out_fd);
+        int ret = nsp_stream(&pfs0_ctx, settings->nsp_out_fd);
+        pfs0_free_ctx(&pfs0_ctx);
+        *out_nsp_size = nsp_size;
+        return ret;
+    }
+
+    nsp_out_t out;
+    if (nsp_out_open(&out, out_nsp_filepath, settings->nsp_split, nsp_size) != 0)
+    {
+        pfs0_free_ctx(&pfs0_ctx);
+        return 1;
+    }
+
+    unsigned char *header = pfs0_create_header(&pfs0_ctx);
+    if (nsp_out_write(&out, header, pfs0_ctx.header_size, 0) != 0)
+    {
+        hp_error("Failed to write to %s!\n", out_nsp_filepath->char_path);
+        hp_exit_failure();
+    }
+    free(header);
+
+    // Split entries into chunks so that large NCAs are copied by several workers
+    uint32_t num_jobs = 0;
+    for (uint32_t i = 0; i < pfs0_ctx.num_files; i++)
+        num_jobs += (uint32_t)((pfs0_ctx.files[i].size + NSP_COPY_CHUNK_SIZE - 1) / NSP_COPY_CHUNK_SIZE);
+
+    nsp_copy_job_t *jobs = calloc(num_jobs ? num_jobs : 1, sizeof(nsp_copy_job_t));
+    if (jobs == NULL)
+    {
+        hp_error("Failed to allocate copy jobs!\n");
+        hp_exit_failure();
+    }
+    uint32_t job_index = 0;
+    for (uint32_t i = 0; i < pfs0_ctx.num_files; i++)
+    {
+        for (uint64_t ofs = 0; ofs < pfs0_ctx.files[i].size; ofs += NSP_COPY_CHUNK_SIZE)
+        {
+            jobs[job_index].file_index = i;
+            jobs[job_index].offset = ofs;
+            jobs[job_index].size = pfs0_ctx.files[i].size - ofs < NSP_COPY_CHUNK_SIZE ? pfs0_ctx.files[i].size - ofs : NSP_COPY_CHUNK_SIZE;
+            job_index++;
+        }
+    }
+
+    nsp_copy_ctx_t copy_ctx;
+    copy_ctx.pfs0_ctx = &pfs0_ctx;
+    copy_ctx.jobs = jobs;
+    copy_ctx.out = &out;
+    uint32_t num_threads = settings->num_threads ? settings->num_threads : worker_get_cpu_count();
+    if (out.num_parts > 1)
+        hp_log("Writing %" PRIu32 " entries to %s in %" PRIu32 " parts\n", pfs0_ctx.num_files, out_nsp_filepath->char_path, out.num_parts);
+    else
+        hp_log("Writing %" PRIu32 " entries to %s\n", pfs0_ctx.num_files, out_nsp_filepath->char_path);
+    worker_run(nsp_copy_job, &copy_ctx, num_jobs, num_threads);
+
+    int ret = 0;
+    fio_copy_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    for (uint32_t i = 0; i < num_jobs; i++)
+    {
+        if (jobs[i].failed)
+            ret = 1;
+        stats.reflinked += jobs[i].stats.reflinked;
+        stats.kernel_copied += jobs[i].stats.kernel_copied;
+        stats.buffered += jobs[i].stats.buffered;
+    }
+    fio_print_copy_stats(&stats);
+
+    free(jobs);
+    pfs0_free_ctx(&pfs0_ctx);
+    nsp_out_close(&out);
+
+    *out_nsp_size = nsp_size;
+    return ret;
+}
+
+typedef struct
+{
+    char *label;
+    enum hp_nca_type nca_type;
+    filepath_t *romfs_dir;
+    hp_nca_digest_t *digest;
+} nsp_app_nca_t;
+
+/* Zero fills the NSP up to the next entry, NCAs are built at the end of the file. */
+static void nsp_align_file(FILE *nsp_file)
+{
+    static const unsigned char zeros[NSP_DATA_ALIGNMENT] = {0};
+    fseeko64(nsp_file, 0, SEEK_END);
+    uint64_t offset = (uint64_t)ftello64(nsp_file);
+    uint64_t padding = (NSP_DATA_ALIGNMENT - offset % NSP_DATA_ALIGNMENT) % NSP_DATA_ALIGNMENT;
+    if (fwrite(zeros, 1, padding, nsp_file) != padding)
+    {
+        hp_error("Failed to write NSP padding!\n");
+        hp_exit_failure();
+    }
+}
+
+/* Builds program, control, manual and meta NCAs straight into their regions of the NSP.
+   Entries are stored in build order, the header is reserved up front and patched once NCA IDs are known. */
+int nsp_build_application(hp_settings_t *settings, filepath_t *out_nsp_filepath, uint64_t *out_nsp_size)
+{
+    nsp_app_nca_t ncas[4];
+    uint32_t num_ncas = 0;
+    ncas[num_ncas++] = (nsp_app_nca_t){"Program", NCA_TYPE_PROGRAM, &settings->romfs_dir, &settings->programnca_digest};
+    ncas[num_ncas++] = (nsp_app_nca_t){"Control", NCA_TYPE_CONTROL, &settings->control_dir, &settings->controlnca_digest};
+    if (settings->htmldoc_dir.valid == VALIDITY_VALID)
+        ncas[num_ncas++] = (nsp_app_nca_t){"HtmlDocument", NCA_TYPE_MANUAL, &settings->htmldoc_dir, &settings->htmldocnca_digest};
+    if (settings->legal_dir.valid == VALIDITY_VALID)
+        ncas[num_ncas++] = (nsp_app_nca_t){"LegalInformation", NCA_TYPE_MANUAL, &settings->legal_dir, &settings->legalnca_digest};
+
+    // NCA IDs aren't known yet but their names have fixed lengths, which is all the header size depends on
+    pfs0_ctx_t pfs0_ctx;
+    memset(&pfs0_ctx, 0, sizeof(pfs0_ctx));
+    pfs0_ctx.data_alignment = NSP_DATA_ALIGNMENT;
+    pfs0_ctx.num_files = num_ncas + 1 + (settings->has_title_key ? 2 : 0);
+    pfs0_ctx.files = calloc(pfs0_ctx.num_files, sizeof(pfs0_file_ctx_t));
+    if (pfs0_ctx.files == NULL)
+    {
+        hp_error("Failed to allocate NSP entries!\n");
+        hp_exit_failure();
+    }
+    char ticket_name[TICKET_NAME_SIZE];
+    char entry_name[TICKET_NAME_SIZE + 0x10];
+    ticket_get_name(settings, ticket_name, sizeof(ticket_name));
+    for (uint32_t i = 0; i < pfs0_ctx.num_files; i++)
+    {
+        if (i < num_ncas)
+            strcpy(entry_name, "00000000000000000000000000000000.nca");
+        else if (i == num_ncas)
+            strcpy(entry_name, "00000000000000000000000000000000.cnmt.nca");
+        else
+            snprintf(entry_name, sizeof(entry_name), "%s.%s", ticket_name, i == num_ncas + 1 ? "tik" : "cert");
+        pfs0_ctx.files[i].name = strdup(entry_name);
+        if (pfs0_ctx.files[i].name == NULL)
+        {
+            hp_error("Failed to allocate NSP entries!\n");
+            hp_exit_failure();
+        }
+    }
+    pfs0_calculate_layout(&pfs0_ctx);
+
+    FILE *nsp_file = os_fopen(out_nsp_filepath->os_path, OS_MODE_WRITE_EDIT);
+    if (nsp_file == NULL)
+    {
+        hp_error("Failed to create %s!\n", out_nsp_filepath->char_path);
+        pfs0_free_ctx(&pfs0_ctx);
+        return 1;
+    }
+
+    hp_log("Reserving NSP header in %s\n", out_nsp_filepath->char_path);
+    unsigned char *header = pfs0_create_header(&pfs0_ctx);
+    fwrite(header, 1, pfs0_ctx.header_size, nsp_file);
+    free(header);
+
+    for (uint32_t i = 0; i < num_ncas; i++)
+    {
+        hp_settings_t nca_settings = *settings;
+        nca_settings.nca_type = ncas[i].nca_type;
+        nca_settings.romfs_dir = *ncas[i].romfs_dir;
+        nsp_align_file(nsp_file);
+        hp_log("\n----> Creating %s NCA:\n", ncas[i].label);
+        if (ncas[i].nca_type == NCA_TYPE_PROGRAM)
+        {
+            hp_log("===> Processing NPDM\n");
+            npdm_process(&nca_settings);
+            nca_build_program(&nca_settings, nsp_file, ncas[i].digest);
+        }
+        else
+        {
+            if (ncas[i].nca_type == NCA_TYPE_CONTROL)
+            {
+                hp_log("===> Processing NACP\n");
+                nacp_process(&nca_settings);
+            }
+            // Titlekey crypto is only used for program and offline manual
+            if (ncas[i].nca_type == NCA_TYPE_CONTROL || ncas[i].digest == &settings->legalnca_digest)
+                nca_settings.has_title_key = 0;
+            nca_build_romfs_type(&nca_settings, nsp_file, ncas[i].digest);
+        }
+        pfs0_ctx.files[i].size = ncas[i].digest->size;
+        nca_get_filename(ncas[i].digest, 0, pfs0_ctx.files[i].name);
+    }
+
+    // Content records come from the digests captured above
+    hp_settings_t meta_settings = *settings;
+    hp_nca_digest_t meta_digest;
+    meta_settings.nca_type = NCA_TYPE_META;
+    meta_settings.title_type = TITLE_TYPE_APPLICATION;
+    meta_settings.has_title_key = 0;
+    nsp_align_file(nsp_file);
+    hp_log("\n----> Creating metadata NCA:\n");
+    nca_build_meta(&meta_settings, nsp_file, &meta_digest);
+    pfs0_ctx.files[num_ncas].size = meta_digest.size;
+    nca_get_filename(&meta_digest, 1, pfs0_ctx.files[num_ncas].name);
+
+    if (settings->has_title_key)
+    {
+        hp_log("\n----> Adding ticket:\n");
+        unsigned char *tik;
+        const unsigned char *cert;
+        pfs0_ctx.files[num_ncas + 1].size = ticket_get_tik(settings, &tik);
+        pfs0_ctx.files[num_ncas + 2].size = ticket_get_cert(&cert);
+        nsp_align_file(nsp_file);
+        fwrite(tik, 1, pfs0_ctx.files[num_ncas + 1].size, nsp_file);
+        nsp_align_file(nsp_file);
+        fwrite(cert, 1, pfs0_ctx.files[num_ncas + 2].size, nsp_file);
+        free(tik);
+    }
+
+    // Patch the reserved header now that names are final, its size is unchanged
+    hp_log("\n===> Writing NSP header\n");
+    pfs0_calculate_layout(&pfs0_ctx);
+    header = pfs0_create_header(&pfs0_ctx);
+    fseeko64(nsp_file, 0, SEEK_SET);
+    fwrite(header, 1, pfs0_ctx.header_size, nsp_file);
+    free(header);
+    for (uint32_t i = 0; i < pfs0_ctx.num_files; i++)
+        hp_log("%s: %" PRIu64 " bytes\n", pfs0_ctx.files[i].name, pfs0_ctx.files[i].size);
+
+    int ret = 0;
+    fseeko64(nsp_file, 0, SEEK_END);
+    if ((uint64_t)ftello64(nsp_file) != pfs0_ctx.header_size + pfs0_ctx.data_size || fflush(nsp_file) != 0)
+    {
+        hp_error("Failed to write %s!\n", out_nsp_filepath->char_path);
+        ret = 1;
+    }
+    os_fclose(nsp_file);
+
+    *out_nsp_size = pfs0_ctx.header_size + pfs0_ctx.data_size;
+    pfs0_free_ctx(&pfs0_ctx);
+    return ret;
+}
@@ -0,0 +1,16 @@
+#ifndef HACPACK_NSP_H
+#define HACPACK_NSP_H
+
+#include <stdint.h>
+#include "types.h"
+#include "filepath.h"
+#include "settings.h"
+
+#define NSP_COPY_CHUNK_SIZE 0x10000000 // 256 MB
+#define NSP_SPLIT_PART_SIZE 0xFFFF0000 // Largest part that fits on FAT32
+#define NSP_DATA_ALIGNMENT 0x1000       // Filesystem block, so entries can be reflinked
+
+int nsp_build(filepath_t *in_dirpath, filepath_t *out_nsp_filepath, hp_settings_t *settings, uint64_t *out_nsp_size);
+int nsp_build_application(hp_settings_t *settings, filepath_t *out_nsp_filepath, uint64_t *out_nsp_size);
+
+#endif
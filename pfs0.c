@@ -5,12 +5,26 @@
 #include <dirent.h>
 #include "pfs0.h"
 #include "sha.h"
+#include "fio.h"
 
 #include "types.h"
 
-#define MAX_FS_ENTRIES 0x20 //If ever needed, this constant and the size of stringtable can be increased.
+#define PFS0_COPY_BUFFER_SIZE 0x400000 // 4 MB
 
-int pfs0_build(filepath_t *in_dirpath, filepath_t *out_pfs0_filepath, uint64_t *out_pfs0_size)
+static int pfs0_compare_files(const void *a, const void *b)
+{
+    return strcmp(((const pfs0_file_ctx_t *)a)->name, ((const pfs0_file_ctx_t *)b)->name);
+}
+
+void pfs0_free_ctx(pfs0_ctx_t *pfs0_ctx)
+{
+    for (uint32_t i = 0; i < pfs0_ctx->num_files; i++)
+        free(pfs0_ctx->files[i].name);
+    free(pfs0_ctx->files);
+    memset(pfs0_ctx, 0, sizeof(*pfs0_ctx));
+}
+
+int pfs0_visit_dir(pfs0_ctx_t *pfs0_ctx, filepath_t *in_dirpath)
 {
 #if __MINGW32__
     struct __stat64 objstats;
@@ -19,179 +33,274 @@ int pfs0_build(filepath_t *in_dirpath, filepath_t *out_pfs0_filepath, uint64_t *
 #endif
     DIR *dir = NULL;
     struct dirent *cur_dirent = NULL;
-    FILE *fout = NULL, *fin = NULL;
-    int ret = 0;
-    uint32_t tmplen = 0;
-    uint32_t pos;
-    uint8_t *tmpbuf;
-
-    uint32_t objcount = 0;
-    uint32_t stringtable_offset = 0;
-    uint64_t filedata_reloffset = 0;
-
-    pfs0_header_t header;
-    pfs0_file_entry_t fsentries[MAX_FS_ENTRIES];
-    pfs0_file_entry_t *fsentry;
-
     char objpath[4351];
 
-    char stringtable[0x200];
-
-    memset(&header, 0, sizeof(header));
-    memset(fsentries, 0, sizeof(fsentries));
-    memset(stringtable, 0, sizeof(stringtable));
+    memset(pfs0_ctx, 0, sizeof(*pfs0_ctx));
+    filepath_init(&pfs0_ctx->dirpath);
+    filepath_copy(&pfs0_ctx->dirpath, in_dirpath);
+    if (strcmp(&pfs0_ctx->dirpath.char_path[strlen(pfs0_ctx->dirpath.char_path) - 1], OS_PATH_SEPARATOR) != 0)
+        filepath_append(&pfs0_ctx->dirpath, "");
 
-    filepath_t in_dirpath_cpy;
-    filepath_init(&in_dirpath_cpy);
-    filepath_copy(&in_dirpath_cpy, in_dirpath);
-    if (strcmp(&in_dirpath_cpy.char_path[strlen(in_dirpath_cpy.char_path) - 1], OS_PATH_SEPARATOR) != 0)
-        filepath_append(&in_dirpath_cpy, "");
-
-    dir = opendir(in_dirpath_cpy.char_path);
+    dir = opendir(pfs0_ctx->dirpath.char_path);
     if (dir == NULL)
     {
-        printf("Failed to open %s.\n", in_dirpath_cpy.char_path);
-        return 1;
-    }
-
-    fout = os_fopen(out_pfs0_filepath->os_path, OS_MODE_WRITE);
-    if (fout == NULL)
-    {
-        printf("Failed to open PFS0 filepath.\n");
-        closedir(dir);
+        hp_error("Failed to open %s!\n", pfs0_ctx->dirpath.char_path);
         return 1;
     }
 
+    // Gather names and sizes in a single pass, the stat info is reused for the layout
     while ((cur_dirent = readdir(dir)))
     {
         if (strcmp(cur_dirent->d_name, ".") == 0 || strcmp(cur_dirent->d_name, "..") == 0)
             continue;
 
-        memset(objpath, 0, sizeof(objpath));
-        snprintf(objpath, sizeof(objpath) - 1, "%s%s", in_dirpath_cpy.char_path, cur_dirent->d_name);
+        snprintf(objpath, sizeof(objpath), "%s%s", pfs0_ctx->dirpath.char_path, cur_dirent->d_name);
 
         if (os_char_stat(objpath, &objstats) == -1)
         {
-            printf("Failed to stat: %s\n", objpath);
-            exit(EXIT_FAILURE);
+            hp_error("Failed to stat: %s\n", objpath);
+            hp_exit_failure();
         }
 
         if ((objstats.st_mode & S_IFMT) == S_IFDIR) //directory
         {
-            printf("Directories aren't supported, skipping... (%s)\n", objpath);
+            hp_log("Directories aren't supported, skipping... (%s)\n", objpath);
         }
         else if ((objstats.st_mode & S_IFMT) == S_IFREG) //file
         {
-            if (objcount >= MAX_FS_ENTRIES)
+            if (pfs0_ctx->num_files == pfs0_ctx->files_capacity)
             {
-                printf("Maximum fs object count already reached.\n");
-                exit(EXIT_FAILURE);
+                pfs0_ctx->files_capacity = pfs0_ctx->files_capacity ? pfs0_ctx->files_capacity * 2 : 0x20;
+                pfs0_file_ctx_t *files = realloc(pfs0_ctx->files, pfs0_ctx->files_capacity * sizeof(pfs0_file_ctx_t));
+                if (files == NULL)
+                {
+                    hp_error("Failed to allocate PFS0 file entries!\n");
+                    hp_exit_failure();
+                }
+                pfs0_ctx->files = files;
             }
 
-            fsentry = &fsentries[objcount];
-
-            fsentry->offset = filedata_reloffset;
-            fsentry->size = objstats.st_size;
-            filedata_reloffset += fsentry->size;
-            fsentry->string_table_offset = stringtable_offset;
-
-            tmplen = strlen(cur_dirent->d_name) + 1;
-            if (stringtable_offset + tmplen > sizeof(stringtable))
+            pfs0_file_ctx_t *cur_file = &pfs0_ctx->files[pfs0_ctx->num_files];
+            memset(cur_file, 0, sizeof(*cur_file));
+            cur_file->size = objstats.st_size;
+            if ((cur_file->name = strdup(cur_dirent->d_name)) == NULL)
             {
-                printf("Max size of stringtable reached.\n");
-                exit(EXIT_FAILURE);
+                hp_error("Failed to allocate PFS0 file name!\n");
+                hp_exit_failure();
             }
-
-            strncpy(&stringtable[stringtable_offset], cur_dirent->d_name, sizeof(stringtable) - stringtable_offset);
-            stringtable_offset += tmplen;
-
-            objcount++;
+            pfs0_ctx->num_files++;
         }
         else
         {
-            printf("Invalid FS object type.\n");
-            exit(EXIT_FAILURE);
+            hp_error("Invalid FS object type: %s\n", objpath);
+            hp_exit_failure();
         }
     }
 
     closedir(dir);
 
-    if (ret == 0)
+    // Sort entries by name so that output doesn't depend on readdir order
+    if (pfs0_ctx->num_files > 1)
+        qsort(pfs0_ctx->files, pfs0_ctx->num_files, sizeof(pfs0_file_ctx_t), pfs0_compare_files);
+
+    pfs0_calculate_layout(pfs0_ctx);
+    return 0;
+}
+
+void pfs0_calculate_layout(pfs0_ctx_t *pfs0_ctx)
+{
+    uint64_t string_table_size = 0;
+    uint64_t alignment = pfs0_ctx->data_alignment ? pfs0_ctx->data_alignment : 1;
+    pfs0_ctx->data_size = 0;
+    for (uint32_t i = 0; i < pfs0_ctx->num_files; i++)
     {
-        stringtable_offset = (stringtable_offset + 0x1f) & ~0x1f;
+        pfs0_ctx->data_size = (pfs0_ctx->data_size + alignment - 1) / alignment * alignment;
+        pfs0_ctx->files[i].offset = pfs0_ctx->data_size;
+        pfs0_ctx->data_size += pfs0_ctx->files[i].size;
+        pfs0_ctx->files[i].string_table_offset = (uint32_t)string_table_size;
+        string_table_size += strlen(pfs0_ctx->files[i].name) + 1;
+    }
 
-        header.magic = le_word(0x30534650);
-        header.num_files = le_word(objcount);
-        header.string_table_size = le_word(stringtable_offset);
+    // Padding the string table makes the data start aligned too
+    uint64_t entries_size = sizeof(pfs0_header_t) + (uint64_t)sizeof(pfs0_file_entry_t) * pfs0_ctx->num_files;
+    string_table_size = (string_table_size + 0x1f) & ~(uint64_t)0x1f;
+    if (alignment > 1)
+        string_table_size = (entries_size + string_table_size + alignment - 1) / alignment * alignment - entries_size;
+    if (string_table_size > UINT32_MAX)
+    {
+        hp_error("PFS0 string table is too big!\n");
+        hp_exit_failure();
+    }
 
-        fwrite(&header, 1, sizeof(header), fout);
-        fwrite(fsentries, 1, sizeof(pfs0_file_entry_t) * objcount, fout);
-        fwrite(stringtable, 1, stringtable_offset, fout);
+    pfs0_ctx->string_table_size = (uint32_t)string_table_size;
+    pfs0_ctx->header_size = entries_size + pfs0_ctx->string_table_size;
+}
 
-        stringtable_offset = 0;
+/* Size of the header of a PFS0 starting with header, 0 if it isn't a PFS0. */
+uint64_t pfs0_get_header_size(const pfs0_header_t *header)
+{
+    if (header->magic != MAGIC_PFS0)
+        return 0;
+    return sizeof(pfs0_header_t) + (uint64_t)sizeof(pfs0_file_entry_t) * header->num_files + header->string_table_size;
+}
 
-        for (pos = 0; pos < objcount; pos++)
+/* Fills pfs0_ctx with the entries of a whole PFS0 header, pfs0_size is the size of the PFS0 the entries must lie in.
+   Returns 0 on success, the reverse of pfs0_create_header. */
+int pfs0_parse_header(pfs0_ctx_t *pfs0_ctx, const unsigned char *header, uint64_t pfs0_size)
+{
+    const pfs0_header_t *pfs0_header = (const pfs0_header_t *)header;
+    memset(pfs0_ctx, 0, sizeof(*pfs0_ctx));
+    filepath_init(&pfs0_ctx->dirpath);
+    pfs0_ctx->header_size = pfs0_get_header_size(pfs0_header);
+    if (pfs0_ctx->header_size == 0 || pfs0_ctx->header_size > pfs0_size)
+        return 1;
+    pfs0_ctx->data_size = pfs0_size - pfs0_ctx->header_size;
+    pfs0_ctx->string_table_size = pfs0_header->string_table_size;
+    pfs0_ctx->files = calloc(pfs0_header->num_files ? pfs0_header->num_files : 1, sizeof(pfs0_file_ctx_t));
+    if (pfs0_ctx->files == NULL)
+        return 1;
+    pfs0_ctx->files_capacity = pfs0_header->num_files;
+
+    const pfs0_file_entry_t *entries = (const pfs0_file_entry_t *)(pfs0_header + 1);
+    const char *string_table = (const char *)(entries + pfs0_header->num_files);
+    for (uint32_t i = 0; i < pfs0_header->num_files; i++)
+    {
+        const pfs0_file_entry_t *entry = &entries[i];
+        if (entry->string_table_offset >= pfs0_header->string_table_size ||
+            memchr(string_table + entry->string_table_offset, '\0', pfs0_header->string_table_size - entry->string_table_offset) == NULL ||
+            entry->offset > pfs0_ctx->data_size || entry->size > pfs0_ctx->data_size - entry->offset)
         {
-            tmplen = strlen(&stringtable[stringtable_offset]);
-            if (tmplen == 0)
-            {
-                printf("Empty string entry found in stringtable.\n");
-                ret = 5;
-                break;
-            }
-            tmplen++;
+            pfs0_free_ctx(pfs0_ctx);
+            return 1;
+        }
+        pfs0_file_ctx_t *file = &pfs0_ctx->files[pfs0_ctx->num_files++];
+        file->offset = entry->offset;
+        file->size = entry->size;
+        file->string_table_offset = entry->string_table_offset;
+        if ((file->name = strdup(string_table + entry->string_table_offset)) == NULL)
+        {
+            pfs0_free_ctx(pfs0_ctx);
+            return 1;
+        }
+    }
+    return 0;
+}
 
-            if (stringtable_offset + tmplen > sizeof(stringtable))
-            {
-                printf("Max size of stringtable reached during stringtable entry reading.\n");
-                ret = 4;
-                break;
-            }
+/* Reads the header of the PFS0 of pfs0_size bytes at offset in fd, like an NSP, returns 0 on success. */
+int pfs0_read_header(pfs0_ctx_t *pfs0_ctx, int fd, uint64_t offset, uint64_t pfs0_size)
+{
+    pfs0_header_t pfs0_header;
+    memset(pfs0_ctx, 0, sizeof(*pfs0_ctx));
+    if (pfs0_size < sizeof(pfs0_header) || fio_pread(fd, &pfs0_header, sizeof(pfs0_header), offset) != 0)
+        return 1;
+    uint64_t header_size = pfs0_get_header_size(&pfs0_header);
+    if (header_size == 0 || header_size > pfs0_size)
+        return 1;
+    unsigned char *header = malloc(header_size);
+    int ret = header == NULL || fio_pread(fd, header, header_size, offset) != 0 || pfs0_parse_header(pfs0_ctx, header, pfs0_size) != 0;
+    free(header);
+    return ret;
+}
 
-            memset(objpath, 0, sizeof(objpath));
-            snprintf(objpath, sizeof(objpath) - 1, "%s%s", in_dirpath_cpy.char_path, &stringtable[stringtable_offset]);
-            stringtable_offset += tmplen;
+unsigned char *pfs0_create_header(pfs0_ctx_t *pfs0_ctx)
+{
+    unsigned char *header_buf = calloc(1, pfs0_ctx->header_size);
+    if (header_buf == NULL)
+    {
+        hp_error("Failed to allocate PFS0 header!\n");
+        hp_exit_failure();
+    }
 
-            fin = fopen(objpath, "rb");
-            if (fin == NULL)
-            {
-                printf("Failed to open filepath for filedata.\n");
-                ret = 1;
-                break;
-            }
+    pfs0_header_t *header = (pfs0_header_t *)header_buf;
+    pfs0_file_entry_t *fsentries = (pfs0_file_entry_t *)(header_buf + sizeof(pfs0_header_t));
+    char *stringtable = (char *)(fsentries + pfs0_ctx->num_files);
 
-            uint64_t read_size = 0x61A8000; // 100 MB
-            tmpbuf = malloc(read_size);
-            if (tmpbuf == NULL)
-            {
-                printf("Failed to allocate filedata.\n");
-                ret = 6;
-                fclose(fin);
-                break;
-            }
+    header->magic = le_word(MAGIC_PFS0);
+    header->num_files = le_word(pfs0_ctx->num_files);
+    header->string_table_size = le_word(pfs0_ctx->string_table_size);
 
-            printf("Writing %s to %s\n", objpath, out_pfs0_filepath->char_path);
+    for (uint32_t i = 0; i < pfs0_ctx->num_files; i++)
+    {
+        fsentries[i].offset = le_dword(pfs0_ctx->files[i].offset);
+        fsentries[i].size = le_dword(pfs0_ctx->files[i].size);
+        fsentries[i].string_table_offset = le_word(pfs0_ctx->files[i].string_table_offset);
+        strcpy(&stringtable[pfs0_ctx->files[i].string_table_offset], pfs0_ctx->files[i].name);
+    }
+
+    return header_buf;
+}
+
+int pfs0_build(filepath_t *in_dirpath, filepath_t *out_pfs0_filepath, uint64_t *out_pfs0_size)
+{
+    FILE *fout = NULL, *fin = NULL;
+    int ret = 0;
+    char objpath[4351];
+    pfs0_ctx_t pfs0_ctx;
 
-            uint64_t offset = 0;
-            while (offset < fsentries[pos].size)
+    if (pfs0_visit_dir(&pfs0_ctx, in_dirpath) != 0)
+        return 1;
+
+    fout = os_fopen(out_pfs0_filepath->os_path, OS_MODE_WRITE);
+    if (fout == NULL)
+    {
+        hp_error("Failed to open %s!\n", out_pfs0_filepath->char_path);
+        pfs0_free_ctx(&pfs0_ctx);
+        return 1;
+    }
+
+    unsigned char *header = pfs0_create_header(&pfs0_ctx);
+    fwrite(header, 1, pfs0_ctx.header_size, fout);
+    free(header);
+
+    unsigned char *tmpbuf = hp_track_buffer(malloc(PFS0_COPY_BUFFER_SIZE));
+    if (tmpbuf == NULL)
+    {
+        hp_error("Failed to allocate file-read buffer!\n");
+        hp_exit_failure();
+    }
+
+    for (uint32_t pos = 0; pos < pfs0_ctx.num_files; pos++)
+    {
+        snprintf(objpath, sizeof(objpath), "%s%s", pfs0_ctx.dirpath.char_path, pfs0_ctx.files[pos].name);
+
+        fin = hp_track_file(fopen(objpath, "rb"));
+        if (fin == NULL)
+        {
+            hp_error("Failed to open %s!\n", objpath);
+            ret = 1;
+            break;
+        }
+
+        hp_log("Writing %s to %s\n", objpath, out_pfs0_filepath->char_path);
+
+        uint64_t read_size = PFS0_COPY_BUFFER_SIZE;
+        uint64_t offset = 0;
+        while (offset < pfs0_ctx.files[pos].size)
+        {
+            if (pfs0_ctx.files[pos].size - offset < read_size)
+                read_size = pfs0_ctx.files[pos].size - offset;
+            if (fread(tmpbuf, 1, read_size, fin) != read_size)
             {
-                if (fsentries[pos].size - offset < read_size)
-                {
-                    read_size = fsentries[pos].size - offset;
-                }
-                tmplen = fread(tmpbuf, 1, read_size, fin);
-                fwrite(tmpbuf, 1, read_size, fout);
-                offset += read_size;
+                hp_error("Failed to read file: %s!\n", objpath);
+                hp_exit_failure();
             }
-
-            fclose(fin);
-            free(tmpbuf);
+            if (fwrite(tmpbuf, 1, read_size, fout) != read_size)
+            {
+                hp_error("Failed to write to %s!\n", out_pfs0_filepath->char_path);
+                hp_exit_failure();
+            }
+            offset += read_size;
         }
+
+        os_fclose(fin);
     }
 
+    hp_free(tmpbuf);
+    pfs0_free_ctx(&pfs0_ctx);
+
     *out_pfs0_size = (uint64_t)ftello64(fout);
 
-    fclose(fout);
+    os_fclose(fout);
 
     return ret;
 }
@@ -205,14 +314,14 @@ void pfs0_create_hashtable(filepath_t *pfs0_path, filepath_t *pfs0_hashtable_pat
     src_file = os_fopen(pfs0_path->os_path, OS_MODE_READ);
     if (src_file == NULL)
     {
-        fprintf(stderr, "Unable to open: %s\n", pfs0_path->char_path);
-        exit(EXIT_FAILURE);
+        hp_error("Unable to open: %s\n", pfs0_path->char_path);
+        hp_exit_failure();
     }
     dst_file = os_fopen(pfs0_hashtable_path->os_path, OS_MODE_WRITE);
     if (dst_file == NULL)
     {
-        fprintf(stderr, "Unable to open: %s\n", pfs0_hashtable_path->char_path);
-        exit(EXIT_FAILURE);
+        hp_error("Unable to open: %s\n", pfs0_hashtable_path->char_path);
+        hp_exit_failure();
     }
 
     uint64_t read_size = hash_block_size;
@@ -223,14 +332,14 @@ void pfs0_create_hashtable(filepath_t *pfs0_path, filepath_t *pfs0_hashtable_pat
     fseeko64(src_file, 0, SEEK_END);
     src_file_size = ftello64(src_file);
 
-    unsigned char *buf = calloc(1, read_size);
+    unsigned char *buf = hp_track_buffer(calloc(1, read_size));
     fseeko64(src_file, 0, SEEK_SET);
     fseeko64(dst_file, 0, SEEK_SET);
 
     if (buf == NULL)
     {
-        fprintf(stderr, "Failed to allocate file-read buffer!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Failed to allocate file-read buffer!\n");
+        hp_exit_failure();
     }
     uint64_t ofs = 0;
 
@@ -241,8 +350,8 @@ void pfs0_create_hashtable(filepath_t *pfs0_path, filepath_t *pfs0_hashtable_pat
             read_size = src_file_size - ofs;
         if (fread(buf, 1, read_size, src_file) != read_size)
         {
-            fprintf(stderr, "Failed to read file: %s!\n", pfs0_path->char_path);
-            exit(EXIT_FAILURE);
+            hp_error("Failed to read file: %s!\n", pfs0_path->char_path);
+            hp_exit_failure();
         }
         sha_update(sha_ctx, buf, read_size);
         sha_get_hash(sha_ctx, hash);
@@ -265,9 +374,9 @@ void pfs0_create_hashtable(filepath_t *pfs0_path, filepath_t *pfs0_hashtable_pat
     }
     *out_pfs0_offset = (uint64_t)ftello64(dst_file);
 
-    free(buf);
-    fclose(src_file);
-    fclose(dst_file);
+    hp_free(buf);
+    os_fclose(src_file);
+    os_fclose(dst_file);
 }
 
 void pfs0_calculate_master_hash(filepath_t *pfs0_hashtable_filepath, uint64_t hash_table_size, uint8_t *out_master_hash)
@@ -276,8 +385,8 @@ void pfs0_calculate_master_hash(filepath_t *pfs0_hashtable_filepath, uint64_t ha
     pfs0_hashtable_file = os_fopen(pfs0_hashtable_filepath->os_path, OS_MODE_READ);
     if (pfs0_hashtable_file == NULL)
     {
-        fprintf(stderr, "Unable to open: %s\n", pfs0_hashtable_filepath->char_path);
-        exit(EXIT_FAILURE);
+        hp_error("Unable to open: %s\n", pfs0_hashtable_filepath->char_path);
+        hp_exit_failure();
     }
 
     // Calculate hash
@@ -291,8 +400,8 @@ void pfs0_calculate_master_hash(filepath_t *pfs0_hashtable_filepath, uint64_t ha
             read_size = hash_table_size - ofs;
         if (fread(buf, 1, hash_table_size, pfs0_hashtable_file) != hash_table_size)
         {
-            fprintf(stderr, "Failed to read file: %s!\n", pfs0_hashtable_filepath->char_path);
-            exit(EXIT_FAILURE);
+            hp_error("Failed to read file: %s!\n", pfs0_hashtable_filepath->char_path);
+            hp_exit_failure();
         }
         sha_update(sha_ctx, buf, hash_table_size);
         ofs += read_size;
@@ -301,5 +410,5 @@ void pfs0_calculate_master_hash(filepath_t *pfs0_hashtable_filepath, uint64_t ha
 
     free_sha_ctx(sha_ctx);
     free(buf);
-    fclose(pfs0_hashtable_file);
+    os_fclose(pfs0_hashtable_file);
 }
@@ -7,9 +7,9 @@
 #include "filepath.h"
 
 #define MAGIC_PFS0 0x30534650
-#define PFS0_EXEFS_HASH_BLOCK_SIZE 0x10000;
-#define PFS0_LOGO_HASH_BLOCK_SIZE 0x1000;
-#define PFS0_META_HASH_BLOCK_SIZE 0x1000;
+#define PFS0_EXEFS_HASH_BLOCK_SIZE 0x10000
+#define PFS0_LOGO_HASH_BLOCK_SIZE 0x1000
+#define PFS0_META_HASH_BLOCK_SIZE 0x1000
 #define PFS0_PADDING_SIZE 0x200;
 
 #pragma pack(push, 1)
@@ -43,6 +43,31 @@ typedef struct {
 } pfs0_superblock_t;
 #pragma pack(pop)
 
+typedef struct {
+    char *name;
+    uint64_t size;
+    uint64_t offset; /* Relative to the end of the header. */
+    uint32_t string_table_offset;
+} pfs0_file_ctx_t;
+
+typedef struct {
+    filepath_t dirpath;
+    pfs0_file_ctx_t *files;
+    uint32_t num_files;
+    uint32_t files_capacity;
+    uint32_t string_table_size; /* Aligned to 0x20, or to data_alignment with the header. */
+    uint64_t header_size;
+    uint64_t data_size;
+    uint64_t data_alignment; /* Of the data and every entry, 0 packs the entries. */
+} pfs0_ctx_t;
+
+int pfs0_visit_dir(pfs0_ctx_t *pfs0_ctx, filepath_t *in_dirpath);
+void pfs0_calculate_layout(pfs0_ctx_t *pfs0_ctx);
+unsigned char *pfs0_create_header(pfs0_ctx_t *pfs0_ctx);
+uint64_t pfs0_get_header_size(const pfs0_header_t *header);
+int pfs0_parse_header(pfs0_ctx_t *pfs0_ctx, const unsigned char *header, uint64_t pfs0_size);
+int pfs0_read_header(pfs0_ctx_t *pfs0_ctx, int fd, uint64_t offset, uint64_t pfs0_size);
+void pfs0_free_ctx(pfs0_ctx_t *pfs0_ctx);
 int pfs0_build(filepath_t *in_dirpath, filepath_t *out_pfs0_filepath, uint64_t *out_pfs0_size);
 void pfs0_create_hashtable(filepath_t *pfs0_path, filepath_t *pfs0_hashtable_path, uint32_t hash_block_size, uint64_t *out_hashtable_size, uint64_t *out_pfs0_offset);
 void pfs0_calculate_master_hash(filepath_t *pfs0_hashtable_filepath, uint64_t hash_table_size, uint8_t *out_master_hash);
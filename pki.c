@@ -92,7 +92,7 @@ void pki_derive_keys(hp_keyset_t *keyset) {
         }
         aes_calculate_cmac(cmac, &keyset->encrypted_keyblobs[i][0x10], 0xA0, keyset->keyblob_mac_keys[i]);
         if (memcmp(cmac, &keyset->encrypted_keyblobs[i][0], 0x10) != 0) {
-            fprintf(stderr, "[ WARN ] Keyblob MAC %02x is invalid. Are SBK/TSEC key correct?\n", i);
+            hp_error("[ WARN ] Keyblob MAC %02x is invalid. Are SBK/TSEC key correct?\n", i);
             continue;
         }
         aes_ctx_t *keyblob_ctx = new_aes_ctx(&keyset->keyblob_keys[i], 0x10, AES_MODE_CTR);
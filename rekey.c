@@ -0,0 +1,840 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "rekey.h"
+#include "nca.h"
+#include "ncareader.h"
+#include "aes.h"
+#include "fio.h"
+#include "rsa.h"
+#include "sha.h"
+#include "ticket.h"
+#include "worker.h"
+#include "json.h"
+#include "extkeys.h"
+#include "filepath.h"
+#include "utils.h"
+
+/* One output of a rekey, header and section key are made from settings. */
+typedef struct
+{
+    hp_settings_t *settings;
+    const char *name; /* Label for logs, NULL for a plain rekey */
+    filepath_t path;
+    filepath_t final_path;
+    int fd;
+    nca_header_t nca_header;
+    unsigned char key[0x10];
+    hp_nca_digest_t digest;
+} rekey_target_t;
+
+/* One chunk of a CTR section, decrypted once and encrypted again for every target. */
+typedef struct
+{
+    uint64_t offset; /* Offset in the NCA */
+    uint64_t size;
+    uint8_t section_index;
+    int failed;
+} rekey_job_t;
+
+typedef struct
+{
+    int src_fd;
+    nca_header_t *nca_header; /* Decrypted header of the source NCA */
+    unsigned char src_key[0x10];
+    const unsigned char *plain_buf; /* Plaintext at plain_offset handed over by the build, read from src_fd if NULL */
+    uint64_t plain_offset;
+    uint64_t plain_written; /* CTR bytes the targets already got from the build */
+    rekey_target_t *targets;
+    uint32_t num_targets;
+    rekey_job_t *jobs;
+} rekey_ctx_t;
+
+/* Variants of an NCA build, nca_encrypt_section hands every plaintext chunk to rekey_variants_write before encrypting it. */
+struct rekey_variants
+{
+    json_value_t *json;
+    hp_settings_t *variant_settings;
+    unsigned char *keyareakeys;
+    rekey_target_t *targets;
+    rekey_ctx_t rekey_ctx;
+    uint8_t has_keys; /* Target keys were set from the key area of the build */
+    uint32_t num_threads;
+};
+
+static void rekey_job(void *ctx, uint32_t index)
+{
+    rekey_ctx_t *rekey_ctx = (rekey_ctx_t *)ctx;
+    rekey_job_t *job = &rekey_ctx->jobs[index];
+
+    // A second buffer keeps the plaintext around when there's more than one target, plaintext from the build is kept by the build
+    uint8_t read_src = rekey_ctx->plain_buf == NULL ? 1 : 0;
+    unsigned char *buf = hp_track_buffer(malloc(read_src && rekey_ctx->num_targets > 1 ? job->size * 2 : job->size));
+    if (buf == NULL || (read_src && fio_pread(rekey_ctx->src_fd, buf, job->size, job->offset) != 0))
+    {
+        hp_free(buf);
+        job->failed = 1;
+        return;
+    }
+
+    // Every key runs on the same counter, hash trees over the plaintext stay valid
+    unsigned char ctr[0x10];
+    for (unsigned int j = 0; j < 0x8; j++)
+        ctr[j] = rekey_ctx->nca_header->fs_headers[job->section_index].section_ctr[0x8 - j - 1];
+    nca_update_ctr(ctr, job->offset);
+
+    const unsigned char *plain = buf;
+    if (read_src)
+    {
+        aes_ctx_t *src_aes_ctx = new_aes_ctx(rekey_ctx->src_key, 16, AES_MODE_CTR);
+        aes_setiv(src_aes_ctx, ctr, 0x10);
+        aes_decrypt(src_aes_ctx, buf, buf, job->size);
+        free_aes_ctx(src_aes_ctx);
+    }
+    else
+        plain = rekey_ctx->plain_buf + (job->offset - rekey_ctx->plain_offset);
+
+    unsigned char *out_buf = read_src && rekey_ctx->num_targets > 1 ? buf + job->size : buf;
+    for (uint32_t i = 0; i < rekey_ctx->num_targets; i++)
+    {
+        rekey_target_t *target = &rekey_ctx->targets[i];
+        if (out_buf != plain)
+            memcpy(out_buf, plain, job->size);
+        aes_ctx_t *dst_aes_ctx = new_aes_ctx(target->key, 16, AES_MODE_CTR);
+        aes_setiv(dst_aes_ctx, ctr, 0x10);
+        aes_encrypt(dst_aes_ctx, out_buf, out_buf, job->size);
+        free_aes_ctx(dst_aes_ctx);
+        if (fio_pwrite(target->fd, out_buf, job->size, job->offset) != 0)
+        {
+            job->failed = 1;
+            break;
+        }
+    }
+    hp_free(buf);
+}
+
+/* Hashes one finished target for its NCA ID, targets are hashed side by side. */
+static void rekey_hash_job(void *ctx, uint32_t index)
+{
+    rekey_ctx_t *rekey_ctx = (rekey_ctx_t *)ctx;
+    rekey_target_t *target = &rekey_ctx->targets[index];
+    memset(&target->digest, 0, sizeof(target->digest));
+
+    int fd = fio_open(&target->path, FIO_MODE_READ);
+    if (fd < 0)
+    {
+        hp_error("Failed to open %s!\n", target->path.char_path);
+        return;
+    }
+    unsigned char *buf = hp_track_buffer(malloc(REKEY_CHUNK_SIZE));
+    if (buf == NULL)
+    {
+        hp_error("Failed to allocate hash buffer!\n");
+        fio_close(fd);
+        return;
+    }
+
+    sha_ctx_t *sha_ctx = new_sha_ctx(HASH_TYPE_SHA256, 0);
+    uint64_t nca_size = target->nca_header.nca_size;
+    uint64_t ofs = 0;
+    while (ofs < nca_size)
+    {
+        uint64_t read_size = nca_size - ofs < REKEY_CHUNK_SIZE ? nca_size - ofs : REKEY_CHUNK_SIZE;
+        if (fio_pread(fd, buf, read_size, ofs) != 0)
+            break;
+        sha_update(sha_ctx, buf, read_size);
+        ofs += read_size;
+    }
+    if (ofs == nca_size)
+    {
+        sha_get_hash(sha_ctx, target->digest.hash);
+        target->digest.size = nca_size;
+        target->digest.valid = 1;
+    }
+    free_sha_ctx(sha_ctx);
+    hp_free(buf);
+    fio_close(fd);
+}
+
+static int rekey_compare_ranges(const void *a, const void *b)
+{
+    const uint64_t *range_a = (const uint64_t *)a;
+    const uint64_t *range_b = (const uint64_t *)b;
+    if (range_a[0] != range_b[0])
+        return range_a[0] < range_b[0] ? -1 : 1;
+    return 0;
+}
+
+/* Signs a changed header again, signature 1 is only replaced when resign_sig1 is set. */
+static void rekey_sign_header(hp_settings_t *settings, nca_header_t *nca_header, uint8_t resign_sig1)
+{
+    if (resign_sig1 == 1 && settings->nca_sig1_private_key.valid == VALIDITY_INVALID)
+    {
+        hp_log("Generating signature\n");
+        memset(nca_header->fixed_key_sig, 0, sizeof(nca_header->fixed_key_sig));
+        nca_generate_sig(nca_header->fixed_key_sig, settings);
+    }
+    else if (settings->nca_sig1_private_key.valid == VALIDITY_VALID)
+    {
+        hp_log("Signing NCA header\n");
+        rsa_sign_with_file(&nca_header->magic, 0x200, nca_header->fixed_key_sig, 0x100, settings->nca_sig1_private_key.char_path);
+    }
+
+    memset(nca_header->npdm_key_sig, 0, sizeof(nca_header->npdm_key_sig));
+    if (nca_header->content_type == NCA_TYPE_PROGRAM && (settings->noselfsignncasig2 == 0 || settings->nca_sig2_private_key.valid == VALIDITY_VALID))
+    {
+        hp_log("Signing NCA header signature 2\n");
+        if (settings->nca_sig2_private_key.valid == VALIDITY_VALID)
+            rsa_sign_with_file(&nca_header->magic, 0x200, (unsigned char *)&nca_header->npdm_key_sig, 0x100, settings->nca_sig2_private_key.char_path);
+        else
+            rsa_sign(&nca_header->magic, 0x200, (unsigned char *)&nca_header->npdm_key_sig, 0x100, (char *)rsa_get_acid_private_key());
+    }
+}
+
+/* Key area of a target, the source's is kept and key area key 2 only changes with --keyareakey.
+ * A source with titlekey crypto has no key area, it gets one with the key area key of the settings. */
+static void rekey_get_key_area(hp_settings_t *settings, unsigned char (*src_key_area)[0x10], unsigned char (*out_keys)[0x10])
+{
+    memset(out_keys, 0, 0x40);
+    if (src_key_area != NULL)
+        memcpy(out_keys, src_key_area, 0x40);
+    if (src_key_area == NULL || (settings->header_fields & HEADER_FIELD_KEYAREAKEY))
+        memcpy(out_keys[2], settings->keyareakey, 0x10);
+}
+
+/* Section key of a target, the titlekey or key area key 2. */
+static void rekey_get_target_key(hp_settings_t *settings, unsigned char (*src_key_area)[0x10], unsigned char *out_key)
+{
+    unsigned char keys[4][0x10];
+    rekey_get_key_area(settings, src_key_area, keys);
+    memcpy(out_key, settings->has_title_key == 1 ? settings->title_key : keys[2], 0x10);
+}
+
+/* Makes the header of a target from the decrypted source header with the keys, keygeneration and header fields of target->settings. */
+static void rekey_init_target(rekey_target_t *target, nca_header_t *src_header, unsigned char (*src_key_area)[0x10])
+{
+    hp_settings_t *settings = target->settings;
+    nca_header_t *nca_header = &target->nca_header;
+    *nca_header = *src_header;
+
+    hp_log("===> Rekeying NCA header%s%s\n", target->name ? " of variant " : "", target->name ? target->name : "");
+    if (settings->header_fields & HEADER_FIELD_DISTTYPE)
+        nca_header->distribution = settings->nca_disttype == NCA_DISTRIBUTION_GAMECARD ? 1 : 0;
+    if (settings->header_fields & HEADER_FIELD_SDK_VERSION)
+        nca_header->sdk_version = settings->sdk_version;
+    nca_header->crypto_type = 0;
+    nca_header->crypto_type2 = 0;
+    nca_set_keygen(nca_header, settings);
+    memset(nca_header->rights_id, 0, sizeof(nca_header->rights_id));
+    memset(nca_header->encrypted_keys, 0, sizeof(nca_header->encrypted_keys));
+    rekey_get_target_key(settings, src_key_area, target->key);
+    if (settings->has_title_key == 0)
+    {
+        unsigned char keys[4][0x10];
+        rekey_get_key_area(settings, src_key_area, keys);
+        hp_log("Encrypting key area\n");
+        aes_ctx_t *aes_ctx = new_aes_ctx(ncareader_get_kek(settings, nca_header, settings->keygeneration), 16, AES_MODE_ECB);
+        aes_encrypt(aes_ctx, nca_header->encrypted_keys, keys, 0x40);
+        free_aes_ctx(aes_ctx);
+    }
+    else
+    {
+        // Calculate RightsID
+        for (int ridc = 0; ridc < 8; ridc++)
+        {
+            nca_header->rights_id[7 - ridc] = (settings->title_id >> (8 * ridc) & 0xff);
+        }
+        nca_header->rights_id[15] = (uint8_t)settings->keygeneration;
+    }
+}
+
+/* hacpack_settings_build leaves key checks of rekeying and patching to these, the keygeneration is only known once the input NCA is read.
+ * Key area keys are checked by ncareader_get_kek when the key area is encrypted. */
+static void rekey_check_keys(hp_settings_t *settings)
+{
+    unsigned char zero_key[0x10] = {0};
+    if (settings->has_title_key == 1 && memcmp(settings->keyset.titlekeks[settings->keygeneration - 1], zero_key, 0x10) == 0)
+    {
+        hp_error("Error: titlekek for keygeneration %i is not present in keyset file\n", settings->keygeneration);
+        hp_exit_failure();
+    }
+}
+
+/* Creates the temp file of a target as RekeyN.nca in its output directory. */
+static void rekey_create_target(rekey_target_t *target, uint32_t index)
+{
+    filepath_init(&target->path);
+    filepath_copy(&target->path, &target->settings->out_dir);
+    filepath_append(&target->path, "Rekey%" PRIu32 ".nca", index);
+    target->fd = fio_open(&target->path, FIO_MODE_WRITE);
+    if (target->fd < 0)
+    {
+        hp_error("Failed to create %s!\n", target->path.char_path);
+        hp_exit_failure();
+    }
+}
+
+/* Writes every target from the source NCA, CTR sections are read and decrypted once and encrypted again for each target.
+ * CTR sections the build already handed over through rekey_variants_write aren't read again. */
+static void rekey_write_targets(rekey_ctx_t *rekey_ctx, filepath_t *src_path, uint64_t nca_size, uint32_t num_threads)
+{
+    nca_header_t *nca_header = rekey_ctx->nca_header;
+
+    // Collect CTR sections, everything else is copied as it is
+    uint64_t ctr_ranges[4][2];
+    uint32_t num_ctr_ranges = 0;
+    uint32_t num_jobs = 0;
+    uint64_t ctr_size = 0;
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        uint64_t start_offset = (uint64_t)nca_header->section_entries[i].media_start_offset * 0x200;
+        uint64_t end_offset = (uint64_t)nca_header->section_entries[i].media_end_offset * 0x200;
+        if (end_offset == 0)
+            continue;
+        if (start_offset < sizeof(*nca_header) || end_offset <= start_offset || end_offset > nca_size)
+        {
+            hp_error("Error: Invalid section %u offsets in %s\n", i, src_path->char_path);
+            hp_exit_failure();
+        }
+
+        switch (nca_header->fs_headers[i].crypt_type)
+        {
+        case CRYPT_NONE:
+            hp_log("Section %u is plaintext, copying it as is\n", i);
+            break;
+        case CRYPT_CTR:
+            ctr_ranges[num_ctr_ranges][0] = start_offset;
+            ctr_ranges[num_ctr_ranges][1] = end_offset;
+            num_ctr_ranges++;
+            ctr_size += end_offset - start_offset;
+            num_jobs += (uint32_t)((end_offset - start_offset + REKEY_CHUNK_SIZE - 1) / REKEY_CHUNK_SIZE);
+            break;
+        default:
+            hp_error("Error: Section %u of %s has unsupported crypto type %u\n", i, src_path->char_path, nca_header->fs_headers[i].crypt_type);
+            hp_exit_failure();
+        }
+    }
+    qsort(ctr_ranges, num_ctr_ranges, sizeof(ctr_ranges[0]), rekey_compare_ranges);
+
+    // Data between CTR sections is copied, or reflinked where the filesystem allows it
+    hp_log("===> Copying unencrypted data\n");
+    for (uint32_t t = 0; t < rekey_ctx->num_targets; t++)
+    {
+        rekey_target_t *target = &rekey_ctx->targets[t];
+        if (fio_set_size(target->fd, nca_size) != 0)
+        {
+            hp_error("Failed to create %s!\n", target->path.char_path);
+            hp_exit_failure();
+        }
+
+        uint64_t copy_offset = sizeof(*nca_header);
+        for (uint32_t i = 0; i <= num_ctr_ranges; i++)
+        {
+            uint64_t copy_end = i < num_ctr_ranges ? ctr_ranges[i][0] : nca_size;
+            if (copy_end > copy_offset && fio_copy_range(rekey_ctx->src_fd, copy_offset, target->fd, copy_offset, copy_end - copy_offset, NULL) != 0)
+            {
+                hp_error("Failed to copy %s!\n", src_path->char_path);
+                hp_exit_failure();
+            }
+            if (i < num_ctr_ranges && ctr_ranges[i][1] > copy_offset)
+                copy_offset = ctr_ranges[i][1];
+        }
+    }
+
+    // Sections the build handed over are done, after a cache hit or for a plain rekey they're read from the source
+    if (ctr_size > 0 && rekey_ctx->plain_written == ctr_size)
+    {
+        hp_log("===> %" PRIu32 " sections were encrypted for %" PRIu32 " NCAs while the NCA was built\n", num_ctr_ranges, rekey_ctx->num_targets);
+        num_jobs = 0;
+    }
+    else
+        hp_log("===> Re-encrypting %" PRIu32 " sections for %" PRIu32 " NCAs\n", num_ctr_ranges, rekey_ctx->num_targets);
+    rekey_job_t *jobs = calloc(num_jobs ? num_jobs : 1, sizeof(rekey_job_t));
+    if (jobs == NULL)
+    {
+        hp_error("Failed to allocate rekey jobs!\n");
+        hp_exit_failure();
+    }
+    uint32_t job_index = 0;
+    for (uint8_t i = 0; i < 4 && num_jobs > 0; i++)
+    {
+        if (nca_header->section_entries[i].media_end_offset == 0 || nca_header->fs_headers[i].crypt_type != CRYPT_CTR)
+            continue;
+        uint64_t start_offset = (uint64_t)nca_header->section_entries[i].media_start_offset * 0x200;
+        uint64_t end_offset = (uint64_t)nca_header->section_entries[i].media_end_offset * 0x200;
+        for (uint64_t ofs = start_offset; ofs < end_offset; ofs += REKEY_CHUNK_SIZE)
+        {
+            jobs[job_index].offset = ofs;
+            jobs[job_index].size = end_offset - ofs < REKEY_CHUNK_SIZE ? end_offset - ofs : REKEY_CHUNK_SIZE;
+            jobs[job_index].section_index = i;
+            job_index++;
+        }
+    }
+
+    rekey_ctx->plain_buf = NULL;
+    rekey_ctx->jobs = jobs;
+    worker_run(rekey_job, rekey_ctx, num_jobs, num_threads);
+    for (uint32_t i = 0; i < num_jobs; i++)
+    {
+        if (jobs[i].failed)
+        {
+            hp_error("Failed to re-encrypt %s at 0x%" PRIx64 "!\n", src_path->char_path, jobs[i].offset);
+            hp_exit_failure();
+        }
+    }
+    free(jobs);
+    rekey_ctx->jobs = NULL;
+
+    for (uint32_t t = 0; t < rekey_ctx->num_targets; t++)
+    {
+        rekey_target_t *target = &rekey_ctx->targets[t];
+
+        // Header changed, so both signatures are made again
+        rekey_sign_header(target->settings, &target->nca_header, 1);
+        hp_log("Encrypting header\n");
+        nca_header_t enc_header = target->nca_header;
+        nca_encrypt_header(&enc_header, target->settings);
+        if (fio_pwrite(target->fd, &enc_header, sizeof(enc_header), 0) != 0 || fio_close(target->fd) != 0)
+        {
+            hp_error("Failed to write %s!\n", target->path.char_path);
+            hp_exit_failure();
+        }
+        target->fd = -1;
+    }
+
+    hp_log("\n===> Post creation process\n");
+    hp_log("Calculating NCA hash\n");
+    worker_run(rekey_hash_job, rekey_ctx, rekey_ctx->num_targets, num_threads);
+    for (uint32_t t = 0; t < rekey_ctx->num_targets; t++)
+    {
+        rekey_target_t *target = &rekey_ctx->targets[t];
+        if (target->digest.valid == 0)
+        {
+            hp_error("Failed to hash %s!\n", target->path.char_path);
+            hp_exit_failure();
+        }
+
+        if (target->settings->has_title_key == 1)
+        {
+            // Create cert and tik
+            ticket_create_cert(target->settings);
+            ticket_create_tik(target->settings);
+        }
+
+        // Rename RekeyN.nca to ncaid.nca
+        nca_rename_to_id(target->settings, &target->path, &target->digest, target->settings->nca_type == NCA_TYPE_META, &target->final_path);
+        nca_write_sidecar(target->settings, &target->final_path, &target->digest);
+    }
+}
+
+/* Re-encrypts an existing NCA with the keys in settings, section bodies are streamed through CTR and every hash is reused. */
+void rekey_nca(hp_settings_t *settings)
+{
+    hp_log("----> Rekeying NCA: %s\n", settings->rekey_nca.char_path);
+    ncareader_t reader;
+    ncareader_open(settings, &settings->rekey_nca, settings->has_rekey_title_key ? settings->rekey_title_key : NULL, &reader);
+    if (reader.has_key == 0)
+    {
+        hp_error("Error: %s uses titlekey crypto, set its titlekey with --rekeytitlekey\n", settings->rekey_nca.char_path);
+        hp_exit_failure();
+    }
+    if (ncareader_has_rights_id(&reader.header) == 1)
+        hp_log("Using titlekey of input NCA\n");
+    nca_header_t nca_header = reader.header;
+
+    rekey_ctx_t rekey_ctx;
+    memset(&rekey_ctx, 0, sizeof(rekey_ctx));
+    rekey_ctx.src_fd = reader.fd;
+    rekey_ctx.nca_header = &nca_header;
+    memcpy(rekey_ctx.src_key, reader.key, 0x10);
+
+    // Output is named after the content type and title of the input NCA
+    settings->nca_type = (enum hp_nca_type)nca_header.content_type;
+    settings->title_id = nca_header.title_id;
+    // Keygeneration of the input NCA is kept unless --keygeneration is given
+    if ((settings->header_fields & HEADER_FIELD_KEYGENERATION) == 0)
+        settings->keygeneration = ncareader_get_keygeneration(&nca_header);
+    rekey_check_keys(settings);
+
+    rekey_target_t target;
+    memset(&target, 0, sizeof(target));
+    target.settings = settings;
+    rekey_init_target(&target, &nca_header, ncareader_has_rights_id(&nca_header) ? NULL : reader.key_area);
+    rekey_create_target(&target, 0);
+    rekey_ctx.targets = &target;
+    rekey_ctx.num_targets = 1;
+    rekey_write_targets(&rekey_ctx, &settings->rekey_nca, reader.size, settings->num_threads ? settings->num_threads : worker_get_cpu_count());
+    ncareader_close(&reader);
+    hp_log("\n----> Rekeyed %s NCA: %s\n", nca_get_content_type_name(settings->nca_type), target.final_path.char_path);
+}
+
+/* Changes header fields of an NCA in place, only the header is written and the NCA is read once for its new NCA ID. */
+void rekey_patch_header(hp_settings_t *settings)
+{
+    hp_log("----> Patching NCA header: %s\n", settings->patch_nca.char_path);
+    int fd = fio_open(&settings->patch_nca, FIO_MODE_EDIT);
+    if (fd < 0)
+    {
+        hp_error("Failed to open %s!\n", settings->patch_nca.char_path);
+        hp_exit_failure();
+    }
+
+    uint64_t nca_size;
+    nca_header_t nca_header;
+    ncareader_read_header(settings, &settings->patch_nca, fd, &nca_header, &nca_size);
+    settings->nca_type = (enum hp_nca_type)nca_header.content_type;
+    settings->title_id = nca_header.title_id;
+    int keygeneration = ncareader_get_keygeneration(&nca_header);
+    if ((settings->header_fields & HEADER_FIELD_KEYGENERATION) == 0)
+        settings->keygeneration = keygeneration;
+    rekey_check_keys(settings);
+
+    hp_log("===> Patching NCA header\n");
+    if (settings->header_fields & HEADER_FIELD_DISTTYPE)
+    {
+        hp_log("Setting distribution type to %s\n", settings->nca_disttype == NCA_DISTRIBUTION_GAMECARD ? "gamecard" : "download");
+        nca_header.distribution = settings->nca_disttype == NCA_DISTRIBUTION_GAMECARD ? 1 : 0;
+    }
+    if (settings->header_fields & HEADER_FIELD_SDK_VERSION)
+    {
+        hp_log("Setting SDK version to %08" PRIX32 "\n", settings->sdk_version);
+        nca_header.sdk_version = settings->sdk_version;
+    }
+    if (settings->keygeneration != keygeneration)
+    {
+        hp_log("Changing keygeneration from %i to %i\n", keygeneration, settings->keygeneration);
+        if (ncareader_has_rights_id(&nca_header) == 1)
+        {
+            // Titlekey stays the same, only the ticket that carries it changes
+            if (settings->has_title_key == 0)
+            {
+                hp_error("Error: %s uses titlekey crypto, set its titlekey with --titlekey to create the new ticket\n", settings->patch_nca.char_path);
+                hp_exit_failure();
+            }
+            nca_header.rights_id[15] = (uint8_t)settings->keygeneration;
+        }
+        else
+        {
+            unsigned char keys[4][0x10];
+            ncareader_decrypt_key_area(settings, &nca_header, keys);
+            hp_log("Encrypting key area\n");
+            aes_ctx_t *aes_ctx = new_aes_ctx(ncareader_get_kek(settings, &nca_header, settings->keygeneration), 16, AES_MODE_ECB);
+            aes_encrypt(aes_ctx, nca_header.encrypted_keys, keys, 0x40);
+            free_aes_ctx(aes_ctx);
+        }
+        nca_header.crypto_type = 0;
+        nca_header.crypto_type2 = 0;
+        nca_set_keygen(&nca_header, settings);
+    }
+
+    // Signature 1 is kept unless a new one is asked for, a zero or static one is still what it was
+    rekey_sign_header(settings, &nca_header, (settings->header_fields & HEADER_FIELD_NCASIG) ? 1 : 0);
+
+    hp_log("Encrypting header\n");
+    nca_encrypt_header(&nca_header, settings);
+    if (fio_pwrite(fd, &nca_header, sizeof(nca_header), 0) != 0 || fio_close(fd) != 0)
+    {
+        hp_error("Failed to write %s!\n", settings->patch_nca.char_path);
+        hp_exit_failure();
+    }
+
+    hp_log("\n===> Post creation process\n");
+    hp_log("Calculating NCA hash\n");
+    FILE *nca_file = os_fopen(settings->patch_nca.os_path, OS_MODE_READ);
+    if (nca_file == NULL)
+    {
+        hp_error("Failed to open %s!\n", settings->patch_nca.char_path);
+        hp_exit_failure();
+    }
+    hp_nca_digest_t digest;
+    nca_set_digest(nca_file, 0, &digest);
+    os_fclose(nca_file);
+
+    // The NCA keeps its directory, only its name follows the new NCA ID
+    char old_sidecar[MAX_PATH + sizeof(NCA_SIDECAR_EXTENSION)];
+    snprintf(old_sidecar, sizeof(old_sidecar), "%s" NCA_SIDECAR_EXTENSION, settings->patch_nca.char_path);
+    os_deletefile(old_sidecar);
+
+    char nca_dir[MAX_PATH];
+    snprintf(nca_dir, sizeof(nca_dir), "%s", settings->patch_nca.char_path);
+    char *separator = strrchr(nca_dir, OS_PATH_SEPARATOR[0]);
+    if (separator == NULL)
+        strcpy(nca_dir, ".");
+    else
+        separator[separator == nca_dir ? 1 : 0] = '\0';
+    filepath_init(&settings->out_dir);
+    filepath_set(&settings->out_dir, nca_dir);
+
+    if (settings->has_title_key == 1)
+    {
+        // Create cert and tik
+        ticket_create_cert(settings);
+        ticket_create_tik(settings);
+    }
+
+    filepath_t nca_final_path;
+    nca_rename_to_id(settings, &settings->patch_nca, &digest, settings->nca_type == NCA_TYPE_META, &nca_final_path);
+    nca_write_sidecar(settings, &nca_final_path, &digest);
+    hp_log("\n----> Patched %s NCA: %s\n", nca_get_content_type_name(settings->nca_type), nca_final_path.char_path);
+}
+
+/* Applies one variant object over a copy of the build settings, members are named like the options they stand for. */
+static void rekey_parse_variant(hp_settings_t *settings, json_value_t *variant, uint32_t index, const char **out_name)
+{
+    if (variant->type != JSON_OBJECT)
+    {
+        hp_error("Error: Variant %u is not an object\n", index);
+        hp_exit_failure();
+    }
+
+    for (uint32_t i = 0; i < variant->num_items; i++)
+    {
+        json_value_t *member = &variant->items[i];
+        if (strcmp(member->key, "titlekey") == 0 && (member->type == JSON_NULL || (member->type == JSON_BOOL && !member->boolean)))
+        {
+            settings->has_title_key = 0;
+            continue;
+        }
+        if (member->type != JSON_STRING && member->type != JSON_NUMBER)
+        {
+            hp_error("Error: Unsupported value for %s in variant %u\n", member->key, index);
+            hp_exit_failure();
+        }
+
+        const char *value = member->string;
+        if (strcmp(member->key, "name") == 0)
+            *out_name = value;
+        else if (strcmp(member->key, "outdir") == 0)
+            filepath_set(&settings->out_dir, value);
+        else if (strcmp(member->key, "disttype") == 0)
+        {
+            if (strcmp(value, "download") == 0)
+                settings->nca_disttype = NCA_DISTRIBUTION_DOWNLOAD;
+            else if (strcmp(value, "gamecard") == 0)
+                settings->nca_disttype = NCA_DISTRIBUTION_GAMECARD;
+            else
+            {
+                hp_error("Error: Invalid disttype in variant %u: %s\n", index, value);
+                hp_exit_failure();
+            }
+            settings->header_fields |= HEADER_FIELD_DISTTYPE;
+        }
+        else if (strcmp(member->key, "sdkversion") == 0)
+        {
+            settings->sdk_version = strtoul(value, NULL, 16);
+            if (settings->sdk_version < 0x000B0000)
+            {
+                hp_error("Error: Invalid SDK version in variant %u: %08" PRIX32 "\n", index, settings->sdk_version);
+                hp_exit_failure();
+            }
+            settings->header_fields |= HEADER_FIELD_SDK_VERSION;
+        }
+        else if (strcmp(member->key, "keygeneration") == 0)
+        {
+            settings->keygeneration = atoi(value);
+            if (settings->keygeneration < 1 || settings->keygeneration > 32)
+            {
+                hp_error("Invalid keygeneration in variant %u: %i, keygeneration range: 1-32\n", index, settings->keygeneration);
+                hp_exit_failure();
+            }
+            settings->header_fields |= HEADER_FIELD_KEYGENERATION;
+        }
+        else if (strcmp(member->key, "titlekey") == 0)
+        {
+            parse_hex_key(settings->title_key, value, 0x10);
+            settings->has_title_key = 1;
+        }
+        else if (strcmp(member->key, "keyareakey") == 0)
+        {
+            parse_hex_key(settings->keyareakey, value, 0x10);
+            settings->header_fields |= HEADER_FIELD_KEYAREAKEY;
+        }
+        else if (strcmp(member->key, "ncasig") == 0)
+        {
+            if (strcmp(value, "zero") == 0)
+                settings->nca_sig = NCA_SIG_TYPE_ZERO;
+            else if (strcmp(value, "static") == 0)
+                settings->nca_sig = NCA_SIG_TYPE_STATIC;
+            else if (strcmp(value, "random") == 0)
+                settings->nca_sig = NCA_SIG_TYPE_RANDOM;
+            else
+            {
+                hp_error("Error: Invalid ncasig in variant %u: %s\n", index, value);
+                hp_exit_failure();
+            }
+            settings->header_fields |= HEADER_FIELD_NCASIG;
+        }
+        else
+        {
+            hp_error("Error: Unknown member %s in variant %u\n", member->key, index);
+            hp_exit_failure();
+        }
+    }
+}
+
+/* Reads settings->variants and creates a temp file for every variant, call before the NCA is built.
+ * The build hands its CTR sections to rekey_variants_write, rekey_variants_close writes the rest from the built NCA. */
+rekey_variants_t *rekey_variants_open(hp_settings_t *settings)
+{
+    hp_log("Reading NCA variants: %s\n", settings->variants.char_path);
+    FILE *variants_file = os_fopen(settings->variants.os_path, OS_MODE_READ);
+    if (variants_file == NULL)
+    {
+        hp_error("Error: Failed to open %s\n", settings->variants.char_path);
+        hp_exit_failure();
+    }
+    char error[0x100];
+    json_value_t *json = json_parse_file(variants_file, error, sizeof(error));
+    os_fclose(variants_file);
+    if (json == NULL)
+    {
+        hp_error("Error: Failed to parse %s: %s\n", settings->variants.char_path, error);
+        hp_exit_failure();
+    }
+    json_value_t *variants_value = json->type == JSON_ARRAY ? json : json_get(json, "variants");
+    if (variants_value == NULL || variants_value->type != JSON_ARRAY || variants_value->num_items == 0)
+    {
+        hp_error("Error: %s doesn't contain any variants\n", settings->variants.char_path);
+        hp_exit_failure();
+    }
+
+    uint32_t num_targets = variants_value->num_items;
+    rekey_variants_t *variants = hp_track_buffer(calloc(1, sizeof(rekey_variants_t)));
+    rekey_target_t *targets = hp_track_buffer(calloc(num_targets, sizeof(rekey_target_t)));
+    hp_settings_t *variant_settings = hp_track_buffer(calloc(num_targets, sizeof(hp_settings_t)));
+    unsigned char *keyareakeys = hp_track_buffer(calloc(num_targets, 0x10));
+    if (variants == NULL || targets == NULL || variant_settings == NULL || keyareakeys == NULL)
+    {
+        hp_error("Failed to allocate NCA variants!\n");
+        hp_exit_failure();
+    }
+    variants->json = json;
+    variants->targets = targets;
+    variants->variant_settings = variant_settings;
+    variants->keyareakeys = keyareakeys;
+    variants->rekey_ctx.src_fd = -1;
+    variants->rekey_ctx.targets = targets;
+    variants->rekey_ctx.num_targets = num_targets;
+    variants->num_threads = settings->num_threads ? settings->num_threads : worker_get_cpu_count();
+
+    // Variants start from the build settings, so only what differs needs to be listed
+    for (uint32_t i = 0; i < num_targets; i++)
+    {
+        hp_settings_t *variant = &variant_settings[i];
+        *variant = *settings;
+        variant->header_fields = 0;
+        variant->variant_writer = NULL;
+        variant->keyareakey = &keyareakeys[i * 0x10];
+        memcpy(variant->keyareakey, settings->keyareakey, 0x10);
+        const char *name = NULL;
+        rekey_parse_variant(variant, &variants_value->items[i], i, &name);
+        if (variant->has_title_key == 1 && (variant->nca_type == NCA_TYPE_CONTROL || variant->nca_type == NCA_TYPE_DATA || variant->nca_type == NCA_TYPE_META))
+        {
+            hp_error("Error: Titlekey is not supported for %s nca in variant %u\n", nca_get_content_type_name(variant->nca_type), i);
+            hp_exit_failure();
+        }
+        rekey_check_keys(variant);
+        os_makedir(variant->out_dir.os_path);
+
+        targets[i].settings = variant;
+        targets[i].name = name;
+        rekey_create_target(&targets[i], i);
+    }
+    return variants;
+}
+
+/* Encrypts size bytes of plaintext at offset in CTR section section_index of the NCA being built for every variant.
+ * nca_header is the header of the build, its key area is still plaintext. */
+void rekey_variants_write(rekey_variants_t *variants, nca_header_t *nca_header, uint8_t section_index, const unsigned char *buf, uint64_t size, uint64_t offset)
+{
+    rekey_ctx_t *rekey_ctx = &variants->rekey_ctx;
+    if (variants->has_keys == 0)
+    {
+        for (uint32_t i = 0; i < rekey_ctx->num_targets; i++)
+            rekey_get_target_key(variants->targets[i].settings, ncareader_has_rights_id(nca_header) ? NULL : nca_header->encrypted_keys, variants->targets[i].key);
+        variants->has_keys = 1;
+    }
+
+    uint32_t num_jobs = (uint32_t)((size + REKEY_CHUNK_SIZE - 1) / REKEY_CHUNK_SIZE);
+    rekey_job_t *jobs = hp_track_buffer(calloc(num_jobs ? num_jobs : 1, sizeof(rekey_job_t)));
+    if (jobs == NULL)
+    {
+        hp_error("Failed to allocate rekey jobs!\n");
+        hp_exit_failure();
+    }
+    for (uint32_t i = 0; i < num_jobs; i++)
+    {
+        jobs[i].offset = offset + (uint64_t)i * REKEY_CHUNK_SIZE;
+        jobs[i].size = size - (uint64_t)i * REKEY_CHUNK_SIZE < REKEY_CHUNK_SIZE ? size - (uint64_t)i * REKEY_CHUNK_SIZE : REKEY_CHUNK_SIZE;
+        jobs[i].section_index = section_index;
+    }
+
+    rekey_ctx->nca_header = nca_header;
+    rekey_ctx->plain_buf = buf;
+    rekey_ctx->plain_offset = offset;
+    rekey_ctx->jobs = jobs;
+    worker_run(rekey_job, rekey_ctx, num_jobs, variants->num_threads);
+    for (uint32_t i = 0; i < num_jobs; i++)
+    {
+        if (jobs[i].failed)
+        {
+            hp_error("Failed to encrypt NCA variants at 0x%" PRIx64 "!\n", jobs[i].offset);
+            hp_exit_failure();
+        }
+    }
+    hp_free(jobs);
+    rekey_ctx->jobs = NULL;
+    rekey_ctx->plain_buf = NULL;
+    rekey_ctx->nca_header = NULL;
+    rekey_ctx->plain_written += size;
+}
+
+/* Finishes every variant from the NCA just built at nca_path, the source tree isn't read or hashed again.
+ * Only the header and unencrypted data are read from the NCA unless the build didn't hand over its sections. */
+void rekey_variants_close(rekey_variants_t *variants, hp_settings_t *settings, filepath_t *nca_path)
+{
+    hp_log("\n----> Creating NCA variants: %s\n", settings->variants.char_path);
+    int src_fd = fio_open(nca_path, FIO_MODE_READ);
+    if (src_fd < 0)
+    {
+        hp_error("Failed to open %s!\n", nca_path->char_path);
+        hp_exit_failure();
+    }
+    uint64_t nca_size;
+    nca_header_t nca_header;
+    ncareader_read_header(settings, nca_path, src_fd, &nca_header, &nca_size);
+
+    rekey_ctx_t *rekey_ctx = &variants->rekey_ctx;
+    rekey_ctx->src_fd = src_fd;
+    rekey_ctx->nca_header = &nca_header;
+    unsigned char src_key_area[4][0x10];
+    if (settings->has_title_key == 1)
+        memcpy(rekey_ctx->src_key, settings->title_key, 0x10);
+    else
+    {
+        ncareader_decrypt_key_area(settings, &nca_header, src_key_area);
+        memcpy(rekey_ctx->src_key, src_key_area[2], 0x10);
+    }
+    for (uint32_t i = 0; i < rekey_ctx->num_targets; i++)
+        rekey_init_target(&variants->targets[i], &nca_header, settings->has_title_key == 1 ? NULL : src_key_area);
+
+    rekey_write_targets(rekey_ctx, nca_path, nca_size, variants->num_threads);
+    fio_close(src_fd);
+
+    for (uint32_t i = 0; i < rekey_ctx->num_targets; i++)
+    {
+        rekey_target_t *target = &variants->targets[i];
+        if (target->name != NULL)
+            hp_log("\n----> Created %s NCA variant %s: %s\n", nca_get_content_type_name(settings->nca_type), target->name, target->final_path.char_path);
+        else
+            hp_log("\n----> Created %s NCA variant %u: %s\n", nca_get_content_type_name(settings->nca_type), i, target->final_path.char_path);
+    }
+
+    json_free(variants->json);
+    hp_free(variants->keyareakeys);
+    hp_free(variants->variant_settings);
+    hp_free(variants->targets);
+    hp_free(variants);
+}
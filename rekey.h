@@ -0,0 +1,19 @@
+#ifndef HACPACK_REKEY_H
+#define HACPACK_REKEY_H
+
+#include "settings.h"
+#include "filepath.h"
+#include "nca.h"
+
+#define REKEY_CHUNK_SIZE 0x800000 // 8 MB
+
+void rekey_nca(hp_settings_t *settings);
+void rekey_patch_header(hp_settings_t *settings);
+
+typedef struct rekey_variants rekey_variants_t;
+
+rekey_variants_t *rekey_variants_open(hp_settings_t *settings);
+void rekey_variants_write(rekey_variants_t *variants, nca_header_t *nca_header, uint8_t section_index, const unsigned char *buf, uint64_t size, uint64_t offset);
+void rekey_variants_close(rekey_variants_t *variants, hp_settings_t *settings, filepath_t *nca_path);
+
+#endif
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "report.h"
+#include "json.h"
+#include "utils.h"
+
+/* Files created by the current build, batch jobs return them as results. Kept per thread for library builds. */
+static _Thread_local report_output_t *report_outputs = NULL;
+static _Thread_local uint32_t report_num_outputs = 0;
+
+void report_add_output(const char *type, const char *path, const unsigned char *ncaid, uint64_t size)
+{
+    report_output_t *outputs = realloc(report_outputs, (report_num_outputs + 1) * sizeof(report_output_t));
+    if (outputs == NULL)
+    {
+        hp_error("Failed to allocate report entry!\n");
+        hp_exit_failure();
+    }
+    report_outputs = outputs;
+
+    report_output_t *output = &report_outputs[report_num_outputs++];
+    memset(output, 0, sizeof(*output));
+    output->type = strdup(type);
+    output->path = strdup(path);
+    if (output->type == NULL || output->path == NULL)
+    {
+        hp_error("Failed to allocate report entry!\n");
+        hp_exit_failure();
+    }
+    if (ncaid != NULL)
+        hexBinaryString((unsigned char *)ncaid, 0x10, output->ncaid, sizeof(output->ncaid));
+    output->size = size;
+}
+
+/* Appends outputs taken from another thread and frees the array, the entries are moved. */
+void report_add_outputs(report_output_t *outputs, uint32_t num_outputs)
+{
+    if (num_outputs == 0)
+    {
+        free(outputs);
+        return;
+    }
+    report_output_t *merged = realloc(report_outputs, (report_num_outputs + num_outputs) * sizeof(report_output_t));
+    if (merged == NULL)
+    {
+        hp_error("Failed to allocate report entry!\n");
+        hp_exit_failure();
+    }
+    memcpy(&merged[report_num_outputs], outputs, num_outputs * sizeof(report_output_t));
+    report_outputs = merged;
+    report_num_outputs += num_outputs;
+    free(outputs);
+}
+
+/* Hands the outputs to the caller, free them with report_free_outputs. */
+report_output_t *report_take_outputs(uint32_t *num_outputs)
+{
+    report_output_t *outputs = report_outputs;
+    *num_outputs = report_num_outputs;
+    report_outputs = NULL;
+    report_num_outputs = 0;
+    return outputs;
+}
+
+void report_free_outputs(report_output_t *outputs, uint32_t num_outputs)
+{
+    for (uint32_t i = 0; i < num_outputs; i++)
+    {
+        free(outputs[i].type);
+        free(outputs[i].path);
+    }
+    free(outputs);
+}
+
+/* Writes outputs as a JSON array. */
+void report_write_json(FILE *f)
+{
+    fprintf(f, "[");
+    for (uint32_t i = 0; i < report_num_outputs; i++)
+    {
+        fprintf(f, "%s{\"type\": ", i ? ", " : "");
+        json_write_string(f, report_outputs[i].type);
+        fprintf(f, ", \"path\": ");
+        json_write_string(f, report_outputs[i].path);
+        if (report_outputs[i].ncaid[0] != '\0')
+            fprintf(f, ", \"ncaid\": \"%s\"", report_outputs[i].ncaid);
+        fprintf(f, ", \"size\": %" PRIu64 "}", report_outputs[i].size);
+    }
+    fprintf(f, "]");
+}
+
+void report_clear(void)
+{
+    report_free_outputs(report_outputs, report_num_outputs);
+    report_outputs = NULL;
+    report_num_outputs = 0;
+}
@@ -0,0 +1,22 @@
+#ifndef HACPACK_REPORT_H
+#define HACPACK_REPORT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef struct
+{
+    char *type;
+    char *path;
+    char ncaid[33]; /* Empty for outputs which aren't ncas. */
+    uint64_t size;
+} report_output_t;
+
+void report_add_output(const char *type, const char *path, const unsigned char *ncaid, uint64_t size);
+void report_add_outputs(report_output_t *outputs, uint32_t num_outputs);
+report_output_t *report_take_outputs(uint32_t *num_outputs);
+void report_free_outputs(report_output_t *outputs, uint32_t num_outputs);
+void report_write_json(FILE *f);
+void report_clear(void);
+
+#endif
@@ -6,11 +6,10 @@
 #include "types.h"
 #include "romfs.h"
 #include "utils.h"
+#include "fio.h"
+#include "worker.h"
 #include <sys/stat.h>
 
-#define ROMFS_ENTRY_EMPTY 0xFFFFFFFF
-#define ROMFS_FILEPARTITION_OFS 0x200
-
 romfs_direntry_t *romfs_get_direntry(romfs_direntry_t *directories, uint32_t offset)
 {
     return (romfs_direntry_t *)((char *)directories + offset);
@@ -65,12 +64,163 @@ uint32_t romfs_get_hash_table_count(uint32_t num_entries)
     return count;
 }
 
+static romfs_dirent_ctx_t *romfs_find_dir(romfs_dirent_ctx_t *dir_tree, const char *cur_path)
+{
+    for (romfs_dirent_ctx_t *cur_dir = dir_tree; cur_dir != NULL; cur_dir = cur_dir->sibling)
+    {
+        if (strcmp(cur_dir->cur_path.char_path, cur_path) == 0)
+            return cur_dir;
+    }
+    return NULL;
+}
+
+static romfs_fent_ctx_t *romfs_find_file(romfs_fent_ctx_t *file_tree, const char *cur_path)
+{
+    for (romfs_fent_ctx_t *cur_file = file_tree; cur_file != NULL; cur_file = cur_file->sibling)
+    {
+        if (strcmp(cur_file->cur_path.char_path, cur_path) == 0)
+            return cur_file;
+    }
+    return NULL;
+}
+
+static romfs_dirent_ctx_t *romfs_add_dir(romfs_dirent_ctx_t *parent, romfs_dirent_ctx_t **child_dir_tree, filepath_t *cur_sum_path, filepath_t *cur_path, romfs_ctx_t *romfs_ctx)
+{
+    romfs_dirent_ctx_t *cur_dir;
+    if ((cur_dir = calloc(1, sizeof(romfs_dirent_ctx_t))) == NULL)
+    {
+        hp_error("Failed to allocate RomFS directory context!\n");
+        hp_exit_failure();
+    }
+
+    romfs_ctx->num_dirs++;
+
+    cur_dir->parent = parent;
+    filepath_copy(&cur_dir->sum_path, cur_sum_path);
+    filepath_copy(&cur_dir->cur_path, cur_path);
+
+    romfs_ctx->dir_table_size += 0x18 + align(strlen(cur_dir->cur_path.char_path) - 1, 4);
+
+    /* Ordered insertion on sibling */
+    if (*child_dir_tree == NULL || strcmp(cur_dir->sum_path.char_path, (*child_dir_tree)->sum_path.char_path) < 0)
+    {
+        cur_dir->sibling = *child_dir_tree;
+        *child_dir_tree = cur_dir;
+    }
+    else
+    {
+        romfs_dirent_ctx_t *child, *prev;
+        prev = *child_dir_tree;
+        child = (*child_dir_tree)->sibling;
+        while (child != NULL)
+        {
+            if (strcmp(cur_dir->sum_path.char_path, child->sum_path.char_path) < 0)
+            {
+                break;
+            }
+            prev = child;
+            child = child->sibling;
+        }
+
+        prev->sibling = cur_dir;
+        cur_dir->sibling = child;
+    }
+
+    /* Ordered insertion on next */
+    romfs_dirent_ctx_t *tmp = parent->next, *tmp_prev = parent;
+    while (tmp != NULL)
+    {
+        if (strcmp(cur_dir->sum_path.char_path, tmp->sum_path.char_path) < 0)
+        {
+            break;
+        }
+        tmp_prev = tmp;
+        tmp = tmp->next;
+    }
+    tmp_prev->next = cur_dir;
+    cur_dir->next = tmp;
+
+    return cur_dir;
+}
+
+static romfs_fent_ctx_t *romfs_add_file(romfs_dirent_ctx_t *parent, romfs_fent_ctx_t **child_file_tree, filepath_t *cur_sum_path, filepath_t *cur_path, uint64_t size, romfs_ctx_t *romfs_ctx)
+{
+    romfs_fent_ctx_t *cur_file;
+    if ((cur_file = calloc(1, sizeof(romfs_fent_ctx_t))) == NULL)
+    {
+        hp_error("Failed to allocate RomFS File context!\n");
+        hp_exit_failure();
+    }
+
+    romfs_ctx->num_files++;
+
+    cur_file->parent = parent;
+    filepath_copy(&cur_file->sum_path, cur_sum_path);
+    filepath_copy(&cur_file->cur_path, cur_path);
+    cur_file->size = size;
+
+    romfs_ctx->file_table_size += 0x20 + align(strlen(cur_file->cur_path.char_path) - 1, 4);
+
+    /* Ordered insertion on sibling */
+    if (*child_file_tree == NULL || strcmp(cur_file->sum_path.char_path, (*child_file_tree)->sum_path.char_path) < 0)
+    {
+        cur_file->sibling = *child_file_tree;
+        *child_file_tree = cur_file;
+    }
+    else
+    {
+        romfs_fent_ctx_t *child, *prev;
+        prev = *child_file_tree;
+        child = (*child_file_tree)->sibling;
+        while (child != NULL)
+        {
+            if (strcmp(cur_file->sum_path.char_path, child->sum_path.char_path) < 0)
+            {
+                break;
+            }
+            prev = child;
+            child = child->sibling;
+        }
+
+        prev->sibling = cur_file;
+        cur_file->sibling = child;
+    }
+
+    /* Ordered insertion on next */
+    if (romfs_ctx->files == NULL || strcmp(cur_file->sum_path.char_path, romfs_ctx->files->sum_path.char_path) < 0)
+    {
+        cur_file->next = romfs_ctx->files;
+        romfs_ctx->files = cur_file;
+    }
+    else
+    {
+        romfs_fent_ctx_t *child, *prev;
+        prev = romfs_ctx->files;
+        child = romfs_ctx->files->next;
+        while (child != NULL)
+        {
+            if (strcmp(cur_file->sum_path.char_path, child->sum_path.char_path) < 0)
+            {
+                break;
+            }
+            prev = child;
+            child = child->next;
+        }
+
+        prev->next = cur_file;
+        cur_file->next = child;
+    }
+
+    return cur_file;
+}
+
+/* Visits a directory on disk, entries already in the tree from a base RomFS are merged rather than added again. */
 void romfs_visit_dir(romfs_dirent_ctx_t *parent, romfs_ctx_t *romfs_ctx)
 {
     osdir_t *dir = NULL;
     osdirent_t *cur_dirent = NULL;
-    romfs_dirent_ctx_t *child_dir_tree = NULL;
-    romfs_fent_ctx_t *child_file_tree = NULL;
+    romfs_dirent_ctx_t *child_dir_tree = parent->child;
+    romfs_fent_ctx_t *child_file_tree = parent->file;
     romfs_dirent_ctx_t *cur_dir = NULL;
     romfs_fent_ctx_t *cur_file = NULL;
     filepath_t cur_path;
@@ -80,8 +230,8 @@ void romfs_visit_dir(romfs_dirent_ctx_t *parent, romfs_ctx_t *romfs_ctx)
 
     if ((dir = os_opendir(parent->sum_path.os_path)) == NULL)
     {
-        fprintf(stderr, "Failed to open directory %s!\n", parent->sum_path.char_path);
-        exit(EXIT_FAILURE);
+        hp_error("Failed to open directory %s!\n", parent->sum_path.char_path);
+        hp_exit_failure();
     }
 
     while ((cur_dirent = os_readdir(dir)))
@@ -101,142 +251,46 @@ void romfs_visit_dir(romfs_dirent_ctx_t *parent, romfs_ctx_t *romfs_ctx)
 
         if (os_stat(cur_sum_path.os_path, &cur_stats) == -1)
         {
-            fprintf(stderr, "Failed to stat %s\n", cur_sum_path.char_path);
-            exit(EXIT_FAILURE);
+            hp_error("Failed to stat %s\n", cur_sum_path.char_path);
+            hp_exit_failure();
         }
 
         if ((cur_stats.st_mode & S_IFMT) == S_IFDIR)
         {
             /* Directory */
-            if ((cur_dir = calloc(1, sizeof(romfs_dirent_ctx_t))) == NULL)
-            {
-                fprintf(stderr, "Failed to allocate RomFS directory context!\n");
-                exit(EXIT_FAILURE);
-            }
-
-            romfs_ctx->num_dirs++;
-
-            cur_dir->parent = parent;
-            filepath_copy(&cur_dir->sum_path, &cur_sum_path);
-            filepath_copy(&cur_dir->cur_path, &cur_path);
-
-            romfs_ctx->dir_table_size += 0x18 + align(strlen(cur_dir->cur_path.char_path) - 1, 4);
-
-            /* Ordered insertion on sibling */
-            if (child_dir_tree == NULL || strcmp(cur_dir->sum_path.char_path, child_dir_tree->sum_path.char_path) < 0)
+            if (romfs_find_file(child_file_tree, cur_path.char_path) != NULL)
             {
-                cur_dir->sibling = child_dir_tree;
-                child_dir_tree = cur_dir;
+                hp_error("%s is a file in the base RomFS!\n", cur_sum_path.char_path);
+                hp_exit_failure();
             }
+            if ((cur_dir = romfs_find_dir(child_dir_tree, cur_path.char_path)) != NULL)
+                cur_dir->base_only = 0;
             else
-            {
-                romfs_dirent_ctx_t *child, *prev;
-                prev = child_dir_tree;
-                child = child_dir_tree->sibling;
-                while (child != NULL)
-                {
-                    if (strcmp(cur_dir->sum_path.char_path, child->sum_path.char_path) < 0)
-                    {
-                        break;
-                    }
-                    prev = child;
-                    child = child->sibling;
-                }
-
-                prev->sibling = cur_dir;
-                cur_dir->sibling = child;
-            }
-
-            /* Ordered insertion on next */
-            romfs_dirent_ctx_t *tmp = parent->next, *tmp_prev = parent;
-            while (tmp != NULL)
-            {
-                if (strcmp(cur_dir->sum_path.char_path, tmp->sum_path.char_path) < 0)
-                {
-                    break;
-                }
-                tmp_prev = tmp;
-                tmp = tmp->next;
-            }
-            tmp_prev->next = cur_dir;
-            cur_dir->next = tmp;
-
+                romfs_add_dir(parent, &child_dir_tree, &cur_sum_path, &cur_path, romfs_ctx);
             cur_dir = NULL;
         }
         else if ((cur_stats.st_mode & S_IFMT) == S_IFREG)
         {
             /* File */
-            if ((cur_file = calloc(1, sizeof(romfs_fent_ctx_t))) == NULL)
-            {
-                fprintf(stderr, "Failed to allocate RomFS File context!\n");
-                exit(EXIT_FAILURE);
-            }
-
-            romfs_ctx->num_files++;
-
-            cur_file->parent = parent;
-            filepath_copy(&cur_file->sum_path, &cur_sum_path);
-            filepath_copy(&cur_file->cur_path, &cur_path);
-            cur_file->size = cur_stats.st_size;
-
-            romfs_ctx->file_table_size += 0x20 + align(strlen(cur_file->cur_path.char_path) - 1, 4);
-
-            /* Ordered insertion on sibling */
-            if (child_file_tree == NULL || strcmp(cur_file->sum_path.char_path, child_file_tree->sum_path.char_path) < 0)
-            {
-                cur_file->sibling = child_file_tree;
-                child_file_tree = cur_file;
-            }
-            else
+            if (romfs_find_dir(child_dir_tree, cur_path.char_path) != NULL)
             {
-                romfs_fent_ctx_t *child, *prev;
-                prev = child_file_tree;
-                child = child_file_tree->sibling;
-                while (child != NULL)
-                {
-                    if (strcmp(cur_file->sum_path.char_path, child->sum_path.char_path) < 0)
-                    {
-                        break;
-                    }
-                    prev = child;
-                    child = child->sibling;
-                }
-
-                prev->sibling = cur_file;
-                cur_file->sibling = child;
+                hp_error("%s is a directory in the base RomFS!\n", cur_sum_path.char_path);
+                hp_exit_failure();
             }
-
-            /* Ordered insertion on next */
-            if (romfs_ctx->files == NULL || strcmp(cur_file->sum_path.char_path, romfs_ctx->files->sum_path.char_path) < 0)
+            if ((cur_file = romfs_find_file(child_file_tree, cur_path.char_path)) != NULL)
             {
-                cur_file->next = romfs_ctx->files;
-                romfs_ctx->files = cur_file;
+                /* Replaces the file of the base RomFS */
+                cur_file->from_base = 0;
+                cur_file->size = cur_stats.st_size;
             }
             else
-            {
-                romfs_fent_ctx_t *child, *prev;
-                prev = romfs_ctx->files;
-                child = romfs_ctx->files->next;
-                while (child != NULL)
-                {
-                    if (strcmp(cur_file->sum_path.char_path, child->sum_path.char_path) < 0)
-                    {
-                        break;
-                    }
-                    prev = child;
-                    child = child->next;
-                }
-
-                prev->next = cur_file;
-                cur_file->next = child;
-            }
-
+                romfs_add_file(parent, &child_file_tree, &cur_sum_path, &cur_path, cur_stats.st_size, romfs_ctx);
             cur_file = NULL;
         }
         else
         {
-            fprintf(stderr, "Invalid FS object type for %s!\n", cur_path.char_path);
-            exit(EXIT_FAILURE);
+            hp_error("Invalid FS object type for %s!\n", cur_path.char_path);
+            hp_exit_failure();
         }
     }
 
@@ -247,50 +301,224 @@ void romfs_visit_dir(romfs_dirent_ctx_t *parent, romfs_ctx_t *romfs_ctx)
     cur_dir = child_dir_tree;
     while (cur_dir != NULL)
     {
-        romfs_visit_dir(cur_dir, romfs_ctx);
+        if (cur_dir->base_only == 0)
+            romfs_visit_dir(cur_dir, romfs_ctx);
         cur_dir = cur_dir->sibling;
     }
 }
 
-size_t build_romfs_into_file(filepath_t *in_dirpath, FILE *f_out, off_t base_offset, filepath_t *out_romfspath)
+/* Copies the name of a base RomFS entry into cur_path the way a directory visit would set it. */
+static void romfs_base_entry_path(filepath_t *cur_path, const char *name, uint32_t name_size)
+{
+    char entry_name[MAX_PATH];
+    if (name_size >= sizeof(entry_name) - 1)
+    {
+        hp_error("Base RomFS entry name is too long!\n");
+        hp_exit_failure();
+    }
+    memcpy(entry_name, name, name_size);
+    entry_name[name_size] = '\0';
+    filepath_init(cur_path);
+    filepath_set(cur_path, "");
+    filepath_append(cur_path, "%s", entry_name);
+}
+
+/* Adds the directories and files of a base RomFS directory to the tree, they sort as if they were under parent's path on disk. */
+static void romfs_visit_base_dir(romfs_dirent_ctx_t *parent, uint32_t dir_offset, romfs_base_t *base, romfs_ctx_t *romfs_ctx, uint32_t depth)
+{
+    filepath_t cur_path;
+    filepath_t cur_sum_path;
+    romfs_direntry_t *dir_entry = romfs_get_direntry(base->dir_table, dir_offset);
+    uint64_t partition_size = base->size - base->header.file_partition_ofs;
+
+    if (depth > 0x100)
+    {
+        hp_error("Base RomFS directory table has a loop!\n");
+        hp_exit_failure();
+    }
+
+    uint32_t file_offset = le_word(dir_entry->file);
+    while (file_offset != ROMFS_ENTRY_EMPTY)
+    {
+        if ((uint64_t)file_offset + sizeof(romfs_fentry_t) > base->header.file_table_size)
+        {
+            hp_error("Invalid file entry in base RomFS!\n");
+            hp_exit_failure();
+        }
+        romfs_fentry_t *file_entry = romfs_get_fentry(base->file_table, file_offset);
+        if (le_word(file_entry->name_size) > base->header.file_table_size - file_offset - sizeof(romfs_fentry_t) ||
+            le_dword(file_entry->offset) > partition_size || le_dword(file_entry->size) > partition_size - le_dword(file_entry->offset))
+        {
+            hp_error("Invalid file entry in base RomFS!\n");
+            hp_exit_failure();
+        }
+        romfs_base_entry_path(&cur_path, file_entry->name, le_word(file_entry->name_size));
+        filepath_copy(&cur_sum_path, &parent->sum_path);
+        filepath_append(&cur_sum_path, "%s", cur_path.char_path + 1);
+        romfs_fent_ctx_t *cur_file = romfs_add_file(parent, &parent->file, &cur_sum_path, &cur_path, le_dword(file_entry->size), romfs_ctx);
+        cur_file->in_base = 1;
+        cur_file->from_base = 1;
+        cur_file->base_size = cur_file->size;
+        cur_file->base_offset = base->header.file_partition_ofs + le_dword(file_entry->offset);
+        file_offset = le_word(file_entry->sibling);
+    }
+
+    uint32_t child_offset = le_word(dir_entry->child);
+    while (child_offset != ROMFS_ENTRY_EMPTY)
+    {
+        if ((uint64_t)child_offset + sizeof(romfs_direntry_t) > base->header.dir_table_size)
+        {
+            hp_error("Invalid directory entry in base RomFS!\n");
+            hp_exit_failure();
+        }
+        romfs_direntry_t *child_entry = romfs_get_direntry(base->dir_table, child_offset);
+        if (le_word(child_entry->name_size) > base->header.dir_table_size - child_offset - sizeof(romfs_direntry_t))
+        {
+            hp_error("Invalid directory entry in base RomFS!\n");
+            hp_exit_failure();
+        }
+        romfs_base_entry_path(&cur_path, child_entry->name, le_word(child_entry->name_size));
+        filepath_copy(&cur_sum_path, &parent->sum_path);
+        filepath_append(&cur_sum_path, "%s", cur_path.char_path + 1);
+        romfs_dirent_ctx_t *cur_dir = romfs_add_dir(parent, &parent->child, &cur_sum_path, &cur_path, romfs_ctx);
+        cur_dir->base_only = 1;
+        romfs_visit_base_dir(cur_dir, child_offset, base, romfs_ctx, depth + 1);
+        child_offset = le_word(child_entry->sibling);
+    }
+}
+
+void romfs_free_ctx(romfs_ctx_t *romfs_ctx)
+{
+    romfs_fent_ctx_t *cur_file = romfs_ctx->files;
+    while (cur_file != NULL)
+    {
+        romfs_fent_ctx_t *temp = cur_file;
+        cur_file = cur_file->next;
+        free(temp);
+    }
+    free(romfs_ctx->dir_hash_table);
+    free(romfs_ctx->dir_table);
+    free(romfs_ctx->file_hash_table);
+    free(romfs_ctx->file_table);
+    if (romfs_ctx->base != NULL)
+        romfs_base_free(romfs_ctx->base);
+    memset(romfs_ctx, 0, sizeof(*romfs_ctx));
+}
+
+/* Reads the header and entry tables of a base RomFS, read_func, read_ctx and size must be set. */
+void romfs_base_load(romfs_base_t *base)
+{
+    romfs_header_t *header = &base->header;
+    if (base->size < sizeof(romfs_header_t) || base->read_func(base->read_ctx, header, sizeof(romfs_header_t), 0) != 0)
+    {
+        hp_error("Failed to read base RomFS header of %s!\n", base->path.char_path);
+        hp_exit_failure();
+    }
+
+    // Tables are used in place, so the header is kept in host order
+    header->header_size = le_dword(header->header_size);
+    header->dir_hash_table_ofs = le_dword(header->dir_hash_table_ofs);
+    header->dir_hash_table_size = le_dword(header->dir_hash_table_size);
+    header->dir_table_ofs = le_dword(header->dir_table_ofs);
+    header->dir_table_size = le_dword(header->dir_table_size);
+    header->file_hash_table_ofs = le_dword(header->file_hash_table_ofs);
+    header->file_hash_table_size = le_dword(header->file_hash_table_size);
+    header->file_table_ofs = le_dword(header->file_table_ofs);
+    header->file_table_size = le_dword(header->file_table_size);
+    header->file_partition_ofs = le_dword(header->file_partition_ofs);
+    if (header->header_size != sizeof(romfs_header_t) || header->dir_table_size < sizeof(romfs_direntry_t) ||
+        header->dir_table_ofs > base->size || header->dir_table_size > base->size - header->dir_table_ofs ||
+        header->file_table_ofs > base->size || header->file_table_size > base->size - header->file_table_ofs ||
+        header->file_partition_ofs > base->size)
+    {
+        hp_error("Error: %s doesn't contain a valid RomFS\n", base->path.char_path);
+        hp_exit_failure();
+    }
+
+    base->dir_table = malloc(header->dir_table_size);
+    base->file_table = malloc(header->file_table_size ? header->file_table_size : 1);
+    if (base->dir_table == NULL || base->file_table == NULL)
+    {
+        hp_error("Failed to allocate base RomFS tables!\n");
+        hp_exit_failure();
+    }
+    if (base->read_func(base->read_ctx, base->dir_table, header->dir_table_size, header->dir_table_ofs) != 0 ||
+        base->read_func(base->read_ctx, base->file_table, header->file_table_size, header->file_table_ofs) != 0)
+    {
+        hp_error("Failed to read base RomFS tables of %s!\n", base->path.char_path);
+        hp_exit_failure();
+    }
+}
+
+void romfs_base_free(romfs_base_t *base)
+{
+    free(base->dir_table);
+    free(base->file_table);
+    base->dir_table = NULL;
+    base->file_table = NULL;
+    // The source may own base itself, so it's closed last
+    void (*close_func)(void *read_ctx) = base->close_func;
+    base->close_func = NULL;
+    if (close_func != NULL)
+        close_func(base->read_ctx);
+}
+
+/* Visits in_dirpath and lays out the RomFS, returns the RomFS size. Nothing is written yet.
+   With a base RomFS, in_dirpath is an overlay merged into it and may be invalid, file bodies that aren't replaced are read from the base when writing. */
+uint64_t romfs_prepare(filepath_t *in_dirpath, romfs_base_t *base, romfs_ctx_t *romfs_ctx)
 {
     romfs_dirent_ctx_t *root_ctx = calloc(1, sizeof(romfs_dirent_ctx_t));
     if (root_ctx == NULL)
     {
-        fprintf(stderr, "Failed to allocate root context!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Failed to allocate root context!\n");
+        hp_exit_failure();
     }
 
     root_ctx->parent = root_ctx;
 
-    romfs_ctx_t romfs_ctx;
-    memset(&romfs_ctx, 0, sizeof(romfs_ctx));
+    memset(romfs_ctx, 0, sizeof(*romfs_ctx));
 
-    filepath_copy(&root_ctx->sum_path, in_dirpath);
+    if (in_dirpath != NULL && in_dirpath->valid == VALIDITY_VALID)
+        filepath_copy(&root_ctx->sum_path, in_dirpath);
+    else
+    {
+        filepath_init(&root_ctx->sum_path);
+        filepath_set(&root_ctx->sum_path, "");
+        root_ctx->base_only = 1;
+    }
     filepath_init(&root_ctx->cur_path);
     filepath_set(&root_ctx->cur_path, "");
-    romfs_ctx.dir_table_size = 0x18; /* Root directory. */
-    romfs_ctx.num_dirs = 1;
+    romfs_ctx->dir_table_size = 0x18; /* Root directory. */
+    romfs_ctx->num_dirs = 1;
+    romfs_ctx->base = base;
+
+    if (base != NULL)
+    {
+        hp_log("Reading base RomFS tables\n");
+        romfs_visit_base_dir(root_ctx, 0, base, romfs_ctx, 0);
+    }
 
     /* Visit all directories. */
-    printf("Visiting directories\n");
-    romfs_visit_dir(root_ctx, &romfs_ctx);
-    uint32_t dir_hash_table_entry_count = romfs_get_hash_table_count(romfs_ctx.num_dirs);
-    uint32_t file_hash_table_entry_count = romfs_get_hash_table_count(romfs_ctx.num_files);
-    romfs_ctx.dir_hash_table_size = 4 * dir_hash_table_entry_count;
-    romfs_ctx.file_hash_table_size = 4 * file_hash_table_entry_count;
-
-    romfs_header_t header;
-    memset(&header, 0, sizeof(header));
+    if (root_ctx->base_only == 0)
+    {
+        hp_log("Visiting directories\n");
+        romfs_visit_dir(root_ctx, romfs_ctx);
+    }
+    uint32_t dir_hash_table_entry_count = romfs_get_hash_table_count(romfs_ctx->num_dirs);
+    uint32_t file_hash_table_entry_count = romfs_get_hash_table_count(romfs_ctx->num_files);
+    romfs_ctx->dir_hash_table_size = 4 * dir_hash_table_entry_count;
+    romfs_ctx->file_hash_table_size = 4 * file_hash_table_entry_count;
+
+    romfs_header_t *header = &romfs_ctx->header;
     romfs_fent_ctx_t *cur_file = NULL;
     romfs_dirent_ctx_t *cur_dir = NULL;
     uint32_t entry_offset = 0;
 
-    uint32_t *dir_hash_table = malloc(romfs_ctx.dir_hash_table_size);
+    uint32_t *dir_hash_table = malloc(romfs_ctx->dir_hash_table_size);
     if (dir_hash_table == NULL)
     {
-        fprintf(stderr, "Failed to allocate directory hash table!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Failed to allocate directory hash table!\n");
+        hp_exit_failure();
     }
 
     for (uint32_t i = 0; i < dir_hash_table_entry_count; i++)
@@ -298,11 +526,11 @@ size_t build_romfs_into_file(filepath_t *in_dirpath, FILE *f_out, off_t base_off
         dir_hash_table[i] = le_word(ROMFS_ENTRY_EMPTY);
     }
 
-    uint32_t *file_hash_table = malloc(romfs_ctx.file_hash_table_size);
+    uint32_t *file_hash_table = malloc(romfs_ctx->file_hash_table_size);
     if (file_hash_table == NULL)
     {
-        fprintf(stderr, "Failed to allocate file hash table!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Failed to allocate file hash table!\n");
+        hp_exit_failure();
     }
 
     for (uint32_t i = 0; i < file_hash_table_entry_count; i++)
@@ -310,29 +538,29 @@ size_t build_romfs_into_file(filepath_t *in_dirpath, FILE *f_out, off_t base_off
         file_hash_table[i] = le_word(ROMFS_ENTRY_EMPTY);
     }
 
-    romfs_direntry_t *dir_table = calloc(1, romfs_ctx.dir_table_size);
+    romfs_direntry_t *dir_table = calloc(1, romfs_ctx->dir_table_size);
     if (dir_table == NULL)
     {
-        fprintf(stderr, "Failed to allocate directory table!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Failed to allocate directory table!\n");
+        hp_exit_failure();
     }
 
-    romfs_fentry_t *file_table = calloc(1, romfs_ctx.file_table_size);
+    romfs_fentry_t *file_table = calloc(1, romfs_ctx->file_table_size);
     if (file_table == NULL)
     {
-        fprintf(stderr, "Failed to allocate file table!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Failed to allocate file table!\n");
+        hp_exit_failure();
     }
 
-    printf("Calculating metadata\n");
+    hp_log("Calculating metadata\n");
     /* Determine file offsets. */
-    cur_file = romfs_ctx.files;
+    cur_file = romfs_ctx->files;
     entry_offset = 0;
     while (cur_file != NULL)
     {
-        romfs_ctx.file_partition_size = align64(romfs_ctx.file_partition_size, 0x10);
-        cur_file->offset = romfs_ctx.file_partition_size;
-        romfs_ctx.file_partition_size += cur_file->size;
+        romfs_ctx->file_partition_size = align64(romfs_ctx->file_partition_size, 0x10);
+        cur_file->offset = romfs_ctx->file_partition_size;
+        romfs_ctx->file_partition_size += cur_file->size;
         cur_file->entry_offset = entry_offset;
         entry_offset += 0x20 + align(strlen(cur_file->cur_path.char_path) - 1, 4);
         cur_file = cur_file->next;
@@ -356,7 +584,7 @@ size_t build_romfs_into_file(filepath_t *in_dirpath, FILE *f_out, off_t base_off
     }
 
     /* Populate file tables. */
-    cur_file = romfs_ctx.files;
+    cur_file = romfs_ctx->files;
     while (cur_file != NULL)
     {
         romfs_fentry_t *cur_entry = romfs_get_fentry(file_table, cur_file->entry_offset);
@@ -399,135 +627,167 @@ size_t build_romfs_into_file(filepath_t *in_dirpath, FILE *f_out, off_t base_off
         free(temp);
     }
 
-    header.header_size = le_dword(sizeof(header));
-    header.file_hash_table_size = le_dword(romfs_ctx.file_hash_table_size);
-    header.file_table_size = le_dword(romfs_ctx.file_table_size);
-    header.dir_hash_table_size = le_dword(romfs_ctx.dir_hash_table_size);
-    header.dir_table_size = le_dword(romfs_ctx.dir_table_size);
-    header.file_partition_ofs = le_dword(ROMFS_FILEPARTITION_OFS);
+    header->header_size = le_dword(sizeof(romfs_header_t));
+    header->file_hash_table_size = le_dword(romfs_ctx->file_hash_table_size);
+    header->file_table_size = le_dword(romfs_ctx->file_table_size);
+    header->dir_hash_table_size = le_dword(romfs_ctx->dir_hash_table_size);
+    header->dir_table_size = le_dword(romfs_ctx->dir_table_size);
+    header->file_partition_ofs = le_dword(ROMFS_FILEPARTITION_OFS);
 
     /* Abuse of endianness follows. */
-    uint64_t dir_hash_table_ofs = align64(romfs_ctx.file_partition_size + ROMFS_FILEPARTITION_OFS, 4);
-    header.dir_hash_table_ofs = dir_hash_table_ofs;
-    header.dir_table_ofs = header.dir_hash_table_ofs + romfs_ctx.dir_hash_table_size;
-    header.file_hash_table_ofs = header.dir_table_ofs + romfs_ctx.dir_table_size;
-    header.file_table_ofs = header.file_hash_table_ofs + romfs_ctx.file_hash_table_size;
-    header.dir_hash_table_ofs = le_dword(header.dir_hash_table_ofs);
-    header.dir_table_ofs = le_dword(header.dir_table_ofs);
-    header.file_hash_table_ofs = le_dword(header.file_hash_table_ofs);
-    header.file_table_ofs = le_dword(header.file_table_ofs);
+    uint64_t dir_hash_table_ofs = align64(romfs_ctx->file_partition_size + ROMFS_FILEPARTITION_OFS, 4);
+    header->dir_hash_table_ofs = dir_hash_table_ofs;
+    header->dir_table_ofs = header->dir_hash_table_ofs + romfs_ctx->dir_hash_table_size;
+    header->file_hash_table_ofs = header->dir_table_ofs + romfs_ctx->dir_table_size;
+    header->file_table_ofs = header->file_hash_table_ofs + romfs_ctx->file_hash_table_size;
+    header->dir_hash_table_ofs = le_dword(header->dir_hash_table_ofs);
+    header->dir_table_ofs = le_dword(header->dir_table_ofs);
+    header->file_hash_table_ofs = le_dword(header->file_hash_table_ofs);
+    header->file_table_ofs = le_dword(header->file_table_ofs);
+
+    romfs_ctx->dir_hash_table = dir_hash_table;
+    romfs_ctx->dir_table = dir_table;
+    romfs_ctx->file_hash_table = file_hash_table;
+    romfs_ctx->file_table = file_table;
+    romfs_ctx->romfs_size = dir_hash_table_ofs + romfs_ctx->dir_hash_table_size + romfs_ctx->dir_table_size + romfs_ctx->file_hash_table_size + romfs_ctx->file_table_size;
+    return romfs_ctx->romfs_size;
+}
 
-    fseeko64(f_out, base_offset, SEEK_SET);
-    fwrite(&header, 1, sizeof(header), f_out);
+/* One range of a file body in the base RomFS, copied by a worker. */
+typedef struct
+{
+    romfs_base_t *base;
+    int dst_fd;
+    uint64_t src_offset;
+    uint64_t dst_offset;
+    uint64_t size;
+    int failed;
+} romfs_copy_job_t;
+
+static void romfs_copy_job(void *ctx, uint32_t index)
+{
+    romfs_copy_job_t *job = &((romfs_copy_job_t *)ctx)[index];
+    unsigned char *buf = hp_track_buffer(malloc(job->size));
+    if (buf == NULL || job->base->read_func(job->base->read_ctx, buf, job->size, job->src_offset) != 0 || fio_pwrite(job->dst_fd, buf, job->size, job->dst_offset) != 0)
+        job->failed = 1;
+    hp_free(buf);
+}
 
-    /* Write files. */
-    uint64_t read_size = 0x61A8000; // 100 MB
-    unsigned char *buffer = malloc(read_size); // 100 MB buffer.
-    if (buffer == NULL)
+/* Streams the unchanged file bodies of the base RomFS to dst_fd, large files are split so they are copied side by side. */
+static void romfs_copy_base_files(romfs_ctx_t *romfs_ctx, int dst_fd, uint64_t base_offset)
+{
+    uint64_t num_jobs = 0;
+    for (romfs_fent_ctx_t *cur_file = romfs_ctx->files; cur_file != NULL; cur_file = cur_file->next)
     {
-        fprintf(stderr, "Failed to allocate work buffer!\n");
-        exit(EXIT_FAILURE);
+        if (cur_file->from_base == 1)
+            num_jobs += (cur_file->size + ROMFS_BASE_COPY_SIZE - 1) / ROMFS_BASE_COPY_SIZE;
     }
-    cur_file = romfs_ctx.files;
-    while (cur_file != NULL)
+    if (num_jobs == 0)
+        return;
+
+    romfs_copy_job_t *jobs = calloc(num_jobs, sizeof(romfs_copy_job_t));
+    if (jobs == NULL || num_jobs > UINT32_MAX)
     {
-        FILE *f_in = os_fopen(cur_file->sum_path.os_path, OS_MODE_READ);
-        if (f_in == NULL)
+        hp_error("Failed to allocate base RomFS copy jobs!\n");
+        hp_exit_failure();
+    }
+
+    uint64_t job_index = 0;
+    uint64_t total_size = 0;
+    for (romfs_fent_ctx_t *cur_file = romfs_ctx->files; cur_file != NULL; cur_file = cur_file->next)
+    {
+        if (cur_file->from_base == 0)
+            continue;
+        for (uint64_t ofs = 0; ofs < cur_file->size; ofs += ROMFS_BASE_COPY_SIZE)
         {
-            fprintf(stderr, "Failed to open %s!\n", cur_file->sum_path.char_path);
-            exit(EXIT_FAILURE);
+            romfs_copy_job_t *job = &jobs[job_index++];
+            job->base = romfs_ctx->base;
+            job->dst_fd = dst_fd;
+            job->src_offset = cur_file->base_offset + ofs;
+            job->dst_offset = base_offset + ROMFS_FILEPARTITION_OFS + cur_file->offset + ofs;
+            job->size = cur_file->size - ofs < ROMFS_BASE_COPY_SIZE ? cur_file->size - ofs : ROMFS_BASE_COPY_SIZE;
         }
+        total_size += cur_file->size;
+    }
 
-        printf("Writing %s to %s\n", cur_file->sum_path.char_path, out_romfspath->char_path);
-        fseeko64(f_out, base_offset + cur_file->offset + ROMFS_FILEPARTITION_OFS, SEEK_SET);
-        uint64_t offset = 0;
-        while (offset < cur_file->size)
+    hp_log("Copying 0x%" PRIx64 " bytes from base RomFS %s\n", total_size, romfs_ctx->base->path.char_path);
+    worker_run(romfs_copy_job, jobs, (uint32_t)num_jobs, romfs_ctx->base->num_threads ? romfs_ctx->base->num_threads : worker_get_cpu_count());
+    for (uint64_t i = 0; i < num_jobs; i++)
+    {
+        if (jobs[i].failed)
         {
-            if (cur_file->size - offset < read_size)
-            {
-                read_size = cur_file->size - offset;
-            }
-
-            if (fread(buffer, 1, read_size, f_in) != read_size)
-            {
-                fprintf(stderr, "Failed to read from %s!\n", cur_file->sum_path.char_path);
-                exit(EXIT_FAILURE);
-            }
+            hp_error("Failed to copy base RomFS file data!\n");
+            hp_exit_failure();
+        }
+    }
+    free(jobs);
+}
 
-            if (fwrite(buffer, 1, read_size, f_out) != read_size)
-            {
-                fprintf(stderr, "Failed to write to output!\n");
-                exit(EXIT_FAILURE);
-            }
+/* Writes a prepared RomFS to f_out at base_offset and frees the context. */
+void romfs_write(romfs_ctx_t *romfs_ctx, FILE *f_out, uint64_t base_offset)
+{
+    fseeko64(f_out, base_offset, SEEK_SET);
+    fwrite(&romfs_ctx->header, 1, sizeof(romfs_header_t), f_out);
+    fflush(f_out);
+
+    /* Write files, the data is copied between files without passing through a userspace buffer where possible. */
+    int dst_fd = fileno(f_out);
+    fio_copy_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    romfs_fent_ctx_t *cur_file = romfs_ctx->files;
+    while (cur_file != NULL)
+    {
+        if (cur_file->from_base == 1)
+        {
+            cur_file = cur_file->next;
+            continue;
+        }
 
-            offset += read_size;
+        int src_fd = fio_open(&cur_file->sum_path, FIO_MODE_READ);
+        if (src_fd < 0)
+        {
+            hp_error("Failed to open %s!\n", cur_file->sum_path.char_path);
+            hp_exit_failure();
         }
 
-        os_fclose(f_in);
+        hp_log("Writing %s\n", cur_file->sum_path.char_path);
+        if (fio_copy_range(src_fd, 0, dst_fd, base_offset + cur_file->offset + ROMFS_FILEPARTITION_OFS, cur_file->size, &stats) != 0)
+        {
+            hp_error("Failed to write %s to output!\n", cur_file->sum_path.char_path);
+            hp_exit_failure();
+        }
 
-        romfs_fent_ctx_t *temp = cur_file;
+        fio_close(src_fd);
         cur_file = cur_file->next;
-        free(temp);
     }
-    free(buffer);
+    fio_print_copy_stats(&stats);
+    if (romfs_ctx->base != NULL)
+        romfs_copy_base_files(romfs_ctx, dst_fd, base_offset);
 
-    fseeko64(f_out, base_offset + dir_hash_table_ofs, SEEK_SET);
-    if (fwrite(dir_hash_table, 1, romfs_ctx.dir_hash_table_size, f_out) != romfs_ctx.dir_hash_table_size)
+    fseeko64(f_out, base_offset + romfs_ctx->header.dir_hash_table_ofs, SEEK_SET);
+    if (fwrite(romfs_ctx->dir_hash_table, 1, romfs_ctx->dir_hash_table_size, f_out) != romfs_ctx->dir_hash_table_size)
     {
-        fprintf(stderr, "Failed to write dir hash table!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Failed to write dir hash table!\n");
+        hp_exit_failure();
     }
-    free(dir_hash_table);
 
-    if (fwrite(dir_table, 1, romfs_ctx.dir_table_size, f_out) != romfs_ctx.dir_table_size)
+    if (fwrite(romfs_ctx->dir_table, 1, romfs_ctx->dir_table_size, f_out) != romfs_ctx->dir_table_size)
     {
-        fprintf(stderr, "Failed to write dir table!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Failed to write dir table!\n");
+        hp_exit_failure();
     }
-    free(dir_table);
 
-    if (fwrite(file_hash_table, 1, romfs_ctx.file_hash_table_size, f_out) != romfs_ctx.file_hash_table_size)
+    if (fwrite(romfs_ctx->file_hash_table, 1, romfs_ctx->file_hash_table_size, f_out) != romfs_ctx->file_hash_table_size)
     {
-        fprintf(stderr, "Failed to write file hash table!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Failed to write file hash table!\n");
+        hp_exit_failure();
     }
-    free(file_hash_table);
 
-    if (fwrite(file_table, 1, romfs_ctx.file_table_size, f_out) != romfs_ctx.file_table_size)
+    if (fwrite(romfs_ctx->file_table, 1, romfs_ctx->file_table_size, f_out) != romfs_ctx->file_table_size)
     {
-        fprintf(stderr, "Failed to write file table!\n");
-        exit(EXIT_FAILURE);
+        hp_error("Failed to write file table!\n");
+        hp_exit_failure();
     }
-    free(file_table);
 
-    return dir_hash_table_ofs + romfs_ctx.dir_hash_table_size + romfs_ctx.dir_table_size + romfs_ctx.file_hash_table_size + romfs_ctx.file_table_size;
+    romfs_free_ctx(romfs_ctx);
 }
-
-size_t romfs_build(filepath_t *in_dirpath, filepath_t *out_romfspath, uint64_t *out_size)
-{
-    FILE *f_out = NULL;
-
-    if ((f_out = os_fopen(out_romfspath->os_path, OS_MODE_WRITE)) == NULL)
-    {
-        fprintf(stderr, "Failed to open %s!\n", out_romfspath->char_path);
-        exit(EXIT_FAILURE);
-    }
-
-    size_t sz = build_romfs_into_file(in_dirpath, f_out, 0, out_romfspath);
-
-    // Write Padding
-    fseeko64(f_out, 0, SEEK_END);
-    *out_size = (uint64_t)ftello64(f_out);
-    uint64_t hash_block_size = IVFC_HASH_BLOCK_SIZE;
-    uint64_t curr_offset = ftello64(f_out);
-    uint64_t padding_size = hash_block_size - (curr_offset % hash_block_size);
-    if (padding_size != 0)
-    {
-        unsigned char *padding_buf = (unsigned char*)calloc(1, padding_size);
-        fwrite(padding_buf, 1, padding_size, f_out);
-        free(padding_buf);
-    }
-
-    fclose(f_out);
-    return sz;
-}
\ No newline at end of file
@@ -1,6 +1,7 @@
 #ifndef HACPACK_ROMFS_H
 #define HACPACK_ROMFS_H
 
+#include <stdio.h>
 #include <sys/types.h>
 #include "filepath.h"
 #include "ivfc.h"
@@ -14,6 +15,7 @@ typedef struct romfs_dirent_ctx {
     struct romfs_dirent_ctx *sibling; /* Sibling node */
     struct romfs_fent_ctx *file; /* File node */
     struct romfs_dirent_ctx *next; /* Next node */
+    uint8_t base_only; /* Only in the base RomFS, there's no directory to visit */
 } romfs_dirent_ctx_t;
 
 typedef struct romfs_fent_ctx {
@@ -25,19 +27,12 @@ typedef struct romfs_fent_ctx {
     romfs_dirent_ctx_t *parent; /* Parent dir */
     struct romfs_fent_ctx *sibling; /* Sibling file */
     struct romfs_fent_ctx *next; /* Logical next file */
+    uint8_t in_base; /* Path is in the base RomFS, with base_size bytes at base_offset */
+    uint8_t from_base; /* Body is read from the base RomFS */
+    uint64_t base_offset;
+    uint64_t base_size;
 } romfs_fent_ctx_t;
 
-typedef struct {
-    romfs_fent_ctx_t *files;
-    uint64_t num_dirs;
-    uint64_t num_files;
-    uint64_t dir_table_size;
-    uint64_t file_table_size;
-    uint64_t dir_hash_table_size;
-    uint64_t file_hash_table_size;
-    uint64_t file_partition_size;
-} romfs_ctx_t;
-
 #pragma pack(push, 1)
 typedef struct {
     uint64_t header_size;
@@ -77,6 +72,37 @@ typedef struct {
 } romfs_fentry_t;
 #pragma pack(pop)
 
+/* Existing RomFS an overlay directory is merged into, read_func reads its decrypted image so it can sit inside an NCA. */
+typedef struct {
+    filepath_t path;
+    int (*read_func)(void *read_ctx, void *buf, uint64_t size, uint64_t offset);
+    void (*close_func)(void *read_ctx);
+    void *read_ctx;
+    uint64_t size;
+    uint32_t num_threads; /* Copy threads, 0 for one per CPU */
+    romfs_header_t header;
+    romfs_direntry_t *dir_table;
+    romfs_fentry_t *file_table;
+} romfs_base_t;
+
+typedef struct {
+    romfs_fent_ctx_t *files;
+    uint64_t num_dirs;
+    uint64_t num_files;
+    uint64_t dir_table_size;
+    uint64_t file_table_size;
+    uint64_t dir_hash_table_size;
+    uint64_t file_hash_table_size;
+    uint64_t file_partition_size;
+    uint64_t romfs_size;
+    romfs_header_t header;
+    uint32_t *dir_hash_table;
+    romfs_direntry_t *dir_table;
+    uint32_t *file_hash_table;
+    romfs_fentry_t *file_table;
+    romfs_base_t *base;
+} romfs_ctx_t;
+
 #pragma pack(push, 1)
 typedef struct {
     ivfc_hdr_t ivfc_header;
@@ -84,6 +110,15 @@ typedef struct {
 } romfs_superblock_t;
 #pragma pack(pop)
 
-size_t romfs_build(filepath_t *in_dirpath, filepath_t *out_romfspath, uint64_t *out_size);
+#define ROMFS_FILEPARTITION_OFS 0x200
+#define ROMFS_BASE_COPY_SIZE 0x800000 // 8 MB
+#define ROMFS_ENTRY_EMPTY 0xFFFFFFFF
+
+uint32_t calc_path_hash(uint32_t parent, const unsigned char *path, uint32_t start, size_t path_len);
+void romfs_base_load(romfs_base_t *base);
+void romfs_base_free(romfs_base_t *base);
+uint64_t romfs_prepare(filepath_t *in_dirpath, romfs_base_t *base, romfs_ctx_t *romfs_ctx);
+void romfs_write(romfs_ctx_t *romfs_ctx, FILE *f_out, uint64_t base_offset);
+void romfs_free_ctx(romfs_ctx_t *romfs_ctx);
 
-#endif
\ No newline at end of file
+#endif
\ No newline at end of file
@@ -2,7 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include "rsa.h"
-#include "rsa_keys.h"
+#include "rsa_keys.h"
+#include "utils.h"
 #include "mbedtls/entropy.h"
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/md.h"
@@ -58,8 +59,8 @@ void rsa_sign_with_file(void *input, size_t input_size, unsigned char *output, s
     mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (const unsigned char *)pers, strlen(pers));
     if (mbedtls_pk_parse_keyfile(&pk, keypath, NULL) != 0)
     {
-        fprintf(stderr, "Private key is invalid: %s\n", keypath);
-        exit(EXIT_FAILURE);
+        hp_error("Private key is invalid: %s\n", keypath);
+        hp_exit_failure();
     }
     mbedtls_rsa_set_padding(mbedtls_pk_rsa(pk), MBEDTLS_RSA_PKCS_V21, MBEDTLS_MD_SHA256);
     mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (unsigned char *)input, input_size, hash);
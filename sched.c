@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "sched.h"
+#include "utils.h"
+
+typedef struct
+{
+    sched_t *sched;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t num_disk_jobs;
+    uint32_t running_disk_jobs;
+    uint8_t failed;
+    hp_trap_t *parent_trap;
+} sched_run_ctx_t;
+
+typedef struct
+{
+    sched_run_ctx_t *run;
+    sched_task_t *task;
+} sched_log_ctx_t;
+
+void sched_init(sched_t *sched)
+{
+    memset(sched, 0, sizeof(*sched));
+}
+
+/* Adds a task, returns its index for sched_add_dep. */
+uint32_t sched_add(sched_t *sched, sched_func_t func, void *ctx, uint8_t disk_heavy)
+{
+    hp_trap_remove(sched->tasks);
+    sched_task_t *tasks = hp_track_buffer(realloc(sched->tasks, (sched->num_tasks + 1) * sizeof(sched_task_t)));
+    if (tasks == NULL)
+    {
+        hp_track_buffer(sched->tasks);
+        hp_error("Failed to allocate build task!\n");
+        hp_exit_failure();
+    }
+    sched->tasks = tasks;
+    sched_task_t *task = &sched->tasks[sched->num_tasks];
+    memset(task, 0, sizeof(*task));
+    task->func = func;
+    task->ctx = ctx;
+    task->disk_heavy = disk_heavy;
+    return sched->num_tasks++;
+}
+
+/* Makes task wait for dep. Tasks are added in a valid order, so dep must be added before task. */
+void sched_add_dep(sched_t *sched, uint32_t task, uint32_t dep)
+{
+    if (dep >= task || task >= sched->num_tasks || sched->tasks[task].num_deps == SCHED_MAX_DEPS)
+    {
+        hp_error("Invalid build task dependency!\n");
+        hp_exit_failure();
+    }
+    sched->tasks[task].deps[sched->tasks[task].num_deps++] = dep;
+}
+
+/* Passes a message on to whoever ran the scheduler. */
+static void sched_emit(sched_run_ctx_t *run, int is_error, const char *message)
+{
+    if (run->parent_trap != NULL && run->parent_trap->log_func != NULL)
+        run->parent_trap->log_func(run->parent_trap->log_user, is_error, message);
+    else
+        fputs(message, is_error ? stderr : stdout);
+}
+
+/* Called with the lock held. */
+static void sched_flush_log(sched_run_ctx_t *run, sched_task_t *task)
+{
+    if (task->log_size > 0)
+        sched_emit(run, 0, task->log);
+    task->log_size = 0;
+}
+
+static void sched_log(void *user, int is_error, const char *message)
+{
+    sched_log_ctx_t *log_ctx = (sched_log_ctx_t *)user;
+    sched_task_t *task = log_ctx->task;
+    if (is_error)
+    {
+        // Errors go out right away, after what the task printed before them
+        pthread_mutex_lock(&log_ctx->run->lock);
+        sched_flush_log(log_ctx->run, task);
+        sched_emit(log_ctx->run, 1, message);
+        pthread_mutex_unlock(&log_ctx->run->lock);
+        return;
+    }
+
+    size_t len = strlen(message);
+    if (task->log_size + len + 1 > task->log_capacity)
+    {
+        size_t capacity = task->log_capacity ? task->log_capacity : 0x1000;
+        while (task->log_size + len + 1 > capacity)
+            capacity *= 2;
+        // Logs outlive the task, they are released with the trap of the whole run
+        hp_trap_t *task_trap = hp_get_trap();
+        hp_set_trap(log_ctx->run->parent_trap);
+        hp_trap_remove(task->log);
+        char *log = hp_track_buffer(realloc(task->log, capacity));
+        if (log == NULL)
+            hp_track_buffer(task->log);
+        hp_set_trap(task_trap);
+        if (log == NULL)
+            return;
+        task->log = log;
+        task->log_capacity = capacity;
+    }
+    memcpy(task->log + task->log_size, message, len + 1);
+    task->log_size += len;
+}
+
+/* Called with the lock held, returns a task whose dependencies are done and which fits the disk job limit. */
+static sched_task_t *sched_next_task(sched_run_ctx_t *run, uint8_t *out_waiting)
+{
+    sched_t *sched = run->sched;
+    *out_waiting = 0;
+    for (uint32_t i = 0; i < sched->num_tasks; i++)
+    {
+        sched_task_t *task = &sched->tasks[i];
+        if (task->state != SCHED_TASK_WAITING)
+            continue;
+        *out_waiting = 1;
+        uint8_t ready = !task->disk_heavy || run->running_disk_jobs < run->num_disk_jobs;
+        for (uint32_t j = 0; j < task->num_deps && ready; j++)
+        {
+            if (sched->tasks[task->deps[j]].state != SCHED_TASK_DONE)
+                ready = 0;
+        }
+        if (ready)
+            return task;
+    }
+    return NULL;
+}
+
+/* Runs a task with its own trap, a failing task stops the scheduler instead of the process. */
+static void sched_run_task(sched_run_ctx_t *run, sched_task_t *task)
+{
+    sched_log_ctx_t log_ctx;
+    hp_trap_t *prev_trap = hp_get_trap();
+    hp_trap_t trap;
+    log_ctx.run = run;
+    log_ctx.task = task;
+    hp_trap_init(&trap, run->parent_trap, sched_log, &log_ctx);
+    hp_set_trap(&trap);
+    if (setjmp(trap.env) == 0)
+    {
+        task->func(task->ctx);
+        task->failed = 0;
+    }
+    else
+        task->failed = 1;
+    hp_trap_finish(&trap, task->failed);
+    hp_set_trap(prev_trap);
+    task->outputs = report_take_outputs(&task->num_outputs);
+}
+
+static void *sched_thread(void *arg)
+{
+    sched_run_ctx_t *run = (sched_run_ctx_t *)arg;
+    pthread_mutex_lock(&run->lock);
+    while (!run->failed)
+    {
+        uint8_t waiting;
+        sched_task_t *task = sched_next_task(run, &waiting);
+        if (task == NULL)
+        {
+            if (!waiting)
+                break;
+            pthread_cond_wait(&run->cond, &run->lock);
+            continue;
+        }
+
+        task->state = SCHED_TASK_RUNNING;
+        if (task->disk_heavy)
+            run->running_disk_jobs++;
+        pthread_mutex_unlock(&run->lock);
+        sched_run_task(run, task);
+        pthread_mutex_lock(&run->lock);
+        task->state = SCHED_TASK_DONE;
+        if (task->disk_heavy)
+            run->running_disk_jobs--;
+        if (task->failed)
+            run->failed = 1;
+        sched_flush_log(run, task);
+        pthread_cond_broadcast(&run->cond);
+    }
+    pthread_mutex_unlock(&run->lock);
+    return NULL;
+}
+
+/* Runs all tasks on up to num_threads threads and returns once they are done, num_disk_jobs of 0 means the default.
+ * With one thread tasks run in the order they were added, like plain calls. */
+void sched_run(sched_t *sched, uint32_t num_threads, uint32_t num_disk_jobs)
+{
+    if (num_threads > sched->num_tasks)
+        num_threads = sched->num_tasks;
+    if (num_threads <= 1)
+    {
+        for (uint32_t i = 0; i < sched->num_tasks; i++)
+            sched->tasks[i].func(sched->tasks[i].ctx);
+        return;
+    }
+
+    sched_run_ctx_t run;
+    run.sched = sched;
+    run.num_disk_jobs = num_disk_jobs ? num_disk_jobs : SCHED_DEFAULT_DISK_JOBS;
+    run.running_disk_jobs = 0;
+    run.failed = 0;
+    run.parent_trap = hp_get_trap();
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.cond, NULL);
+
+    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+    if (threads == NULL)
+    {
+        hp_error("Failed to allocate build threads!\n");
+        hp_exit_failure();
+    }
+    uint32_t started = 0;
+    for (; started < num_threads; started++)
+    {
+        if (pthread_create(&threads[started], NULL, sched_thread, &run) != 0)
+            break;
+    }
+    // Run everything here if no thread could be started
+    if (started == 0)
+        sched_thread(&run);
+    for (uint32_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_cond_destroy(&run.cond);
+    pthread_mutex_destroy(&run.lock);
+
+    // Outputs are reported in task order, as if the tasks ran one after another
+    for (uint32_t i = 0; i < sched->num_tasks; i++)
+    {
+        sched_task_t *task = &sched->tasks[i];
+        if (!run.failed)
+            report_add_outputs(task->outputs, task->num_outputs);
+        else
+            report_free_outputs(task->outputs, task->num_outputs);
+        task->outputs = NULL;
+        task->num_outputs = 0;
+    }
+    if (run.failed)
+        hp_exit_failure();
+}
+
+void sched_free(sched_t *sched)
+{
+    for (uint32_t i = 0; i < sched->num_tasks; i++)
+        hp_free(sched->tasks[i].log);
+    hp_free(sched->tasks);
+    memset(sched, 0, sizeof(*sched));
+}
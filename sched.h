@@ -0,0 +1,48 @@
+#ifndef HACPACK_SCHED_H
+#define HACPACK_SCHED_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "report.h"
+
+#define SCHED_MAX_DEPS 8
+#define SCHED_DEFAULT_DISK_JOBS 2
+
+typedef void (*sched_func_t)(void *ctx);
+
+typedef enum
+{
+    SCHED_TASK_WAITING = 0,
+    SCHED_TASK_RUNNING = 1,
+    SCHED_TASK_DONE = 2
+} sched_task_state_t;
+
+typedef struct
+{
+    sched_func_t func;
+    void *ctx;
+    uint8_t disk_heavy; /* Counts against the disk job limit. */
+    uint32_t deps[SCHED_MAX_DEPS];
+    uint32_t num_deps;
+    sched_task_state_t state;
+    uint8_t failed;
+    char *log; /* Messages are held back until the task is done, so tasks don't interleave. */
+    size_t log_size;
+    size_t log_capacity;
+    report_output_t *outputs;
+    uint32_t num_outputs;
+} sched_task_t;
+
+typedef struct
+{
+    sched_task_t *tasks;
+    uint32_t num_tasks;
+} sched_t;
+
+void sched_init(sched_t *sched);
+uint32_t sched_add(sched_t *sched, sched_func_t func, void *ctx, uint8_t disk_heavy);
+void sched_add_dep(sched_t *sched, uint32_t task, uint32_t dep);
+void sched_run(sched_t *sched, uint32_t num_threads, uint32_t num_disk_jobs);
+void sched_free(sched_t *sched);
+
+#endif
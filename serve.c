@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+#include "serve.h"
+#include "json.h"
+#include "worker.h"
+#include "utils.h"
+
+/* Messages are a 4 byte big-endian length followed by that many bytes of JSON. */
+
+#ifndef _WIN32
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_handle_signal(int sig)
+{
+    (void)sig;
+    serve_stop = 1;
+}
+
+static int serve_write_all(int fd, const void *buf, size_t size)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    while (size > 0)
+    {
+        ssize_t done = write(fd, p, size);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return -1;
+        p += done;
+        size -= (size_t)done;
+    }
+    return 0;
+}
+
+static int serve_read_all(int fd, void *buf, size_t size)
+{
+    unsigned char *p = (unsigned char *)buf;
+    while (size > 0)
+    {
+        ssize_t done = read(fd, p, size);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return -1;
+        p += done;
+        size -= (size_t)done;
+    }
+    return 0;
+}
+
+static int serve_send(int fd, const char *message, size_t size)
+{
+    unsigned char header[4] = {(unsigned char)(size >> 24), (unsigned char)(size >> 16), (unsigned char)(size >> 8), (unsigned char)size};
+    if (serve_write_all(fd, header, sizeof(header)) != 0)
+        return -1;
+    return serve_write_all(fd, message, size);
+}
+
+/* Returns a NUL terminated message, or NULL once the peer is gone. */
+static char *serve_receive(int fd)
+{
+    unsigned char header[4];
+    if (serve_read_all(fd, header, sizeof(header)) != 0)
+        return NULL;
+    uint32_t size = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | header[3];
+    if (size > SERVE_MAX_MESSAGE_SIZE)
+        return NULL;
+    char *message = malloc((size_t)size + 1);
+    if (message == NULL)
+    {
+        fprintf(stderr, "Failed to allocate message!\n");
+        exit(EXIT_FAILURE);
+    }
+    if (serve_read_all(fd, message, size) != 0)
+    {
+        free(message);
+        return NULL;
+    }
+    message[size] = '\0';
+    return message;
+}
+
+/* Sends a message assembled in a memory stream. */
+static int serve_send_stream(int fd, FILE *stream, char **buf, size_t *size)
+{
+    fclose(stream);
+    int ret = serve_send(fd, *buf, *size);
+    free(*buf);
+    return ret;
+}
+
+static int serve_send_log(int fd, const char *text)
+{
+    char *buf;
+    size_t size;
+    FILE *stream = open_memstream(&buf, &size);
+    if (stream == NULL)
+        return -1;
+    fprintf(stream, "{\"type\": \"log\", \"text\": ");
+    json_write_string(stream, text);
+    fprintf(stream, "}");
+    return serve_send_stream(fd, stream, &buf, &size);
+}
+
+static int serve_send_result(int fd, batch_job_t *job)
+{
+    char *buf;
+    size_t size;
+    FILE *stream = open_memstream(&buf, &size);
+    if (stream == NULL)
+        return -1;
+    fprintf(stream, "{\"type\": \"result\", \"name\": ");
+    if (job->name != NULL)
+        json_write_string(stream, job->name);
+    else
+        fprintf(stream, "null");
+    fprintf(stream, ", \"status\": \"%s\", \"exit_code\": %d, \"seconds\": %.3f, \"outputs\": %s}",
+            job->exit_code == 0 ? "ok" : "failed", job->exit_code, job->seconds, job->outputs != NULL ? job->outputs : "[]");
+    return serve_send_stream(fd, stream, &buf, &size);
+}
+
+/* Runs one request in a child process, its output is relayed line by line as log messages. */
+static void serve_handle_client(int client_fd, hp_settings_t *settings, batch_parse_func_t parse_func, batch_build_func_t build_func, uint32_t index, uint32_t num_threads)
+{
+    batch_job_t job;
+    char *request_text = serve_receive(client_fd);
+    if (request_text == NULL)
+        return;
+
+    char error[0x100];
+    json_value_t *request = json_parse(request_text, error, sizeof(error));
+    free(request_text);
+    if (request == NULL || batch_job_init(&job, NULL, request, index) != 0)
+    {
+        if (request == NULL)
+            serve_send_log(client_fd, error);
+        memset(&job, 0, sizeof(job));
+        job.exit_code = EXIT_FAILURE;
+        serve_send_result(client_fd, &job);
+        json_free(request);
+        return;
+    }
+    json_free(request);
+
+    int pipe_fds[2];
+    job.result_file = tmpfile();
+    if (job.result_file == NULL || pipe(pipe_fds) != 0)
+    {
+        serve_send_log(client_fd, "Failed to start job");
+        job.exit_code = EXIT_FAILURE;
+        serve_send_result(client_fd, &job);
+        batch_job_free(&job);
+        return;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    job.start_time = hp_get_time();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(pipe_fds[0]);
+        close(client_fd);
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        dup2(pipe_fds[1], STDERR_FILENO);
+        close(pipe_fds[1]);
+        int ret = batch_build_job(settings, parse_func, build_func, &job, index, num_threads);
+        fflush(NULL);
+        _exit(ret);
+    }
+    close(pipe_fds[1]);
+
+    // Forward complete lines as they arrive
+    char line[0x1000];
+    size_t line_len = 0;
+    char buf[0x1000];
+    ssize_t done;
+    while ((done = read(pipe_fds[0], buf, sizeof(buf))) != 0)
+    {
+        if (done < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (ssize_t i = 0; i < done; i++)
+        {
+            if (buf[i] == '\n' || line_len == sizeof(line) - 1)
+            {
+                line[line_len] = '\0';
+                serve_send_log(client_fd, line);
+                line_len = 0;
+                if (buf[i] == '\n')
+                    continue;
+            }
+            line[line_len++] = buf[i];
+        }
+    }
+    if (line_len > 0)
+    {
+        line[line_len] = '\0';
+        serve_send_log(client_fd, line);
+    }
+    close(pipe_fds[0]);
+
+    int status = 0;
+    if (pid < 0)
+        job.exit_code = EXIT_FAILURE;
+    else
+    {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+            ;
+        job.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+    job.seconds = hp_get_time() - job.start_time;
+    job.outputs = batch_read_file(job.result_file);
+    if (job.outputs[0] == '\0')
+    {
+        free(job.outputs);
+        job.outputs = NULL;
+    }
+    fclose(job.result_file);
+    serve_send_result(client_fd, &job);
+    batch_job_free(&job);
+}
+
+static int serve_make_address(filepath_t *socket_path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(socket_path->char_path) >= sizeof(addr->sun_path))
+    {
+        fprintf(stderr, "Error: Socket path is too long: %s\n", socket_path->char_path);
+        return -1;
+    }
+    strcpy(addr->sun_path, socket_path->char_path);
+    return 0;
+}
+#endif
+
+/* Keeps the keyset loaded and builds requests from a Unix socket, each in its own process. */
+int serve_run(hp_settings_t *settings, batch_parse_func_t parse_func, batch_build_func_t build_func)
+{
+#ifdef _WIN32
+    (void)settings;
+    (void)parse_func;
+    (void)build_func;
+    fprintf(stderr, "Error: --serve isn't supported on Windows\n");
+    return 1;
+#else
+    struct sockaddr_un addr;
+    if (serve_make_address(&settings->serve_socket, &addr) != 0)
+        return 1;
+
+    // Requests are built from these settings, they mustn't start another server
+    hp_settings_t job_settings = *settings;
+    filepath_init(&job_settings.serve_socket);
+
+    // Only a stale socket of an earlier server is replaced, never a file at a mistyped path
+    struct stat st;
+    if (lstat(addr.sun_path, &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            fprintf(stderr, "Error: %s exists and isn't a socket\n", settings->serve_socket.char_path);
+            return 1;
+        }
+        unlink(addr.sun_path);
+    }
+
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd < 0 || bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(server_fd, 64) != 0)
+    {
+        fprintf(stderr, "Error: Failed to listen on %s: %s\n", settings->serve_socket.char_path, strerror(errno));
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Admission control, requests wait in the listen backlog while the budget is used up
+    uint32_t num_cpus = settings->num_threads ? settings->num_threads : worker_get_cpu_count();
+    uint32_t max_jobs = num_cpus;
+    if (settings->batch_memory != 0 && settings->batch_memory / BATCH_JOB_MEMORY < max_jobs)
+        max_jobs = settings->batch_memory / BATCH_JOB_MEMORY;
+    if (max_jobs == 0)
+        max_jobs = 1;
+    uint32_t num_threads = num_cpus / max_jobs ? num_cpus / max_jobs : 1;
+    printf("Serving on %s, %u jobs at a time\n", settings->serve_socket.char_path, max_jobs);
+
+    uint32_t running = 0;
+    uint32_t index = 0;
+    while (!serve_stop)
+    {
+        while (running > 0 && waitpid(-1, NULL, WNOHANG) > 0)
+            running--;
+        if (running >= max_jobs)
+        {
+            if (waitpid(-1, NULL, 0) > 0)
+                running--;
+            continue;
+        }
+
+        int client_fd = accept(server_fd, NULL, NULL);
+        if (client_fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "Error: Failed to accept request: %s\n", strerror(errno));
+            break;
+        }
+
+        printf("Starting job %u\n", index);
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(server_fd);
+            serve_handle_client(client_fd, &job_settings, parse_func, build_func, index, num_threads);
+            close(client_fd);
+            _exit(0);
+        }
+        close(client_fd);
+        if (pid > 0)
+            running++;
+        index++;
+    }
+
+    printf("Stopping server\n");
+    close(server_fd);
+    unlink(addr.sun_path);
+    while (running > 0 && waitpid(-1, NULL, 0) > 0)
+        running--;
+    return 0;
+#endif
+}
+
+/* Sends one request, logs go to stderr and the result message to results_file. Returns the job's exit code. */
+int serve_client(filepath_t *socket_path, filepath_t *request_path, FILE *results_file)
+{
+#ifdef _WIN32
+    (void)socket_path;
+    (void)request_path;
+    (void)results_file;
+    fprintf(stderr, "Error: --connect isn't supported on Windows\n");
+    return 1;
+#else
+    FILE *request_file = os_fopen(request_path->os_path, OS_MODE_READ);
+    if (request_file == NULL)
+    {
+        fprintf(stderr, "Error: Failed to open %s\n", request_path->char_path);
+        return 1;
+    }
+    char error[0x100];
+    json_value_t *request = json_parse_file(request_file, error, sizeof(error));
+    fclose(request_file);
+    if (request == NULL || request->type != JSON_OBJECT)
+    {
+        fprintf(stderr, "Error: %s isn't a valid request: %s\n", request_path->char_path, request == NULL ? error : "not an object");
+        json_free(request);
+        return 1;
+    }
+    json_free(request);
+
+    // Send the file as is, the server parses it again
+    request_file = os_fopen(request_path->os_path, OS_MODE_READ);
+    char *request_text = request_file != NULL ? batch_read_file(request_file) : NULL;
+    if (request_file != NULL)
+        fclose(request_file);
+
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (request_text == NULL || serve_make_address(socket_path, &addr) != 0 || fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        fprintf(stderr, "Error: Failed to connect to %s\n", socket_path->char_path);
+        free(request_text);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    int ret = serve_send(fd, request_text, strlen(request_text));
+    free(request_text);
+
+    char *message;
+    while (ret == 0 && (message = serve_receive(fd)) != NULL)
+    {
+        json_value_t *value = json_parse(message, error, sizeof(error));
+        json_value_t *type = json_get(value, "type");
+        if (type != NULL && type->type == JSON_STRING && strcmp(type->string, "log") == 0)
+        {
+            json_value_t *text = json_get(value, "text");
+            if (text != NULL && text->type == JSON_STRING)
+                fprintf(stderr, "%s\n", text->string);
+        }
+        else if (type != NULL && type->type == JSON_STRING && strcmp(type->string, "result") == 0)
+        {
+            json_value_t *exit_code = json_get(value, "exit_code");
+            fprintf(results_file, "%s\n", message);
+            fflush(results_file);
+            ret = exit_code != NULL && exit_code->type == JSON_NUMBER ? atoi(exit_code->string) : 1;
+            json_free(value);
+            free(message);
+            close(fd);
+            return ret;
+        }
+        json_free(value);
+        free(message);
+    }
+    close(fd);
+    fprintf(stderr, "Error: Connection closed before a result was received\n");
+    return 1;
+#endif
+}
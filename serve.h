@@ -0,0 +1,13 @@
+#ifndef HACPACK_SERVE_H
+#define HACPACK_SERVE_H
+
+#include <stdio.h>
+#include "settings.h"
+#include "batch.h"
+
+#define SERVE_MAX_MESSAGE_SIZE 0x1000000 /* 16 MB */
+
+int serve_run(hp_settings_t *settings, batch_parse_func_t parse_func, batch_build_func_t build_func);
+int serve_client(filepath_t *socket_path, filepath_t *request_path, FILE *results_file);
+
+#endif
@@ -58,7 +58,18 @@ enum hp_nca_type
     NCA_TYPE_CONTROL = 2,
     NCA_TYPE_MANUAL = 3,
     NCA_TYPE_DATA = 4,
-    NCA_TYPE_PUBLICDATA = 5
+    NCA_TYPE_PUBLICDATA = 5,
+    NCA_TYPE_APPLICATION = 6 /* Program, control, manual and meta in one go */
+};
+
+/* Header fields set by an option, --patchheader only changes these. */
+enum hp_header_field
+{
+    HEADER_FIELD_DISTTYPE = 1 << 0,
+    HEADER_FIELD_SDK_VERSION = 1 << 1,
+    HEADER_FIELD_KEYGENERATION = 1 << 2,
+    HEADER_FIELD_NCASIG = 1 << 3,
+    HEADER_FIELD_KEYAREAKEY = 1 << 4
 };
 
 enum hp_file_type
@@ -89,6 +100,21 @@ enum nca_distribution_type
     NCA_DISTRIBUTION_GAMECARD = 1
 };
 
+enum nsp_split_type
+{
+    NSP_SPLIT_NONE = 0,
+    NSP_SPLIT_PARTS = 1, /* <nsp>.00, <nsp>.01... */
+    NSP_SPLIT_DIR = 2    /* <nsp>/00, <nsp>/01... */
+};
+
+/* Hash and size of an NCA built in this run, spares cnmt from re-reading the NCA. */
+typedef struct
+{
+    uint8_t valid;
+    unsigned char hash[0x20];
+    uint64_t size;
+} hp_nca_digest_t;
+
 typedef struct
 {
     hp_keyset_t keyset;
@@ -106,6 +132,15 @@ typedef struct
     filepath_t datanca;
     filepath_t publicdatanca;
     filepath_t ncadir;
+    filepath_t control_dir;
+    filepath_t legal_dir;
+    filepath_t htmldoc_dir;
+    hp_nca_digest_t programnca_digest;
+    hp_nca_digest_t controlnca_digest;
+    hp_nca_digest_t legalnca_digest;
+    hp_nca_digest_t htmldocnca_digest;
+    hp_nca_digest_t datanca_digest;
+    hp_nca_digest_t publicdatanca_digest;
     filepath_t cnmt;
     filepath_t backup_dir;
     filepath_t acid_sig_private_key;
@@ -120,6 +155,9 @@ typedef struct
     unsigned char title_key[0x10];
     unsigned char *keyareakey;
     int keygeneration;
+    uint32_t num_threads;
+    uint32_t disk_jobs; /* Disk heavy build steps at a time, 0 means the default */
+    int nsp_out_fd; /* Stream the NSP to this descriptor instead of a file, -1 if unset. */
     union {
         uint32_t sdk_version; /* What SDK was this built with? */
         struct
@@ -135,6 +173,34 @@ typedef struct
     enum hp_title_type title_type;
     enum nca_sig_type nca_sig;
     enum nca_distribution_type nca_disttype;
+    enum nsp_split_type nsp_split;
+    uint8_t verify_sidecars;
+    filepath_t cache_dir;
+    uint64_t cache_size;    /* MB, 0 means no limit */
+    uint32_t cache_verify;  /* Percent of cache hits rebuilt and compared */
+    filepath_t rekey_nca;
+    uint8_t has_rekey_title_key;
+    unsigned char rekey_title_key[0x10]; /* Titlekey of rekey_nca if it uses titlekey crypto */
+    filepath_t patch_nca;
+    filepath_t verify_path; /* NCA or NSP checked by --verify */
+    filepath_t extract_path; /* NCA, NSP or RomFS image unpacked by --extract */
+    filepath_t info_path; /* NCA, NSP or directory of them read by --info */
+    uint8_t info_json; /* Write --info as JSON to stdout */
+    uint32_t header_fields; /* enum hp_header_field flags */
+    filepath_t variants;
+    struct rekey_variants *variant_writer; /* Open while an NCA with variants is built, fed by nca_encrypt_section */
+    filepath_t romfs_base;
+    uint8_t has_base_title_key;
+    unsigned char base_title_key[0x10]; /* Titlekey of romfs_base if it uses titlekey crypto */
+    uint8_t bktr; /* Write the program RomFS as a patch of romfs_base */
+    uint8_t compress_romfs; /* Store RomFS sections LZ4 compressed */
+    uint8_t nsz; /* Write NCAs of the NSP as NCZs in an NSZ */
+    int nsz_level; /* zstd level of NCZ blocks, 0 is the default */
+    filepath_t batch_manifest;
+    uint32_t batch_memory; /* MB, 0 means no limit */
+    filepath_t serve_socket;
+    filepath_t connect_socket;
+    filepath_t request;
 } hp_settings_t;
 
 #endif
@@ -1,65 +1,94 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <libgen.h>
 #include "ticket.h"
 #include "ticket_files.h"
 #include "aes.h"
 
+/* Rights ID based base name shared by the tik and cert, always 32 hex digits. */
+void ticket_get_name(hp_settings_t *settings, char *out_name, size_t out_size)
+{
+    snprintf(out_name, out_size, "%016" PRIx64 "00000000000000%02x", settings->title_id, (uint8_t)settings->keygeneration);
+}
+
+uint32_t ticket_get_cert(const unsigned char **out_cert)
+{
+    *out_cert = ticket_files_cert;
+    return TICKETCERTSIZE;
+}
+
+/* Returns a malloc'd tik for settings->title_key. */
+uint32_t ticket_get_tik(hp_settings_t *settings, unsigned char **out_tik)
+{
+    unsigned char *tik = (unsigned char *)malloc(TICKETTIKSIZE);
+    if (tik == NULL)
+    {
+        hp_error("Error: unable to allocate tik\n");
+        hp_exit_failure();
+    }
+    memcpy(tik, ticket_files_tik, TICKETTIKSIZE);
+
+    // Encrypting title key
+    hp_log("Encrypting Titlekey\n");
+    aes_ctx_t *aes_tkey_ctx = new_aes_ctx(settings->keyset.titlekeks[settings->keygeneration - 1], 16, AES_MODE_ECB);
+    aes_encrypt(aes_tkey_ctx, tik + 0x180, settings->title_key, 0x10);
+    free_aes_ctx(aes_tkey_ctx);
+    tik[0x285] = (uint8_t)settings->keygeneration;
+
+    // Calculate RightsID
+    uint8_t *rights_id = tik + 0x2A0;
+    memset(rights_id, 0, 0x10);
+    for (int ridc = 0; ridc < 8; ridc++)
+    {
+        rights_id[7 - ridc] = (settings->title_id >> (8 * ridc) & 0xff);
+    }
+    rights_id[15] = (uint8_t)settings->keygeneration;
+
+    *out_tik = tik;
+    return TICKETTIKSIZE;
+}
+
 void ticket_create_cert(hp_settings_t *settings)
 {
+    char ticket_name[TICKET_NAME_SIZE];
+    ticket_get_name(settings, ticket_name, sizeof(ticket_name));
     filepath_t cert_path;
     filepath_init(&cert_path);
     filepath_copy(&cert_path, &settings->out_dir);
-    filepath_append(&cert_path, "%016" PRIx64 "000000000000000%x.cert", settings->title_id, settings->keygeneration);
-    printf("Creating cert %s\n", cert_path.char_path);
+    filepath_append(&cert_path, "%s.cert", ticket_name);
+    hp_log("Creating cert %s\n", cert_path.char_path);
     FILE *file;
     if (!(file = os_fopen(cert_path.os_path, OS_MODE_WRITE)))
     {
-        fprintf(stderr, "Error: unable to create cert\n");
-        exit(EXIT_FAILURE);
+        hp_error("Error: unable to create cert\n");
+        hp_exit_failure();
     }
     fwrite(ticket_files_cert, 1, TICKETCERTSIZE, file);
-    fclose(file);
+    os_fclose(file);
 }
 
 void ticket_create_tik(hp_settings_t *settings)
 {
+    char ticket_name[TICKET_NAME_SIZE];
+    ticket_get_name(settings, ticket_name, sizeof(ticket_name));
     filepath_t tik_path;
     filepath_init(&tik_path);
     filepath_copy(&tik_path, &settings->out_dir);
-    filepath_append(&tik_path, "%016" PRIx64 "000000000000000%x.tik", settings->title_id, settings->keygeneration);
+    filepath_append(&tik_path, "%s.tik", ticket_name);
 
-    // Encrypting title key
-    printf("Encrypting Titlekey\n");
-    unsigned char enc_key[0x10];
-    aes_ctx_t *aes_tkey_ctx = new_aes_ctx(settings->keyset.titlekeks[settings->keygeneration - 1], 16, AES_MODE_ECB);
-    aes_encrypt(aes_tkey_ctx, enc_key, settings->title_key, 0x10);
-    free_aes_ctx(aes_tkey_ctx);
+    unsigned char *tik;
+    uint32_t tik_size = ticket_get_tik(settings, &tik);
 
-    printf("Creating tik %s\n", tik_path.char_path);
+    hp_log("Creating tik %s\n", tik_path.char_path);
     FILE *file;
     if (!(file = os_fopen(tik_path.os_path, OS_MODE_WRITE)))
     {
-        fprintf(stderr, "Error: unable to create tik\n");
-        exit(EXIT_FAILURE);
-    }
-    fwrite(ticket_files_tik, 1, TICKETTIKSIZE, file);
-    fseeko64(file, 0x180, SEEK_SET);
-    fwrite(enc_key, 1, 0x10, file);
-    fseeko64(file, 0x285, SEEK_SET);
-    fwrite((uint8_t*)&settings->keygeneration, 1, 1, file);
-    fseeko64(file, 0x2A0, SEEK_SET);
-
-    // Calculate RightsID
-    uint8_t rights_id[0x10] = { 0 };
-    for (int ridc = 0; ridc < 8; ridc++)
-    {
-        rights_id[7 - ridc] = (settings->title_id >> (8 * ridc) & 0xff);
+        hp_error("Error: unable to create tik\n");
+        hp_exit_failure();
     }
-    rights_id[15] = (uint8_t)settings->keygeneration;
-    
-    fwrite(rights_id, 1, 0x10, file);
-    
-    fclose(file);
+    fwrite(tik, 1, tik_size, file);
+    os_fclose(file);
+    free(tik);
 }
\ No newline at end of file
@@ -4,6 +4,11 @@
 #include "filepath.h"
 #include "settings.h"
 
+#define TICKET_NAME_SIZE 0x40
+
+void ticket_get_name(hp_settings_t *settings, char *out_name, size_t out_size);
+uint32_t ticket_get_cert(const unsigned char **out_cert);
+uint32_t ticket_get_tik(hp_settings_t *settings, unsigned char **out_tik);
 void ticket_create_cert(hp_settings_t *settings);
 void ticket_create_tik(hp_settings_t *settings);
 
@@ -1,14 +1,33 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #ifdef _WIN32
+#include <windows.h>
 #include <direct.h>
 #endif
 #include "utils.h"
 #include "filepath.h"
 #include "sha.h"
 
+static _Thread_local hp_trap_t *hp_trap = NULL;
+
+/* Resources of every live trap, a worker may free what the calling thread allocated and the other way round. */
+typedef struct
+{
+    hp_release_func_t func;
+    void *resource;
+    hp_trap_t *trap;
+} hp_resource_t;
+
+static pthread_mutex_t hp_resources_lock = PTHREAD_MUTEX_INITIALIZER;
+static hp_resource_t *hp_resources = NULL;
+static uint32_t hp_num_resources = 0;
+static uint32_t hp_max_resources = 0;
+
 /* Taken mostly from ctrtool. */
 void memdump(FILE *f, const char *prefix, const void *data, size_t size)
 {
@@ -48,6 +67,175 @@ void memdump(FILE *f, const char *prefix, const void *data, size_t size)
     }
 }
 
+hp_trap_t *hp_get_trap(void)
+{
+    return hp_trap;
+}
+
+void hp_set_trap(hp_trap_t *trap)
+{
+    hp_trap = trap;
+}
+
+void hp_trap_init(hp_trap_t *trap, hp_trap_t *parent, hp_log_func_t log_func, void *log_user)
+{
+    memset(trap, 0, sizeof(*trap));
+    trap->can_jump = 1;
+    trap->log_func = log_func;
+    trap->log_user = log_user;
+    trap->parent = parent;
+}
+
+/* Releases the resources of a failed trap, those of a trap that succeeded now belong to its parent. */
+void hp_trap_finish(hp_trap_t *trap, int failed)
+{
+    pthread_mutex_lock(&hp_resources_lock);
+    uint32_t i = hp_num_resources;
+    while (i-- > 0)
+    {
+        hp_resource_t *resource = &hp_resources[i];
+        if (resource->trap != trap)
+            continue;
+        if (!failed && trap->parent != NULL)
+        {
+            resource->trap = trap->parent;
+            continue;
+        }
+        if (failed)
+            resource->func(resource->resource);
+        *resource = hp_resources[--hp_num_resources];
+    }
+    pthread_mutex_unlock(&hp_resources_lock);
+}
+
+/* Registers a resource with the trap of the calling thread, without a trap failures exit and nothing is kept. */
+void hp_trap_add(hp_release_func_t func, void *resource)
+{
+    if (hp_trap == NULL)
+        return;
+    pthread_mutex_lock(&hp_resources_lock);
+    if (hp_num_resources == hp_max_resources)
+    {
+        uint32_t max_resources = hp_max_resources ? hp_max_resources * 2 : 64;
+        hp_resource_t *resources = realloc(hp_resources, max_resources * sizeof(hp_resource_t));
+        if (resources == NULL)
+        {
+            pthread_mutex_unlock(&hp_resources_lock);
+            func(resource);
+            hp_error("Failed to allocate trap resources!\n");
+            hp_exit_failure();
+        }
+        hp_resources = resources;
+        hp_max_resources = max_resources;
+    }
+    hp_resources[hp_num_resources].func = func;
+    hp_resources[hp_num_resources].resource = resource;
+    hp_resources[hp_num_resources].trap = hp_trap;
+    hp_num_resources++;
+    pthread_mutex_unlock(&hp_resources_lock);
+}
+
+/* Forgets a resource that is being released normally, whichever trap it belongs to. */
+void hp_trap_remove(void *resource)
+{
+    pthread_mutex_lock(&hp_resources_lock);
+    uint32_t i = hp_num_resources;
+    while (i-- > 0)
+    {
+        if (hp_resources[i].resource == resource)
+        {
+            hp_resources[i] = hp_resources[--hp_num_resources];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&hp_resources_lock);
+}
+
+static void hp_release_file(void *file)
+{
+    fclose((FILE *)file);
+}
+
+/* Registers a file from fopen with the trap, NULL is passed through. */
+FILE *hp_track_file(FILE *file)
+{
+    if (file != NULL)
+        hp_trap_add(hp_release_file, file);
+    return file;
+}
+
+int hp_fclose(FILE *file)
+{
+    hp_trap_remove(file);
+    return fclose(file);
+}
+
+/* Registers a heap buffer with the trap, NULL is passed through. */
+void *hp_track_buffer(void *buf)
+{
+    if (buf != NULL)
+        hp_trap_add(free, buf);
+    return buf;
+}
+
+void hp_free(void *buf)
+{
+    if (buf == NULL)
+        return;
+    hp_trap_remove(buf);
+    free(buf);
+}
+
+static void hp_vlog(int is_error, const char *format, va_list args)
+{
+    if (hp_trap == NULL || hp_trap->log_func == NULL)
+    {
+        vfprintf(is_error ? stderr : stdout, format, args);
+        return;
+    }
+    char message[0x1000];
+    vsnprintf(message, sizeof(message), format, args);
+    hp_trap->log_func(hp_trap->log_user, is_error, message);
+}
+
+/* Progress messages, stdout unless a library caller set a log callback. */
+void hp_log(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    hp_vlog(0, format, args);
+    va_end(args);
+}
+
+/* Error messages, stderr unless a library caller set a log callback. */
+void hp_error(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    hp_vlog(1, format, args);
+    va_end(args);
+}
+
+/* Fails the current build, the CLI exits while library builds return an error. */
+void hp_exit_failure(void)
+{
+    if (hp_trap != NULL && hp_trap->can_jump)
+        longjmp(hp_trap->env, 1);
+    exit(EXIT_FAILURE);
+}
+
+/* Monotonic time in seconds, for durations and throughput. */
+double hp_get_time(void)
+{
+#ifdef _WIN32
+    return (double)GetTickCount64() / 1000.0;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
 // Code by NullModel https://github.com/ENCODE-DCC/kentUtils/commits?author=NullModel
 char hexTab[16] = {
     '0',
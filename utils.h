@@ -3,13 +3,36 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <setjmp.h>
 #include "types.h"
 
 #define FATAL_ERROR(msg) do {\
-    fprintf(stderr, "Error: %s\n", msg);\
-    exit(EXIT_FAILURE);\
+    hp_error("Error: %s\n", msg);\
+    hp_exit_failure();\
 } while (0)
 
+#if defined(__MINGW32__)
+#define HP_PRINTF_FORMAT(f, a) __attribute__((format(__MINGW_PRINTF_FORMAT, f, a)))
+#elif defined(__GNUC__)
+#define HP_PRINTF_FORMAT(f, a) __attribute__((format(printf, f, a)))
+#else
+#define HP_PRINTF_FORMAT(f, a)
+#endif
+
+typedef void (*hp_log_func_t)(void *user, int is_error, const char *message);
+typedef void (*hp_release_func_t)(void *resource);
+
+/* Installed per thread by the library, errors jump back to it instead of exiting the process.
+ * Files, fds and I/O buffers opened under a trap are released when it fails. */
+typedef struct hp_trap
+{
+    jmp_buf env;
+    uint8_t can_jump;
+    hp_log_func_t log_func;
+    void *log_user;
+    struct hp_trap *parent; /* Takes over the resources still open when the trap ends */
+} hp_trap_t;
+
 
 #if defined(_WIN32) || defined(_WIN64)
 #define PATH_SEPERATOR '\\'
@@ -27,6 +50,21 @@
 
 void memdump(FILE *f, const char *prefix, const void *data, size_t size);
 
+hp_trap_t *hp_get_trap(void);
+void hp_set_trap(hp_trap_t *trap);
+void hp_trap_init(hp_trap_t *trap, hp_trap_t *parent, hp_log_func_t log_func, void *log_user);
+void hp_trap_finish(hp_trap_t *trap, int failed);
+void hp_trap_add(hp_release_func_t func, void *resource);
+void hp_trap_remove(void *resource);
+FILE *hp_track_file(FILE *file);
+int hp_fclose(FILE *file);
+void *hp_track_buffer(void *buf);
+void hp_free(void *buf);
+void hp_log(const char *format, ...) HP_PRINTF_FORMAT(1, 2);
+void hp_error(const char *format, ...) HP_PRINTF_FORMAT(1, 2);
+_Noreturn void hp_exit_failure(void);
+double hp_get_time(void);
+
 #ifdef _MSC_VER
 inline int fseeko64(FILE *__stream, long long __off, int __whence)
 {
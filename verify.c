@@ -0,0 +1,632 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include "verify.h"
+#include "ncareader.h"
+#include "ivfc.h"
+#include "pfs0.h"
+#include "cnmt.h"
+#include "sha.h"
+#include "fio.h"
+#include "worker.h"
+#include "utils.h"
+
+typedef enum
+{
+    VERIFY_RESULT_OK,
+    VERIFY_RESULT_FAILED,
+    VERIFY_RESULT_SKIPPED
+} verify_result_t;
+
+/* Hash blocks of a section checked by one worker job, a job without a section hashes the whole NCA for its NCA ID. */
+typedef struct
+{
+    int section_index;
+    uint64_t offset; /* In the section */
+    uint64_t size;
+    uint64_t data_end; /* End of the hashed data, the last block is cut or zero padded there */
+    uint32_t block_size;
+    uint8_t padded_blocks; /* IVFC hashes the last block zero padded, PFS0 hashes only what's left of it */
+    const unsigned char *hashes; /* Expected hash of the first block and the ones after it */
+    double start_time;
+    double end_time;
+    uint64_t bad_offset;
+    int failed; /* 1 if a read failed, 2 if a block hash differs */
+} verify_job_t;
+
+typedef struct
+{
+    verify_result_t result;
+    const char *message; /* Why the section failed or was skipped */
+    uint64_t size;       /* Bytes hashed */
+    double seconds;      /* Hashing of in-memory levels, before the jobs run */
+    uint32_t first_job;
+    uint32_t num_jobs;
+    unsigned char *levels[IVFC_MAX_LEVEL - 1]; /* IVFC levels 1-5, or the PFS0 hash table */
+} verify_section_t;
+
+typedef struct
+{
+    ncareader_t *reader;
+    verify_job_t *jobs;
+    uint32_t num_jobs;
+    uint32_t max_jobs;
+    unsigned char nca_hash[0x20];
+} verify_ctx_t;
+
+/* Hashes the blocks of data, read from data_offset in the section, returns the section offset of the first bad block or UINT64_MAX.
+   data must hold whole blocks when they are padded. */
+static uint64_t verify_hash_blocks(const unsigned char *data, uint64_t data_offset, uint64_t size, uint64_t data_end, uint32_t block_size, uint8_t padded_blocks, const unsigned char *hashes)
+{
+    unsigned char hash[0x20];
+    for (uint64_t ofs = 0; ofs < size; ofs += block_size)
+    {
+        uint64_t hash_size = block_size;
+        if (!padded_blocks && data_offset + ofs + block_size > data_end)
+            hash_size = data_end - data_offset - ofs;
+        sha256_hash_buffer(hash, data + ofs, hash_size);
+        if (memcmp(hash, hashes + (ofs / block_size) * 0x20, 0x20) != 0)
+            return data_offset + ofs;
+    }
+    return UINT64_MAX;
+}
+
+/* SHA-256 of size bytes at offset in fd, returns 0 on success. */
+static int verify_hash_range(int fd, uint64_t offset, uint64_t size, unsigned char *out_hash)
+{
+    unsigned char *buf = hp_track_buffer(malloc(VERIFY_JOB_SIZE));
+    if (buf == NULL)
+        return 1;
+    int ret = 0;
+    sha_ctx_t *sha_ctx = new_sha_ctx(HASH_TYPE_SHA256, 0);
+    for (uint64_t ofs = 0; ofs < size; ofs += VERIFY_JOB_SIZE)
+    {
+        uint64_t read_size = size - ofs < VERIFY_JOB_SIZE ? size - ofs : VERIFY_JOB_SIZE;
+        if (fio_pread(fd, buf, read_size, offset + ofs) != 0)
+        {
+            ret = 1;
+            break;
+        }
+        sha_update(sha_ctx, buf, read_size);
+    }
+    sha_get_hash(sha_ctx, out_hash);
+    free_sha_ctx(sha_ctx);
+    hp_free(buf);
+    return ret;
+}
+
+static void verify_job(void *ctx, uint32_t index)
+{
+    verify_ctx_t *verify_ctx = (verify_ctx_t *)ctx;
+    verify_job_t *job = &verify_ctx->jobs[index];
+    job->start_time = hp_get_time();
+    if (job->section_index < 0)
+    {
+        job->failed = verify_hash_range(verify_ctx->reader->fd, verify_ctx->reader->offset, job->size, verify_ctx->nca_hash);
+        job->end_time = hp_get_time();
+        return;
+    }
+
+    // Reads are positional, every job reads and decrypts its own range
+    uint64_t buf_size = (job->size + job->block_size - 1) / job->block_size * job->block_size;
+    unsigned char *buf = hp_track_buffer(calloc(1, buf_size));
+    if (buf == NULL || ncareader_read_section(verify_ctx->reader, (uint8_t)job->section_index, buf, job->size, job->offset) != 0)
+        job->failed = 1;
+    else if ((job->bad_offset = verify_hash_blocks(buf, job->offset, job->size, job->data_end, job->block_size, job->padded_blocks, job->hashes)) != UINT64_MAX)
+        job->failed = 2;
+    hp_free(buf);
+    job->end_time = hp_get_time();
+}
+
+static verify_job_t *verify_new_job(verify_ctx_t *ctx)
+{
+    if (ctx->num_jobs == ctx->max_jobs)
+    {
+        ctx->max_jobs = ctx->max_jobs ? ctx->max_jobs * 2 : 64;
+        ctx->jobs = realloc(ctx->jobs, ctx->max_jobs * sizeof(verify_job_t));
+        if (ctx->jobs == NULL)
+        {
+            hp_error("Failed to allocate verify jobs!\n");
+            hp_exit_failure();
+        }
+    }
+    verify_job_t *job = &ctx->jobs[ctx->num_jobs++];
+    memset(job, 0, sizeof(*job));
+    return job;
+}
+
+/* Splits [offset, end) of a section into jobs of whole blocks. */
+static void verify_add_jobs(verify_ctx_t *ctx, int section_index, uint64_t offset, uint64_t end, uint32_t block_size, uint8_t padded_blocks, const unsigned char *hashes)
+{
+    uint64_t job_size = VERIFY_JOB_SIZE - VERIFY_JOB_SIZE % block_size;
+    if (job_size == 0)
+        job_size = block_size;
+    for (uint64_t ofs = offset; ofs < end; ofs += job_size)
+    {
+        verify_job_t *job = verify_new_job(ctx);
+        job->section_index = section_index;
+        job->offset = ofs;
+        job->size = end - ofs < job_size ? end - ofs : job_size;
+        job->data_end = end;
+        job->block_size = block_size;
+        job->padded_blocks = padded_blocks;
+        job->hashes = hashes + ((ofs - offset) / block_size) * 0x20;
+    }
+}
+
+static void verify_fail(verify_section_t *section, const char *message)
+{
+    section->result = VERIFY_RESULT_FAILED;
+    section->message = message;
+}
+
+static void verify_prepare_pfs0(verify_ctx_t *ctx, int section_index, uint64_t section_size, verify_section_t *section)
+{
+    pfs0_superblock_t *superblock = &ctx->reader->header.fs_headers[section_index].pfs0_superblock;
+    uint64_t block_size = superblock->block_size;
+    if (block_size == 0 || superblock->hash_table_size > section_size || superblock->pfs0_size > section_size ||
+        superblock->hash_table_size < (superblock->pfs0_size + block_size - 1) / block_size * 0x20)
+    {
+        verify_fail(section, "bad PFS0 superblock");
+        return;
+    }
+
+    section->levels[0] = malloc(superblock->hash_table_size ? superblock->hash_table_size : 1);
+    if (section->levels[0] == NULL || ncareader_read_section(ctx->reader, (uint8_t)section_index, section->levels[0], superblock->hash_table_size, superblock->hash_table_offset) != 0)
+    {
+        verify_fail(section, "failed to read hash table");
+        return;
+    }
+    unsigned char master_hash[0x20];
+    sha256_hash_buffer(master_hash, section->levels[0], superblock->hash_table_size);
+    if (memcmp(master_hash, superblock->master_hash, 0x20) != 0)
+    {
+        verify_fail(section, "hash table doesn't match master hash");
+        return;
+    }
+
+    section->size = superblock->hash_table_size + superblock->pfs0_size;
+    section->first_job = ctx->num_jobs;
+    verify_add_jobs(ctx, section_index, superblock->pfs0_offset, superblock->pfs0_offset + superblock->pfs0_size, (uint32_t)block_size, 0, section->levels[0]);
+    section->num_jobs = ctx->num_jobs - section->first_job;
+}
+
+/* Levels 1-5 are read and checked here, level 6 is left to the jobs. */
+static void verify_prepare_ivfc(verify_ctx_t *ctx, int section_index, uint64_t section_size, verify_section_t *section)
+{
+    ivfc_hdr_t *ivfc_header = &ctx->reader->header.fs_headers[section_index].romfs_superblock.ivfc_header;
+    if (ivfc_header->magic != MAGIC_IVFC || ivfc_header->num_levels != IVFC_MAX_LEVEL + 1)
+    {
+        verify_fail(section, "bad IVFC header");
+        return;
+    }
+    for (int i = 0; i < IVFC_MAX_LEVEL; i++)
+    {
+        ivfc_level_hdr_t *level = &ivfc_header->level_headers[i];
+        if (level->block_size < 4 || level->block_size > 24 || level->logical_offset > section_size || level->hash_data_size > section_size - level->logical_offset)
+        {
+            verify_fail(section, "bad IVFC level header");
+            return;
+        }
+        if (i > 0)
+        {
+            uint64_t block_size = 1ULL << level->block_size;
+            if (ivfc_header->level_headers[i - 1].hash_data_size < (level->hash_data_size + block_size - 1) / block_size * 0x20)
+            {
+                verify_fail(section, "IVFC level is too small for the level after it");
+                return;
+            }
+        }
+    }
+
+    double start_time = hp_get_time();
+    for (int i = 0; i < IVFC_MAX_LEVEL - 1; i++)
+    {
+        ivfc_level_hdr_t *level = &ivfc_header->level_headers[i];
+        uint64_t block_size = 1ULL << level->block_size;
+        section->levels[i] = calloc(1, (level->hash_data_size + block_size - 1) / block_size * block_size + 1);
+        if (section->levels[i] == NULL || ncareader_read_section(ctx->reader, (uint8_t)section_index, section->levels[i], level->hash_data_size, level->logical_offset) != 0)
+        {
+            verify_fail(section, "failed to read IVFC levels");
+            return;
+        }
+        section->size += level->hash_data_size;
+    }
+
+    unsigned char master_hash[0x20];
+    sha256_hash_buffer(master_hash, section->levels[0], ivfc_header->level_headers[0].hash_data_size);
+    if (memcmp(master_hash, ivfc_header->master_hash, 0x20) != 0)
+    {
+        verify_fail(section, "level 1 doesn't match master hash");
+        return;
+    }
+    for (int i = 1; i < IVFC_MAX_LEVEL - 1; i++)
+    {
+        ivfc_level_hdr_t *level = &ivfc_header->level_headers[i];
+        if (verify_hash_blocks(section->levels[i], 0, level->hash_data_size, level->hash_data_size, 1U << level->block_size, 1, section->levels[i - 1]) != UINT64_MAX)
+        {
+            static const char *level_messages[IVFC_MAX_LEVEL - 1] = {NULL, "level 2 doesn't match level 1", "level 3 doesn't match level 2", "level 4 doesn't match level 3", "level 5 doesn't match level 4"};
+            verify_fail(section, level_messages[i]);
+            return;
+        }
+    }
+    section->seconds = hp_get_time() - start_time;
+
+    ivfc_level_hdr_t *data_level = &ivfc_header->level_headers[IVFC_MAX_LEVEL - 1];
+    section->size += data_level->hash_data_size;
+    section->first_job = ctx->num_jobs;
+    verify_add_jobs(ctx, section_index, data_level->logical_offset, data_level->logical_offset + data_level->hash_data_size, 1U << data_level->block_size, 1, section->levels[IVFC_MAX_LEVEL - 2]);
+    section->num_jobs = ctx->num_jobs - section->first_job;
+}
+
+/* NCA ID of a file named <NCA ID>.nca or <NCA ID>.cnmt.nca, 0 if the name isn't one. */
+static int verify_get_name_id(const char *path, char *out_id)
+{
+    const char *name = strrchr(path, OS_PATH_SEPARATOR[0]);
+    name = name != NULL ? name + 1 : path;
+    if (strlen(name) < 32 || (strcmp(name + 32, ".nca") != 0 && strcmp(name + 32, ".cnmt.nca") != 0))
+        return 0;
+    for (int i = 0; i < 32; i++)
+    {
+        if (!isxdigit((unsigned char)name[i]))
+            return 0;
+        out_id[i] = (char)tolower((unsigned char)name[i]);
+    }
+    out_id[32] = '\0';
+    return 1;
+}
+
+/* Checks section header hashes, every PFS0 hash table and IVFC level, and the NCA ID, over the worker threads.
+   Titlekey crypto NCAs are decrypted with --titlekey or the ticket of their rights ID next to the NCA. Returns the number of failed checks. */
+int verify_nca(hp_settings_t *settings, filepath_t *nca_path)
+{
+    hp_log("----> Verifying NCA: %s\n", nca_path->char_path);
+    ncareader_t reader;
+    ncareader_open(settings, nca_path, settings->has_title_key ? settings->title_key : NULL, &reader);
+    if (reader.has_key == 0 && ncareader_load_sibling_ticket(settings, &reader) == 0)
+        hp_log("Using titlekey of ticket next to NCA\n");
+    hp_log("%s NCA of title %016" PRIx64 ", keygeneration %i, %s crypto\n", nca_get_content_type_name((enum hp_nca_type)reader.header.content_type), reader.header.title_id,
+           ncareader_get_keygeneration(&reader.header), ncareader_has_rights_id(&reader.header) ? "titlekey" : "key area");
+
+    verify_ctx_t verify_ctx;
+    memset(&verify_ctx, 0, sizeof(verify_ctx));
+    verify_ctx.reader = &reader;
+    // Job 0 hashes the whole NCA while the others check sections
+    verify_job_t *nca_job = verify_new_job(&verify_ctx);
+    nca_job->section_index = -1;
+    nca_job->size = reader.size;
+
+    hp_log("\n===> Checking section headers\n");
+    verify_section_t sections[4];
+    memset(sections, 0, sizeof(sections));
+    int num_sections = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        nca_section_entry_t *entry = &reader.header.section_entries[i];
+        nca_fs_header_t *fs_header = &reader.header.fs_headers[i];
+        verify_section_t *section = &sections[i];
+        if (entry->media_end_offset <= entry->media_start_offset)
+        {
+            section->result = VERIFY_RESULT_SKIPPED;
+            continue;
+        }
+        num_sections++;
+
+        uint8_t section_hash[0x20];
+        nca_calculate_section_hash(fs_header, section_hash);
+        uint64_t section_size = (uint64_t)(entry->media_end_offset - entry->media_start_offset) * 0x200;
+        if (memcmp(section_hash, reader.header.section_hashes[i], 0x20) != 0)
+            verify_fail(section, "section header doesn't match its hash in the NCA header");
+        else if ((uint64_t)entry->media_end_offset * 0x200 > reader.size)
+            verify_fail(section, "section ends past the end of the NCA");
+        else if (fs_header->crypt_type == CRYPT_BKTR)
+        {
+            section->result = VERIFY_RESULT_SKIPPED;
+            section->message = "patch sections are hashed over their base NCA";
+        }
+        else if (fs_header->crypt_type != CRYPT_NONE && fs_header->crypt_type != CRYPT_CTR)
+        {
+            section->result = VERIFY_RESULT_SKIPPED;
+            section->message = "unsupported crypto type";
+        }
+        else if (fs_header->crypt_type == CRYPT_CTR && reader.has_key == 0)
+        {
+            section->result = VERIFY_RESULT_SKIPPED;
+            section->message = "no titlekey, set --titlekey or put the ticket next to the NCA";
+        }
+        else if (fs_header->hash_type == HASH_TYPE_PFS0)
+            verify_prepare_pfs0(&verify_ctx, i, section_size, section);
+        else if (fs_header->hash_type == HASH_TYPE_ROMFS)
+            verify_prepare_ivfc(&verify_ctx, i, section_size, section);
+        else
+        {
+            section->result = VERIFY_RESULT_SKIPPED;
+            section->message = "unknown hash type";
+        }
+    }
+
+    // The whole NCA is hashed for its NCA ID and every section again against its hash tree
+    uint64_t sections_size = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        if (sections[i].num_jobs > 0)
+            sections_size += sections[i].size;
+    }
+    uint32_t num_threads = settings->num_threads ? settings->num_threads : worker_get_cpu_count();
+    hp_log("\n===> Hashing 0x%" PRIx64 " bytes of NCA and 0x%" PRIx64 " bytes of sections in %" PRIu32 " jobs\n", reader.size, sections_size, verify_ctx.num_jobs);
+    double start_time = hp_get_time();
+    worker_run(verify_job, &verify_ctx, verify_ctx.num_jobs, num_threads);
+    double seconds = hp_get_time() - start_time;
+
+    int num_failed = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        verify_section_t *section = &sections[i];
+        double first_start = 0, last_end = 0;
+        for (uint32_t j = section->first_job; j < section->first_job + section->num_jobs; j++)
+        {
+            verify_job_t *job = &verify_ctx.jobs[j];
+            if (j == section->first_job || job->start_time < first_start)
+                first_start = job->start_time;
+            if (job->end_time > last_end)
+                last_end = job->end_time;
+            if (job->failed && section->result == VERIFY_RESULT_OK)
+            {
+                section->result = VERIFY_RESULT_FAILED;
+                section->message = job->failed == 1 ? "failed to read section" : "block doesn't match its hash";
+                if (job->failed == 2)
+                    hp_log("Section %i: block at 0x%" PRIx64 " doesn't match its hash\n", i, job->bad_offset);
+            }
+        }
+        section->seconds += section->num_jobs ? last_end - first_start : 0;
+
+        const char *type = reader.header.fs_headers[i].hash_type == HASH_TYPE_ROMFS ? "RomFS" : "PFS0";
+        if (section->result == VERIFY_RESULT_OK)
+        {
+            hp_log("Section %i (%s): OK, 0x%" PRIx64 " bytes in %.2f s, %.1f MB/s\n", i, type, section->size, section->seconds,
+                   section->seconds > 0 ? (double)section->size / section->seconds / 1048576.0 : 0.0);
+        }
+        else if (section->result == VERIFY_RESULT_FAILED)
+        {
+            num_failed++;
+            hp_log("Section %i (%s): FAILED, %s\n", i, type, section->message);
+        }
+        else if (section->message != NULL)
+            hp_log("Section %i (%s): skipped, %s\n", i, type, section->message);
+        for (int j = 0; j < IVFC_MAX_LEVEL - 1; j++)
+            free(section->levels[j]);
+    }
+
+    char nca_id[33];
+    char name_id[33];
+    hexBinaryString(verify_ctx.nca_hash, 16, nca_id, sizeof(nca_id));
+    if (verify_ctx.jobs[0].failed)
+    {
+        num_failed++;
+        hp_log("NCA ID: FAILED, failed to read NCA\n");
+    }
+    else if (verify_get_name_id(nca_path->char_path, name_id) == 0)
+        hp_log("NCA ID: %s, not checked as the file isn't named after it\n", nca_id);
+    else if (strcmp(nca_id, name_id) != 0)
+    {
+        num_failed++;
+        hp_log("NCA ID: FAILED, NCA hashes to %s\n", nca_id);
+    }
+    else
+        hp_log("NCA ID: OK, %s\n", nca_id);
+    free(verify_ctx.jobs);
+    ncareader_close(&reader);
+
+    uint64_t hashed_size = reader.size + sections_size;
+    hp_log("\n===> Hashed 0x%" PRIx64 " bytes of NCA and 0x%" PRIx64 " bytes of sections in %.2f s, %.1f MB/s\n", reader.size, sections_size, seconds,
+           seconds > 0 ? (double)hashed_size / seconds / 1048576.0 : 0.0);
+    if (num_failed > 0)
+        hp_error("Error: %s failed %i of %i checks\n", nca_path->char_path, num_failed, num_sections + 1);
+    else
+        hp_log("\n----> Verified NCA: %s\n", nca_path->char_path);
+    return num_failed;
+}
+
+/* An NCA stored in an NSP, hashed whole by one job. */
+typedef struct
+{
+    const char *name;
+    uint64_t offset; /* In the NSP */
+    uint64_t size;
+    const cnmt_content_record_t *record; /* Its content record, NULL if the cnmt doesn't list it */
+    uint8_t is_meta;
+    unsigned char hash[0x20];
+    double seconds;
+    int failed;
+} verify_entry_t;
+
+/* Entries are hashed largest first, so the last jobs to finish are small ones. */
+typedef struct
+{
+    uint64_t size;
+    uint32_t index;
+} verify_order_t;
+
+typedef struct
+{
+    int fd;
+    verify_entry_t *entries;
+    verify_order_t *order;
+} verify_nsp_ctx_t;
+
+static int verify_compare_order(const void *a, const void *b)
+{
+    uint64_t size_a = ((const verify_order_t *)a)->size;
+    uint64_t size_b = ((const verify_order_t *)b)->size;
+    return size_a < size_b ? 1 : (size_a > size_b ? -1 : 0);
+}
+
+static void verify_entry_job(void *ctx, uint32_t index)
+{
+    verify_nsp_ctx_t *nsp_ctx = (verify_nsp_ctx_t *)ctx;
+    verify_entry_t *entry = &nsp_ctx->entries[nsp_ctx->order[index].index];
+    double start_time = hp_get_time();
+    entry->failed = verify_hash_range(nsp_ctx->fd, entry->offset, entry->size, entry->hash);
+    entry->seconds = hp_get_time() - start_time;
+}
+
+/* Checks every NCA of an NSP against the content records of its cnmt, NCAs are hashed at once over the worker threads from one file handle.
+   Returns the number of failed checks. */
+int verify_nsp(hp_settings_t *settings, filepath_t *nsp_path)
+{
+    hp_log("----> Verifying NSP: %s\n", nsp_path->char_path);
+    uint64_t nsp_size;
+    pfs0_ctx_t pfs0_ctx;
+    int fd = fio_open(nsp_path, FIO_MODE_READ);
+    if (fd < 0 || fio_get_size(fd, &nsp_size) != 0 || pfs0_read_header(&pfs0_ctx, fd, 0, nsp_size) != 0)
+    {
+        hp_error("Error: Failed to read NSP header of %s\n", nsp_path->char_path);
+        if (fd >= 0)
+            fio_close(fd);
+        return 1;
+    }
+
+    verify_entry_t *entries = calloc(pfs0_ctx.num_files + 1, sizeof(verify_entry_t));
+    verify_order_t *order = calloc(pfs0_ctx.num_files + 1, sizeof(verify_order_t));
+    unsigned char **cnmts = calloc(pfs0_ctx.num_files + 1, sizeof(unsigned char *));
+    if (entries == NULL || order == NULL || cnmts == NULL)
+    {
+        hp_error("Failed to allocate NSP entries!\n");
+        hp_exit_failure();
+    }
+    uint32_t num_entries = 0;
+    for (uint32_t i = 0; i < pfs0_ctx.num_files; i++)
+    {
+        pfs0_file_ctx_t *file = &pfs0_ctx.files[i];
+        size_t name_len = strlen(file->name);
+        if (name_len < 4 || strcmp(file->name + name_len - 4, ".nca") != 0)
+            continue;
+        verify_entry_t *entry = &entries[num_entries];
+        entry->name = file->name;
+        entry->offset = pfs0_ctx.header_size + file->offset;
+        entry->size = file->size;
+        entry->is_meta = name_len >= 9 && strcmp(file->name + name_len - 9, ".cnmt.nca") == 0;
+        order[num_entries].size = file->size;
+        order[num_entries].index = num_entries;
+        num_entries++;
+    }
+    hp_log("%" PRIu32 " files, %" PRIu32 " NCAs\n", pfs0_ctx.num_files, num_entries);
+
+    hp_log("\n===> Reading cnmt\n");
+    int num_failed = 0;
+    int num_checks = 0;
+    for (uint32_t i = 0; i < num_entries; i++)
+    {
+        if (!entries[i].is_meta)
+            continue;
+        num_checks++;
+        ncareader_t reader;
+        uint64_t cnmt_size = 0;
+        ncareader_open_at(settings, nsp_path, entries[i].offset, entries[i].size, NULL, &reader);
+        cnmts[i] = ncareader_read_pfs0_file(&reader, 0, ".cnmt", &cnmt_size);
+        ncareader_close(&reader);
+        const cnmt_content_record_t *records = cnmts[i] != NULL ? cnmt_get_content_records(cnmts[i], cnmt_size) : NULL;
+        if (records == NULL)
+        {
+            num_failed++;
+            hp_log("%s: FAILED, cnmt can't be read\n", entries[i].name);
+            continue;
+        }
+
+        const cnmt_header_t *cnmt_header = (const cnmt_header_t *)cnmts[i];
+        hp_log("cnmt of title %016" PRIx64 " version %" PRIu32 " lists %u contents\n", cnmt_header->title_id, cnmt_header->title_version, cnmt_header->content_entry_count);
+        for (uint16_t j = 0; j < cnmt_header->content_entry_count; j++)
+        {
+            char nca_id[33];
+            hexBinaryString((unsigned char *)records[j].ncaid, 0x10, nca_id, sizeof(nca_id));
+            verify_entry_t *entry = NULL;
+            for (uint32_t k = 0; k < num_entries && entry == NULL; k++)
+            {
+                if (strncmp(entries[k].name, nca_id, 32) == 0 && entries[k].name[32] == '.')
+                    entry = &entries[k];
+            }
+            if (entry != NULL)
+                entry->record = &records[j];
+            else
+            {
+                num_checks++;
+                num_failed++;
+                hp_log("%s.nca: FAILED, listed in cnmt but missing from NSP\n", nca_id);
+            }
+        }
+    }
+
+    uint32_t num_threads = settings->num_threads ? settings->num_threads : worker_get_cpu_count();
+    uint64_t total_size = 0;
+    for (uint32_t i = 0; i < num_entries; i++)
+        total_size += entries[i].size;
+    hp_log("\n===> Hashing 0x%" PRIx64 " bytes of NCAs\n", total_size);
+    qsort(order, num_entries, sizeof(verify_order_t), verify_compare_order);
+    verify_nsp_ctx_t nsp_ctx;
+    nsp_ctx.fd = fd;
+    nsp_ctx.entries = entries;
+    nsp_ctx.order = order;
+    double start_time = hp_get_time();
+    worker_run(verify_entry_job, &nsp_ctx, num_entries, num_threads);
+    double seconds = hp_get_time() - start_time;
+
+    for (uint32_t i = 0; i < num_entries; i++)
+    {
+        verify_entry_t *entry = &entries[i];
+        const cnmt_content_record_t *record = entry->record;
+        char nca_id[33];
+        char name_id[33];
+        hexBinaryString(entry->hash, 0x10, nca_id, sizeof(nca_id));
+        num_checks++;
+        num_failed++;
+        if (entry->failed)
+            hp_log("%s: FAILED, failed to read NCA\n", entry->name);
+        else if (record != NULL && cnmt_get_content_size(record) != entry->size)
+            hp_log("%s: FAILED, 0x%" PRIx64 " bytes but cnmt says 0x%" PRIx64 "\n", entry->name, entry->size, cnmt_get_content_size(record));
+        else if (record != NULL && memcmp(record->hash, entry->hash, 0x20) != 0)
+            hp_log("%s: FAILED, hash doesn't match cnmt\n", entry->name);
+        else if (record != NULL && memcmp(record->ncaid, entry->hash, 0x10) != 0)
+            hp_log("%s: FAILED, NCA ID in cnmt doesn't match its hash\n", entry->name);
+        else if (verify_get_name_id(entry->name, name_id) && strcmp(name_id, nca_id) != 0)
+            hp_log("%s: FAILED, NCA hashes to %s\n", entry->name, nca_id);
+        else
+        {
+            num_failed--;
+            hp_log("%s: OK%s, 0x%" PRIx64 " bytes in %.2f s, %.1f MB/s\n", entry->name, record != NULL ? "" : (entry->is_meta ? ", meta" : ", not listed in cnmt"),
+                   entry->size, entry->seconds, entry->seconds > 0 ? (double)entry->size / entry->seconds / 1048576.0 : 0.0);
+        }
+    }
+    for (uint32_t i = 0; i < num_entries; i++)
+        free(cnmts[i]);
+    free(cnmts);
+    free(order);
+    free(entries);
+    pfs0_free_ctx(&pfs0_ctx);
+    fio_close(fd);
+
+    hp_log("\n===> Hashed 0x%" PRIx64 " bytes in %.2f s, %.1f MB/s\n", total_size, seconds, seconds > 0 ? (double)total_size / seconds / 1048576.0 : 0.0);
+    if (num_failed > 0)
+        hp_error("Error: %s failed %i of %i checks\n", nsp_path->char_path, num_failed, num_checks);
+    else
+        hp_log("\n----> Verified NSP: %s\n", nsp_path->char_path);
+    return num_failed;
+}
+
+/* Verifies an NSP, told apart by its PFS0 header, or an NCA. */
+int verify_file(hp_settings_t *settings, filepath_t *path)
+{
+    uint32_t magic = 0;
+    int fd = fio_open(path, FIO_MODE_READ);
+    if (fd < 0)
+    {
+        hp_error("Failed to open %s!\n", path->char_path);
+        return 1;
+    }
+    int ret = fio_pread(fd, &magic, sizeof(magic), 0);
+    fio_close(fd);
+    if (ret == 0 && magic == MAGIC_PFS0)
+        return verify_nsp(settings, path);
+    return verify_nca(settings, path);
+}
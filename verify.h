@@ -0,0 +1,13 @@
+#ifndef HACPACK_VERIFY_H
+#define HACPACK_VERIFY_H
+
+#include "settings.h"
+#include "filepath.h"
+
+#define VERIFY_JOB_SIZE 0x800000 // 8 MB
+
+int verify_nca(hp_settings_t *settings, filepath_t *nca_path);
+int verify_nsp(hp_settings_t *settings, filepath_t *nsp_path);
+int verify_file(hp_settings_t *settings, filepath_t *path);
+
+#endif
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "worker.h"
+#include "utils.h"
+
+typedef struct
+{
+    worker_func_t func;
+    void *ctx;
+    uint32_t num_jobs;
+    uint32_t next_job;
+    pthread_mutex_t lock;
+    hp_trap_t *trap;
+    uint8_t failed;
+} worker_ctx_t;
+
+uint32_t worker_get_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (uint32_t)info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (uint32_t)count : 1;
+#endif
+}
+
+/* Failures jump back here and stop the remaining jobs, worker_run fails on the calling thread once all workers are done. */
+static void *worker_thread(void *arg)
+{
+    worker_ctx_t *worker_ctx = (worker_ctx_t *)arg;
+    hp_trap_t *prev_trap = hp_get_trap();
+    hp_trap_t trap;
+    hp_trap_init(&trap, worker_ctx->trap, worker_ctx->trap ? worker_ctx->trap->log_func : NULL, worker_ctx->trap ? worker_ctx->trap->log_user : NULL);
+    hp_set_trap(&trap);
+    if (setjmp(trap.env) == 0)
+    {
+        while (1)
+        {
+            pthread_mutex_lock(&worker_ctx->lock);
+            uint32_t index = worker_ctx->failed ? worker_ctx->num_jobs : worker_ctx->next_job++;
+            pthread_mutex_unlock(&worker_ctx->lock);
+            if (index >= worker_ctx->num_jobs)
+                break;
+            worker_ctx->func(worker_ctx->ctx, index);
+        }
+        hp_trap_finish(&trap, 0);
+    }
+    else
+    {
+        hp_trap_finish(&trap, 1);
+        pthread_mutex_lock(&worker_ctx->lock);
+        worker_ctx->failed = 1;
+        pthread_mutex_unlock(&worker_ctx->lock);
+    }
+    hp_set_trap(prev_trap);
+    return NULL;
+}
+
+/* Runs func for every job index on up to num_threads threads, returns once all jobs are done. */
+void worker_run(worker_func_t func, void *ctx, uint32_t num_jobs, uint32_t num_threads)
+{
+    if (num_threads > num_jobs)
+        num_threads = num_jobs;
+
+    if (num_threads <= 1)
+    {
+        for (uint32_t i = 0; i < num_jobs; i++)
+            func(ctx, i);
+        return;
+    }
+
+    worker_ctx_t worker_ctx;
+    worker_ctx.func = func;
+    worker_ctx.ctx = ctx;
+    worker_ctx.num_jobs = num_jobs;
+    worker_ctx.next_job = 0;
+    worker_ctx.trap = hp_get_trap();
+    worker_ctx.failed = 0;
+    pthread_mutex_init(&worker_ctx.lock, NULL);
+
+    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+    if (threads == NULL)
+    {
+        hp_error("Failed to allocate worker threads!\n");
+        hp_exit_failure();
+    }
+
+    uint32_t started = 0;
+    for (; started < num_threads; started++)
+    {
+        if (pthread_create(&threads[started], NULL, worker_thread, &worker_ctx) != 0)
+            break;
+    }
+
+    // Run the remaining jobs on the calling thread if no worker could be started
+    if (started == 0)
+        worker_thread(&worker_ctx);
+
+    for (uint32_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+    pthread_mutex_destroy(&worker_ctx.lock);
+    if (worker_ctx.failed)
+        hp_exit_failure();
+}
@@ -0,0 +1,12 @@
+#ifndef HACPACK_WORKER_H
+#define HACPACK_WORKER_H
+
+#include <stdint.h>
+#include "types.h"
+
+typedef void (*worker_func_t)(void *ctx, uint32_t index);
+
+uint32_t worker_get_cpu_count(void);
+void worker_run(worker_func_t func, void *ctx, uint32_t num_jobs, uint32_t num_threads);
+
+#endif